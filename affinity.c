@@ -0,0 +1,229 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * thread placement, see affinity.h
+ *
+ * No libnuma, the node comes from getcpu and the policy is set with the
+ * set_mempolicy syscall, the same way utils.h calls futex.
+ */
+
+#define _GNU_SOURCE         /* cpu_set_t, pthread_attr_setaffinity_np */
+#include <stdlib.h>         /* strtol */
+#include <sched.h>          /* cpu_set_t, sched_getaffinity */
+#include <stdatomic.h>      /* round robin */
+#include <linux/mempolicy.h> /* MPOL_PREFERRED */
+#include "utils.h"
+#include "affinity.h"
+
+/**
+ * affinity_t - the placement policy
+ * @cpus: worker cpus, empty to not pin workers
+ * @ncpus: cpus in @cpus
+ * @timer_cpu: cpu of the timer service, -1 to not pin it
+ * @next: worker count, picks the next cpu of @cpus
+ */
+typedef struct affinity {
+	cpu_set_t cpus;
+	int ncpus;
+	int timer_cpu;
+	atomic_uint next;
+} affinity_t;
+
+static affinity_t fsm_affinity = {
+	.timer_cpu = -1,
+};
+
+/**
+ * affinity_exclude_timer - keep the timer cpu for the timer service
+ *
+ * Unless it is the only worker cpu, then the workers share it.
+ */
+static void affinity_exclude_timer(void)
+{
+	affinity_t *aff_p = &fsm_affinity;
+
+	if (aff_p->timer_cpu < 0 || aff_p->ncpus < 2 || !CPU_ISSET(aff_p->timer_cpu, &aff_p->cpus))
+		return;
+	CPU_CLR(aff_p->timer_cpu, &aff_p->cpus);
+	aff_p->ncpus--;
+}
+
+/**
+ * affinity_parse - read a cpu list
+ * @list: e.g. "0-3,6"
+ * @set_p: the cpus
+ *
+ * Every cpu must be one the process may run on.
+ *
+ * Return: number of cpus, -1 for a bad list
+ */
+static int affinity_parse(const char *list, cpu_set_t *set_p)
+{
+	cpu_set_t allowed;
+	const char *p = list;
+	char *end_p;
+	long lo, hi;
+
+	CPU_ZERO(set_p);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		die("sched_getaffinity");
+
+	while (*p) {
+		lo = hi = strtol(p, &end_p, 10);
+		if (end_p == p)
+			return(-1);
+		if ('-' == *end_p) {
+			p = end_p + 1;
+			hi = strtol(p, &end_p, 10);
+			if (end_p == p)
+				return(-1);
+		}
+		if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+			return(-1);
+		for (; lo <= hi; lo++) {
+			if (!CPU_ISSET(lo, &allowed))
+				return(-1);
+			CPU_SET(lo, set_p);
+		}
+		if (',' == *end_p)
+			end_p++;
+		else if (*end_p)
+			return(-1);
+		p = end_p;
+	}
+	return CPU_COUNT(set_p) ? CPU_COUNT(set_p) : -1;
+}
+
+/**
+ * affinity_workers - set the worker cpus
+ * @list: cpu list, see affinity_parse
+ *
+ * Return: 0 or -1 for a bad list
+ */
+int affinity_workers(const char *list)
+{
+	int n = affinity_parse(list, &fsm_affinity.cpus);
+
+	if (n < 0)
+		return(-1);
+	fsm_affinity.ncpus = n;
+	affinity_exclude_timer();
+	return(0);
+}
+
+/**
+ * affinity_timer - set the timer service cpu
+ * @cpu: the cpu
+ *
+ * Return: 0 or -1 if the process may not run on @cpu
+ */
+int affinity_timer(int cpu)
+{
+	cpu_set_t allowed;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		die("sched_getaffinity");
+	if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed))
+		return(-1);
+	fsm_affinity.timer_cpu = cpu;
+	affinity_exclude_timer();
+	return(0);
+}
+
+/**
+ * affinity_next_cpu - cpu for the next worker
+ *
+ * Return: the next worker cpu round-robin, -1 to not pin the worker
+ */
+int affinity_next_cpu(void)
+{
+	affinity_t *aff_p = &fsm_affinity;
+	int n, cpu;
+
+	if (0 == aff_p->ncpus)
+		return(-1);
+
+	n = atomic_fetch_add(&aff_p->next, 1) % aff_p->ncpus;
+	for (cpu=0; cpu<CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &aff_p->cpus) && 0 == n--)
+			break;
+	return(cpu);
+}
+
+/**
+ * affinity_attr - thread attributes to start a thread on one cpu
+ * @attr_p: attributes to set up
+ * @cpu: the cpu, -1 for default attributes
+ *
+ * Return: @attr_p for pthread_create, NULL for -1; pthread_attr_destroy
+ * it after pthread_create
+ */
+pthread_attr_t *affinity_attr(pthread_attr_t *attr_p, int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return(NULL);
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_attr_init(attr_p);
+	if (pthread_attr_setaffinity_np(attr_p, sizeof(set), &set))
+		die("pthread_attr_setaffinity_np");
+	return(attr_p);
+}
+
+/**
+ * affinity_place_self - prefer the local NUMA node for the calling thread
+ * @cpu: the cpu the thread was pinned to, -1 if not pinned
+ *
+ * Pages the thread touches from now on come from the node of its cpu
+ * while the node has free memory.
+ *
+ * Return: the node, -1 if not pinned
+ */
+int affinity_place_self(int cpu)
+{
+	unsigned int cur, node;
+	unsigned long nodemask;
+
+	if (cpu < 0)
+		return(-1);
+
+	if (syscall(SYS_getcpu, &cur, &node, NULL))
+		return(-1);
+	if (node >= 8 * sizeof(nodemask))
+		return(node);
+
+	nodemask = 1UL << node;
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, 8 * sizeof(nodemask)))
+		perror("set_mempolicy");
+	return(node);
+}
+
+/**
+ * affinity_show - print the placement policy
+ */
+void affinity_show(void)
+{
+	affinity_t *aff_p = &fsm_affinity;
+	int cpu, sep = ' ';
+
+	printf("affinity workers=");
+	if (0 == aff_p->ncpus)
+		printf("any");
+	for (cpu=0; cpu<CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &aff_p->cpus))
+			continue;
+		if (' ' != sep)
+			putchar(sep);
+		printf("%d", cpu);
+		sep = ',';
+	}
+	if (aff_p->timer_cpu < 0)
+		printf(" timer=any\n");
+	else
+		printf(" timer=%d\n", aff_p->timer_cpu);
+}
@@ -0,0 +1,34 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * thread placement
+ *
+ * Workers are pinned round-robin, in creation order, to a cpu list
+ * (fsmdemo -c) and the timer service to a cpu of its own (fsmdemo -C),
+ * which is then left out of the worker list.  A pinned worker creates its
+ * queue and FSM instance on its own thread, after it is running on its
+ * cpu, with its memory policy set to that cpu's NUMA node, so the pages
+ * are node local.
+ *
+ * With no cpu list nothing is pinned and threads run where the kernel
+ * puts them.  The policy is set up by the main program before any worker
+ * is created.
+ */
+
+#ifndef _AFFINITY_H
+#define _AFFINITY_H
+
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <pthread.h>     /* pthread_attr_t */
+
+extern int affinity_workers(const char *list);
+extern int affinity_timer(int cpu);
+extern int affinity_next_cpu(void);
+extern pthread_attr_t *affinity_attr(pthread_attr_t *attr_p, int cpu);
+extern int affinity_place_self(int cpu);
+extern void affinity_show(void);
+
+#endif /* _AFFINITY_H */
@@ -0,0 +1,109 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * preallocated object arena, see arena.h
+ */
+
+#include <sys/mman.h>    /* mmap, mlock, madvise */
+#include "utils.h"
+#include "arena.h"
+
+arena_t *fsm_arena;
+
+/* hugepage size the mapping is rounded to */
+#define ARENA_HUGE_SIZE (2UL << 20)
+
+/**
+ * arena_create - map and pre-fault an arena
+ * @size: bytes, rounded up to a hugepage
+ * @flags: arena_flags_t
+ *
+ * ARENA_HUGE tries hugetlb pages first, then asks for transparent
+ * hugepages on a normal mapping.  If mlock fails (RLIMIT_MEMLOCK) the
+ * arena is still used, just not locked.  arena_show tells what the
+ * arena got.
+ *
+ * Return: the arena
+ */
+arena_t *arena_create(size_t size, uint32_t flags)
+{
+	arena_t *arena_p = calloc(1, sizeof(arena_t));
+	int mflags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+	void *p = MAP_FAILED;
+
+	if (NULL == arena_p)
+		die("arena_create");
+
+	size = (size + ARENA_HUGE_SIZE - 1) & ~(ARENA_HUGE_SIZE - 1);
+
+	if (flags & ARENA_HUGE)
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, mflags | MAP_HUGETLB, -1, 0);
+	if (MAP_FAILED == p) {
+		if (MAP_FAILED == (p = mmap(NULL, size, PROT_READ | PROT_WRITE, mflags, -1, 0)))
+			die("arena_create mmap");
+		if ((flags & ARENA_HUGE) && madvise(p, size, MADV_HUGEPAGE))
+			flags &= ~ARENA_HUGE;
+	}
+
+	if ((flags & ARENA_MLOCK) && mlock(p, size)) {
+		perror("arena_create mlock");
+		flags &= ~ARENA_MLOCK;
+	}
+
+	arena_p->base_p = p;
+	arena_p->size = size;
+	atomic_init(&arena_p->used, 0);
+	arena_p->flags = flags;
+	atomic_init(&arena_p->allocs, 0);
+	return(arena_p);
+}
+
+/**
+ * arena_alloc - carve an object off the arena
+ * @arena_p: the arena
+ * @size: bytes, rounded up to ARENA_ALIGN
+ *
+ * Safe from any thread.  The memory is zero, it was never used before.
+ * Running out of arena is fatal, the arena size is the configuration.
+ *
+ * Return: ARENA_ALIGN aligned memory
+ */
+void *arena_alloc(arena_t *arena_p, size_t size)
+{
+	size_t off;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	off = atomic_fetch_add_explicit(&arena_p->used, size, memory_order_relaxed);
+	if (off + size > arena_p->size)
+		die("arena full, raise -A");
+	atomic_fetch_add_explicit(&arena_p->allocs, 1, memory_order_relaxed);
+	return(arena_p->base_p + off);
+}
+
+/**
+ * arena_show - print the arena usage
+ * @arena_p: the arena, NULL is fine
+ */
+void arena_show(arena_t *arena_p)
+{
+	if (NULL == arena_p)
+		return;
+	printf("arena size=%zu used=%zu objects=%lu%s%s\n", arena_p->size,
+	       atomic_load(&arena_p->used), atomic_load(&arena_p->allocs),
+	       (arena_p->flags & ARENA_HUGE) ? " huge" : "",
+	       (arena_p->flags & ARENA_MLOCK) ? " mlock" : "");
+}
+
+/**
+ * arena_destroy - unmap the arena, every object in it is gone
+ * @arena_p: the arena, NULL is fine
+ */
+void arena_destroy(arena_t *arena_p)
+{
+	if (NULL == arena_p)
+		return;
+	munmap(arena_p->base_p, arena_p->size);
+	free(arena_p);
+}
@@ -0,0 +1,114 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * preallocated object arena
+ *
+ * One mapping sized at process start (fsmdemo -A), optionally hugepage
+ * backed and mlock'd, and pre-faulted so creating thousands of workers,
+ * instances, queues and timers takes no page faults and no allocator
+ * lock.  Objects are carved off with one atomic add, each on its own
+ * cache line, and never freed one by one: arena_destroy unmaps the lot.
+ *
+ * With no arena (fsm_arena NULL) arena_calloc and arena_free are
+ * aligned_alloc and free.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <stdlib.h>      /* aligned_alloc, free */
+#include <string.h>      /* memset */
+#include <stdatomic.h>   /* bump pointer */
+#include "utils.h"
+
+/* object alignment, one cache line */
+#define ARENA_ALIGN L1_CACHE_BYTES
+
+/**
+ * arena_flags_t - arena backing
+ * @ARENA_MLOCK: lock the arena in memory
+ * @ARENA_HUGE: back the arena with hugepages, transparent ones if there
+ *              are no hugetlb pages
+ */
+typedef enum arena_flags {
+	ARENA_MLOCK = 0x1,
+	ARENA_HUGE = 0x2,
+} arena_flags_t;
+
+/**
+ * arena_t - the arena
+ * @base_p: start of the mapping
+ * @size: bytes mapped
+ * @used: bytes handed out
+ * @flags: arena_flags_t actually in effect
+ * @allocs: objects handed out
+ */
+typedef struct arena {
+	uint8_t *base_p;
+	size_t size;
+	atomic_size_t used;
+	uint32_t flags;
+	atomic_ulong allocs;
+} arena_t;
+
+/*
+ * fsm_arena - the process arena for workers, instances, queues and
+ * timers, NULL to use malloc
+ */
+extern arena_t *fsm_arena;
+
+extern arena_t *arena_create(size_t size, uint32_t flags);
+extern void *arena_alloc(arena_t *arena_p, size_t size);
+extern void arena_show(arena_t *arena_p);
+extern void arena_destroy(arena_t *arena_p);
+
+/**
+ * arena_owns - check if memory came from an arena
+ * @arena_p: the arena, NULL is fine
+ * @p: the memory
+ */
+static inline bool arena_owns(const arena_t *arena_p, const void *p)
+{
+	return arena_p && (const uint8_t *)p >= arena_p->base_p &&
+		(const uint8_t *)p < arena_p->base_p + arena_p->size;
+}
+
+/**
+ * arena_calloc - zeroed memory from the process arena
+ * @size: bytes
+ *
+ * Without an arena the memory is still cache line aligned, the
+ * ____cacheline_aligned types rely on it.
+ *
+ * Return: cache line aligned zeroed memory, NULL if malloc fails
+ */
+static inline void *arena_calloc(size_t size)
+{
+	void *p;
+
+	if (fsm_arena)
+		return arena_alloc(fsm_arena, size);
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (NULL != (p = aligned_alloc(ARENA_ALIGN, size)))
+		memset(p, 0, size);
+	return(p);
+}
+
+/**
+ * arena_free - free memory from arena_calloc
+ * @p: the memory, NULL is fine
+ *
+ * Nothing to do for arena memory, it goes with arena_destroy.
+ */
+static inline void arena_free(void *p)
+{
+	if (!arena_owns(fsm_arena, p))
+		free(p);
+}
+
+#endif /* _ARENA_H */
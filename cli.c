@@ -6,12 +6,15 @@
  * command line interface for the FSM project
  */
 
-#include <sys/epoll.h>   /* epoll_ctl */
-
 #include "utils.h"
 #include "timer.h"
 #include "evtq.h"
 #include "workers.h"
+#include "stats.h"
+#include "arena.h"
+#include "reactor.h"
+#include "fsmsnap.h"
+#include "ingest.h"
 
 /* default or set in the program arguments */
 extern char scriptfile[];
@@ -19,8 +22,29 @@ extern char scriptfile[];
 /* default or set in the program arguments */
 extern uint32_t tick;
 
-/* max number of epoll events to wait for */
-#define MAX_WAIT_EVENTS 1
+/*
+ * cli_ingest - the CLI event commands are sent as INGEST_ALL frames, the
+ * same path as a stream from a file or socket
+ */
+static ingest_t cli_ingest = {
+	.batch = INGEST_BATCH,
+	.listen.fd = -1,
+};
+
+/**
+ * cli_send - broadcast an event through the ingestion stage
+ * @evt_id: the event id, not checked by the caller
+ * @data_p: payload bytes
+ * @len: payload length
+ */
+static void cli_send(fsm_events_t evt_id, const void *data_p, size_t len)
+{
+	uint64_t bad = cli_ingest.bad;
+
+	ingest_send(&cli_ingest, INGEST_ALL, evt_id, data_p, len);
+	if (cli_ingest.bad != bad)
+		printf("%u: unknown event\n", evt_id);
+}
 
 /**
  * evt_script - load events from a file to added to event queue
@@ -53,7 +77,7 @@ void evt_script(void)
 
 		len = strlen(buf);
 		
-		if (debug_flag & DBG_DEEP)
+		if (dbg_on(DBG_DEEP))
 			printf("%s: len=%d buf=%s", __func__, len, buf);
 
 		/* call event parser */
@@ -71,7 +95,7 @@ void evt_script(void)
  * 
  * Each input event can be symbolically represented as a one or more characters.  
  * This function maps the chars to an internal event id (defined in evtq.h) and
- * pushes it to all workers.
+ * pushes it to all workers, as a frame through the ingestion stage.
  */
 int evt_parse_buf(const char *buf)
 {
@@ -84,7 +108,10 @@ int evt_parse_buf(const char *buf)
 			case 'h':
 				printf("\tx,q: exit producer and workers (gracefully)\n");
 				printf("\tw: show workers and curr state\n");
+				printf("\tc: show worker queue, payload buffer and arena counters\n");
+				printf("\tl: show per-thread latency and FSM counters\n");
 				printf("\tb: crosswalk button push\n");
+				printf("\tbN: button push, light changes in N ticks\n");
 				printf("\tg: go %s\n", evt_name[E_INIT]);
 				printf("\teN: send event id N\n");
 				printf("\tf: set timer fast\n");
@@ -92,21 +119,30 @@ int evt_parse_buf(const char *buf)
 				printf("\tr: run event input script %s\n", scriptfile);
 				printf("\ts: show current FSM state\n");
 				printf("\tnN: main thread nap N ticks\n"
-				      "(worker/timer threads keep running)\n");
+				      "(worker/timer threads keep running, -V skips the wait)\n");
 				printf("\tp: pause CLI thread\n");
+				printf("\tS: save a snapshot of the scheduled instances\n");
 				printf("\tdefault: unknown command\n");
 				break;
 			case 'x':
 			case 'q':
 				/* exit event threads and main */
-				workers_evt_broadcast(E_DONE);
+				cli_send(E_DONE, NULL, 0);
 				ret = 1;
 				break;
 			case 'w':
 				show_workers();
 				break;
+			case 'c':
+				show_queues();
+				evtbuf_show();
+				arena_show(fsm_arena);
+				break;
+			case 'l':
+				stats_show();
+				break;
 			case 'g':
-				workers_evt_broadcast(E_INIT);
+				cli_send(E_INIT, NULL, 0);
 				break;
 			case 'f':
 			{
@@ -121,7 +157,14 @@ int evt_parse_buf(const char *buf)
 			}
 			break;
 			case 'b':
-				workers_evt_broadcast(E_BUTTON);
+				if (isdigit(sp[1])) {
+					/* the tick count rides with the event */
+					uint32_t ticks = (uint32_t)(*++sp - 0x30);
+
+					cli_send(E_BUTTON, &ticks, sizeof(ticks));
+				} else {
+					cli_send(E_BUTTON, NULL, 0);
+				}
 				break;
 			case 's':
 				printf("*** FSM status\n");
@@ -133,7 +176,7 @@ int evt_parse_buf(const char *buf)
 			{
 				/* get next char and convert to int */
 				uint32_t evtid = (uint32_t)(*++sp - 0x30);
-				workers_evt_broadcast(evtid);
+				cli_send(evtid, NULL, 0);
 			}
 			break;
 			case 't':
@@ -151,13 +194,26 @@ int evt_parse_buf(const char *buf)
 				/* get next char and convert to int */
 				uint32_t len = (uint32_t)(*++sp - 0x30);
 				dbg_verbose("begin nap");
-				nap(len*tick);
+				timer_nap(len*tick);
 				dbg_verbose("after nap");
 			}
 			break;
 			case 'p':
 				relax();
 				break;
+			case 'S':
+			{
+				fsm_snap_stats_t snap;
+
+				if (NULL == workers.sched_p || NULL == workers.snap_path) {
+					printf("S: no scheduled instances or snapshot file\n");
+					break;
+				}
+				if (0 == fsmsnap_write(workers.sched_p, workers.snap_path, &snap))
+					printf("snapshot %s: %u instances, %u timers, %u events\n",
+					       workers.snap_path, snap.ninst, snap.ntimers, snap.nevts);
+			}
+			break;
 			default:
 				printf("%c: unknown cmd\n", *sp);
 				break;
@@ -170,88 +226,64 @@ int evt_parse_buf(const char *buf)
 }
 
 
+/**
+ * cli_ready - reactor callback for STDIN
+ * @src_p: the STDIN source, ctx_p is the reactor
+ * @events: epoll events
+ *
+ * Stop the reactor when 'x' is entered or STDIN is closed.
+ */
+static void cli_ready(reactor_src_t *src_p, uint32_t events)
+{
+	char buf[32];
+	int len;
+
+	/* bad event or corrupted file descriptor */
+	if (!(events & EPOLLIN))
+		die("bad incoming event");
+
+	/* line buffered by tty driver so must hit CR to read */
+	len=read(src_p->fd, buf, sizeof(buf)-1);
+	if (len <= 0) {
+		reactor_stop(src_p->ctx_p);
+		return;
+	}
+	/* replace CR with string termination */
+	buf[len] = '\0';
+	if (dbg_on(DBG_DEEP))
+		printf("\nread %d: %s\n", len, buf);
+
+	if (evt_parse_buf(buf))
+		reactor_stop(src_p->ctx_p);
+}
+
 /**
  * evt_producer - event producer to queue to workers
+ * @reactor_p: the reactor to read STDIN on, the caller may have put the
+ *             timer wheel on it too
  *
- * This function has several notable mechanisms. The main one is a 
- * man:epoll loop to handle input from several sources:
- * - epoll error: many error types but this will exit when a signal is received 
- *   (which we ignore for SIGINT handling)
- * - fd=STDIN: on-demand input from user, call to evt_ondemand() to process
+ * Add STDIN as a reactor source and run the reactor on the calling
+ * thread: evt_parse_buf runs for each line of user input, along with
+ * whatever else the reactor serves, until 'x' is entered.
  *
- * The loop will exit when 'x' is entered
- * 
+ * The n command naps with timer_nap, so the timers on the reactor keep
+ * firing.
  */
-void evt_producer(void)
+void evt_producer(reactor_t *reactor_p)
 {
-	int fd_epoll;                 /* epoll reference */
-	struct epoll_event event;     /* struct to add to the epoll list */
-	struct epoll_event events[MAX_WAIT_EVENTS]; /* struct return from epoll_wait */
-	int done = 0;
-
-	/* create epoll */
-	if (-1 == (fd_epoll=epoll_create1(0)))
-		die("epoll");
+	reactor_src_t src = {
+		.fd = STDIN_FILENO,
+		.fn = cli_ready,
+		.ctx_p = reactor_p,
+	};
 
-	/* add stdin to epoll for user control */
-	event.data.fd = STDIN_FILENO;
-	event.events = EPOLLIN;
-	if (-1 == epoll_ctl(fd_epoll, EPOLL_CTL_ADD, event.data.fd, &event))
-		die("epoll_ctl for STDIN");
+	reactor_add(reactor_p, &src);
 
 	/* event loop */
 	printf("%s: Enter commands (g:start FSMs, h:help, x:exit)\n", __func__);
 	fflush(stdout);
-	while (!done) {
-		int nfds; /* number of ready file descriptors */
-
-		dbg_verbose("poll_wait");
-		
-		/* wait for desciptors or timeout (in ms, -1 no timeout) */
-		nfds=epoll_wait(fd_epoll, events, MAX_WAIT_EVENTS, -1);
-
-		/* 
-		 * nfds < 0: error
-		 * nfds == 0: timeout
-		 * nfds > 0: number of descriptors with pending I/O
-		 */
-		switch(nfds) {
-		case -1:
-			/* if poll returns due to an signal interrupt then do nothing 
-			 * otherwise die
-			 */
-			if (errno != EINTR)
-				die("epoll_wait");
-			break;
-		case 0:
-			dbg("epoll timeout");
-		break;
-		default:
-		{
-			int i;
-			for (i=0; i<nfds; i++) {
-				/* bad event or corrupted file descriptor */
-				if (!(events[i].events&EPOLLIN))
-					die("bad incoming event");
-
-				if (events[i].data.fd == STDIN_FILENO) {
-					char buf[32];
-					int len;
-					
-					/* line buffered by tty driver so must hit CR to read */
-					len=read(events[i].data.fd, buf, sizeof(buf));
-					/* replace CR with string termination */
-					buf[len] = '\0';
-					if (debug_flag & DBG_DEEP)
-						printf("\nread %d: %s\n", len, buf);
-
-					done = evt_parse_buf(buf);
-				}
-			}
-		}
-		break;
-		} /* switch */
-	} /* while */
+	reactor_run(reactor_p);
 
+	reactor_del(reactor_p, &src);
 	dbg("exitting...");
 }
@@ -0,0 +1,116 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * payload buffer pool, see evtbuf.h
+ *
+ * Like the stats counters, a thread gets its pool the first time it asks
+ * for a buffer and the pool stays on a lock-free list until
+ * evtbuf_destroy.  Buffers of a thread that exited can still be put, they
+ * wait on its remote list.
+ */
+
+#include "utils.h"
+#include "workers.h"
+#include "evtbuf.h"
+#include "arena.h"
+
+__thread evtbuf_pool_t *evtbuf_self_p;
+
+static _Atomic(evtbuf_pool_t *) evtbuf_pools;
+static atomic_uint evtbuf_npools;
+
+/**
+ * evtbuf_pool_create - give the calling thread its buffer pool
+ */
+evtbuf_pool_t *evtbuf_pool_create(void)
+{
+	evtbuf_pool_t *pool_p = calloc(1, sizeof(evtbuf_pool_t));
+	const char *name = worker_get_name();
+	uint32_t n = atomic_fetch_add(&evtbuf_npools, 1);
+
+	if (NULL == pool_p)
+		die("evtbuf_pool_create");
+
+	if (name)
+		strncpy(pool_p->name, name, sizeof(pool_p->name)-1);
+	else
+		snprintf(pool_p->name, sizeof(pool_p->name), "thread%u", n);
+
+	pool_p->next_p = atomic_load(&evtbuf_pools);
+	while (!atomic_compare_exchange_weak(&evtbuf_pools, &pool_p->next_p, pool_p))
+		;
+	evtbuf_self_p = pool_p;
+	return(pool_p);
+}
+
+/**
+ * evtbuf_refill - fill an empty free list
+ * @pool_p: the calling thread pool
+ *
+ * Take back every buffer the other threads put, or if there are none add
+ * a slab, from the arena if there is one.  Only the owner takes the
+ * remote list, all of it at once, so a buffer cannot be popped twice.
+ *
+ * Return: the first free buffer, still on @pool_p->free_p
+ */
+evtbuf_t *evtbuf_refill(evtbuf_pool_t *pool_p)
+{
+	evtbuf_slab_t *slab_p;
+	uint32_t i;
+
+	pool_p->free_p = atomic_exchange_explicit(&pool_p->remote_p, NULL, memory_order_acquire);
+	if (pool_p->free_p)
+		return(pool_p->free_p);
+
+	if (NULL == (slab_p = arena_calloc(sizeof(evtbuf_slab_t))))
+		die("evtbuf_refill");
+	for (i=0; i<EVTBUF_SLAB; i++) {
+		slab_p->buf[i].pool_p = pool_p;
+		slab_p->buf[i].next_p = (i+1 < EVTBUF_SLAB) ? &slab_p->buf[i+1] : NULL;
+	}
+	slab_p->next_p = pool_p->slab_p;
+	pool_p->slab_p = slab_p;
+	atomic_fetch_add_explicit(&pool_p->slabs, 1, memory_order_relaxed);
+
+	pool_p->free_p = &slab_p->buf[0];
+	return(pool_p->free_p);
+}
+
+/**
+ * evtbuf_show - print the buffer pool counters
+ */
+void evtbuf_show(void)
+{
+	evtbuf_pool_t *pool_p;
+
+	printf("payload buffers\n%-12s %10s %10s %6s\n", "name", "gets", "remote", "slabs");
+	for (pool_p = atomic_load(&evtbuf_pools); pool_p; pool_p = pool_p->next_p)
+		printf("%-12s %10lu %10lu %6lu\n", pool_p->name,
+		       atomic_load_explicit(&pool_p->gets, memory_order_relaxed),
+		       atomic_load_explicit(&pool_p->remote_puts, memory_order_relaxed),
+		       atomic_load_explicit(&pool_p->slabs, memory_order_relaxed));
+}
+
+/**
+ * evtbuf_destroy - free every pool and its slabs
+ *
+ * Call after the threads using payloads are done, any buffer still held
+ * is freed with its slab.
+ */
+void evtbuf_destroy(void)
+{
+	evtbuf_pool_t *pool_p, *n_p;
+	evtbuf_slab_t *slab_p, *s_p;
+
+	for (pool_p = atomic_exchange(&evtbuf_pools, NULL); pool_p; pool_p = n_p) {
+		n_p = pool_p->next_p;
+		for (slab_p = pool_p->slab_p; slab_p; slab_p = s_p) {
+			s_p = slab_p->next_p;
+			arena_free(slab_p);
+		}
+		free(pool_p);
+	}
+	evtbuf_self_p = NULL;
+}
@@ -0,0 +1,309 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * event payloads and the payload buffer pool
+ *
+ * An event carries an evt_payload_t: nothing, up to EVT_INLINE_MAX bytes
+ * copied with the event, or a reference to a pooled evtbuf_t.  A pooled
+ * buffer is written once by the producer and handed to the consumer by
+ * pointer, the data is never copied.
+ *
+ * Buffers come from a per-thread pool carved out of slabs.  The owner
+ * thread gets and puts buffers on a plain free list; any other thread
+ * putting a buffer pushes it on the owner's remote list, which the owner
+ * takes back in one exchange when its free list runs dry.  No malloc on
+ * the event path, a new slab only when a pool is empty.
+ *
+ * Ownership: whoever holds an evt_payload_t holds one buffer reference.
+ * Enqueue moves it to the queue, dequeue moves it to the consumer and
+ * fsm_run_batch_pl releases it after the event is run.  A broadcast
+ * leaves the caller its payload and gives each receiver its own copy or
+ * reference.
+ */
+
+#ifndef _EVTBUF_H
+#define _EVTBUF_H
+
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <stddef.h>      /* size_t */
+#include <string.h>      /* memcpy */
+#include <stdatomic.h>   /* refs, remote free list */
+#include "utils.h"
+
+/* inline payload bytes, header plus data fit in a cache line */
+#define EVT_INLINE_MAX 48
+/* data bytes of a pooled buffer */
+#define EVTBUF_SIZE 1024
+/* buffers per pool slab */
+#define EVTBUF_SLAB 64
+
+/**
+ * evt_pl_type_t - where the payload data is
+ * @EVT_PL_NONE: no payload
+ * @EVT_PL_INLINE: in evt_payload_t.data
+ * @EVT_PL_BUF: in the pooled evt_payload_t.buf_p
+ */
+typedef enum evt_pl_type {
+	EVT_PL_NONE = 0,
+	EVT_PL_INLINE,
+	EVT_PL_BUF,
+} evt_pl_type_t;
+
+struct evtbuf_pool;
+
+/**
+ * evtbuf_t - pooled payload buffer
+ * @next_p: pool free list link
+ * @pool_p: pool the buffer goes back to
+ * @refs: holders of the buffer, returned to the pool at 0
+ * @len: bytes used in @data
+ * @data: the payload
+ */
+typedef struct evtbuf {
+	struct evtbuf *next_p;
+	struct evtbuf_pool *pool_p;
+	atomic_uint refs;
+	uint32_t len;
+	uint8_t data[EVTBUF_SIZE];
+} evtbuf_t;
+
+/**
+ * evtbuf_slab_t - one allocation of pool buffers
+ * @next_p: next slab of the pool
+ * @buf: the buffers
+ */
+typedef struct evtbuf_slab {
+	struct evtbuf_slab *next_p;
+	evtbuf_t buf[EVTBUF_SLAB];
+} evtbuf_slab_t;
+
+/**
+ * evtbuf_pool_t - buffers of one thread
+ * @next_p: next pool on the pool list
+ * @name: worker name, threadN for other threads
+ * @free_p: free buffers, only the owner thread uses it
+ * @remote_p: buffers put by other threads
+ * @slab_p: slabs, freed by evtbuf_destroy
+ * @gets: buffers handed out
+ * @remote_puts: buffers put by other threads
+ * @slabs: slabs allocated
+ */
+typedef struct evtbuf_pool {
+	struct evtbuf_pool *next_p;
+	char name[32];
+	evtbuf_t *free_p;
+	_Atomic(evtbuf_t *) remote_p;
+	evtbuf_slab_t *slab_p;
+	atomic_ulong gets;
+	atomic_ulong remote_puts;
+	atomic_ulong slabs;
+} evtbuf_pool_t;
+
+/**
+ * evt_payload_t - data carried with an event
+ * @type: evt_pl_type_t
+ * @len: payload bytes
+ * @data: inline bytes for EVT_PL_INLINE
+ * @buf_p: pooled buffer for EVT_PL_BUF, the holder owns one reference
+ */
+typedef struct evt_payload {
+	uint8_t type;
+	uint16_t len;
+	union {
+		uint8_t data[EVT_INLINE_MAX];
+		evtbuf_t *buf_p;
+	};
+} evt_payload_t;
+
+_Static_assert(sizeof(evt_payload_t) <= 64, "inline payload is one cache line");
+
+/*
+ * evtbuf_self_p - the calling thread pool, NULL until evtbuf_get
+ */
+extern __thread evtbuf_pool_t *evtbuf_self_p;
+
+extern evtbuf_pool_t *evtbuf_pool_create(void);
+extern evtbuf_t *evtbuf_refill(evtbuf_pool_t *pool_p);
+extern void evtbuf_show(void);
+extern void evtbuf_destroy(void);
+
+/**
+ * evtbuf_get - take a buffer from the calling thread pool
+ *
+ * The buffer has one reference and no data.
+ */
+static inline evtbuf_t *evtbuf_get(void)
+{
+	evtbuf_pool_t *pool_p = evtbuf_self_p;
+	evtbuf_t *buf_p;
+
+	if (unlikely(NULL == pool_p))
+		pool_p = evtbuf_pool_create();
+	if (unlikely(NULL == (buf_p = pool_p->free_p)))
+		buf_p = evtbuf_refill(pool_p);
+	pool_p->free_p = buf_p->next_p;
+
+	atomic_store_explicit(&pool_p->gets,
+			      atomic_load_explicit(&pool_p->gets, memory_order_relaxed) + 1,
+			      memory_order_relaxed);
+	atomic_store_explicit(&buf_p->refs, 1, memory_order_relaxed);
+	buf_p->len = 0;
+	return(buf_p);
+}
+
+/**
+ * evtbuf_ref - add references for more holders
+ * @buf_p: the buffer
+ * @n: new holders
+ */
+static inline void evtbuf_ref(evtbuf_t *buf_p, uint32_t n)
+{
+	atomic_fetch_add_explicit(&buf_p->refs, n, memory_order_relaxed);
+}
+
+/**
+ * evtbuf_put - drop a reference, the last one returns the buffer
+ * @buf_p: the buffer
+ *
+ * Safe from any thread.  The owner pushes on its free list, any other
+ * thread on the owner remote list.
+ */
+static inline void evtbuf_put(evtbuf_t *buf_p)
+{
+	evtbuf_pool_t *pool_p = buf_p->pool_p;
+
+	/* the last holder sees every write of the others */
+	if (1 != atomic_fetch_sub_explicit(&buf_p->refs, 1, memory_order_acq_rel))
+		return;
+
+	if (pool_p == evtbuf_self_p) {
+		buf_p->next_p = pool_p->free_p;
+		pool_p->free_p = buf_p;
+		return;
+	}
+
+	buf_p->next_p = atomic_load_explicit(&pool_p->remote_p, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&pool_p->remote_p, &buf_p->next_p, buf_p,
+						      memory_order_release,
+						      memory_order_relaxed))
+		;
+	atomic_fetch_add_explicit(&pool_p->remote_puts, 1, memory_order_relaxed);
+}
+
+/**
+ * evt_payload_none - clear a payload
+ * @pl_p: the payload
+ */
+static inline void evt_payload_none(evt_payload_t *pl_p)
+{
+	pl_p->type = EVT_PL_NONE;
+	pl_p->len = 0;
+}
+
+/**
+ * evt_payload_inline - copy data into an inline payload
+ * @pl_p: the payload
+ * @data_p: the data
+ * @len: bytes, at most EVT_INLINE_MAX
+ *
+ * Return: 0 or -1 if @len does not fit, use a pooled buffer then
+ */
+static inline int evt_payload_inline(evt_payload_t *pl_p, const void *data_p, size_t len)
+{
+	if (len > EVT_INLINE_MAX)
+		return(-1);
+	pl_p->type = EVT_PL_INLINE;
+	pl_p->len = len;
+	memcpy(pl_p->data, data_p, len);
+	return(0);
+}
+
+/**
+ * evt_payload_buf - give a filled pooled buffer to a payload
+ * @pl_p: the payload
+ * @buf_p: from evtbuf_get, @buf_p->len set, the payload takes the reference
+ */
+static inline void evt_payload_buf(evt_payload_t *pl_p, evtbuf_t *buf_p)
+{
+	pl_p->type = EVT_PL_BUF;
+	pl_p->len = buf_p->len;
+	pl_p->buf_p = buf_p;
+}
+
+/**
+ * evt_payload_move - move a payload, e.g. into a queue slot
+ * @to_p: destination
+ * @from_p: source, NULL for no payload
+ *
+ * Only the used inline bytes are copied.  A buffer reference moves with
+ * it, @from_p must not be released afterwards.
+ */
+static inline void evt_payload_move(evt_payload_t *to_p, const evt_payload_t *from_p)
+{
+	if (NULL == from_p || EVT_PL_NONE == from_p->type) {
+		evt_payload_none(to_p);
+		return;
+	}
+	to_p->type = from_p->type;
+	to_p->len = from_p->len;
+	if (EVT_PL_INLINE == from_p->type)
+		memcpy(to_p->data, from_p->data, from_p->len);
+	else
+		to_p->buf_p = from_p->buf_p;
+}
+
+/**
+ * evt_payload_dup - copy a payload for one more receiver
+ * @to_p: destination
+ * @from_p: source, NULL for no payload
+ *
+ * Same as evt_payload_move plus a new reference on a pooled buffer.
+ */
+static inline void evt_payload_dup(evt_payload_t *to_p, const evt_payload_t *from_p)
+{
+	evt_payload_move(to_p, from_p);
+	if (EVT_PL_BUF == to_p->type)
+		evtbuf_ref(to_p->buf_p, 1);
+}
+
+/**
+ * evt_payload_release - drop the payload and its buffer reference
+ * @pl_p: the payload, NULL is fine
+ */
+static inline void evt_payload_release(evt_payload_t *pl_p)
+{
+	if (NULL == pl_p)
+		return;
+	if (EVT_PL_BUF == pl_p->type)
+		evtbuf_put(pl_p->buf_p);
+	evt_payload_none(pl_p);
+}
+
+/**
+ * evt_payload_data - the payload bytes
+ * @pl_p: the payload, NULL is fine
+ * @len_p: set to the number of bytes, may be NULL
+ *
+ * Return: pointer to the data, NULL if there is no payload
+ */
+static inline const void *evt_payload_data(const evt_payload_t *pl_p, size_t *len_p)
+{
+	const void *data_p = NULL;
+	size_t len = 0;
+
+	if (pl_p && EVT_PL_INLINE == pl_p->type) {
+		data_p = pl_p->data;
+		len = pl_p->len;
+	} else if (pl_p && EVT_PL_BUF == pl_p->type) {
+		data_p = pl_p->buf_p->data;
+		len = pl_p->len;
+	}
+	if (len_p)
+		*len_p = len;
+	return(data_p);
+}
+
+#endif /* _EVTBUF_H */
@@ -0,0 +1,383 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * event broadcast channel, see evtbus.h
+ */
+
+#include "utils.h"
+#include "evtbus.h"
+#include "trace.h"
+#include "stats.h"
+#include "arena.h"
+
+/**
+ * evtbus_create - create a broadcast channel
+ * @size: number of ring slots, rounded up to a power of two, 0 for default
+ *
+ * A slot sequence of 0 means empty: the event with sequence s is in slot
+ * s & mask once the slot sequence is s + 1.
+ */
+evtbus_t *evtbus_create(uint32_t size)
+{
+	evtbus_t *bus_p = arena_calloc(sizeof(evtbus_t));
+	uint32_t i;
+
+	if (NULL == bus_p)
+		die("evtbus_create");
+
+	if (0 == size)
+		size = EVTBUS_SIZE;
+	for (i=1; i<size; i<<=1)
+		;
+	size = i;
+
+	if (NULL == (bus_p->ring_p = malloc(size * sizeof(evtbus_slot_t))))
+		die("evtbus_create ring");
+	for (i=0; i<size; i++) {
+		atomic_init(&bus_p->ring_p[i].seq, 0);
+		evt_payload_none(&bus_p->ring_p[i].pl);
+	}
+	bus_p->mask = size - 1;
+	atomic_init(&bus_p->claim, 0);
+	atomic_init(&bus_p->gate, 0);
+	atomic_init(&bus_p->nsubs, 0);
+	atomic_init(&bus_p->wakeups, 0);
+	return(bus_p);
+}
+
+/**
+ * evtbus_destroy - free the channel and its subscribers
+ * @bus_p: the channel, no thread may use it
+ *
+ * Drops the payload references still held by the slots.
+ */
+void evtbus_destroy(evtbus_t *bus_p)
+{
+	uint32_t i;
+
+	if (NULL == bus_p)
+		return;
+	for (i=0; i<=bus_p->mask; i++)
+		evt_payload_release(&bus_p->ring_p[i].pl);
+	for (i=0; i<atomic_load(&bus_p->nsubs); i++)
+		arena_free(atomic_load(&bus_p->subs[i]));
+	free(bus_p->ring_p);
+	arena_free(bus_p);
+}
+
+/**
+ * evtbus_subscribe - add a subscriber
+ * @bus_p: the channel
+ * @mask: EVTBUS_BIT of every event to receive
+ *
+ * The subscriber gets the events published after it subscribed.
+ *
+ * Return: the subscriber, read it with evtbus_dequeue_batch
+ */
+evtbus_sub_t *evtbus_subscribe(evtbus_t *bus_p, uint32_t mask)
+{
+	evtbus_sub_t *sub_p = arena_calloc(sizeof(evtbus_sub_t));
+	uint32_t idx;
+
+	if (NULL == sub_p)
+		die("evtbus_subscribe");
+
+	sub_p->mask = mask;
+	sub_p->bus_p = bus_p;
+	atomic_init(&sub_p->cursor, atomic_load(&bus_p->claim));
+	atomic_init(&sub_p->active, true);
+
+	if (EVTBUS_SUBS_MAX <= (idx = atomic_fetch_add(&bus_p->nsubs, 1)))
+		die("evtbus_subscribe too many");
+	atomic_store(&bus_p->subs[idx], sub_p);
+	return(sub_p);
+}
+
+/**
+ * evtbus_unsubscribe - stop receiving, producers stop waiting for it
+ * @sub_p: the subscriber
+ *
+ * Called by the subscriber thread when it is done, e.g. on E_DONE.  The
+ * subscriber is freed by evtbus_destroy.
+ */
+void evtbus_unsubscribe(evtbus_sub_t *sub_p)
+{
+	atomic_store(&sub_p->active, false);
+}
+
+/**
+ * bus_sub - subscriber by index
+ * @bus_p: the channel
+ * @i: index below nsubs
+ *
+ * NULL while evtbus_subscribe has the index but has not stored it.
+ */
+static inline evtbus_sub_t *bus_sub(evtbus_t *bus_p, uint32_t i)
+{
+	return atomic_load_explicit(&bus_p->subs[i], memory_order_acquire);
+}
+
+/**
+ * bus_wake_sub - wake a parked subscriber
+ * @bus_p: the channel
+ * @sub_p: the subscriber
+ *
+ * Only the first producer to see it parked makes the syscall.
+ */
+static inline void bus_wake_sub(evtbus_t *bus_p, evtbus_sub_t *sub_p)
+{
+	if (atomic_load_explicit(&sub_p->waiting, memory_order_relaxed) &&
+	    atomic_exchange(&sub_p->waiting, 0)) {
+		atomic_fetch_add(&sub_p->futex, 1);
+		futex_wake(&sub_p->futex, 1);
+		atomic_fetch_add_explicit(&bus_p->wakeups, 1, memory_order_relaxed);
+	}
+}
+
+/**
+ * bus_gate - refresh the lowest active subscriber cursor
+ * @bus_p: the channel
+ * @pos: sequence the caller claimed, the gate with no subscribers
+ * @wake: wake the parked subscribers holding back @pos
+ *
+ * Cursors only move forward, so a stale gate is lower than the real one
+ * and only makes a producer wait longer.
+ *
+ * Return: the new gate
+ */
+static uint64_t bus_gate(evtbus_t *bus_p, uint64_t pos, bool wake)
+{
+	uint64_t gate = pos, cur;
+	evtbus_sub_t *sub_p;
+	uint32_t i, n = atomic_load(&bus_p->nsubs);
+
+	for (i=0; i<n; i++) {
+		if (NULL == (sub_p = bus_sub(bus_p, i)) || !atomic_load(&sub_p->active))
+			continue;
+		cur = atomic_load_explicit(&sub_p->cursor, memory_order_acquire);
+		if (cur < gate)
+			gate = cur;
+		if (wake && cur + bus_p->mask < pos)
+			bus_wake_sub(bus_p, sub_p);
+	}
+	atomic_store_explicit(&bus_p->gate, gate, memory_order_release);
+	return(gate);
+}
+
+/**
+ * evtbus_publish - broadcast an event to the subscribers
+ * @bus_p: the channel
+ * @evt_id: the event id
+ *
+ * Claim a sequence, wait until every active subscriber has read the
+ * previous event in the slot, write the event and publish it with the
+ * slot sequence (release.)  Then wake the parked subscribers whose mask
+ * has the event, and any parked at this sequence: a subscriber reads in
+ * claim order, so one woken by a later event parks again on this one
+ * while it is unpublished, even if its mask does not have it.
+ *
+ * If the ring is full the producer wakes the lagging subscribers and
+ * relaxes until they move on, the channel never drops an event.  As with
+ * the ring queues, a subscriber publishing to a ring it is holding full
+ * waits for itself.
+ */
+void evtbus_publish(evtbus_t *bus_p, fsm_events_t evt_id)
+{
+	evtbus_publish_pl(bus_p, evt_id, NULL);
+}
+
+/**
+ * evtbus_publish_pl - broadcast an event with a payload
+ * @bus_p: the channel
+ * @evt_id: the event id
+ * @pl_p: payload, NULL for none, the slot takes its buffer reference
+ *
+ * Same as evtbus_publish.  Every subscriber passed the slot before the
+ * gate let the producer in, so the previous payload in the slot is
+ * released here.
+ */
+void evtbus_publish_pl(evtbus_t *bus_p, fsm_events_t evt_id, const evt_payload_t *pl_p)
+{
+	evtbus_publish_from(bus_p, NULL, evt_id, pl_p);
+}
+
+/**
+ * evtbus_publish_from - broadcast an event to every subscriber but one
+ * @bus_p: the channel
+ * @from_p: the publishing subscriber, NULL for none
+ * @evt_id: the event id
+ * @pl_p: payload, NULL for none, the slot takes its buffer reference
+ *
+ * Same as evtbus_publish_pl, @from_p is neither woken nor reads the
+ * event, e.g. a worker FSM that ran it to completion already.
+ */
+void evtbus_publish_from(evtbus_t *bus_p, const evtbus_sub_t *from_p,
+			 fsm_events_t evt_id, const evt_payload_t *pl_p)
+{
+	evtbus_slot_t *slot_p;
+	evtbus_sub_t *sub_p;
+	uint64_t ts = stats_stamp();
+	uint64_t pos;
+	uint32_t i, n, bit = (evt_id < E_LAST) ? EVTBUS_BIT(evt_id) : 0;
+
+	pos = atomic_fetch_add_explicit(&bus_p->claim, 1, memory_order_relaxed);
+	slot_p = &bus_p->ring_p[pos & bus_p->mask];
+
+	if (pos > atomic_load_explicit(&bus_p->gate, memory_order_acquire) + bus_p->mask) {
+		while (pos > bus_gate(bus_p, pos, true) + bus_p->mask)
+			relax();
+	}
+
+	slot_p->event_id = evt_id;
+	slot_p->ts = ts;
+	slot_p->from_p = from_p;
+	evt_payload_release(&slot_p->pl);
+	evt_payload_move(&slot_p->pl, pl_p);
+	atomic_store_explicit(&slot_p->seq, pos+1, memory_order_release);
+
+	/* pairs with the waiting store in evtbus_dequeue_batch */
+	atomic_thread_fence(memory_order_seq_cst);
+	n = atomic_load(&bus_p->nsubs);
+	for (i=0; i<n; i++) {
+		sub_p = bus_sub(bus_p, i);
+		if (!sub_p)
+			continue;
+		if ((sub_p != from_p && (sub_p->mask & bit)) ||
+		    (atomic_load_explicit(&sub_p->waiting, memory_order_relaxed) &&
+		     atomic_load_explicit(&sub_p->cursor, memory_order_relaxed) == pos))
+			bus_wake_sub(bus_p, sub_p);
+	}
+
+	dbg_evts(evt_id);
+	trace_evt(evt_id);
+}
+
+/**
+ * bus_ready - check for a published event at the subscriber cursor
+ * @sub_p: the subscriber
+ */
+static inline bool bus_ready(evtbus_sub_t *sub_p)
+{
+	evtbus_t *bus_p = sub_p->bus_p;
+	uint64_t c = atomic_load_explicit(&sub_p->cursor, memory_order_relaxed);
+
+	return (atomic_load_explicit(&bus_p->ring_p[c & bus_p->mask].seq,
+				     memory_order_acquire) == c+1);
+}
+
+/**
+ * bus_take - read the published events at the subscriber cursor
+ * @sub_p: the subscriber
+ * @out_p: array of at least @max event ids to fill
+ * @pl_p: array of at least @max payloads to fill, NULL to skip them
+ * @max: most events to take
+ *
+ * Events outside the mask are skipped, events the subscriber published
+ * itself are passed over without counting.  Reading stops at the first
+ * sequence not yet published, so the order is the claim order even when
+ * a later producer finishes first.  The cursor store (release) hands the
+ * slots back to the producers after the events are read.
+ *
+ * Return: number of events written to @out_p
+ */
+static size_t bus_take(evtbus_sub_t *sub_p, fsm_events_t *out_p,
+		       evt_payload_t *pl_p, size_t max)
+{
+	evtbus_t *bus_p = sub_p->bus_p;
+	evtbus_slot_t *slot_p;
+	uint64_t c = atomic_load_explicit(&sub_p->cursor, memory_order_relaxed);
+	uint64_t skips = 0;
+	size_t n = 0;
+
+	while (n < max) {
+		slot_p = &bus_p->ring_p[c & bus_p->mask];
+		if (atomic_load_explicit(&slot_p->seq, memory_order_acquire) != c+1)
+			break;
+		if (slot_p->from_p == sub_p) {
+			/* its own event */
+		} else if (slot_p->event_id < E_LAST && (sub_p->mask & EVTBUS_BIT(slot_p->event_id))) {
+			if (pl_p)
+				evt_payload_dup(&pl_p[n], &slot_p->pl);
+			out_p[n++] = slot_p->event_id;
+			stats_qlat(slot_p->ts);
+		} else {
+			skips++;
+		}
+		c++;
+	}
+	atomic_store_explicit(&sub_p->cursor, c, memory_order_release);
+
+	stats_inc(&sub_p->reads, n);
+	stats_inc(&sub_p->skips, skips);
+	if (skips)
+		stats_filtered(skips);
+	return(n);
+}
+
+/**
+ * evtbus_dequeue_batch - take the subscriber events, park if there are none
+ * @sub_p: the subscriber, only its thread may call this
+ * @out_p: array of at least @max event ids to fill
+ * @max: most events to take
+ *
+ * Same park protocol as the ring queues: read the futex, announce the
+ * waiter, check the ring once more, sleep.  A producer publishing after
+ * the check sees the waiter and bumps the futex.
+ *
+ * Return: number of events written to @out_p, always >= 1 if @max > 0
+ */
+size_t evtbus_dequeue_batch(evtbus_sub_t *sub_p, fsm_events_t *out_p, size_t max)
+{
+	return evtbus_dequeue_batch_pl(sub_p, out_p, NULL, max);
+}
+
+/**
+ * evtbus_dequeue_batch_pl - evtbus_dequeue_batch with the event payloads
+ * @sub_p: the subscriber, only its thread may call this
+ * @out_p: array of at least @max event ids to fill
+ * @pl_p: array of at least @max payloads to fill, NULL to skip them
+ * @max: most events to take
+ *
+ * The caller owns the payloads, see fsm_run_batch_pl.
+ *
+ * Return: number of events written to @out_p, always >= 1 if @max > 0
+ */
+size_t evtbus_dequeue_batch_pl(evtbus_sub_t *sub_p, fsm_events_t *out_p,
+			       evt_payload_t *pl_p, size_t max)
+{
+	uint32_t key;
+	size_t n, i;
+
+	if (0 == max)
+		return(0);
+
+	while (0 == (n = bus_take(sub_p, out_p, pl_p, max))) {
+		key = atomic_load(&sub_p->futex);
+		atomic_store(&sub_p->waiting, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (bus_ready(sub_p)) {
+			atomic_store(&sub_p->waiting, 0);
+			continue;
+		}
+		stats_inc(&sub_p->waits, 1);
+		futex_wait(&sub_p->futex, key);
+		atomic_store(&sub_p->waiting, 0);
+	}
+
+	for (i=0; i<n; i++)
+		dbg_evts(out_p[i]);
+	return(n);
+}
+
+/**
+ * evtbus_show - print the channel counters
+ * @bus_p: the channel
+ */
+void evtbus_show(evtbus_t *bus_p)
+{
+	printf("bus size=%lu published=%lu subscribers=%u wakeups=%lu\n",
+	       bus_p->mask + 1, atomic_load(&bus_p->claim), atomic_load(&bus_p->nsubs),
+	       atomic_load(&bus_p->wakeups));
+}
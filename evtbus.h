@@ -0,0 +1,137 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * event broadcast channel
+ *
+ * One shared ring of sequence-numbered events, Disruptor style.  A
+ * broadcast is written to the ring once, whatever the number of
+ * subscribers, and each subscriber reads the ring with its own cursor.
+ * Producers claim a sequence with one atomic add, no lock, no malloc,
+ * and only wake a subscriber that is parked and wants the event.
+ *
+ * Each subscriber has an event mask.  An event outside the mask is never
+ * a reason to wake the subscriber; it is skipped the next time the
+ * subscriber reads the ring.  A producer that finds the ring full wakes
+ * the lagging subscribers so they skip ahead.
+ *
+ * All subscribers see the broadcasts in the same order.  A subscriber
+ * publishing with evtbus_publish_from does not get its own event back.
+ *
+ * A payload is stored in the slot once.  Each subscriber reading it gets
+ * a copy of the inline bytes or its own reference on the pooled buffer;
+ * the slot reference is dropped when a producer reuses the slot.
+ */
+
+#ifndef _EVTBUS_H
+#define _EVTBUS_H
+
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <stdatomic.h>   /* sequences */
+#include "evtq.h"
+
+/* default number of ring slots */
+#define EVTBUS_SIZE 1024
+/* most subscribers on one channel */
+#define EVTBUS_SUBS_MAX 64
+
+/* event mask bit of an event id */
+#define EVTBUS_BIT(evt_id) (1U << (evt_id))
+/* mask of every event */
+#define EVTBUS_ALL ((1U << E_LAST) - 1)
+
+_Static_assert(E_LAST <= 32, "event mask is 32 bits");
+
+/**
+ * evtbus_slot_t - one ring entry
+ * @seq: sequence + 1 of the event in the slot, set last by the producer
+ * @event_id: the event
+ * @ts: enqueue time for the latency stats, 0 if not stamped
+ * @pl: event payload, holds a buffer reference until the slot is reused
+ * @from_p: subscriber that published the event, it does not read it back
+ */
+typedef struct evtbus_slot {
+	atomic_ulong seq;
+	fsm_events_t event_id;
+	uint64_t ts;
+	evt_payload_t pl;
+	const struct evtbus_sub *from_p;
+} evtbus_slot_t;
+
+struct evtbus;
+
+/**
+ * evtbus_sub_t - one subscriber
+ * @cursor: next sequence to read, only the subscriber stores it
+ * @mask: EVTBUS_BIT of each event the subscriber wants
+ * @active: false after evtbus_unsubscribe, the ring no longer waits for it
+ * @futex: bumped by a producer to wake the parked subscriber
+ * @waiting: subscriber is parked or about to park
+ * @reads: events taken, only written by the subscriber
+ * @skips: events skipped because of the mask
+ * @waits: times the subscriber parked
+ * @bus_p: the channel
+ *
+ * The park handshake, written by producers, is on its own cache line,
+ * apart from the cursor and counters the subscriber writes on every read.
+ */
+typedef struct evtbus_sub {
+	atomic_ulong cursor;
+	atomic_ulong reads;
+	atomic_ulong skips;
+	atomic_ulong waits;
+	uint32_t mask;
+	atomic_bool active;
+	struct evtbus *bus_p;
+
+	atomic_uint futex ____cacheline_aligned;
+	atomic_uint waiting;
+} ____cacheline_aligned evtbus_sub_t;
+
+_Static_assert(offsetof(evtbus_sub_t, bus_p) / L1_CACHE_BYTES <
+	       offsetof(evtbus_sub_t, futex) / L1_CACHE_BYTES, "subscriber apart from the park");
+
+/**
+ * evtbus_t - the broadcast channel
+ * @mask: ring slots - 1
+ * @ring_p: the slots
+ * @claim: next sequence a producer claims
+ * @gate: cached lowest active subscriber cursor, producers refresh it
+ *        when the claimed sequence would lap it
+ * @nsubs: number of entries in @subs
+ * @subs: subscribers, in subscribe order
+ * @wakeups: times a producer woke a subscriber
+ *
+ * The sequences producers write on every publish are on their own cache
+ * line, apart from the subscriber list the subscribers read.
+ */
+typedef struct evtbus {
+	uint64_t mask;
+	evtbus_slot_t *ring_p;
+	atomic_uint nsubs;
+	_Atomic(evtbus_sub_t *) subs[EVTBUS_SUBS_MAX];
+
+	atomic_ulong claim ____cacheline_aligned;
+	atomic_ulong gate;
+	atomic_ulong wakeups;
+} ____cacheline_aligned evtbus_t;
+
+_Static_assert(offsetof(evtbus_t, subs[EVTBUS_SUBS_MAX-1]) / L1_CACHE_BYTES <
+	       offsetof(evtbus_t, claim) / L1_CACHE_BYTES, "subscriber list apart from the producers");
+
+extern evtbus_t *evtbus_create(uint32_t size);
+extern void evtbus_destroy(evtbus_t *bus_p);
+extern evtbus_sub_t *evtbus_subscribe(evtbus_t *bus_p, uint32_t mask);
+extern void evtbus_unsubscribe(evtbus_sub_t *sub_p);
+extern void evtbus_publish(evtbus_t *bus_p, fsm_events_t evt_id);
+extern void evtbus_publish_pl(evtbus_t *bus_p, fsm_events_t evt_id, const evt_payload_t *pl_p);
+extern void evtbus_publish_from(evtbus_t *bus_p, const evtbus_sub_t *from_p,
+				fsm_events_t evt_id, const evt_payload_t *pl_p);
+extern size_t evtbus_dequeue_batch(evtbus_sub_t *sub_p, fsm_events_t *out_p, size_t max);
+extern size_t evtbus_dequeue_batch_pl(evtbus_sub_t *sub_p, fsm_events_t *out_p,
+				      evt_payload_t *pl_p, size_t max);
+extern void evtbus_show(evtbus_t *bus_p);
+
+#endif /* _EVTBUS_H */
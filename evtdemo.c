@@ -50,6 +50,7 @@
 #include "evtq.h"
 #include "timer.h"
 #include "workers.h"
+#include "reactor.h"
 
 /* max number of epoll events to wait for */
 #define MAX_WAIT_EVENTS 1
@@ -61,6 +62,8 @@ char *arguments = "\n"							\
 	" -t tick: timer tick in msec\n"				\
 	" -s scriptfile: read events from file\n"			\
 	" -n: non-interactive mode (only read from scriptfile)\n"	\
+	" -q type: worker event queue type list, spsc or mpsc\n"	\
+	" -W wake: queue wakeup immediate, yield, spin or coalesce\n"	\
 	" -d level: set debug_flag to hex level\n"			\
 	" -h: this help\n";
 
@@ -89,6 +92,21 @@ static bool non_interactive = false;
  */
 uint32_t debug_flag;
 
+/*
+ * workers - global registry of worker threads.  See workers.h
+ */
+workers_t workers = WORKERS_INIT;
+
+/*
+ * worker_self_p - thread-local pointer to the current worker.  See workers.h
+ */
+__thread worker_t *worker_self_p;
+
+/*
+ * workers_reader_p - thread-local registry reader record.  See workers.h
+ */
+__thread workers_reader_t *workers_reader_p;
+
 /**
  * cmdline_args - parse command line arguments
  * @argc: argument count (from main)
@@ -104,7 +122,7 @@ uint32_t debug_flag;
 int cmdline_args(int argc, char *argv[]) {
 	int opt;
 	
-	while((opt = getopt(argc, argv, "t:s:nd:h")) != -1) {
+	while((opt = getopt(argc, argv, "t:s:nq:W:d:h")) != -1) {
 		switch(opt) {
 		case 't':
 			tick = strtoul(optarg, NULL, 0);
@@ -118,6 +136,28 @@ int cmdline_args(int argc, char *argv[]) {
 		case 'n':
 			non_interactive = true;
 			break;
+		case 'q':
+		{
+			int type = evtq_type_parse(optarg);
+
+			if (type < 0) {
+				fprintf(stderr, "unknown queue type %s\n", optarg);
+				exit(1);
+			}
+			workers.qattr.type = type;
+		}
+		break;
+		case 'W':
+		{
+			int wake = evtq_wake_parse(optarg);
+
+			if (wake < 0) {
+				fprintf(stderr, "unknown queue wakeup %s\n", optarg);
+				exit(1);
+			}
+			workers.qattr.wake = wake;
+		}
+		break;
 		case 'd':
 			debug_flag = strtoul(optarg, NULL, 0);
 			break;
@@ -183,7 +223,6 @@ void *evt_c1(void *arg)
 
 	dbg("enter and wait for fsm events");
 
-	/* worker_self() loops through worker_list for match on pthread_self */
 	evtq_self = self_p->evtq_p;
 	while (true)
 	{
@@ -233,7 +272,6 @@ void *evt_c2(void *arg)
 
 	dbg("enter and wait for fsm events");
 
-	/* worker_self() loops through worker_list for match on pthread_self */
 	evtq_self = self_p->evtq_p;
 	while (true)
 	{
@@ -263,11 +301,6 @@ void *evt_c2(void *arg)
 	dbg("exitting...");
 }
 
-/*
- * workers - global linked list of worker threads.  See workers.h
- */
-workers_t workers;
-
 /**
  * main - a simple driver for an event producer/consumer framework (MGMT)
  *
@@ -277,6 +310,8 @@ workers_t workers;
  * - process command line arguments
  * - set signal handlers (just in case)
  * - create an event queue for the consumer
+ * - start timer service thread for -n, otherwise the timers run on the
+ *   CLI reactor
  * - create the consumer pthread
  * - call the evt_producer function from the main thread
  * - wait for consumer thread to terminate
@@ -286,6 +321,7 @@ int main(int argc, char *argv[])
 {
 	int parsed_args;
 	pthread_t timer_service;
+	reactor_t *reactor_p;
 
 	parsed_args = cmdline_args(argc, argv);
 
@@ -299,7 +335,10 @@ int main(int argc, char *argv[])
 	/* all threads in process use this */
 	set_sig_handlers();
 	
-	if (0 != pthread_create(&timer_service, NULL, timer_service_fn, NULL))
+	reactor_p = reactor_create();
+	if (!non_interactive)
+		timer_reactor_add(reactor_p);
+	else if (0 != pthread_create(&timer_service, NULL, timer_service_fn, reactor_p))
 		die("timer_service create");
 
 	worker_list_create();
@@ -309,12 +348,14 @@ int main(int argc, char *argv[])
 	/* create a test timer */
 
 	/* loop until 'x' entered */
-	non_interactive ? evt_script() : evt_producer();
+	non_interactive ? evt_script() : evt_producer(reactor_p);
 
-	/* cancel timer_service thread */
-	dbg("cancel timer_service and join\n");
-	pthread_cancel(timer_service);
-	pthread_join(timer_service, NULL);
+	if (non_interactive) {
+		dbg("stop timer_service and join\n");
+		reactor_stop(reactor_p);
+		pthread_join(timer_service, NULL);
+	}
+	reactor_destroy(reactor_p);
 	
 	dbg("waiting for worker joins\n");
 	join_workers();
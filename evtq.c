@@ -9,21 +9,155 @@
 #include "utils.h"
 #include "evtq.h"
 #include "workers.h"
+#include "trace.h"
+#include "stats.h"
+#include "arena.h"
+
+bool evtq_track;
+atomic_uint evtq_inflight;
+
+/*
+ * evtq_type_names - mapping from evtq_type_t to a text string, used by
+ * the -q commandline argument
+ */
+static const char * const evtq_type_names[] = {
+	[EVTQ_LIST] = "list",
+	[EVTQ_SPSC] = "spsc",
+	[EVTQ_MPSC] = "mpsc",
+};
+
+/**
+ * evtq_type_parse - map a queue type name to the evtq_type_t
+ * @name: one of the evtq_type_names strings
+ *
+ * Return: the queue type or -1 if unknown
+ */
+int evtq_type_parse(const char *name)
+{
+	int i;
+
+	for (i=0; i<EVTQ_TYPE_LAST; i++)
+		if (0 == strcmp(name, evtq_type_names[i]))
+			return(i);
+	return(-1);
+}
+
+/**
+ * evtq_type_name - queue type as a string for debugging
+ * @type: queue type
+ */
+const char *evtq_type_name(evtq_type_t type)
+{
+	return (type < EVTQ_TYPE_LAST) ? evtq_type_names[type] : "unknown";
+}
+
+/*
+ * evtq_wake_names - mapping from evtq_wake_t to a text string, used by
+ * the -W commandline argument
+ */
+static const char * const evtq_wake_names[] = {
+	[EVTQ_WAKE_IMMEDIATE] = "immediate",
+	[EVTQ_WAKE_YIELD] = "yield",
+	[EVTQ_WAKE_SPIN] = "spin",
+	[EVTQ_WAKE_COALESCE] = "coalesce",
+	[EVTQ_WAKE_ADAPTIVE] = "adaptive",
+};
+
+/**
+ * evtq_wake_parse - map a wakeup policy name to the evtq_wake_t
+ * @name: one of the evtq_wake_names strings
+ *
+ * Return: the wakeup policy or -1 if unknown
+ */
+int evtq_wake_parse(const char *name)
+{
+	int i;
+
+	for (i=0; i<EVTQ_WAKE_LAST; i++)
+		if (0 == strcmp(name, evtq_wake_names[i]))
+			return(i);
+	return(-1);
+}
+
+/**
+ * evtq_wake_name - wakeup policy as a string for debugging
+ * @wake: wakeup policy
+ */
+const char *evtq_wake_name(evtq_wake_t wake)
+{
+	return (wake < EVTQ_WAKE_LAST) ? evtq_wake_names[wake] : "unknown";
+}
+
+/*
+ * stat_inc - bump a counter only written by one thread (the consumer),
+ * cheaper than an atomic add.
+ */
+static inline void stat_inc(atomic_ulong *cnt_p, uint64_t n)
+{
+	atomic_store_explicit(cnt_p, atomic_load_explicit(cnt_p, memory_order_relaxed) + n,
+			      memory_order_relaxed);
+}
 
 /**
  * evtq_create - create a queue instance
+ * @attr_p - queue attributes, NULL for an EVTQ_LIST queue
  *
- * This will malloc an instance of a queue and
- * initialize it.  Notice the NL_INIT_LIST_HEAD macro.
+ * This will allocate an instance of a queue, from the arena if there is
+ * one, and initialize it.  Notice the NL_INIT_LIST_HEAD macro.
+ * For a ring the slot count is rounded up to a power of two and each slot
+ * sequence is set to its index, meaning free for the producer.
  */
-evtq_t* evtq_create(void)
+evtq_t* evtq_create(const evtq_attr_t *attr_p)
 {
-	evtq_t *q_p = malloc(sizeof(evtq_t));
+	evtq_t *q_p = arena_calloc(sizeof(evtq_t));
+	uint32_t size, i;
+
+	if (NULL == q_p)
+		die("evtq_create");
 
+	q_p->type = attr_p ? attr_p->type : EVTQ_LIST;
 	pthread_mutex_init(&q_p->mutex, NULL);
 	pthread_cond_init(&q_p->cond, NULL);	
 	q_p->len = 0;
 	NL_INIT_LIST_HEAD(&q_p->head.list);
+	NL_INIT_LIST_HEAD(&q_p->spare);
+
+	q_p->mask = 0;
+	q_p->ring_p = NULL;
+	atomic_init(&q_p->tail, 0);
+	atomic_init(&q_p->head_idx, 0);
+	atomic_init(&q_p->futex, 0);
+	atomic_init(&q_p->waiters, 0);
+
+	q_p->wake = attr_p ? attr_p->wake : EVTQ_WAKE_IMMEDIATE;
+	if (q_p->wake >= EVTQ_WAKE_LAST)
+		die("evtq_create unknown wake");
+	if (attr_p && attr_p->spin)
+		q_p->spin = attr_p->spin;
+	else
+		q_p->spin = q_p->wake == EVTQ_WAKE_ADAPTIVE ? EVTQ_ADAPT_SPIN_NS : EVTQ_SPIN_DEFAULT;
+	q_p->budget_ns = 0;
+	atomic_init(&q_p->wake_pending, 0);
+	atomic_init(&q_p->dequeues, 0);
+	atomic_init(&q_p->waits, 0);
+	atomic_init(&q_p->wakeups, 0);
+
+	if (q_p->type == EVTQ_LIST)
+		return(q_p);
+
+	if (q_p->type >= EVTQ_TYPE_LAST)
+		die("evtq_create unknown type");
+
+	size = (attr_p->size) ? attr_p->size : EVTQ_RING_SIZE;
+	for (i=1; i<size; i<<=1)
+		;
+	size = i;
+
+	if (NULL == (q_p->ring_p = arena_calloc(size * sizeof(struct evtq_slot))))
+		die("evtq_create ring");
+	for (i=0; i<size; i++)
+		atomic_init(&q_p->ring_p[i].seq, i);
+	q_p->mask = size - 1;
 
 	return(q_p);
 }
@@ -31,17 +165,450 @@ evtq_t* evtq_create(void)
 /**
  * evtq_destroy - remove all queue structurs
  *
- * this will destroy mutex, condition and free queue memory
+ * this will destroy mutex, condition and free queue memory, the list
+ * nodes and any event still queued
  */
 void evtq_destroy(evtq_t* q_p)
 {
+	struct fsm_event *ep, *n_p;
+	struct evtq_slot *slot_p;
+	uint32_t pos, tail;
+
 	if (NULL == q_p)
 		return;
 
 	pthread_mutex_destroy(&q_p->mutex);
 	pthread_cond_destroy(&q_p->cond);
 
-	free(q_p);
+	nl_list_for_each_entry_safe(ep, n_p, &q_p->head.list, list) {
+		evt_payload_release(&ep->pl);
+		arena_free(ep);
+	}
+	nl_list_for_each_entry_safe(ep, n_p, &q_p->spare, list)
+		arena_free(ep);
+
+	/* the published slots a consumer has not read yet */
+	tail = atomic_load(&q_p->tail);
+	for (pos = atomic_load(&q_p->head_idx); q_p->ring_p && pos != tail; pos++) {
+		slot_p = &q_p->ring_p[pos & q_p->mask];
+		if (atomic_load(&slot_p->seq) == pos + 1)
+			evt_payload_release(&slot_p->pl);
+	}
+
+	arena_free(q_p->ring_p);
+	arena_free(q_p);
+}
+
+/**
+ * evtq_need_wake - decide if the producer must wake the consumer
+ * @evtq_p - pointer to event queue
+ *
+ * Called after an event is published.  Nothing to do if the consumer is
+ * not parked (or spinning for EVTQ_WAKE_SPIN.)  EVTQ_WAKE_COALESCE only
+ * lets the first producer since the consumer parked send the wake.
+ *
+ * Return: true if the caller must signal the consumer
+ */
+static inline bool evtq_need_wake(evtq_t *evtq_p)
+{
+	if (0 == atomic_load_explicit(&evtq_p->waiters, memory_order_relaxed))
+		return(false);
+
+	if (evtq_p->wake == EVTQ_WAKE_COALESCE &&
+	    atomic_exchange(&evtq_p->wake_pending, 1))
+		return(false);
+
+	atomic_fetch_add_explicit(&evtq_p->wakeups, 1, memory_order_relaxed);
+	return(true);
+}
+
+/**
+ * evtq_woken - consumer is running again after a park
+ * @evtq_p - pointer to event queue
+ *
+ * Clear wake_pending so the next park gets a wake.  The fence orders the
+ * clear before the consumer checks the queue again, pairs with the fence
+ * in ring_publish.
+ */
+static inline void evtq_woken(evtq_t *evtq_p)
+{
+	atomic_exchange(&evtq_p->wake_pending, 0);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+/**
+ * ring_claim - claim up to @k contiguous ring slots
+ * @evtq_p - pointer to a ring event queue
+ * @k - slots wanted, at most the ring size
+ * @pos_p - gets the position of the first claimed slot
+ * @wait - relax until a slot is free if the ring is full
+ *
+ * The consumer frees slots in order, so if the last of the @k slots is
+ * free for this lap of the ring all of them are.  EVTQ_MPSC producers race
+ * for the tail with a CAS, the EVTQ_SPSC producer owns the tail and simply
+ * stores it.  The acquire on the last slot sequence orders the consumer
+ * reads of every slot in the run before the producer writes them.
+ *
+ * If the ring has less than @k free slots fewer are claimed; if it is
+ * full the producer relaxes until the consumer frees a slot, the queue
+ * never drops an event.  Without @wait a full ring claims nothing.
+ *
+ * Return: the number of slots claimed, at least 1 with @wait
+ */
+static uint32_t ring_claim(evtq_t *evtq_p, uint32_t k, uint32_t *pos_p, bool wait)
+{
+	struct evtq_slot *slot_p;
+	uint32_t pos, last, seq;
+
+	pos = atomic_load_explicit(&evtq_p->tail, memory_order_relaxed);
+	while (1) {
+		last = pos + k - 1;
+		slot_p = &evtq_p->ring_p[last & evtq_p->mask];
+		seq = atomic_load_explicit(&slot_p->seq, memory_order_acquire);
+
+		if (seq == last) {
+			if (evtq_p->type == EVTQ_SPSC) {
+				atomic_store_explicit(&evtq_p->tail, pos+k, memory_order_relaxed);
+				break;
+			}
+			/* on failure pos is updated to the current tail */
+			if (atomic_compare_exchange_weak_explicit(&evtq_p->tail, &pos, pos+k,
+								  memory_order_relaxed,
+								  memory_order_relaxed))
+				break;
+		} else if ((int32_t)(seq - last) < 0) {
+			/* not enough room, take what is free or wait for the consumer */
+			if (k > 1) {
+				k /= 2;
+				continue;
+			}
+			if (!wait)
+				return(0);
+			relax();
+			pos = atomic_load_explicit(&evtq_p->tail, memory_order_relaxed);
+		} else {
+			/* another producer claimed pos */
+			pos = atomic_load_explicit(&evtq_p->tail, memory_order_relaxed);
+		}
+	}
+
+	*pos_p = pos;
+	return(k);
+}
+
+/**
+ * ring_publish - wake the consumer after slots are published
+ * @evtq_p - pointer to a ring event queue
+ */
+static inline void ring_publish(evtq_t *evtq_p)
+{
+	/* pairs with the waiters increment in ring_dequeue */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (evtq_need_wake(evtq_p)) {
+		atomic_fetch_add(&evtq_p->futex, 1);
+		futex_wake(&evtq_p->futex, 1);
+	}
+}
+
+/**
+ * ring_enqueue - claim a ring slot and publish the event in it
+ * @evtq_p - pointer to a ring event queue
+ * @evt_id - the event id to add
+ * @ts - enqueue stamp
+ * @pl_p - payload moved into the slot, NULL for none
+ *
+ * The slot sequence store (release) publishes the event to the consumer.
+ */
+static void ring_enqueue(evtq_t *evtq_p, fsm_events_t evt_id, uint64_t ts,
+			 const evt_payload_t *pl_p)
+{
+	struct evtq_slot *slot_p;
+	uint32_t pos;
+
+	ring_claim(evtq_p, 1, &pos, true);
+	slot_p = &evtq_p->ring_p[pos & evtq_p->mask];
+	slot_p->event_id = evt_id;
+	slot_p->ts = ts;
+	evt_payload_move(&slot_p->pl, pl_p);
+	atomic_store_explicit(&slot_p->seq, pos+1, memory_order_release);
+
+	ring_publish(evtq_p);
+}
+
+/**
+ * ring_enqueue_batch - publish @n events in runs of contiguous slots
+ * @evtq_p - pointer to a ring event queue
+ * @ids_p - the event ids
+ * @pls_p - payloads moved into the slots, NULL for none
+ * @n - number of events
+ * @ts - enqueue stamp
+ * @wait - wait for room if the ring is full, else stop
+ *
+ * One tail claim, one fence and at most one wake per run instead of per
+ * event.
+ *
+ * Return: number of events published, the first ones of @ids_p; @n with
+ * @wait
+ */
+static size_t ring_enqueue_batch(evtq_t *evtq_p, const fsm_events_t *ids_p,
+				 const evt_payload_t *pls_p, size_t n, uint64_t ts, bool wait)
+{
+	struct evtq_slot *slot_p;
+	uint32_t pos, k, i;
+	size_t done = 0;
+
+	while (done < n) {
+		k = (n - done > evtq_p->mask + 1) ? evtq_p->mask + 1 : n - done;
+		if (0 == (k = ring_claim(evtq_p, k, &pos, wait)))
+			break;
+		for (i=0; i<k; i++) {
+			slot_p = &evtq_p->ring_p[(pos + i) & evtq_p->mask];
+			slot_p->event_id = ids_p[done + i];
+			slot_p->ts = ts;
+			evt_payload_move(&slot_p->pl, pls_p ? &pls_p[done + i] : NULL);
+			atomic_store_explicit(&slot_p->seq, pos+i+1, memory_order_release);
+		}
+		done += k;
+		ring_publish(evtq_p);
+	}
+	return(done);
+}
+
+/**
+ * ring_trydequeue - pop an event from the ring if there is one
+ * @evtq_p - pointer to a ring event queue
+ * @id_p - update this pointer
+ * @pl_p - gets the event payload, NULL to drop it
+ *
+ * Only the single consumer calls this so head_idx is not contended.
+ * Storing seq = pos + size hands the slot back to the producers for the
+ * next lap of the ring.
+ *
+ * Return: true if @id_p was updated, false if the ring is empty
+ */
+static bool ring_trydequeue(evtq_t *evtq_p, fsm_events_t *id_p, evt_payload_t *pl_p)
+{
+	struct evtq_slot *slot_p;
+	uint32_t pos;
+
+	pos = atomic_load_explicit(&evtq_p->head_idx, memory_order_relaxed);
+	slot_p = &evtq_p->ring_p[pos & evtq_p->mask];
+
+	if (atomic_load_explicit(&slot_p->seq, memory_order_acquire) != pos+1)
+		return(false);
+
+	*id_p = slot_p->event_id;
+	stats_qlat(slot_p->ts);
+	if (pl_p)
+		evt_payload_move(pl_p, &slot_p->pl);
+	else
+		evt_payload_release(&slot_p->pl);
+	atomic_store_explicit(&slot_p->seq, pos + evtq_p->mask + 1, memory_order_release);
+	atomic_store_explicit(&evtq_p->head_idx, pos+1, memory_order_relaxed);
+	return(true);
+}
+
+/**
+ * evtq_ready - the consumer would find an event, without taking it
+ * @evtq_p - pointer to event queue
+ */
+static inline bool evtq_ready(evtq_t *evtq_p)
+{
+	uint32_t pos;
+
+	if (evtq_p->type == EVTQ_LIST)
+		return(0 != __atomic_load_n(&evtq_p->len, __ATOMIC_RELAXED));
+
+	pos = atomic_load_explicit(&evtq_p->head_idx, memory_order_relaxed);
+	return(atomic_load_explicit(&evtq_p->ring_p[pos & evtq_p->mask].seq,
+				    memory_order_relaxed) == pos+1);
+}
+
+/**
+ * evtq_adapt - EVTQ_WAKE_ADAPTIVE spin budget after a wait the spin missed
+ * @evtq_p - pointer to event queue
+ * @wait - nsec from the start of the spin to the event
+ *
+ * A wait no longer than the most spin would have been caught by a longer
+ * spin: double the budget, starting from an eighth of the most.  A longer
+ * wait means the events are too far apart to spin for: halve it, to 0
+ * under the start.  The same shape as the Linux guest halt polling.
+ */
+static void evtq_adapt(evtq_t *evtq_p, uint64_t wait)
+{
+	uint32_t start = evtq_p->spin / 8;
+
+	if (wait <= evtq_p->spin) {
+		evtq_p->budget_ns = evtq_p->budget_ns < start ? start : 2 * evtq_p->budget_ns;
+		if (evtq_p->budget_ns > evtq_p->spin)
+			evtq_p->budget_ns = evtq_p->spin;
+	} else {
+		evtq_p->budget_ns /= 2;
+		if (evtq_p->budget_ns < start)
+			evtq_p->budget_ns = 0;
+	}
+}
+
+/**
+ * evtq_adapt_spin - EVTQ_WAKE_ADAPTIVE wait before parking
+ * @evtq_p - pointer to an empty event queue
+ *
+ * Spin for the budget, reading the clock every 16 loops, then yield
+ * EVTQ_ADAPT_YIELDS times.  Nothing is announced, producers skip the
+ * wake while the consumer is here.
+ *
+ * An event seen while spinning keeps the budget.  One that only shows up
+ * once the consumer yields halves it: spinning did not help, likely the
+ * producer needed this cpu.  After a park the caller passes the wait,
+ * wakeup included, to evtq_adapt.
+ *
+ * Return: 0 if there is an event now, else when the wait started
+ */
+static uint64_t evtq_adapt_spin(evtq_t *evtq_p)
+{
+	uint64_t t0 = stats_now();
+	uint32_t i;
+
+	for (i=1; evtq_p->budget_ns; i++) {
+		if (evtq_ready(evtq_p))
+			return(0);
+		cpu_relax();
+		if (0 == (i & 15) && stats_now() - t0 >= evtq_p->budget_ns)
+			break;
+	}
+	for (i=0; i<EVTQ_ADAPT_YIELDS; i++) {
+		if (evtq_ready(evtq_p)) {
+			if (i)
+				evtq_adapt(evtq_p, UINT64_MAX);
+			return(0);
+		}
+		relax();
+	}
+	return(t0);
+}
+
+/**
+ * ring_dequeue - pop an event from the ring, park on the futex if empty
+ * @evtq_p - pointer to a ring event queue
+ * @id_p - update this pointer
+ * @pl_p - gets the event payload, NULL to drop it
+ *
+ * With EVTQ_WAKE_SPIN first poll the ring for evtq_p->spin loops without
+ * announcing the waiter, so producers skip the wake syscall.
+ * EVTQ_WAKE_ADAPTIVE does the same for its budget, see evtq_adapt_spin.
+ *
+ * Read the futex value, announce the waiter, then check the ring once more
+ * before sleeping.  A producer that publishes after the second check sees
+ * the waiter and bumps the futex, so futex_wait returns immediately rather
+ * than missing the wakeup.
+ *
+ * EVTQ_WAKE_COALESCE: a producer may set wake_pending while the recheck
+ * finds its event, so the flag is cleared on that path too and again
+ * before each park.  Left set, every later producer would skip the wake.
+ */
+static void ring_dequeue(evtq_t *evtq_p, fsm_events_t *id_p, evt_payload_t *pl_p)
+{
+	uint64_t t0 = 0;
+	uint32_t key, i;
+
+	if (evtq_p->wake == EVTQ_WAKE_SPIN) {
+		for (i=0; i<evtq_p->spin; i++) {
+			if (ring_trydequeue(evtq_p, id_p, pl_p))
+				return;
+			cpu_relax();
+		}
+	} else if (evtq_p->wake == EVTQ_WAKE_ADAPTIVE) {
+		if (ring_trydequeue(evtq_p, id_p, pl_p))
+			return;
+		t0 = evtq_adapt_spin(evtq_p);
+	}
+
+	while (!ring_trydequeue(evtq_p, id_p, pl_p)) {
+		/* a wake sent after an earlier recheck found an event */
+		evtq_woken(evtq_p);
+		key = atomic_load(&evtq_p->futex);
+		atomic_fetch_add(&evtq_p->waiters, 1);
+		if (ring_trydequeue(evtq_p, id_p, pl_p)) {
+			atomic_fetch_sub(&evtq_p->waiters, 1);
+			evtq_woken(evtq_p);
+			break;
+		}
+		stat_inc(&evtq_p->waits, 1);
+		futex_wait(&evtq_p->futex, key);
+		atomic_fetch_sub(&evtq_p->waiters, 1);
+		evtq_woken(evtq_p);
+	}
+	if (t0)
+		evtq_adapt(evtq_p, stats_now() - t0);
+}
+
+/**
+ * list_wait - wait for the list queue to be non-empty
+ * @evtq_p - pointer to a list event queue, mutex must be held
+ *
+ * With EVTQ_WAKE_SPIN drop the mutex and poll len first, producers do not
+ * signal the cond while the consumer spins.  EVTQ_WAKE_ADAPTIVE spins
+ * for its budget the same way.
+ *
+ * On return the mutex is held and len > 0.
+ */
+static void list_wait(evtq_t *evtq_p)
+{
+	uint64_t t0 = 0;
+	uint32_t i;
+
+	if (evtq_p->len)
+		return;
+
+	if (evtq_p->wake == EVTQ_WAKE_SPIN) {
+		pthread_mutex_unlock(&evtq_p->mutex);
+		for (i=0; i<evtq_p->spin; i++) {
+			if (__atomic_load_n(&evtq_p->len, __ATOMIC_RELAXED))
+				break;
+			cpu_relax();
+		}
+		pthread_mutex_lock(&evtq_p->mutex);
+	} else if (evtq_p->wake == EVTQ_WAKE_ADAPTIVE) {
+		pthread_mutex_unlock(&evtq_p->mutex);
+		t0 = evtq_adapt_spin(evtq_p);
+		pthread_mutex_lock(&evtq_p->mutex);
+	}
+
+	/* make sure there is something to pop off q */
+	while(0 == evtq_p->len) {
+		atomic_fetch_add(&evtq_p->waiters, 1);
+		stat_inc(&evtq_p->waits, 1);
+		/* this will unlock mutex and then wait on cond */
+		/* On return mutex is re-acquired */
+		/* if a cond_signal is sent before this is waiting, the signal will be discarded */
+		pthread_cond_wait(&evtq_p->cond, &evtq_p->mutex);
+		atomic_fetch_sub(&evtq_p->waiters, 1);
+		atomic_store(&evtq_p->wake_pending, 0);
+	}
+	if (t0)
+		evtq_adapt(evtq_p, stats_now() - t0);
+}
+
+/**
+ * list_pop - unlink the event at the list queue head, keep the node
+ * @evtq_p - pointer to a list event queue, mutex held and len > 0
+ * @id_p - update this pointer
+ * @pl_p - gets the event payload, NULL to drop it
+ */
+static void list_pop(evtq_t *evtq_p, fsm_events_t *id_p, evt_payload_t *pl_p)
+{
+	struct fsm_event *ep;
+
+	ep = nl_list_first_entry(&evtq_p->head.list, struct fsm_event, list);
+	nl_list_del(&ep->list);
+	evtq_p->len--;
+	*id_p = ep->event_id;
+	stats_qlat(ep->ts);
+	if (pl_p)
+		evt_payload_move(pl_p, &ep->pl);
+	else
+		evt_payload_release(&ep->pl);
+	nl_list_add_head(&ep->list, &evtq_p->spare);
 }
 
 /**
@@ -50,26 +617,175 @@ void evtq_destroy(evtq_t* q_p)
  * @id - the event id to add
  * 
  * lock queue
- * create event, add to queue tail
- * signal condition that there is an new event queued
+ * create event (reuse a spare node), add to queue tail
+ * signal condition that there is an new event queued, if the consumer waits
  * unlock queue
+ *
+ * Ring queues use ring_enqueue instead.  Only EVTQ_WAKE_YIELD gives up the
+ * cpu after the enqueue.  With stats_latency the event is stamped here,
+ * the consumer adds the delay to its latency histogram on dequeue.
  */
 void evtq_enqueue(evtq_t *evtq_p, fsm_events_t evt_id)
+{
+	evtq_enqueue_pl(evtq_p, evt_id, NULL);
+}
+
+/**
+ * evtq_enqueue_pl - add an event with a payload to the tail of the queue
+ * @evtq_p - pointer to event queue
+ * @evt_id - the event id to add
+ * @pl_p - payload, NULL for none, the queue takes its buffer reference
+ *
+ * Same as evtq_enqueue.  Inline bytes are copied into the queue, a pooled
+ * buffer is passed by pointer.
+ */
+void evtq_enqueue_pl(evtq_t *evtq_p, fsm_events_t evt_id, const evt_payload_t *pl_p)
 {
 	struct fsm_event *ep;
+	uint64_t ts = stats_stamp();
+
+	/* counted before the consumer can see it */
+	if (evtq_track)
+		atomic_fetch_add(&evtq_inflight, 1);
+
+	if (evtq_p->type != EVTQ_LIST) {
+		ring_enqueue(evtq_p, evt_id, ts, pl_p);
+		goto out;
+	}
 
 	pthread_mutex_lock(&evtq_p->mutex);
 	
-	ep = malloc( sizeof(struct fsm_event) );
+	if (!nl_list_empty(&evtq_p->spare)) {
+		ep = nl_list_first_entry(&evtq_p->spare, struct fsm_event, list);
+		nl_list_del(&ep->list);
+	} else if (NULL == (ep = arena_calloc(sizeof(struct fsm_event)))) {
+		die("evtq_enqueue");
+	}
 	ep->event_id = evt_id;
+	ep->ts = ts;
+	evt_payload_move(&ep->pl, pl_p);
 	nl_list_add_tail(&ep->list, &evtq_p->head.list);
 	evtq_p->len++;
 
-	pthread_cond_signal(&evtq_p->cond);
+	if (evtq_need_wake(evtq_p))
+		pthread_cond_signal(&evtq_p->cond);
 	pthread_mutex_unlock(&evtq_p->mutex);
 
+out:
 	dbg_evts(evt_id);
-	relax();
+	trace_evt(evt_id);
+	if (evtq_p->wake == EVTQ_WAKE_YIELD)
+		relax();
+}
+
+/**
+ * evtq_enqueue_batch_pl - add @n events to the tail of the queue
+ * @evtq_p - pointer to event queue
+ * @ids_p - the event ids, in order
+ * @pls_p - @n payloads, NULL for none, the queue takes their buffer references
+ * @n - number of events
+ *
+ * Same as @n evtq_enqueue_pl calls, but a ring claims its slots in runs
+ * and a list queue takes its mutex once, so the consumer is woken at most
+ * once per run.  The events stay in order with respect to each other,
+ * another producer's events are not interleaved within a run.
+ */
+void evtq_enqueue_batch_pl(evtq_t *evtq_p, const fsm_events_t *ids_p,
+			   const evt_payload_t *pls_p, size_t n)
+{
+	struct fsm_event *ep;
+	uint64_t ts = stats_stamp();
+	size_t i;
+
+	if (0 == n)
+		return;
+	if (evtq_track)
+		atomic_fetch_add(&evtq_inflight, n);
+
+	if (evtq_p->type != EVTQ_LIST) {
+		ring_enqueue_batch(evtq_p, ids_p, pls_p, n, ts, true);
+		goto out;
+	}
+
+	pthread_mutex_lock(&evtq_p->mutex);
+	for (i=0; i<n; i++) {
+		if (!nl_list_empty(&evtq_p->spare)) {
+			ep = nl_list_first_entry(&evtq_p->spare, struct fsm_event, list);
+			nl_list_del(&ep->list);
+		} else if (NULL == (ep = arena_calloc(sizeof(struct fsm_event)))) {
+			die("evtq_enqueue_batch_pl");
+		}
+		ep->event_id = ids_p[i];
+		ep->ts = ts;
+		evt_payload_move(&ep->pl, pls_p ? &pls_p[i] : NULL);
+		nl_list_add_tail(&ep->list, &evtq_p->head.list);
+	}
+	evtq_p->len += n;
+
+	if (evtq_need_wake(evtq_p))
+		pthread_cond_signal(&evtq_p->cond);
+	pthread_mutex_unlock(&evtq_p->mutex);
+
+out:
+	for (i=0; i<n; i++) {
+		dbg_evts(ids_p[i]);
+		trace_evt(ids_p[i]);
+	}
+	if (evtq_p->wake == EVTQ_WAKE_YIELD)
+		relax();
+}
+
+/**
+ * evtq_tryenqueue_batch_pl - evtq_enqueue_batch_pl that does not wait
+ * @evtq_p - pointer to event queue
+ * @ids_p - the event ids, in order
+ * @pls_p - @n payloads, NULL for none, the queue takes the references of
+ *          the events it queued
+ * @n - number of events
+ *
+ * A full ring takes the events it has room for and returns, the caller
+ * keeps the rest and their payloads.  A list queue takes them all.
+ *
+ * Return: number of events queued, the first ones of @ids_p
+ */
+size_t evtq_tryenqueue_batch_pl(evtq_t *evtq_p, const fsm_events_t *ids_p,
+				const evt_payload_t *pls_p, size_t n)
+{
+	uint64_t ts = stats_stamp();
+	size_t done, i;
+
+	if (evtq_p->type == EVTQ_LIST) {
+		evtq_enqueue_batch_pl(evtq_p, ids_p, pls_p, n);
+		return(n);
+	}
+
+	/* counted before the consumer can see them, the rest taken back */
+	if (evtq_track)
+		atomic_fetch_add(&evtq_inflight, n);
+	done = ring_enqueue_batch(evtq_p, ids_p, pls_p, n, ts, false);
+	evtq_done(n - done);
+
+	for (i=0; i<done; i++) {
+		dbg_evts(ids_p[i]);
+		trace_evt(ids_p[i]);
+	}
+	if (done && evtq_p->wake == EVTQ_WAKE_YIELD)
+		relax();
+	return(done);
+}
+
+/**
+ * evtq_tryenqueue_pl - evtq_enqueue_pl that does not wait
+ * @evtq_p - pointer to event queue
+ * @evt_id - the event id to add
+ * @pl_p - payload, NULL for none, the queue takes its reference if the
+ *         event is queued
+ *
+ * Return: false if the ring is full, the caller keeps the payload
+ */
+bool evtq_tryenqueue_pl(evtq_t *evtq_p, fsm_events_t evt_id, const evt_payload_t *pl_p)
+{
+	return(1 == evtq_tryenqueue_batch_pl(evtq_p, &evt_id, pl_p, 1));
 }
 
 /**
@@ -83,33 +799,143 @@ void evtq_enqueue(evtq_t *evtq_p, fsm_events_t evt_id)
  * loop while waiting for condition to be set
  *  note: pthread_cond_wait will block waiting on the cond to be set
  * remove event from queue head set the event id
- * free event memory
+ * keep the node for the next enqueue
  * unlock queue
+ *
+ * Ring queues use ring_dequeue instead.  A payload is dropped.
  */ 
 void evtq_dequeue(evtq_t *evtq_p, fsm_events_t* id_p)
 {
-	struct fsm_event *ep;
+	if (evtq_p->type != EVTQ_LIST) {
+		ring_dequeue(evtq_p, id_p, NULL);
+		goto out;
+	}
 
 	/* lock mutex, must be done before cond_wait */
 	pthread_mutex_lock(&evtq_p->mutex);
+	list_wait(evtq_p);
+	list_pop(evtq_p, id_p, NULL);
 
-	/* make sure there is something to pop off q */
-	while(0 == evtq_p->len) {
-		/* this will unlock mutex and then wait on cond */
-		/* On return mutex is re-acquired */
-		/* if a cond_signal is sent before this is waiting, the signal will be discarded */
-		pthread_cond_wait(&evtq_p->cond, &evtq_p->mutex);
+	pthread_mutex_unlock(&evtq_p->mutex);
+
+out:
+	stat_inc(&evtq_p->dequeues, 1);
+	dbg_evts(*id_p);
+}
+
+/**
+ * evtq_dequeue_batch - pop all available events, up to max, from the queue
+ * @evtq_p - pointer to event queue
+ * @out_p - array of at least @max event ids to fill
+ * @max - most events to pop
+ *
+ * Block like evtq_dequeue until there is at least one event, then take
+ * everything else queued (up to @max) without waiting again.  The list
+ * queue does this in one critical section, so a burst of N events costs
+ * one lock round-trip instead of N.
+ *
+ * Return: number of events written to @out_p, always >= 1 if @max > 0
+ */
+size_t evtq_dequeue_batch(evtq_t *evtq_p, fsm_events_t *out_p, size_t max)
+{
+	return evtq_dequeue_batch_pl(evtq_p, out_p, NULL, max);
+}
+
+/**
+ * evtq_dequeue_batch_pl - evtq_dequeue_batch with the event payloads
+ * @evtq_p - pointer to event queue
+ * @out_p - array of at least @max event ids to fill
+ * @pl_p - array of at least @max payloads to fill, NULL to drop them
+ * @max - most events to pop
+ *
+ * The caller owns the payloads, see fsm_run_batch.
+ *
+ * Return: number of events written to @out_p, always >= 1 if @max > 0
+ */
+size_t evtq_dequeue_batch_pl(evtq_t *evtq_p, fsm_events_t *out_p,
+			     evt_payload_t *pl_p, size_t max)
+{
+	size_t n = 0;
+	size_t i;
+
+	if (0 == max)
+		return(0);
+
+	if (evtq_p->type != EVTQ_LIST) {
+		ring_dequeue(evtq_p, &out_p[n], pl_p ? &pl_p[n] : NULL);
+		n++;
+		while (n < max && ring_trydequeue(evtq_p, &out_p[n], pl_p ? &pl_p[n] : NULL))
+			n++;
+		goto out;
 	}
 
-	ep = nl_list_first_entry(&evtq_p->head.list, struct fsm_event, list);
-	nl_list_del(&ep->list);
-	evtq_p->len--;
-	*id_p = ep->event_id;
-	free(ep);
+	pthread_mutex_lock(&evtq_p->mutex);
+	list_wait(evtq_p);
+
+	while (n < max && evtq_p->len) {
+		list_pop(evtq_p, &out_p[n], pl_p ? &pl_p[n] : NULL);
+		n++;
+	}
 
 	pthread_mutex_unlock(&evtq_p->mutex);
 
-	dbg_evts(*id_p);
+out:
+	stat_inc(&evtq_p->dequeues, n);
+	for (i=0; i<n; i++)
+		dbg_evts(out_p[i]);
+	return(n);
+}
+
+/**
+ * evtq_trydequeue_batch - pop the available events, up to max, never block
+ * @evtq_p - pointer to event queue
+ * @out_p - array of at least @max event ids to fill
+ * @max - most events to pop
+ *
+ * Same as evtq_dequeue_batch except an empty queue returns 0.  Used when
+ * the consumer is told about new events some other way, e.g. the fsmsched
+ * instance mailboxes.
+ *
+ * Return: number of events written to @out_p
+ */
+size_t evtq_trydequeue_batch(evtq_t *evtq_p, fsm_events_t *out_p, size_t max)
+{
+	return evtq_trydequeue_batch_pl(evtq_p, out_p, NULL, max);
+}
+
+/**
+ * evtq_trydequeue_batch_pl - evtq_trydequeue_batch with the event payloads
+ * @evtq_p - pointer to event queue
+ * @out_p - array of at least @max event ids to fill
+ * @pl_p - array of at least @max payloads to fill, NULL to drop them
+ * @max - most events to pop
+ *
+ * Return: number of events written to @out_p
+ */
+size_t evtq_trydequeue_batch_pl(evtq_t *evtq_p, fsm_events_t *out_p,
+				evt_payload_t *pl_p, size_t max)
+{
+	size_t n = 0;
+	size_t i;
+
+	if (evtq_p->type != EVTQ_LIST) {
+		while (n < max && ring_trydequeue(evtq_p, &out_p[n], pl_p ? &pl_p[n] : NULL))
+			n++;
+		goto out;
+	}
+
+	pthread_mutex_lock(&evtq_p->mutex);
+	while (n < max && evtq_p->len) {
+		list_pop(evtq_p, &out_p[n], pl_p ? &pl_p[n] : NULL);
+		n++;
+	}
+	pthread_mutex_unlock(&evtq_p->mutex);
+
+out:
+	stat_inc(&evtq_p->dequeues, n);
+	for (i=0; i<n; i++)
+		dbg_evts(out_p[i]);
+	return(n);
 }
 
 /**
@@ -127,6 +953,10 @@ uint32_t evtq_len(evtq_t *evtq_p)
 {
 	int len;
 
+	/* a snapshot, the ring may change right after */
+	if (evtq_p->type != EVTQ_LIST)
+		return(atomic_load(&evtq_p->tail) - atomic_load(&evtq_p->head_idx));
+
 	pthread_mutex_lock(&evtq_p->mutex);
 	len = evtq_p->len;
 	pthread_mutex_unlock(&evtq_p->mutex);
@@ -134,3 +964,34 @@ uint32_t evtq_len(evtq_t *evtq_p)
 }
 
 
+
+/**
+ * evtq_quiesce - wait until every event sent has been run
+ *
+ * Only with evtq_track.  Counting the events an event sends before it
+ * is done means the count cannot reach 0 while any are on their way.
+ * The caller must not be a consumer with events of its own to run.
+ */
+void evtq_quiesce(void)
+{
+	uint32_t n;
+
+	while (evtq_track && 0 != (n = atomic_load(&evtq_inflight)))
+		futex_wait(&evtq_inflight, n);
+}
+
+/**
+ * evtq_stats - snapshot the queue counters
+ * @evtq_p - pointer to event queue
+ * @stats_p - filled with the current counters
+ *
+ * The counters are read without the queue lock so they may be slightly
+ * out of step with each other.
+ */
+void evtq_stats(evtq_t *evtq_p, evtq_stats_t *stats_p)
+{
+	stats_p->len = evtq_len(evtq_p);
+	stats_p->dequeues = atomic_load_explicit(&evtq_p->dequeues, memory_order_relaxed);
+	stats_p->waits = atomic_load_explicit(&evtq_p->waits, memory_order_relaxed);
+	stats_p->wakeups = atomic_load_explicit(&evtq_p->wakeups, memory_order_relaxed);
+}
@@ -17,69 +17,243 @@
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>     /* posix threads */
+#include <stddef.h>      /* offsetof */
+#include <stdatomic.h>   /* ring head/tail */
 #include <libnl3/netlink/list.h> /* kernel-ish linked list */
+#include "evtbuf.h"
+
+/*
+ * FSM_EVENTS - every event, its identifier and its text for debugging.
+ * The identifier (E_ dropped) names the event in a definition file, see
+ * fsmdef.h.
+ */
+#define FSM_EVENTS(X)				\
+	X(BAD, "BAD EVT")			\
+	X(LIGHT, "LIGHT TIMER")			\
+	X(BLINK, "WALK BLINK")			\
+	X(INIT, "INIT")				\
+	X(RED, "RED")				\
+	X(GREEN, "GREEN")			\
+	X(YELLOW, "YELLOW")			\
+	X(BUTTON, "BUTTON")			\
+	X(DONE, "DONE")				\
+	X(TIMER, "TIMER TEST")			\
+	X(LAST, "LAST")
+
+#define FSM_EVENT_ENUM(id, text) E_##id,
+#define FSM_EVENT_NAME(id, text) [E_##id] = text,
+#define FSM_EVENT_ID(id, text) [E_##id] = #id,
 
 /*
  * fsm_events_t - enum containg all events
  */
 typedef enum evt_id {
-	E_BAD = 0,
-	E_LIGHT,
-	E_BLINK,
-	E_INIT,
-	E_RED,
-	E_GREEN,
-	E_YELLOW,
-	E_BUTTON,
-	E_DONE,
-	E_TIMER,
-	E_LAST,
+	FSM_EVENTS(FSM_EVENT_ENUM)
 } fsm_events_t;
 
 /*
  * evt_name - mapping from evt_id to a text string for debugging
  */
 static const char * const evt_name[] = {
-	[E_BAD] = "BAD EVT",
-	[E_LIGHT] = "LIGHT TIMER",
-	[E_BLINK] = "WALK BLINK",
-	[E_INIT] = "INIT",
-	[E_RED] = "RED",
-	[E_GREEN] = "GREEN",
-	[E_YELLOW] = "YELLOW",
-	[E_BUTTON] = "BUTTON",
-	[E_DONE] = "DONE",
-	[E_TIMER] = "TIMER TEST",
-	[E_LAST] = "LAST",
+	FSM_EVENTS(FSM_EVENT_NAME)
+};
+
+/*
+ * evt_ident - mapping from evt_id to its identifier
+ */
+static const char * const evt_ident[] = {
+	FSM_EVENTS(FSM_EVENT_ID)
 };
 
 /**
  * struct fsm_event
  * @list: kernel-style linked list node
  * @event_id: one of the valid events
+ * @ts: enqueue time for the latency stats, 0 if not stamped
+ * @pl: event payload, see evtbuf.h
  */
 struct fsm_event {
 	struct nl_list_head list;
 	fsm_events_t event_id;
+	uint64_t ts;
+	evt_payload_t pl;
 };
 
 /**
- * evtq_t - the
- * @len: number of items on queue
- * @head: head of queue
- * @mutex: mutex guarding access to the queue
- * @cond: condition set when an event is added to queue
+ * evtq_type_t - queue backend selected at evtq_create time
+ * @EVTQ_LIST: malloc'd linked list guarded by a mutex and cond (default)
+ * @EVTQ_SPSC: lock-free ring, only one thread may enqueue
+ * @EVTQ_MPSC: lock-free ring, any number of threads may enqueue
+ *
+ * Only one thread may dequeue from any queue type.
+ */
+typedef enum evtq_type {
+	EVTQ_LIST = 0,
+	EVTQ_SPSC,
+	EVTQ_MPSC,
+	EVTQ_TYPE_LAST,
+} evtq_type_t;
+
+/* default number of ring slots for EVTQ_SPSC and EVTQ_MPSC */
+#define EVTQ_RING_SIZE 256
+
+/**
+ * evtq_wake_t - how a producer wakes the consumer after an enqueue
+ * @EVTQ_WAKE_IMMEDIATE: wake a parked consumer on every enqueue (default)
+ * @EVTQ_WAKE_YIELD: as immediate, then sched_yield the producer
+ * @EVTQ_WAKE_SPIN: consumer spins before parking, no wake needed while it spins
+ * @EVTQ_WAKE_COALESCE: one wake per park, later enqueues skip it until the
+ *                      consumer runs again
+ * @EVTQ_WAKE_ADAPTIVE: consumer spins, then yields, then parks; the spin
+ *                      budget follows the recent gaps between events
  *
- * This is user-space implementation of the kernel list management function 
+ * The producer never makes a wake call when the consumer is not parked.
+ *
+ * EVTQ_WAKE_ADAPTIVE spins for a budget of up to evtq_attr_t.spin nsec,
+ * yields EVTQ_ADAPT_YIELDS times and then parks.  The budget grows when
+ * the consumer parked for less than the most it may spin, and shrinks
+ * when it parked for longer or the event only came once it yielded, so a
+ * consumer with events close together busy-polls and an idle one sleeps.
+ */
+typedef enum evtq_wake {
+	EVTQ_WAKE_IMMEDIATE = 0,
+	EVTQ_WAKE_YIELD,
+	EVTQ_WAKE_SPIN,
+	EVTQ_WAKE_COALESCE,
+	EVTQ_WAKE_ADAPTIVE,
+	EVTQ_WAKE_LAST,
+} evtq_wake_t;
+
+/* default consumer spin loops for EVTQ_WAKE_SPIN */
+#define EVTQ_SPIN_DEFAULT 2000
+
+/* default most spin nsec for EVTQ_WAKE_ADAPTIVE, about one futex wake */
+#define EVTQ_ADAPT_SPIN_NS 50000
+/* EVTQ_WAKE_ADAPTIVE yields before parking */
+#define EVTQ_ADAPT_YIELDS 4
+
+/**
+ * evtq_attr_t - queue creation attributes, NULL for defaults
+ * @type: queue backend
+ * @size: number of ring slots, rounded up to a power of two, 0 for default
+ * @wake: producer wakeup policy
+ * @spin: consumer spin loops for EVTQ_WAKE_SPIN, most spin nsec for
+ *        EVTQ_WAKE_ADAPTIVE, 0 for default
+ */
+typedef struct evtq_attr {
+	evtq_type_t type;
+	uint32_t size;
+	evtq_wake_t wake;
+	uint32_t spin;
+} evtq_attr_t;
+
+/**
+ * evtq_stats_t - snapshot of queue counters, see evtq_stats
+ * @len: events on the queue
+ * @dequeues: events popped by the consumer
+ * @waits: times the consumer found the queue empty and parked
+ * @wakeups: times a producer woke the parked consumer
+ */
+typedef struct evtq_stats {
+	uint32_t len;
+	uint64_t dequeues;
+	uint64_t waits;
+	uint64_t wakeups;
+} evtq_stats_t;
+
+/**
+ * struct evtq_slot - one ring entry
+ * @seq: slot sequence, tells producer and consumer who owns the slot
+ * @event_id: the queued event
+ * @ts: enqueue time for the latency stats, 0 if not stamped
+ * @pl: event payload, only the used bytes are written
+ */
+struct evtq_slot {
+	atomic_uint seq;
+	fsm_events_t event_id;
+	uint64_t ts;
+	evt_payload_t pl;
+};
+
+/**
+ * evtq_t - the event queue
+ * @type: queue backend
+ * @len: number of items on queue (EVTQ_LIST)
+ * @head: head of queue (EVTQ_LIST)
+ * @spare: popped list nodes kept for the next enqueue (EVTQ_LIST)
+ * @mutex: mutex guarding access to the queue (EVTQ_LIST)
+ * @cond: condition set when an event is added to queue (EVTQ_LIST)
+ * @mask: ring slots - 1 (rings)
+ * @ring_p: array of ring slots (rings)
+ * @tail: next slot a producer claims (rings)
+ * @head_idx: next slot the consumer reads (rings)
+ * @futex: bumped by a producer to wake a parked consumer (rings)
+ * @waiters: consumer is about to park or parked on @futex or @cond
+ * @wake: producer wakeup policy
+ * @spin: consumer spin loops for EVTQ_WAKE_SPIN, most spin nsec for
+ *        EVTQ_WAKE_ADAPTIVE
+ * @wake_pending: a wake was sent and the consumer has not run yet
+ * @dequeues: events popped, only written by the consumer
+ * @waits: consumer parks, only written by the consumer
+ * @budget_ns: EVTQ_WAKE_ADAPTIVE spin budget, consumer only
+ * @wakeups: producer wakes
+ *
+ * The fields are grouped by who writes them, each group on its own cache
+ * line: the settings nobody writes after evtq_create, the list queue
+ * taken under its mutex by both sides, the ring producer side, the park
+ * handshake written only around a consumer park, and the consumer side.
+ * A producer enqueueing never writes a line the consumer writes on every
+ * dequeue.  The evtq_t itself is cache line aligned so neighbouring
+ * queues do not share lines either; see the layout checks below.
+ *
+ * The list queue is a user-space implementation of the kernel list management function 
  * https://www.kesrnel.org/doc/html/v5.1/core-api/kernel-api.html#list-management-functions
  * It uses the netlink/list.h macros.
+ *
+ * The ring queues are a bounded array of slots, each with a sequence number
+ * (D. Vyukov's bounded queue.)  A producer owns a slot when seq == tail,
+ * the consumer when seq == head_idx + 1.  The consumer only sleeps on the
+ * futex when the ring is empty and a producer only makes the futex syscall
+ * when the consumer is waiting.
  */
 typedef struct {
+	/* read-only after evtq_create */
+	evtq_type_t type;
+	evtq_wake_t wake;
+	uint32_t spin;
+	uint32_t mask;
+	struct evtq_slot *ring_p;
+
+	/* list queue, both sides under the mutex */
+	pthread_mutex_t mutex ____cacheline_aligned;
+	pthread_cond_t cond;
 	int len;
 	struct fsm_event head;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
-} evtq_t;
+	struct nl_list_head spare;
+
+	/* ring producers */
+	atomic_uint tail ____cacheline_aligned;
+	atomic_ulong wakeups;
+
+	/* consumer park and wake */
+	atomic_uint futex ____cacheline_aligned;
+	atomic_uint waiters;
+	atomic_uint wake_pending;
+
+	/* consumer */
+	atomic_uint head_idx ____cacheline_aligned;
+	atomic_ulong dequeues;
+	atomic_ulong waits;
+	uint32_t budget_ns;
+} ____cacheline_aligned evtq_t;
+
+/* evtq_t layout checks, the producer and consumer lines must not merge */
+#define EVTQ_LINE(field) (offsetof(evtq_t, field) / L1_CACHE_BYTES)
+_Static_assert(_Alignof(evtq_t) == L1_CACHE_BYTES, "evtq_t is cache line aligned");
+_Static_assert(EVTQ_LINE(ring_p) < EVTQ_LINE(mutex), "settings apart from the list");
+_Static_assert(EVTQ_LINE(spare) < EVTQ_LINE(tail), "list apart from the producers");
+_Static_assert(EVTQ_LINE(wakeups) < EVTQ_LINE(futex), "producers apart from the park");
+_Static_assert(EVTQ_LINE(wake_pending) < EVTQ_LINE(head_idx), "park apart from the consumer");
 
 /**
  * _dbg_evts - create a debug string for event 
@@ -95,17 +269,58 @@ static inline void _dbg_evts(const char *func, fsm_events_t evt_id)
 	write(1, buf, strlen(buf));
 }
 
-#define dbg_evts(evt_id) if (debug_flag & DBG_EVTS) _dbg_evts(__func__, evt_id);
+#define dbg_evts(evt_id) do { if (dbg_on(DBG_EVTS)) _dbg_evts(__func__, evt_id); } while (0)
+
+/*
+ * evtq_track - count the events on their way, set once before any worker
+ * starts, see timer_sim_start
+ * evtq_inflight - events enqueued and not yet run by their consumer
+ */
+extern bool evtq_track;
+extern atomic_uint evtq_inflight;
+
+/**
+ * evtq_done - a consumer has run @n events it dequeued
+ * @n: number of events, the events they sent are already counted
+ *
+ * The last one wakes evtq_quiesce.
+ */
+static inline void evtq_done(size_t n)
+{
+	if (!evtq_track || 0 == n)
+		return;
+	if (n == atomic_fetch_sub(&evtq_inflight, n))
+		futex_wake(&evtq_inflight, INT32_MAX);
+}
 
-extern evtq_t* evtq_create(void);
+extern evtq_t* evtq_create(const evtq_attr_t *attr_p);
 extern void evtq_destroy(evtq_t* q_p);
 extern void evtq_destroy_all(evtq_t** q_pp);
 extern void evtq_enqueue(evtq_t *evtq_p, fsm_events_t id);
+extern void evtq_enqueue_pl(evtq_t *evtq_p, fsm_events_t id, const evt_payload_t *pl_p);
+extern void evtq_enqueue_batch_pl(evtq_t *evtq_p, const fsm_events_t *ids_p,
+				  const evt_payload_t *pls_p, size_t n);
+extern bool evtq_tryenqueue_pl(evtq_t *evtq_p, fsm_events_t id, const evt_payload_t *pl_p);
+extern size_t evtq_tryenqueue_batch_pl(evtq_t *evtq_p, const fsm_events_t *ids_p,
+				       const evt_payload_t *pls_p, size_t n);
 extern void evtq_dequeue(evtq_t *evtq_p, fsm_events_t* id_p);
+extern size_t evtq_dequeue_batch(evtq_t *evtq_p, fsm_events_t *out_p, size_t max);
+extern size_t evtq_dequeue_batch_pl(evtq_t *evtq_p, fsm_events_t *out_p,
+				    evt_payload_t *pl_p, size_t max);
+extern size_t evtq_trydequeue_batch(evtq_t *evtq_p, fsm_events_t *out_p, size_t max);
+extern size_t evtq_trydequeue_batch_pl(evtq_t *evtq_p, fsm_events_t *out_p,
+				       evt_payload_t *pl_p, size_t max);
 extern uint32_t evtq_len(evtq_t *evtq_p);
+extern void evtq_quiesce(void);
+extern int evtq_type_parse(const char *name);
+extern const char *evtq_type_name(evtq_type_t type);
+extern int evtq_wake_parse(const char *name);
+extern const char *evtq_wake_name(evtq_wake_t wake);
+extern void evtq_stats(evtq_t *evtq_p, evtq_stats_t *stats_p);
 extern int evt_parse_buf(char const *buf);
 extern void evt_script(void);
-extern void evt_producer(void);
+struct reactor;
+extern void evt_producer(struct reactor *reactor_p);
 
 #endif /* _EVTQ_H */
 
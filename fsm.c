@@ -9,31 +9,43 @@
 #include <utils.h>
 #include <workers.h>
 #include <fsm.h>
+#include <trace.h>
+#include <stats.h>
+#include <fsmgen.h>
+
+/* next fsm_t id */
+static atomic_uint fsm_ids;
+
+/* most tables with a generated runner, see fsm_gen_register */
+#define FSM_GEN_MAX 8
+
+/* generated runners fsm_compile specializes their tables with */
+static const fsm_gen_t *fsm_gens[FSM_GEN_MAX];
+static uint32_t fsm_ngens;
 
 /**
- * dbg_trans - write to stdout detailed information about the FSM state transition
- * @fsm_p - pointer to FSM context
+ * _dbg_trans - write to stdout detailed information about the FSM state transition
+ * @inst_p - pointer to FSM instance
  * @nextst_p - pointer to presumptive next state (before guard check)
  * @evt_id - event id
  *
  * string containing thread, timestamp, evtid, currstate to nextstate
- * This is called before transition guard check.
+ * This is called before transition guard check.  Only called through
+ * dbg_trans, so nothing is done (not even the clock read) unless DBG_TRANS
+ * is on.
  */
-void dbg_trans(fsm_trans_t *fsm_p, fsm_state_t *nextst_p, fsm_events_t evt_id)
+void _dbg_trans(fsm_inst_t *inst_p, fsm_state_t *nextst_p, fsm_events_t evt_id)
 {
 	struct timespec ts;
 	char buf[120];
 	int len;
 
-	if (!(debug_flag & DBG_TRANS))
-		return;
-			
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 	len=snprintf(buf, sizeof(buf), "%s:ts=%ld.%3ld evt=%s trans %s to %s\n",
 		     worker_get_name(),
 		     ts.tv_sec%100, ts.tv_nsec/(int)1e6,
 		     evt_name[evt_id],
-		     fsm_p->currst_p->name, nextst_p?nextst_p->name:"no next");
+		     fsm_curr_state(inst_p)->name, nextst_p?nextst_p->name:"no next");
 	
 	/* if cannot fit entire string into buffer, force a newline and null at end */
 	if (len >= sizeof(buf)) {
@@ -45,91 +57,507 @@ void dbg_trans(fsm_trans_t *fsm_p, fsm_state_t *nextst_p, fsm_events_t evt_id)
 }
 
 /**
- * next_state - find next state in FSM table and return it
- * @fsm_p - pointer to FSM context
- * @evt_id - event id
+ * state_index - find or add the dense index for a state
+ * @fsm_p - pointer to FSM being compiled
+ * @state_p - state to look up
+ *
+ * A new state is followed by its parents not numbered yet.  Only used by
+ * fsm_compile so a linear search is fine.
+ *
+ * Return: dense index of @state_p in @fsm_p->state_pp
+ */
+static uint16_t state_index(fsm_t *fsm_p, fsm_state_t *state_p)
+{
+	fsm_state_t *up_p;
+	uint16_t i, depth = 0;
+
+	for (i=0; i<fsm_p->nstates; i++)
+		if (fsm_p->state_pp[i] == state_p)
+			return(i);
+
+	/* also catches a parent loop */
+	for (up_p = state_p; up_p; up_p = up_p->parent_p)
+		if (++depth > FSM_DEPTH_MAX)
+			die("fsm_compile state depth");
+
+	fsm_p->state_pp[fsm_p->nstates] = state_p;
+	i = fsm_p->nstates++;
+	if (state_p->parent_p)
+		state_index(fsm_p, state_p->parent_p);
+	return(i);
+}
+
+/**
+ * state_above - check if a state encloses another
+ * @up_p - parent index of each state
+ * @a - the enclosing state
+ * @st - the state
+ *
+ * Return: true if @a is a parent, grandparent... of @st, not @st itself
+ */
+static bool state_above(const uint16_t *up_p, uint16_t a, uint16_t st)
+{
+	for (st = up_p[st]; st != FSM_NO_STATE; st = up_p[st])
+		if (st == a)
+			return(true);
+	return(false);
+}
+
+/**
+ * route_chain - the states a transition exits and enters
+ * @up_p - parent index of each state
+ * @cur - current state
+ * @from - state the transition is defined on, @cur or a parent of it
+ * @to - next state
+ * @chain_p - filled with the exits, innermost first, then the entries,
+ *            outermost first; room for 2 * FSM_DEPTH_MAX
+ * @nexit_p - set to the number of exits
  *
- * loop through the FSM transition table, matching curr state and evt_id
- * then return a pointer to the next state.
+ * The states below the closest state enclosing both @from and @to are
+ * left and entered, so a transition to a sibling exits and enters one
+ * state each and a self transition exits and enters @from.
  *
- * Return: pointer to next state or NULL if no match
+ * Return: length of @chain_p
+ */
+static uint32_t route_chain(const uint16_t *up_p, uint16_t cur, uint16_t from, uint16_t to,
+			    uint16_t *chain_p, uint8_t *nexit_p)
+{
+	uint16_t lca, st, n = 0, i;
+
+	for (lca = up_p[from]; lca != FSM_NO_STATE && !state_above(up_p, lca, to); lca = up_p[lca])
+		;
+
+	for (st = cur; st != lca; st = up_p[st])
+		chain_p[n++] = st;
+	*nexit_p = n;
+
+	for (st = to; st != lca; st = up_p[st])
+		chain_p[n++] = st;
+	/* entries outermost first */
+	for (i=0; i < (n - *nexit_p) / 2; i++) {
+		st = chain_p[*nexit_p + i];
+		chain_p[*nexit_p + i] = chain_p[n - 1 - i];
+		chain_p[n - 1 - i] = st;
+	}
+	return(n);
+}
+
+/**
+ * fsm_compile - build the dense dispatch table for a transition table
+ * @trans_p - FSM transition table terminated by a NULL currst_p entry
+ *
+ * Number every state in the table and its parents, then fill a
+ * [state][E_LAST] table with the route of the matching transition: the
+ * first transition for the (state, event) tuple, else the one of the
+ * closest parent, same as the old linear search tried up the nesting.
+ * The route has the exits and entries of the transition from that state,
+ * so no state nesting is walked at run time.  A guard failing does not
+ * try the parents.  The events found on the way make up the event mask.
+ * Instances start in @trans_p[0].currst_p, see fsm_inst_init.
+ * A table registered with fsm_gen_register gets its generated runner.
  *
- * TODO: make evt_id match in the transition table more efficient.  We already
- * know current state so just a matter of matching the evt_id.
+ * Return: pointer to a new compiled FSM
  */
-fsm_state_t *next_state(fsm_trans_t *fsm_p, fsm_events_t evt_id)
+fsm_t *fsm_compile(fsm_trans_t *trans_p)
 {
-	fsm_trans_t *t_p = fsm_p;
-	char msg[80];
-			
-	while (t_p->currst_p != NULL) {
-		if (t_p->currst_p == fsm_p->currst_p && t_p->event == evt_id) {
-			sprintf(msg, "%s: match %s", fsm_p->currst_p->name, evt_name[evt_id]);
-			dbg_verbose(msg);
-			return (t_p->nextst_p);
+	fsm_t *fsm_p;
+	fsm_trans_t *t_p;
+	fsm_route_t *r_p;
+	int16_t *rows_p;
+	uint16_t *up_p, *nextst_p;
+	size_t ntrans = 0, ncells;
+	size_t i;
+	uint16_t st, cur;
+	int16_t t;
+
+	for (t_p = trans_p; t_p->currst_p != NULL; t_p++)
+		ntrans++;
+
+	if (0 == ntrans || ntrans > INT16_MAX)
+		die("fsm_compile bad table");
+
+	if (NULL == (fsm_p = calloc(1, sizeof(fsm_t))))
+		die("fsm_compile");
+	fsm_p->trans_p = trans_p;
+
+	/* at most two new states and their parents per transition */
+	if (NULL == (fsm_p->state_pp = calloc(2*ntrans*FSM_DEPTH_MAX, sizeof(fsm_state_t*))))
+		die("fsm_compile states");
+	if (NULL == (nextst_p = calloc(ntrans, sizeof(uint16_t))))
+		die("fsm_compile next states");
+	for (i=0; i<ntrans; i++) {
+		state_index(fsm_p, trans_p[i].currst_p);
+		if (trans_p[i].nextst_p)
+			nextst_p[i] = state_index(fsm_p, trans_p[i].nextst_p);
+	}
+	if (NULL == (fsm_p->state_pp = realloc(fsm_p->state_pp, fsm_p->nstates * sizeof(fsm_state_t*))))
+		die("fsm_compile states");
+
+	if (NULL == (up_p = malloc(fsm_p->nstates * sizeof(uint16_t))))
+		die("fsm_compile parents");
+	for (st=0; st<fsm_p->nstates; st++)
+		up_p[st] = fsm_p->state_pp[st]->parent_p ?
+			state_index(fsm_p, fsm_p->state_pp[st]->parent_p) : FSM_NO_STATE;
+
+	/* the transitions defined on each state */
+	ncells = fsm_p->nstates * E_LAST;
+	if (NULL == (rows_p = malloc(ncells * sizeof(int16_t))) ||
+	    NULL == (fsm_p->dispatch_p = malloc(ncells * sizeof(int16_t))))
+		die("fsm_compile dispatch");
+	for (i=0; i<ncells; i++)
+		rows_p[i] = -1;
+
+	for (i=0; i<ntrans; i++) {
+		int16_t *cell_p;
+
+		if (trans_p[i].event >= E_LAST)
+			die("fsm_compile bad event");
+
+		/* a transition without a next state never matches */
+		if (NULL == trans_p[i].nextst_p)
+			continue;
+
+		cell_p = &rows_p[state_index(fsm_p, trans_p[i].currst_p) * E_LAST
+				 + trans_p[i].event];
+		if (*cell_p == -1)
+			*cell_p = i;
+		fsm_p->evt_mask |= 1U << trans_p[i].event;
+	}
+
+	/* each cell takes the transition of the state or its closest parent */
+	for (i=0; i<ncells; i++) {
+		cur = i / E_LAST;
+		for (st = cur; st != FSM_NO_STATE && rows_p[st * E_LAST + i % E_LAST] < 0; st = up_p[st])
+			;
+		if (FSM_NO_STATE == st) {
+			fsm_p->dispatch_p[i] = -1;
+			continue;
 		}
-		t_p++;
+		if (fsm_p->nroutes == INT16_MAX)
+			die("fsm_compile too many routes");
+		fsm_p->dispatch_p[i] = fsm_p->nroutes++;
+	}
+
+	fsm_p->route_p = calloc(fsm_p->nroutes + 1, sizeof(fsm_route_t));
+	fsm_p->chain_p = malloc((fsm_p->nroutes + 1) * 2 * FSM_DEPTH_MAX * sizeof(uint16_t));
+	if (NULL == fsm_p->route_p || NULL == fsm_p->chain_p)
+		die("fsm_compile routes");
+	for (i=0; i<ncells; i++) {
+		if (fsm_p->dispatch_p[i] < 0)
+			continue;
+		cur = i / E_LAST;
+		for (st = cur; rows_p[st * E_LAST + i % E_LAST] < 0; st = up_p[st])
+			;
+		t = rows_p[st * E_LAST + i % E_LAST];
+		r_p = &fsm_p->route_p[fsm_p->dispatch_p[i]];
+		r_p->trans = t;
+		r_p->nextst = nextst_p[t];
+		r_p->chain = fsm_p->nchain;
+		fsm_p->nchain += route_chain(up_p, cur, st, r_p->nextst,
+					     &fsm_p->chain_p[fsm_p->nchain], &r_p->nexit);
+		r_p->nentry = fsm_p->nchain - r_p->chain - r_p->nexit;
+	}
+	if (NULL == (fsm_p->chain_p = realloc(fsm_p->chain_p, (fsm_p->nchain + 1) * sizeof(uint16_t))))
+		die("fsm_compile chain");
+
+	free(rows_p);
+	free(up_p);
+	free(nextst_p);
+
+	for (i=0; i<fsm_ngens; i++)
+		if (fsm_gens[i]->trans_p == trans_p)
+			fsm_specialize(fsm_p, fsm_gens[i]);
+
+	fsm_register(fsm_p);
+	return(fsm_p);
+}
+
+/**
+ * fsm_register - give a compiled FSM its id
+ * @fsm_p - from fsm_compile, or built from a mapped image
+ *
+ * The trace and the stats learn the state names.
+ */
+void fsm_register(fsm_t *fsm_p)
+{
+	fsm_p->id = atomic_fetch_add(&fsm_ids, 1);
+	trace_fsm(fsm_p);
+	stats_fsm(fsm_p);
+}
+
+/**
+ * fsm_specialize - run a compiled FSM with its generated runner
+ * @fsm_p - compiled from @gen_p->trans_p
+ * @gen_p - from FSM_GEN, see fsmgen.h
+ *
+ * The runner indexes the states the way fsm_compile numbered them, a
+ * state list out of order in the FSM_GEN definition is fatal.
+ */
+void fsm_specialize(fsm_t *fsm_p, const fsm_gen_t *gen_p)
+{
+	uint16_t i;
+
+	if (fsm_p->trans_p != gen_p->trans_p || fsm_p->nstates != gen_p->nstates)
+		die("fsm_specialize table");
+	for (i=0; i<fsm_p->nstates; i++)
+		if (fsm_p->state_pp[i] != gen_p->state_pp[i])
+			die("fsm_specialize state order");
+	fsm_p->run_p = gen_p->run;
+}
+
+/**
+ * fsm_gen_register - specialize every later fsm_compile of a table
+ * @gen_p - from FSM_GEN, see fsmgen.h
+ *
+ * Called by the main program before it compiles the tables.
+ */
+void fsm_gen_register(const fsm_gen_t *gen_p)
+{
+	if (fsm_ngens == FSM_GEN_MAX)
+		die("fsm_gen_register");
+	fsm_gens[fsm_ngens++] = gen_p;
+}
+
+/**
+ * fsm_destroy - free a compiled FSM
+ * @fsm_p - pointer returned by fsm_compile
+ *
+ * The source transition table is not touched, nor the tables of a mapped
+ * image.
+ */
+void fsm_destroy(fsm_t *fsm_p)
+{
+	if (NULL == fsm_p)
+		return;
+
+	if (NULL == fsm_p->image_p) {
+		free(fsm_p->dispatch_p);
+		free(fsm_p->route_p);
+		free(fsm_p->chain_p);
 	}
+	free(fsm_p->state_pp);
+	free(fsm_p);
+}
+
+/**
+ * next_route - find the transition for the current state and event
+ * @inst_p - pointer to FSM instance
+ * @evt_id - event id
+ *
+ * One lookup in the dispatch table built by fsm_compile, the parents of
+ * the current state are already in it.
+ *
+ * Return: route of the matching transition or NULL if no match
+ */
+static const fsm_route_t *next_route(fsm_inst_t *inst_p, fsm_events_t evt_id)
+{
+	const fsm_t *fsm_p = inst_p->fsm_p;
+	int16_t idx = -1;
 
-	sprintf(msg, "%s: NO match %s", fsm_p->currst_p->name, evt_name[evt_id]);
-	dbg_verbose(msg);
+	if (evt_id < E_LAST)
+		idx = fsm_p->dispatch_p[inst_p->currst * E_LAST + evt_id];
+
+	if (idx >= 0) {
+		dbg_verbosef("%s: match %s", fsm_curr_state(inst_p)->name, evt_name[evt_id]);
+		return(&fsm_p->route_p[idx]);
+	}
+
+	dbg_verbosef("%s: NO match %s", fsm_curr_state(inst_p)->name,
+		     evt_id < E_LAST ? evt_name[evt_id] : evt_name[E_BAD]);
 	return(NULL);
 }
 
 /**
  * fsm_run - crank the FSM once for input event
- * @fsm_p - the FSM context
+ * @inst_p - the FSM instance
  * @evt_id - the event id
  *
- * - find the next state
+ * - find the transition, of the current state or a parent
  * - if valid (not NULL), check for a guard
  * - if guard, call it and return if fails (false)
  * - otherwise 
- * -  call exit action of the current state
+ * -  call exit actions, from the current state up
  * -  move to next state
- * -  call entry action of new current state
+ * -  call entry actions, down to the new current state
+ *
+ * Guards and actions get @inst_p so they can reach the instance data,
+ * timers and host.  Only @inst_p is changed, the compiled FSM is shared.
+ *
+ * Every call is counted in the calling thread stats, see stats.h.
  *
  * Return:
  *  -1: FSM failure, 
  *   0: failed transition to next state (guard failure)
  *   1: success transition to next state
  */
-int fsm_run(fsm_trans_t* fsm_p, fsm_events_t evt_id)
+int fsm_run(fsm_inst_t *inst_p, fsm_events_t evt_id)
 {
-	fsm_state_t *nextst_p;
-	int ret = -1;  /* set to failed */ 
+	return fsm_run_pl(inst_p, evt_id, NULL);
+}
 
-	nextst_p = next_state(fsm_p, evt_id);
-	dbg_trans(fsm_p, nextst_p, evt_id);
-	
-	if (nextst_p) {
-		/* check if guard and run it, if guard fails set ret to 1 */
-		if (fsm_p->guard && (false == fsm_p->guard(fsm_p)))
-		{
-			dbg_verbose("Guard FAILED");
-			/* set to guard failed */
-			ret = 1;
-		} else {
-			/* before transition to next state, run curr state
-			 * exit action
-			 */
-			if (fsm_p->currst_p->exit_action) {
-				fsm_p->currst_p->exit_action(fsm_p->currst_p);
-			}
-
-			/* update currst to nextst */
-			fsm_p->currst_p = nextst_p;
-
-			/* run currst entry action after state transition */
-			if (fsm_p->currst_p->entry_action) {
-				fsm_p->currst_p->entry_action(fsm_p->currst_p);
-			}
-
-			dbg_verbose("Guard PASSED");
-			/* set to success! */
-			ret = 0;
-		}
+/**
+ * fsm_step_table - one transition for an event, from the compiled tables
+ * @inst_p - the FSM instance
+ * @evt_id - the event id
+ *
+ * The exits of the route run innermost first, the entries outermost
+ * first, the current state changes in between.  A generated runner
+ * falls back to this for the transitions crossing nesting levels.
+ *
+ * Return: same as fsm_run
+ */
+int fsm_step_table(fsm_inst_t *inst_p, fsm_events_t evt_id)
+{
+	const fsm_t *fsm_p = inst_p->fsm_p;
+	const fsm_route_t *r_p;
+	const uint16_t *chain_p;
+	fsm_trans_t *t_p;
+	action act;
+	uint64_t t0;
+	uint32_t i;
+
+	r_p = next_route(inst_p, evt_id);
+	t_p = r_p ? &fsm_p->trans_p[r_p->trans] : NULL;
+	dbg_trans(inst_p, t_p ? t_p->nextst_p : NULL, evt_id);
+
+	if (NULL == t_p)
+		return fsm_step_unmatched(inst_p, evt_id);
+
+	/* check if guard and run it, if guard fails return 1 */
+	if (t_p->guard && (false == t_p->guard(inst_p)))
+		return fsm_step_guard_failed(inst_p, evt_id, r_p->nextst);
+
+	t0 = fsm_step_begin(inst_p, evt_id, r_p->nextst);
+
+	/* before transition to next state, run the exit actions */
+	chain_p = &fsm_p->chain_p[r_p->chain];
+	for (i=0; i<r_p->nexit; i++)
+		if ((act = fsm_p->state_pp[chain_p[i]]->exit_action))
+			act(inst_p);
+
+	fsm_step_move(inst_p, r_p->nextst);
+
+	/* run the entry actions after state transition */
+	for (; i<r_p->nexit + r_p->nentry; i++)
+		if ((act = fsm_p->state_pp[chain_p[i]]->entry_action))
+			act(inst_p);
+	return fsm_step_end(t0);
+}
+
+/**
+ * fsm_step_pl - one transition for an event, no run to completion
+ * @inst_p - the FSM instance
+ * @evt_id - the event id
+ * @pl_p - the event payload, NULL for none
+ *
+ * An FSM with a generated runner (see fsm_specialize) goes straight to it.
+ *
+ * Return: same as fsm_run
+ */
+static int fsm_step_pl(fsm_inst_t *inst_p, fsm_events_t evt_id, const evt_payload_t *pl_p)
+{
+	int ret;
+
+	if (inst_p->fsm_p->run_p)
+		return inst_p->fsm_p->run_p(inst_p, evt_id, pl_p);
+
+	inst_p->pl_p = pl_p;
+	stats_evt(evt_id);
+	ret = fsm_step_table(inst_p, evt_id);
+	inst_p->pl_p = NULL;
+	return (ret);
+}
+
+/**
+ * fsm_run_pl - crank the FSM once for an event with a payload
+ * @inst_p - the FSM instance
+ * @evt_id - the event id
+ * @pl_p - the event payload, NULL for none
+ *
+ * Same as fsm_run, the guard and the actions read @pl_p with fsm_payload.
+ * The caller keeps the payload.
+ *
+ * Run to completion: the events the guard and actions raised to the
+ * instance (fsm_raise) are run next, in order and without a payload,
+ * until none are left.  Events they raise in turn go to the back.
+ *
+ * Return: same as fsm_run, for @evt_id
+ */
+int fsm_run_pl(fsm_inst_t *inst_p, fsm_events_t evt_id, const evt_payload_t *pl_p)
+{
+	uint64_t raised = 0;
+	int ret;
+
+	ret = fsm_step_pl(inst_p, evt_id, pl_p);
+
+	while (inst_p->rtc_n) {
+		evt_id = inst_p->rtc_q[inst_p->rtc_head];
+		inst_p->rtc_head = (inst_p->rtc_head + 1) % FSM_RTC_MAX;
+		inst_p->rtc_n--;
+		fsm_step_pl(inst_p, evt_id, NULL);
+		raised++;
 	}
+	if (raised)
+		stats_inc(&stats_get()->raised, raised);
 	return (ret);
 }
 
+/**
+ * fsm_run_batch - crank the FSM once for each event in an array
+ * @inst_p - the FSM instance
+ * @evts_p - events in arrival order, e.g. from evtq_dequeue_batch
+ * @n - number of events in @evts_p
+ *
+ * Same as calling fsm_run for each event in order.  An entry action may
+ * end a worker thread (E_DONE) before the whole batch is applied.
+ *
+ * Return: number of events that caused a state transition
+ */
+size_t fsm_run_batch(fsm_inst_t *inst_p, const fsm_events_t *evts_p, size_t n)
+{
+	return fsm_run_batch_pl(inst_p, evts_p, NULL, n);
+}
+
+/**
+ * fsm_run_batch_pl - fsm_run_batch with the event payloads
+ * @inst_p - the FSM instance
+ * @evts_p - events in arrival order, e.g. from evtq_dequeue_batch_pl
+ * @pl_p - payload of each event, NULL for none
+ * @n - number of events in @evts_p
+ *
+ * Same as calling fsm_run_pl for each event in order, each payload is
+ * released after its event.  If E_DONE ends the thread first, the
+ * pooled buffers left in the batch are freed with their pool by
+ * evtbuf_destroy.
+ *
+ * Return: number of events that caused a state transition
+ */
+size_t fsm_run_batch_pl(fsm_inst_t *inst_p, const fsm_events_t *evts_p,
+			evt_payload_t *pl_p, size_t n)
+{
+	size_t i, ntrans = 0;
+
+	for (i=0; i<n; i++) {
+		dbg_evts(evts_p[i]);
+		if (0 == fsm_run_pl(inst_p, evts_p[i], pl_p ? &pl_p[i] : NULL))
+			ntrans++;
+		if (pl_p)
+			evt_payload_release(&pl_p[i]);
+	}
+	return(ntrans);
+}
+
+/**
+ * fsm_timer_notify - timer expiry callback for instance timers
+ * @ctx - the fsm_inst_t that created the timer
+ * @evt_id - timer event id
+ *
+ * Runs on the timer service thread, the event goes wherever the
+ * instance host broadcasts, see create_timer_notify.
+ */
+void fsm_timer_notify(void *ctx, fsm_events_t evt_id)
+{
+	fsm_inst_t *inst_p = ctx;
+
+	inst_p->host_p->broadcast(inst_p, evt_id, true);
+}
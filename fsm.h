@@ -14,7 +14,7 @@
 
 /**
  * typedef action - generic function pointer for entry and exit actions
- * @arg: 
+ * @arg: the fsm_inst_t running the action
  */
 typedef void (*action)(void *arg);
 
@@ -23,16 +23,30 @@ typedef void (*action)(void *arg);
  * @name: string name of state for debugging
  * @entry_action: function to run when state is entered
  * @exit_action: function to run when state is exitting
+ * @parent_p: enclosing state, NULL for a top level state
+ *
+ * A state handles the events it has no transition for the way its
+ * parent does, e.g. one E_DONE transition on the parent covers all its
+ * substates.  A transition exits the states up to, and enters the states
+ * down from, the closest state enclosing both ends; a self transition
+ * exits and enters the state.  See fsm_compile.
  */
 typedef struct fsm_state {
 	const char * const name;
 	action entry_action;
 	action exit_action;
+	struct fsm_state *parent_p;
 } fsm_state_t;
 
+/* most nesting levels of a state, counting the state itself */
+#define FSM_DEPTH_MAX 8
+
+/* no state, e.g. the parent of a top level state */
+#define FSM_NO_STATE UINT16_MAX
+
 /**
  * typedef constraint - transition contstraint function
- * @arg:
+ * @arg: the fsm_inst_t checking the transition
  * 
  * Return: a boolean true/false
  */
@@ -52,30 +66,318 @@ typedef struct fsm_trans {
 	fsm_state_t *nextst_p;
 } fsm_trans_t;
 
+/**
+ * typedef fsm_route - how the transition for one (state, event) runs
+ * @trans - index of the transition in the table
+ * @nextst - dense index of its next state
+ * @nexit - states to exit, from the current state up
+ * @nentry - states to enter, down to @nextst
+ * @pad - zero
+ * @chain - index in the chain table of the @nexit exits, the @nentry
+ *          entries follow
+ *
+ * Fixed layout, an image holds the routes as they are, see fsmdef.h.
+ */
+typedef struct fsm_route {
+	uint16_t trans;
+	uint16_t nextst;
+	uint8_t nexit;
+	uint8_t nentry;
+	uint16_t pad;
+	uint32_t chain;
+} fsm_route_t;
+
+_Static_assert(sizeof(fsm_route_t) == 12, "fsm_route_t is in the image format");
+
+struct fsm_inst;
+
+/**
+ * typedef fsm_run_fn - a runner specialized for one transition table
+ * @inst_p - the FSM instance
+ * @evt_id - the event id
+ * @pl_p - the event payload, NULL for none
+ *
+ * Return: same as fsm_run
+ */
+typedef int (*fsm_run_fn)(struct fsm_inst *inst_p, fsm_events_t evt_id,
+			  const evt_payload_t *pl_p);
+
+/**
+ * typedef fsm - FSM compiled from a transition table
+ * @trans_p - source transition table, terminated by a NULL currst_p entry
+ * @state_pp - dense state index to state pointer
+ * @nstates - number of unique states in the table
+ * @dispatch_p - flat [nstates][E_LAST] table of @route_p indices, -1 if none
+ * @route_p - the transition, next state and exit/entry chain of each
+ *            dispatch cell
+ * @chain_p - dense state indices the routes exit and enter
+ * @nroutes - number of @route_p entries
+ * @nchain - number of @chain_p entries
+ * @evt_mask - bit (1 << evt_id) of each event with a transition, see
+ *             fsm_accepts
+ * @id - unique id given by fsm_compile, used by the trace
+ * @run_p - generated runner for @trans_p, NULL to interpret the tables,
+ *          see fsm_specialize
+ * @image_p - mapped image @dispatch_p, @route_p and @chain_p point into,
+ *            NULL if fsm_compile allocated them, see fsmdef.h
+ *
+ * fsm_compile walks the transition table once and numbers each state in
+ * order of first appearance, followed by its parents not numbered yet,
+ * so @trans_p[0].currst_p is always index 0.  The cell of a state holds
+ * the transition of the state or of its closest parent having one, with
+ * the states to exit and enter, so fsm_run finds and runs a transition
+ * with a single @dispatch_p lookup whatever the nesting.
+ *
+ * The compiled FSM is the immutable machine definition, shared by every
+ * fsm_inst_t running it.
+ */
+typedef struct fsm {
+	fsm_trans_t *trans_p;
+	fsm_state_t **state_pp;
+	uint16_t nstates;
+	int16_t *dispatch_p;
+	fsm_route_t *route_p;
+	uint16_t *chain_p;
+	uint16_t nroutes;
+	uint32_t nchain;
+	uint32_t evt_mask;
+	uint16_t id;
+	fsm_run_fn run_p;
+	const void *image_p;
+} fsm_t;
+
+/**
+ * typedef fsm_gen - a runner generated by FSM_GEN, see fsmgen.h
+ * @name - table name
+ * @trans_p - the transition table it was generated from
+ * @run - the runner
+ * @state_pp - the states in runner index order
+ * @nstates - number of states in @state_pp
+ */
+typedef struct fsm_gen {
+	const char *name;
+	fsm_trans_t *trans_p;
+	fsm_run_fn run;
+	fsm_state_t * const *state_pp;
+	uint16_t nstates;
+} fsm_gen_t;
+
+/**
+ * typedef fsm_host - callbacks into whatever runs the FSM instance
+ * @broadcast - send an event from the instance to its peers, and to the
+ *              instance too if self is true
+ * @done - the instance reached its final state
+ *
+ * A worker thread hosts one instance, broadcast goes to all workers and
+ * done ends the thread.  The fsmsched scheduler hosts many instances per
+ * thread, broadcast goes to the instance group and done just retires it.
+ */
+typedef struct fsm_host {
+	void (*broadcast)(struct fsm_inst *inst_p, fsm_events_t evt_id, bool self);
+	void (*done)(struct fsm_inst *inst_p);
+} fsm_host_t;
+
+/* most events an instance can raise to itself before they are run */
+#define FSM_RTC_MAX 16
+
+/**
+ * typedef fsm_inst - one running instance of a compiled FSM
+ * @fsm_p - shared machine definition
+ * @currst - dense index of the current state
+ * @id - instance number for the trace, 0 unless the host sets it
+ * @timer_base - first timer id owned by the instance, see fsm_timer_id
+ * @data - guard and action private data
+ * @pl_p - payload of the event being run, NULL outside fsm_run_pl
+ * @host_p - callbacks of whatever runs the instance
+ * @host_ctx - private data for @host_p
+ * @rtc_head - first event in @rtc_q
+ * @rtc_n - events in @rtc_q
+ * @rtc_q - events the instance raised to itself, see fsm_raise
+ */
+typedef struct fsm_inst {
+	const fsm_t *fsm_p;
+	uint16_t currst;
+	uint32_t id;
+	uint32_t timer_base;
+	void *data;
+	const evt_payload_t *pl_p;
+	const fsm_host_t *host_p;
+	void *host_ctx;
+	uint8_t rtc_head;
+	uint8_t rtc_n;
+	uint8_t rtc_q[FSM_RTC_MAX];
+} fsm_inst_t;
+
+_Static_assert(E_LAST <= UINT8_MAX, "rtc_q holds event ids in a byte");
+
 /*
  * action debug macro
  */
 #define ACT_TRACE() \
 do {									\
-	if (debug_flag & DBG_DEEP) {					\
-		fsm_state_t *state_p = (fsm_state_t*) arg;		\
-		printf("%s:%s %s\n", worker_get_name(), __func__, state_p->name); \
+	if (dbg_on(DBG_DEEP)) {						\
+		fsm_inst_t *inst_p = (fsm_inst_t*) arg;			\
+		printf("%s:%s %s\n", worker_get_name(), __func__,	\
+		       fsm_curr_state(inst_p)->name);			\
 	}								\
 } while(0);
 
+/**
+ * fsm_curr_state - return the current state of an FSM instance
+ * @inst_p - pointer to FSM instance
+ *
+ * show_workers calls this from the CLI thread, a relaxed load pairs with
+ * the store in fsm_run.
+ */
+static inline fsm_state_t *fsm_curr_state(const fsm_inst_t *inst_p)
+{
+	return inst_p->fsm_p->state_pp[__atomic_load_n(&inst_p->currst, __ATOMIC_RELAXED)];
+}
+
+/**
+ * fsm_done - tell the host the instance reached its final state
+ * @inst_p - pointer to FSM instance
+ *
+ * This may not return, a worker thread exits.
+ */
+static inline void fsm_done(fsm_inst_t *inst_p)
+{
+	inst_p->host_p->done(inst_p);
+}
+
+/**
+ * fsm_payload - payload of the event the instance is running
+ * @inst_p - pointer to FSM instance, the guard or action arg
+ * @len_p - set to the number of payload bytes, may be NULL
+ *
+ * Only valid in a guard or action, the payload is released after the
+ * transition.
+ *
+ * Return: pointer to the payload data, NULL if the event has none
+ */
+static inline const void *fsm_payload(const fsm_inst_t *inst_p, size_t *len_p)
+{
+	return evt_payload_data(inst_p->pl_p, len_p);
+}
+
+/**
+ * fsm_timer_id - timer id of one of the instance timers
+ * @inst_p - pointer to FSM instance
+ * @tid - timer number within the instance (e.g. TID_LIGHT)
+ *
+ * Instances sharing timers (stoplight and crosswalk) share a timer_base.
+ */
+static inline uint32_t fsm_timer_id(const fsm_inst_t *inst_p, uint32_t tid)
+{
+	return inst_p->timer_base + tid;
+}
+
+/**
+ * fsm_evt_mask - mask of the events a compiled FSM has transitions for
+ * @fsm_p - compiled machine definition
+ *
+ * Bit (1 << evt_id) for each event in the transition table, any other
+ * event is unmatched in every state.
+ */
+static inline uint32_t fsm_evt_mask(const fsm_t *fsm_p)
+{
+	return fsm_p->evt_mask;
+}
+
+/**
+ * fsm_accepts - check if any state of an FSM can react to an event
+ * @fsm_p - compiled machine definition
+ * @evt_id - the event id
+ *
+ * Broadcasts skip the FSMs that would only find no transition.
+ */
+static inline bool fsm_accepts(const fsm_t *fsm_p, fsm_events_t evt_id)
+{
+	return (evt_id < E_LAST) && (fsm_p->evt_mask & (1U << evt_id));
+}
+
+/**
+ * fsm_raise - send an event from a guard or action to its own instance
+ * @inst_p - pointer to FSM instance
+ * @evt_id - the event id
+ *
+ * Run to completion: the event is run right after the transition that
+ * raised it, before fsm_run returns, in the order raised and ahead of
+ * anything waiting in the instance queue.  It never leaves the thread.
+ * More than FSM_RTC_MAX events pending is an event loop in the table.
+ */
+static inline void fsm_raise(fsm_inst_t *inst_p, fsm_events_t evt_id)
+{
+	if (FSM_RTC_MAX == inst_p->rtc_n)
+		die("fsm_raise too many events");
+	inst_p->rtc_q[(inst_p->rtc_head + inst_p->rtc_n++) % FSM_RTC_MAX] = evt_id;
+}
+
+/**
+ * fsm_broadcast - send an event from an action to the instance peers
+ * @inst_p - pointer to FSM instance
+ * @evt_id - the event id
+ *
+ * The peers get it through the host.  The instance itself, if its table
+ * has a transition for the event, gets it with fsm_raise instead of a
+ * round trip through its own queue.
+ */
+static inline void fsm_broadcast(fsm_inst_t *inst_p, fsm_events_t evt_id)
+{
+	inst_p->host_p->broadcast(inst_p, evt_id, false);
+	if (fsm_accepts(inst_p->fsm_p, evt_id))
+		fsm_raise(inst_p, evt_id);
+}
+
+/**
+ * fsm_inst_init - set up an FSM instance in its initial state
+ * @inst_p - pointer to FSM instance
+ * @fsm_p - compiled machine definition
+ * @host_p - host callbacks
+ * @host_ctx - private data for @host_p
+ * @timer_base - first timer id owned by the instance
+ */
+static inline void fsm_inst_init(fsm_inst_t *inst_p, const fsm_t *fsm_p,
+				 const fsm_host_t *host_p, void *host_ctx,
+				 uint32_t timer_base)
+{
+	inst_p->fsm_p = fsm_p;
+	inst_p->currst = 0;
+	inst_p->id = 0;
+	inst_p->timer_base = timer_base;
+	inst_p->data = NULL;
+	inst_p->pl_p = NULL;
+	inst_p->host_p = host_p;
+	inst_p->host_ctx = host_ctx;
+	inst_p->rtc_head = 0;
+	inst_p->rtc_n = 0;
+}
+
 /**
  * fsm_init - start FSM (when E_INIT is received)
- * @fsm_p - pointer to FSM[0] transition entry
+ * @inst_p - pointer to FSM instance
  * 
  * if there is an entry action, run it
  */
-static inline void fsm_init(fsm_trans_t *fsm_p)
+static inline void fsm_init(fsm_inst_t *inst_p)
 {
+	fsm_state_t *state_p = fsm_curr_state(inst_p);
+
 	/* run FSM init state entry action */
-	if (fsm_p->currst_p->entry_action)
-		fsm_p->currst_p->entry_action(fsm_p->currst_p);
+	if (state_p->entry_action)
+		state_p->entry_action(inst_p);
 }
 
-extern int fsm_run(fsm_trans_t * fsm_p, fsm_events_t evt_id);
+extern fsm_t *fsm_compile(fsm_trans_t *trans_p);
+extern void fsm_register(fsm_t *fsm_p);
+extern void fsm_specialize(fsm_t *fsm_p, const fsm_gen_t *gen_p);
+extern void fsm_gen_register(const fsm_gen_t *gen_p);
+extern void fsm_destroy(fsm_t *fsm_p);
+extern int fsm_run(fsm_inst_t *inst_p, fsm_events_t evt_id);
+extern int fsm_run_pl(fsm_inst_t *inst_p, fsm_events_t evt_id, const evt_payload_t *pl_p);
+extern size_t fsm_run_batch(fsm_inst_t *inst_p, const fsm_events_t *evts_p, size_t n);
+extern size_t fsm_run_batch_pl(fsm_inst_t *inst_p, const fsm_events_t *evts_p,
+			       evt_payload_t *pl_p, size_t n);
+extern void fsm_timer_notify(void *ctx, fsm_events_t evt_id);
 
 #endif /* _FSM_H */
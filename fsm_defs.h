@@ -15,12 +15,18 @@
 #include <timer.h>
 #include <fsm.h>
 #include <workers.h>
+#include <fsmgen.h>
+#include <fsmdef.h>
 
 /************************************ timers ****************************************/
-/* timer ids used in create_timer, set_timer */
+/*
+ * timer numbers within an instance, see fsm_timer_id.  The stoplight and
+ * crosswalk of one intersection share a timer_base, TID_LAST ids apart.
+ */
 enum timer_ids {
 	TID_LIGHT,
 	TID_BLINK,
+	TID_LAST,
 };
 
 /*
@@ -29,8 +35,8 @@ enum timer_ids {
 extern uint32_t tick;
 
 /**
- * timers - values are all multipled by tick to speed up/down
- *  the state transitions for testing/regression.
+ * timers - values are all multipled by tick, when the timer is set, to
+ *  speed up/down the state transitions for testing/regression.
  * t_norm: timeout for red/green lights
  * t_fast: timeout for yellow light
  * t_but: timeout after button push (see FSM1)
@@ -44,6 +50,26 @@ uint32_t t_blink = (10-2);
 
 /************************************** FSM action functions *****************************/
 
+/**
+ * but_ticks - light timer ticks left after a button push
+ * @arg: the fsm_inst_t running the E_BUTTON transition
+ *
+ * The E_BUTTON payload, a uint32_t tick count (CLI bN), or t_but if the
+ * event has none.
+ */
+static uint32_t but_ticks(void *arg)
+{
+	const void *data_p;
+	uint32_t ticks;
+	size_t len;
+
+	data_p = fsm_payload((fsm_inst_t *)arg, &len);
+	if (NULL == data_p || len != sizeof(ticks))
+		return(t_but);
+	memcpy(&ticks, data_p, sizeof(ticks));
+	return(ticks);
+}
+
 /**
  * These are action routines FSM states. See structures in `fsm.h`
  */
@@ -65,13 +91,14 @@ static void act_exit(void *arg)
 }
 
 /**
- * act-done - when the E_DONE event is received, exit the thread immediately.  The main thread 
- * waits on pthread_join to reap the worker threads.
+ * act-done - when the E_DONE event is received, tell the host.  A worker
+ * thread exits immediately and the main thread waits on pthread_join to
+ * reap it, the fsmsched scheduler retires the instance.
  */
 static void act_done(void *arg)
 {
 	ACT_TRACE();
-	pthread_exit(NULL);
+	fsm_done((fsm_inst_t *)arg);
 }
 
 /**
@@ -79,8 +106,9 @@ static void act_done(void *arg)
  *
  * When FSMs are started with E_INIT event, each is responsible to provision
  * itself.  This creates two timers: TID_LIGHT for changing the stoplight
- * and TID_BLINK for crosswalk blinking.  A set of timeout values are configured
- * as increments of the command line argument `tick`.
+ * and TID_BLINK for crosswalk blinking, both relative to the instance
+ * timer_base and sent to the instance host on expiry.  A set of timeout
+ * values are configured as increments of the command line argument `tick`.
  * - t_norm: normal timeout for light change
  * - t_fast: timeout for yellow light, which is brief
  * - t_but: timeout for light when button is pressed
@@ -88,17 +116,13 @@ static void act_done(void *arg)
  */
 static void stoplight_init_enter(void *arg)
 {
+	fsm_inst_t *inst_p = (fsm_inst_t *)arg;
+
 	ACT_TRACE();
 
 	/* create timers with event on expiry */
-	create_timer(TID_LIGHT, E_LIGHT);
-	create_timer(TID_BLINK, E_BLINK);
-
-	/* update timer expiry periods to be adjustable */
-	t_norm *= tick;
-	t_fast *= tick;	
-	t_but *= tick;
-	t_blink *= tick;
+	create_timer_notify(fsm_timer_id(inst_p, TID_LIGHT), E_LIGHT, fsm_timer_notify, inst_p);
+	create_timer_notify(fsm_timer_id(inst_p, TID_BLINK), E_BLINK, fsm_timer_notify, inst_p);
 }
 
 /**
@@ -108,8 +132,8 @@ static void stoplight_init_enter(void *arg)
 static void green_enter(void *arg)
 {
 	ACT_TRACE();
-	workers_evt_broadcast(E_GREEN);
-	set_timer(TID_LIGHT, t_norm);
+	fsm_broadcast(arg, E_GREEN);
+	set_timer(fsm_timer_id(arg, TID_LIGHT), t_norm * tick);
 }
 
 /**
@@ -119,8 +143,8 @@ static void green_enter(void *arg)
 static void yellow_enter(void *arg)
 {
 	ACT_TRACE();
-	workers_evt_broadcast(E_YELLOW);
-	set_timer(TID_LIGHT, t_fast);
+	fsm_broadcast(arg, E_YELLOW);
+	set_timer(fsm_timer_id(arg, TID_LIGHT), t_fast * tick);
 }
 
 /**
@@ -130,19 +154,19 @@ static void yellow_enter(void *arg)
 static void red_enter(void *arg)
 {
 	ACT_TRACE();
-	workers_evt_broadcast(E_RED);
-	set_timer(TID_LIGHT, t_norm);	
+	fsm_broadcast(arg, E_RED);
+	set_timer(fsm_timer_id(arg, TID_LIGHT), t_norm * tick);
 }
 
 /**
  * green_but_enter - action entering S:GREEN_BUT state to
- * update the light timer to t_but, which will cause RED/WALK more
- * quicker. 
+ * update the light timer to t_but, or the button payload, which will
+ * cause RED/WALK more quicker. 
  */
 static void green_but_enter(void *arg)
 {
 	ACT_TRACE();
-	set_timer(TID_LIGHT, t_but);
+	set_timer(fsm_timer_id(arg, TID_LIGHT), but_ticks(arg) * tick);
 }
 
 /**
@@ -153,7 +177,7 @@ static void green_but_enter(void *arg)
 static void walk_enter(void *arg)
 {
 	ACT_TRACE();
-	set_timer(TID_BLINK, t_blink);
+	set_timer(fsm_timer_id(arg, TID_BLINK), t_blink * tick);
 }
 
 #if 0
@@ -163,7 +187,7 @@ static void walk_enter(void *arg)
 static void walk_exit(void *arg)
 {
 	ACT_TRACE();
-	set_timer(TID_BLINK, 0);
+	set_timer(fsm_timer_id(arg, TID_BLINK), 0);
 }
 #endif
 
@@ -173,15 +197,16 @@ static void walk_exit(void *arg)
  * Return: true if constraint is satisfied, false otherwise
  * 
  * If the light timer remaining time is greater than the button time
- * return true, which will transition to S:GREEN_BUT IFF FSM is in S:GREEN
+ * (t_but or the event payload, see but_ticks) return true, which will
+ * transition to S:GREEN_BUT IFF FSM is in S:GREEN
  * If the remaining time is smaller, fail the constraint (no transition.)
  */
 static bool but_constraint(void *arg)
 {
 	uint64_t rem;
 
-	rem = get_timer(TID_LIGHT);
-	if (rem > t_but)
+	rem = get_timer(fsm_timer_id(arg, TID_LIGHT));
+	if (rem > (uint64_t)but_ticks(arg) * tick)
 		return(true);
 	return(false);
 }
@@ -189,61 +214,100 @@ static bool but_constraint(void *arg)
 
 /********************************* FSM Definitions *******************************/
 
+/*
+ * Each table is an X-macro list of (state, event, guard, next state) rows
+ * and its states in order of first appearance, each followed by its
+ * parent; FSM_GEN makes the fsm_trans_t table and the generated runner
+ * from it, see fsmgen.h.  The lights of a running machine are substates
+ * of S:ON, its E_DONE transition covers them all.
+ */
+
 /* Default states */
-fsm_state_t s_init = {"S:INIT", act_enter, act_exit};
-fsm_state_t s_done = {"S:DONE", act_done, NULL};
+FSM_GEN_STATE(init, "S:INIT", act_enter, act_exit)
+FSM_GEN_STATE(done, "S:DONE", act_done, NULL)
 
 /**
  * FSM1, stoplight 
  */
-fsm_state_t s_stoplight_init = {"S:INIT", stoplight_init_enter, act_exit};
-fsm_state_t s_red = {"S:RED", red_enter, act_exit};
-fsm_state_t s_green = {"S:GREEN", green_enter, act_exit};
-fsm_state_t s_yellow = {"S:YELLOW", yellow_enter, act_exit};
-fsm_state_t s_green_but = {"S:GREEN_BUT", green_but_enter, act_exit};
-fsm_trans_t FSM1[] = {
-	/* specific init for timers, transition to s_green */
-	{&s_stoplight_init, E_INIT, NULL, &s_green},
-
-	/* GREEN */
-	{&s_green, E_LIGHT, NULL, &s_yellow},
-	{&s_green, E_DONE, NULL, &s_done},
-	{&s_green, E_BUTTON, but_constraint, &s_green_but},
-
-	/* YELLOW */
-	{&s_yellow, E_LIGHT, NULL, &s_red},
-	{&s_yellow, E_DONE, NULL, &s_done},	
-
-	/* RED */
-	{&s_red, E_LIGHT, NULL, &s_green},
-	{&s_red, E_DONE, NULL, &s_done},
-
-	/* GREEN BUT */
-	{&s_green_but, E_LIGHT, NULL, &s_yellow},
-	// TODO: NO DONE? {&st_green_but, E_DONE, &st_done},
-};
+FSM_GEN_STATE(stoplight_init, "S:INIT", stoplight_init_enter, act_exit)
+FSM_GEN_STATE(stoplight_on, "S:ON", NULL, NULL)
+FSM_GEN_SUBSTATE(red, "S:RED", red_enter, act_exit, stoplight_on)
+FSM_GEN_SUBSTATE(green, "S:GREEN", green_enter, act_exit, stoplight_on)
+FSM_GEN_SUBSTATE(yellow, "S:YELLOW", yellow_enter, act_exit, stoplight_on)
+FSM_GEN_SUBSTATE(green_but, "S:GREEN_BUT", green_but_enter, act_exit, stoplight_on)
+
+#define FSM1_STATES(X, f)						\
+	X(f, stoplight_init) X(f, green) X(f, stoplight_on)		\
+	X(f, yellow) X(f, green_but) X(f, red) X(f, done)
+
+#define FSM1_ROWS(X, f)							\
+	/* specific init for timers, transition to s_green */		\
+	X(f, stoplight_init, E_INIT, NULL, green)			\
+									\
+	/* GREEN */							\
+	X(f, green, E_LIGHT, NULL, yellow)				\
+	X(f, green, E_BUTTON, but_constraint, green_but)		\
+									\
+	/* YELLOW */							\
+	X(f, yellow, E_LIGHT, NULL, red)				\
+									\
+	/* RED */							\
+	X(f, red, E_LIGHT, NULL, green)					\
+									\
+	/* GREEN BUT */							\
+	X(f, green_but, E_LIGHT, NULL, yellow)				\
+									\
+	/* every light */						\
+	X(f, stoplight_on, E_DONE, NULL, done)
+
+FSM_GEN(stoplight, FSM1, FSM1_STATES, FSM1_ROWS)
 
 /**
  * FSM2, crosswalk 
  */
-fsm_state_t s_nowalk = {"S:DONT_WALK", act_enter, act_exit};
-fsm_state_t s_walk = {"S:WALK", walk_enter, act_exit};
-fsm_state_t s_blink = {"S:BLINKING WALK", act_enter, act_exit};
-fsm_trans_t FSM2[] = {
-	/* generic init to s_nowalk */
-	{&s_init, E_INIT, NULL, &s_nowalk},
+FSM_GEN_STATE(crosswalk_on, "S:ON", NULL, NULL)
+FSM_GEN_SUBSTATE(nowalk, "S:DONT_WALK", act_enter, act_exit, crosswalk_on)
+FSM_GEN_SUBSTATE(walk, "S:WALK", walk_enter, act_exit, crosswalk_on)
+FSM_GEN_SUBSTATE(blink, "S:BLINKING WALK", act_enter, act_exit, crosswalk_on)
+
+#define FSM2_STATES(X, f)						\
+	X(f, init) X(f, nowalk) X(f, crosswalk_on) X(f, walk)		\
+	X(f, blink) X(f, done)
+
+#define FSM2_ROWS(X, f)							\
+	/* generic init to s_nowalk */					\
+	X(f, init, E_INIT, NULL, nowalk)				\
+									\
+	/* DONT WALK */							\
+	X(f, nowalk, E_RED, NULL, walk)					\
+									\
+	/* WALK */							\
+	X(f, walk, E_BLINK, NULL, blink)				\
+									\
+	/* BLINKING */							\
+	X(f, blink, E_GREEN, NULL, nowalk)				\
+									\
+	/* every crosswalk state */					\
+	X(f, crosswalk_on, E_DONE, NULL, done)
+
+FSM_GEN(crosswalk, FSM2, FSM2_STATES, FSM2_ROWS)
 
-	/* DONT WALK */
-	{&s_nowalk, E_RED, NULL, &s_walk},
-	{&s_nowalk, E_DONE, NULL, &s_done},	
-
-	/* WALK */
-	{&s_walk, E_BLINK, NULL, &s_blink},
-	{&s_walk, E_DONE, NULL, &s_done},
-
-	/* BLINKING */
-	{&s_blink, E_GREEN, NULL, &s_nowalk},
-	{&s_blink, E_DONE, NULL, &s_done},
+/**
+ * fsm_defs_syms - the actions and guards a definition file may name, see
+ * fsmdemo.fsm
+ */
+const fsm_sym_t fsm_defs_syms[] = {
+	FSM_SYM_ACTION(act_enter),
+	FSM_SYM_ACTION(act_exit),
+	FSM_SYM_ACTION(act_done),
+	FSM_SYM_ACTION(stoplight_init_enter),
+	FSM_SYM_ACTION(green_enter),
+	FSM_SYM_ACTION(yellow_enter),
+	FSM_SYM_ACTION(red_enter),
+	FSM_SYM_ACTION(green_but_enter),
+	FSM_SYM_ACTION(walk_enter),
+	FSM_SYM_GUARD(but_constraint),
+	FSM_SYM_END,
 };
 
 #endif /* _FSM_DEFS_H */
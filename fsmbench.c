@@ -0,0 +1,1669 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * performance benchmarks for fsm_run, evtq and the timer service
+ *
+ * Every result is one CSV line on stdout so runs can be compared between
+ * releases:
+ *  bench,variant,param,ops,ns_per_op,p50_ns,p99_ns,p999_ns,max_ns
+ *
+ * - fsm: fsm_run dispatch on FSM1, FSM2 and synthetic tables of param states,
+ *   FSM1 and FSM2 also with their generated runners (variant -gen)
+ * - gen: check the generated runners against the table interpreter on
+ *   random events, exits 1 on the first difference.  ns_per_op is the
+ *   cost of running each event on both.  Also checks the exits and
+ *   entries of a nested table
+ * - rtc: events an instance sends itself, run to completion with fsm_raise
+ *   or through its own queue, exits 1 if a raised chain does not complete
+ * - bulk: the same event stream over many copies of FSM1, FSM2 and a
+ *   synthetic table, fsm_run on each copy (variant -scalar) and
+ *   fsmbulk_run on param pool threads, exits 1 if a copy ends elsewhere
+ * - pingpong: evtq round trip between two threads, per queue type, with
+ *   the default, the adaptive spin-then-park (variant -adaptive) and the
+ *   coalesced (variant -coalesce) wakeup
+ * - mbox: two fsmsched instances of a group broadcasting to each other
+ *   on every transition while main posts num/10 events to each, with 1
+ *   and param pool threads; the broadcasts overflow the mailboxes.  Exits
+ *   1 if the pool stalls or a transition is lost
+ * - fanin: param producers into one queue, latency from the enqueue stamp
+ * - broadcast: workers_evt_broadcast to param workers, with a queue per
+ *   worker or on the broadcast channel (bus).  ns_per_op is the producer
+ *   cost, max_ns the time until every worker drained the events
+ * - payload: param payload bytes per event over an spsc queue, none,
+ *   inline, from the buffer pool or malloc'd, ns_per_op until the consumer
+ *   released the last payload
+ * - timer: expiry jitter of a 10 msec periodic timer with param armed
+ * - ingest: a binary event stream from a mapped file and a unix socket
+ *   to 4 workers, param events queued per enqueue, exits 1 if an event
+ *   is lost
+ * - registry: workers_evt_broadcast to param workers while another thread
+ *   adds and takes off a worker as fast as it can (churn) or not (static),
+ *   exits 1 if a worker on the registry throughout misses an event.
+ *   max_ns is the count of workers the churn thread went through
+ *
+ * example:
+ *  ./fsmbench > bench.csv
+ *  ./fsmbench -b fsm -n 10000000
+ */
+
+#include <stdlib.h>      /* atoi, malloc, strtol, strtoll, strtoul */
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <unistd.h>      /* common typdefs, e.g. ssize_t, includes getopt.h */
+#include <stdio.h>       /* char I/O */
+#include <string.h>      /* strlen, strsignal,, memset */
+#include <pthread.h>     /* posix threads */
+#include <fcntl.h>       /* open */
+#include <sys/socket.h>  /* socket, connect */
+#include "utils.h"
+#include "evtq.h"
+#include "fsm.h"
+#include "timer.h"
+#include "workers.h"
+#include "stats.h"
+#include "reactor.h"
+#include "evtbus.h"
+#include "ingest.h"
+#include "fsmbulk.h"
+#include "fsmsched.h"
+
+#include <fsm_defs.h>
+
+/**
+ * arguments - descriptive string for all commandline arguments
+ */
+char *arguments = "\n"							\
+	" -b name: run only this bench, fsm, gen, rtc, bulk, pingpong,\n" \
+	"    mbox, fanin, broadcast, payload, timer, ingest or registry\n" \
+	" -n num: fsm_run events per table (default 1000000), the queue\n" \
+	"    benches use num/10 events\n"				\
+	" -p num: most producers for fanin, workers for broadcast and\n" \
+	"    registry, bulk and mbox pool threads (default 8)\n"	\
+	" -q type: broadcast and ingest worker queue type, spsc or mpsc\n" \
+	" -m msec: timer bench run time for each timer count (default 1000)\n" \
+	" -h: this help\n";
+
+/* the library needs these from the main program */
+uint32_t tick = 1000;
+char scriptfile[64] = "";
+uint32_t debug_flag;
+workers_t workers = WORKERS_INIT;
+__thread worker_t *worker_self_p;
+__thread workers_reader_t *workers_reader_p;
+
+static char bench_only[16] = "";
+static uint64_t niter = 1000000;
+static uint32_t max_producers = 8;
+static uint32_t timer_msec = 1000;
+
+/* timer bench period */
+#define BENCH_TIMER_MS 10
+/* most armed timers in the timer bench */
+#define BENCH_TIMER_MAX 10000
+/* first timer id used by the timer bench, FSM1 uses the low ids */
+#define BENCH_TIMER_BASE 1000
+/* first timer id of the fsm and gen bench instances, above the timer bench */
+#define BENCH_FSM_TIMER_BASE (BENCH_TIMER_BASE + BENCH_TIMER_MAX)
+/* events taken per dequeue */
+#define BENCH_BATCH 64
+
+/* next timer_base of an fsm or gen bench instance, timers are never deleted */
+static uint32_t fsm_timer_base = BENCH_FSM_TIMER_BASE;
+
+/**
+ * cmdline_args - parse command line arguments
+ * @argc: argument count (from main)
+ * @argv: array aligned with argc containing an argument string (from main)
+ *
+ * Return:
+ *  optind - the number of parsed (hyphenated) arguments
+ */
+int cmdline_args(int argc, char *argv[]) {
+	int opt;
+
+	while((opt = getopt(argc, argv, "b:n:p:q:m:h")) != -1) {
+		switch(opt) {
+		case 'b':
+			strncpy(bench_only, optarg, sizeof(bench_only)-1);
+			break;
+		case 'n':
+			niter = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			max_producers = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+		{
+			int type = evtq_type_parse(optarg);
+
+			if (type < 0) {
+				fprintf(stderr, "unknown queue type %s\n", optarg);
+				exit(1);
+			}
+			workers.qattr.type = type;
+		}
+		break;
+		case 'm':
+			timer_msec = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			fprintf(stderr, "Usage: %s %s\n", argv[0], arguments);
+			exit(0);
+		}
+	}
+	return optind;
+}
+
+/**
+ * bench_want - check if a bench is selected with -b
+ * @name: bench name
+ */
+static bool bench_want(const char *name)
+{
+	return ('\0' == bench_only[0] || 0 == strcmp(bench_only, name));
+}
+
+/**
+ * result - print one CSV result line
+ * @bench: bench name
+ * @variant: table, queue type, ...
+ * @param: states, producers, workers or timers
+ * @ops: operations measured
+ * @ns: total nsecs for @ops
+ * @h_p: latency histogram, NULL if none
+ * @max: max_ns for a bench without a histogram
+ */
+static void result(const char *bench, const char *variant, uint64_t param,
+		   uint64_t ops, uint64_t ns, stats_hist_t *h_p, uint64_t max)
+{
+	printf("%s,%s,%lu,%lu,%.1f,%lu,%lu,%lu,%lu\n", bench, variant, param, ops,
+	       ops ? (double)ns / ops : 0.0,
+	       h_p ? stats_hist_pct(h_p, 500) : 0,
+	       h_p ? stats_hist_pct(h_p, 990) : 0,
+	       h_p ? stats_hist_pct(h_p, 999) : 0,
+	       h_p ? atomic_load(&h_p->max) : max);
+	fflush(stdout);
+}
+
+/********************** fsm_run dispatch **********************/
+
+static void bench_host_broadcast(fsm_inst_t *inst_p, fsm_events_t evt_id, bool self)
+{
+}
+
+static void bench_host_done(fsm_inst_t *inst_p)
+{
+}
+
+/*
+ * bench_host - broadcasts from the actions go nowhere, so only the
+ * dispatch and the action bodies are measured
+ */
+static const fsm_host_t bench_host = {
+	.broadcast = bench_host_broadcast,
+	.done = bench_host_done,
+};
+
+/**
+ * bench_fsm_run - time fsm_run over an event cycle
+ * @variant: name for the result line
+ * @nstates: param for the result line
+ * @trans_p: transition table
+ * @gen_p: generated runner for @trans_p, NULL to interpret the table
+ * @timer_base: instance timer_base, a crosswalk uses the stoplight timers
+ * @cycle_p: events, run in a loop after E_INIT
+ * @ncycle: number of events in @cycle_p
+ */
+static void bench_fsm_run(const char *variant, uint64_t nstates, fsm_trans_t *trans_p,
+			  const fsm_gen_t *gen_p, uint32_t timer_base,
+			  const fsm_events_t *cycle_p, uint32_t ncycle)
+{
+	fsm_t *fsm_p = fsm_compile(trans_p);
+	fsm_inst_t inst;
+	uint64_t t0, i;
+
+	if (gen_p)
+		fsm_specialize(fsm_p, gen_p);
+	fsm_inst_init(&inst, fsm_p, &bench_host, NULL, timer_base);
+	fsm_init(&inst);
+	fsm_run(&inst, E_INIT);
+
+	t0 = stats_now();
+	for (i=0; i<niter; i++)
+		fsm_run(&inst, cycle_p[i % ncycle]);
+	result("fsm", variant, nstates, niter, stats_now() - t0, NULL, 0);
+
+	fsm_destroy(fsm_p);
+}
+
+/**
+ * synth_t - a synthetic FSM, a ring of states
+ * @states_p: the states
+ * @names_p: state names
+ * @trans_p: transition table
+ */
+typedef struct synth {
+	fsm_state_t *states_p;
+	char (*names_p)[16];
+	fsm_trans_t *trans_p;
+} synth_t;
+
+/**
+ * synth_create - build a table of n states
+ * @syn_p: filled in
+ * @n: number of states
+ *
+ * Each state has E_LIGHT to the next state in the ring and E_RED to
+ * itself, E_YELLOW never matches.  No actions or guards, so this is the
+ * bare dispatch cost.
+ */
+static void synth_create(synth_t *syn_p, uint32_t n)
+{
+	uint32_t i;
+
+	syn_p->states_p = malloc(n * sizeof(fsm_state_t));
+	syn_p->names_p = malloc(n * sizeof(*syn_p->names_p));
+	syn_p->trans_p = malloc((2*n + 1) * sizeof(fsm_trans_t));
+	if (!syn_p->states_p || !syn_p->names_p || !syn_p->trans_p)
+		die("synth_create");
+
+	for (i=0; i<n; i++) {
+		fsm_state_t st = {syn_p->names_p[i], NULL, NULL, NULL};
+
+		snprintf(syn_p->names_p[i], sizeof(syn_p->names_p[i]), "S:%u", i);
+		memcpy(&syn_p->states_p[i], &st, sizeof(st));
+	}
+	for (i=0; i<n; i++) {
+		syn_p->trans_p[2*i] = (fsm_trans_t){&syn_p->states_p[i], E_LIGHT, NULL,
+						    &syn_p->states_p[(i+1) % n]};
+		syn_p->trans_p[2*i+1] = (fsm_trans_t){&syn_p->states_p[i], E_RED, NULL,
+						      &syn_p->states_p[i]};
+	}
+	syn_p->trans_p[2*n] = (fsm_trans_t){NULL, E_BAD, NULL, NULL};
+}
+
+static void synth_destroy(synth_t *syn_p)
+{
+	free(syn_p->trans_p);
+	free(syn_p->names_p);
+	free(syn_p->states_p);
+}
+
+/**
+ * bench_fsm - fsm_run on FSM1, FSM2 and synthetic tables
+ *
+ * FSM1 cycles GREEN, YELLOW, RED with the real actions (timer and
+ * broadcast calls), FSM2 cycles DONT_WALK, WALK, BLINKING.  The synthetic
+ * tables get a pseudo-random event mix so the branch predictor cannot
+ * learn it.
+ */
+static void bench_fsm(void)
+{
+	static const fsm_events_t fsm1_cycle[] = {E_LIGHT};
+	static const fsm_events_t fsm2_cycle[] = {E_RED, E_BLINK, E_GREEN};
+	static const uint32_t sizes[] = {4, 64, 1024, 4096};
+	static const fsm_events_t mix[] = {E_LIGHT, E_LIGHT, E_RED, E_YELLOW};
+	fsm_events_t cycle[4096];
+	uint32_t i, x = 2463534242U;
+	synth_t syn;
+
+	/* tick 0 keeps the FSM1 timers stopped */
+	tick = 0;
+	bench_fsm_run("FSM1", 5, FSM1, NULL, fsm_timer_base, fsm1_cycle, 1);
+	bench_fsm_run("FSM2", 4, FSM2, NULL, fsm_timer_base, fsm2_cycle, 3);
+	fsm_timer_base += TID_LAST;
+	bench_fsm_run("FSM1-gen", 5, FSM1, &stoplight_gen, fsm_timer_base, fsm1_cycle, 1);
+	bench_fsm_run("FSM2-gen", 4, FSM2, &crosswalk_gen, fsm_timer_base, fsm2_cycle, 3);
+	fsm_timer_base += TID_LAST;
+	tick = 1000;
+
+	/* xorshift32 */
+	for (i=0; i<4096; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		cycle[i] = mix[x & 3];
+	}
+
+	for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		synth_create(&syn, sizes[i]);
+		bench_fsm_run("synth", sizes[i], syn.trans_p, NULL, 0, cycle, 4096);
+		synth_destroy(&syn);
+	}
+}
+
+/********************** generated runners **********************/
+
+/**
+ * gen_start - put an instance in its initial state and run E_INIT
+ * @inst_p: the instance
+ * @timers: create the instance timers, for a crosswalk without its
+ *          stoplight
+ *
+ * FSM1 creates its timers on E_INIT, so each start gets new timer ids.
+ */
+static void gen_start(fsm_inst_t *inst_p, bool timers)
+{
+	inst_p->currst = 0;
+	inst_p->timer_base = fsm_timer_base;
+	fsm_timer_base += TID_LAST;
+	if (timers) {
+		create_timer_notify(fsm_timer_id(inst_p, TID_LIGHT), E_LIGHT, fsm_timer_notify, inst_p);
+		create_timer_notify(fsm_timer_id(inst_p, TID_BLINK), E_BLINK, fsm_timer_notify, inst_p);
+	}
+	fsm_init(inst_p);
+	fsm_run(inst_p, E_INIT);
+}
+
+/**
+ * gen_check - run the same events on the interpreter and the runner
+ * @name: table name for the result line
+ * @trans_p: transition table
+ * @gen_p: its generated runner
+ * @timers: see gen_start
+ *
+ * Every event, including ones the table has no transition for, must give
+ * the same return value and the same next state on both.  The FSM1
+ * timers run (tick 1000) so the E_BUTTON guard passes in S:GREEN, each
+ * instance has its own timers.  S:DONE starts both instances over.
+ */
+static void gen_check(const char *name, fsm_trans_t *trans_p, const fsm_gen_t *gen_p,
+		      bool timers)
+{
+	fsm_t *interp_p = fsm_compile(trans_p);
+	fsm_t *gen_fsm_p = fsm_compile(trans_p);
+	fsm_inst_t interp, gen;
+	fsm_events_t evt_id;
+	uint32_t x = 2463534242U;
+	uint64_t t0, i;
+	int r1, r2;
+
+	fsm_specialize(gen_fsm_p, gen_p);
+	fsm_inst_init(&interp, interp_p, &bench_host, NULL, 0);
+	fsm_inst_init(&gen, gen_fsm_p, &bench_host, NULL, 0);
+	gen_start(&interp, timers);
+	gen_start(&gen, timers);
+
+	t0 = stats_now();
+	for (i=0; i<niter; i++) {
+		/* xorshift32, E_DONE rarely so the cycles get covered */
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		evt_id = x % E_LAST;
+		if (E_DONE == evt_id && (x >> 8) % 16)
+			evt_id = E_LIGHT;
+
+		r1 = fsm_run(&interp, evt_id);
+		r2 = fsm_run(&gen, evt_id);
+		if (r1 != r2 || interp.currst != gen.currst) {
+			fprintf(stderr, "%s: event %lu %s: interpreter %d %s, generated %d %s\n",
+				name, i, evt_name[evt_id],
+				r1, fsm_curr_state(&interp)->name,
+				r2, fsm_curr_state(&gen)->name);
+			exit(1);
+		}
+		if (fsm_curr_state(&interp) == &s_done) {
+			gen_start(&interp, timers);
+			gen_start(&gen, timers);
+		}
+	}
+	result("gen", name, interp_p->nstates, niter, stats_now() - t0, NULL, 0);
+
+	fsm_destroy(gen_fsm_p);
+	fsm_destroy(interp_p);
+}
+
+/* actions run by the last fsm_run of the nested table */
+static char hsm_log[128];
+
+/* HSM_ACTS - entry and exit actions of a nested table state, logged */
+#define HSM_ACTS(st)							\
+	static void hsm_enter_##st(void *arg)				\
+	{								\
+		strcat(hsm_log, " e:" #st);				\
+	}								\
+	static void hsm_exit_##st(void *arg)				\
+	{								\
+		strcat(hsm_log, " x:" #st);				\
+	}
+
+HSM_ACTS(a) HSM_ACTS(a1) HSM_ACTS(a11) HSM_ACTS(a2) HSM_ACTS(b)
+
+/* a { a1 { a11 } a2 } b */
+FSM_GEN_STATE(hsm_a, "S:A", hsm_enter_a, hsm_exit_a)
+FSM_GEN_SUBSTATE(hsm_a1, "S:A1", hsm_enter_a1, hsm_exit_a1, hsm_a)
+FSM_GEN_SUBSTATE(hsm_a11, "S:A11", hsm_enter_a11, hsm_exit_a11, hsm_a1)
+FSM_GEN_SUBSTATE(hsm_a2, "S:A2", hsm_enter_a2, hsm_exit_a2, hsm_a)
+FSM_GEN_STATE(hsm_b, "S:B", hsm_enter_b, hsm_exit_b)
+
+#define HSM_STATES(X, f)						\
+	X(f, hsm_a11) X(f, hsm_a1) X(f, hsm_a) X(f, hsm_b) X(f, hsm_a2)
+
+#define HSM_ROWS(X, f)							\
+	X(f, hsm_a11, E_LIGHT, NULL, hsm_b)				\
+	X(f, hsm_b, E_RED, NULL, hsm_a2)				\
+	X(f, hsm_a2, E_GREEN, NULL, hsm_a1)				\
+	X(f, hsm_a, E_INIT, NULL, hsm_a11)				\
+	X(f, hsm_a1, E_RED, NULL, hsm_a1)				\
+	X(f, hsm_a, E_DONE, NULL, hsm_b)
+
+FSM_GEN(hsm, HSM, HSM_STATES, HSM_ROWS)
+
+/**
+ * hsm_step_t - one event of the nested table check
+ * @evt_id: the event
+ * @state_p: state after it
+ * @log: the actions it runs
+ */
+typedef struct hsm_step {
+	fsm_events_t evt_id;
+	fsm_state_t *state_p;
+	const char *log;
+} hsm_step_t;
+
+static const hsm_step_t hsm_steps[] = {
+	/* leaf to top level, up three levels */
+	{E_LIGHT, &s_hsm_b, " x:a11 x:a1 x:a e:b"},
+	/* down two */
+	{E_RED, &s_hsm_a2, " x:b e:a e:a2"},
+	/* none, a and a2 have no E_LIGHT */
+	{E_LIGHT, &s_hsm_a2, ""},
+	/* sibling, runner inline */
+	{E_GREEN, &s_hsm_a1, " x:a2 e:a1"},
+	/* parent to grandchild */
+	{E_INIT, &s_hsm_a11, " x:a1 x:a e:a e:a1 e:a11"},
+	/* parent self transition */
+	{E_RED, &s_hsm_a1, " x:a11 x:a1 e:a1"},
+	/* from the grandparent */
+	{E_DONE, &s_hsm_b, " x:a1 x:a e:b"},
+};
+
+/**
+ * hsm_check - the exits and entries of a nested table
+ * @gen_p: its generated runner, NULL to interpret the table
+ *
+ * Exits 1 on the first step with another state or other actions.
+ */
+static void hsm_check(const fsm_gen_t *gen_p)
+{
+	fsm_t *fsm_p = fsm_compile(HSM);
+	fsm_inst_t inst;
+	uint32_t i;
+
+	if (gen_p)
+		fsm_specialize(fsm_p, gen_p);
+	fsm_inst_init(&inst, fsm_p, &bench_host, NULL, 0);
+	hsm_log[0] = '\0';
+	fsm_init(&inst);
+
+	for (i=0; i<sizeof(hsm_steps)/sizeof(hsm_steps[0]); i++) {
+		hsm_log[0] = '\0';
+		fsm_run(&inst, hsm_steps[i].evt_id);
+		if (fsm_curr_state(&inst) != hsm_steps[i].state_p ||
+		    strcmp(hsm_log, hsm_steps[i].log)) {
+			fprintf(stderr, "HSM%s: step %u %s: %s%s, expected %s%s\n",
+				gen_p ? "-gen" : "", i, evt_name[hsm_steps[i].evt_id],
+				fsm_curr_state(&inst)->name, hsm_log,
+				hsm_steps[i].state_p->name, hsm_steps[i].log);
+			exit(1);
+		}
+	}
+	fsm_destroy(fsm_p);
+}
+
+/**
+ * bench_gen - check the FSM1 and FSM2 generated runners, and the nested
+ * table on both paths
+ */
+static void bench_gen(void)
+{
+	gen_check("FSM1", FSM1, &stoplight_gen, false);
+	gen_check("FSM2", FSM2, &crosswalk_gen, true);
+	hsm_check(NULL);
+	hsm_check(&hsm_gen);
+}
+
+/********************** run to completion **********************/
+
+/* self events each E_INIT raises */
+#define RTC_CHAIN 8
+
+/**
+ * rtc_t - state of a run to completion chain
+ * @left: E_LIGHT events still to send, then E_RED
+ * @q_p: send them through this queue, NULL to fsm_raise them
+ */
+typedef struct rtc {
+	uint32_t left;
+	evtq_t *q_p;
+} rtc_t;
+
+/**
+ * rtc_enter - send the instance its next event
+ * @arg: the fsm_inst_t, data is the rtc_t
+ */
+static void rtc_enter(void *arg)
+{
+	fsm_inst_t *inst_p = arg;
+	rtc_t *rtc_p = inst_p->data;
+	fsm_events_t evt_id = rtc_p->left ? E_LIGHT : E_RED;
+
+	if (rtc_p->left)
+		rtc_p->left--;
+	if (rtc_p->q_p)
+		evtq_enqueue(rtc_p->q_p, evt_id);
+	else
+		fsm_raise(inst_p, evt_id);
+}
+
+static fsm_state_t s_rtc_idle = {"S:IDLE", NULL, NULL, NULL};
+static fsm_state_t s_rtc_a = {"S:A", rtc_enter, NULL, NULL};
+static fsm_state_t s_rtc_b = {"S:B", rtc_enter, NULL, NULL};
+
+/*
+ * E_INIT starts a chain, S:A and S:B bounce on E_LIGHT until E_RED goes
+ * back to S:IDLE.
+ */
+static fsm_trans_t RTC[] = {
+	{&s_rtc_idle, E_INIT, NULL, &s_rtc_a},
+	{&s_rtc_a, E_LIGHT, NULL, &s_rtc_b},
+	{&s_rtc_b, E_LIGHT, NULL, &s_rtc_a},
+	{&s_rtc_a, E_RED, NULL, &s_rtc_idle},
+	{&s_rtc_b, E_RED, NULL, &s_rtc_idle},
+	{NULL, E_BAD, NULL, NULL},
+};
+
+/**
+ * bench_rtc - events an instance sends itself, raised or queued
+ *
+ * Each E_INIT runs a chain of RTC_CHAIN+2 events.  Raised, the whole
+ * chain runs in the one fsm_run and must end in S:IDLE, exits 1 if not.
+ * Queued, the same events take a round trip through an spsc queue of the
+ * same thread, what a self broadcast cost before fsm_raise.  ns_per_op is
+ * per chain event.
+ */
+static void bench_rtc(void)
+{
+	fsm_t *fsm_p = fsm_compile(RTC);
+	evtq_attr_t attr = {.type = EVTQ_SPSC};
+	fsm_inst_t inst;
+	fsm_events_t evt_id;
+	rtc_t rtc = {0};
+	uint64_t n = niter / (RTC_CHAIN+2), t0, i;
+
+	fsm_inst_init(&inst, fsm_p, &bench_host, NULL, 0);
+	inst.data = &rtc;
+	fsm_init(&inst);
+
+	t0 = stats_now();
+	for (i=0; i<n; i++) {
+		rtc.left = RTC_CHAIN;
+		fsm_run(&inst, E_INIT);
+		if (fsm_curr_state(&inst) != &s_rtc_idle || rtc.left) {
+			fprintf(stderr, "rtc: chain %lu ended in %s, %u left\n",
+				i, fsm_curr_state(&inst)->name, rtc.left);
+			exit(1);
+		}
+	}
+	result("rtc", "raise", RTC_CHAIN, n * (RTC_CHAIN+2), stats_now() - t0, NULL, 0);
+
+	rtc.q_p = evtq_create(&attr);
+	t0 = stats_now();
+	for (i=0; i<n; i++) {
+		rtc.left = RTC_CHAIN;
+		fsm_run(&inst, E_INIT);
+		while (evtq_trydequeue_batch(rtc.q_p, &evt_id, 1))
+			fsm_run(&inst, evt_id);
+	}
+	result("rtc", "evtq", RTC_CHAIN, n * (RTC_CHAIN+2), stats_now() - t0, NULL, 0);
+
+	evtq_destroy(rtc.q_p);
+	fsm_destroy(fsm_p);
+}
+
+/********************** bulk engine **********************/
+
+/* events in the bulk bench stream */
+#define BENCH_BULK_EVTS 64
+
+/**
+ * bulk_check - run copies of a table one fsm_run at a time and in bulk
+ * @name: table name for the result lines
+ * @trans_p: transition table
+ * @ncopies: number of copies
+ *
+ * The copies start in random states and run a random event stream,
+ * without E_DONE.  First each event on every copy through fsm_run
+ * (variant -scalar), then fsmbulk_run with 1 and max_producers pool
+ * threads; param is the pool size, ns_per_op is per copy and event.
+ * Exits 1 if a bulk copy ends in another state than its fsm_run twin.
+ *
+ * The copies share one set of timers, stopped by tick 0.
+ */
+static void bulk_check(const char *name, fsm_trans_t *trans_p, uint32_t ncopies)
+{
+	fsm_t *fsm_p = fsm_compile(trans_p);
+	fsm_events_t evts[BENCH_BULK_EVTS];
+	fsm_inst_t *inst_p;
+	fsmbulk_t *bulk_p;
+	uint16_t *seed_p, *st_p;
+	uint32_t threads[2] = {1, max_producers};
+	uint32_t x = 2463534242U, c, t;
+	uint64_t ops = (uint64_t)ncopies * BENCH_BULK_EVTS, t0;
+	char variant[32];
+	int e;
+
+	inst_p = malloc(ncopies * sizeof(fsm_inst_t));
+	seed_p = malloc(ncopies * sizeof(uint16_t));
+	if (NULL == inst_p || NULL == seed_p)
+		die("bulk_check");
+
+	/* xorshift32 */
+	for (c=0; c<ncopies; c++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		seed_p[c] = x % fsm_p->nstates;
+	}
+	for (e=0; e<BENCH_BULK_EVTS; e++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		evts[e] = x % E_LAST;
+		if (E_DONE == evts[e])
+			evts[e] = E_LIGHT;
+	}
+
+	for (c=0; c<ncopies; c++) {
+		fsm_inst_init(&inst_p[c], fsm_p, &bench_host, NULL, fsm_timer_base);
+		inst_p[c].currst = seed_p[c];
+	}
+	create_timer_notify(fsm_timer_id(inst_p, TID_LIGHT), E_LIGHT, fsm_timer_notify, inst_p);
+	create_timer_notify(fsm_timer_id(inst_p, TID_BLINK), E_BLINK, fsm_timer_notify, inst_p);
+
+	t0 = stats_now();
+	for (e=0; e<BENCH_BULK_EVTS; e++)
+		for (c=0; c<ncopies; c++)
+			fsm_run(&inst_p[c], evts[e]);
+	snprintf(variant, sizeof(variant), "%s-scalar", name);
+	result("bulk", variant, 1, ops, stats_now() - t0, NULL, 0);
+
+	for (t=0; t<sizeof(threads)/sizeof(threads[0]); t++) {
+		bulk_p = fsmbulk_create(fsm_p, ncopies, threads[t], &bench_host, NULL, fsm_timer_base);
+		st_p = fsmbulk_states(bulk_p);
+		memcpy(st_p, seed_p, ncopies * sizeof(uint16_t));
+
+		t0 = stats_now();
+		fsmbulk_run(bulk_p, evts, BENCH_BULK_EVTS);
+		result("bulk", name, threads[t], ops, stats_now() - t0, NULL, 0);
+
+		for (c=0; c<ncopies; c++) {
+			if (st_p[c] != inst_p[c].currst) {
+				fprintf(stderr, "bulk %s: copy %u from %s: fsm_run %s, bulk %s\n",
+					name, c, fsm_p->state_pp[seed_p[c]]->name,
+					fsm_p->state_pp[inst_p[c].currst]->name,
+					fsm_p->state_pp[st_p[c]]->name);
+				exit(1);
+			}
+		}
+		fsmbulk_destroy(bulk_p);
+	}
+
+	fsm_timer_base += TID_LAST;
+	free(seed_p);
+	free(inst_p);
+	fsm_destroy(fsm_p);
+}
+
+/**
+ * bench_bulk - fsmbulk_run against fsm_run on FSM1, FSM2 and a synthetic
+ * table without actions, niter copy events each
+ */
+static void bench_bulk(void)
+{
+	uint32_t ncopies = niter / BENCH_BULK_EVTS;
+	synth_t syn;
+
+	/* tick 0 keeps the timers stopped */
+	tick = 0;
+	bulk_check("FSM1", FSM1, ncopies);
+	bulk_check("FSM2", FSM2, ncopies);
+	tick = 1000;
+
+	synth_create(&syn, 64);
+	bulk_check("synth", syn.trans_p, ncopies);
+	synth_destroy(&syn);
+}
+
+/********************** evtq ping-pong **********************/
+
+/**
+ * pingpong_t - the two queues of a ping-pong
+ * @ping_p: main to echo thread
+ * @pong_p: echo thread to main
+ */
+typedef struct pingpong {
+	evtq_t *ping_p;
+	evtq_t *pong_p;
+} pingpong_t;
+
+/**
+ * pingpong_fn - echo every event back until E_DONE
+ * @arg: pingpong_t
+ */
+static void *pingpong_fn(void *arg)
+{
+	pingpong_t *pp_p = (pingpong_t *)arg;
+	fsm_events_t evt_id;
+
+	do {
+		evtq_dequeue(pp_p->ping_p, &evt_id);
+		evtq_enqueue(pp_p->pong_p, evt_id);
+	} while (evt_id != E_DONE);
+	return(NULL);
+}
+
+/**
+ * bench_pingpong - round trip latency between two threads
+ *
+ * With default wakeups a round trip includes two consumer wakes when the
+ * threads park, EVTQ_WAKE_ADAPTIVE spins them away when the other thread
+ * answers within the spin budget.
+ */
+static void bench_pingpong(void)
+{
+	static const evtq_wake_t wakes[] = {EVTQ_WAKE_IMMEDIATE, EVTQ_WAKE_ADAPTIVE,
+					    EVTQ_WAKE_COALESCE};
+	static stats_hist_t rtt;
+	evtq_attr_t attr = {0};
+	pingpong_t pp;
+	pthread_t echo;
+	fsm_events_t evt_id;
+	uint64_t n = niter / 10, t0, t1, start, i;
+	int type;
+	uint32_t w;
+	char variant[32];
+
+	for (w=0; w<sizeof(wakes)/sizeof(wakes[0]); w++) {
+		for (type=0; type<EVTQ_TYPE_LAST; type++) {
+			attr.type = type;
+			attr.wake = wakes[w];
+			pp.ping_p = evtq_create(&attr);
+			pp.pong_p = evtq_create(&attr);
+			memset(&rtt, 0, sizeof(rtt));
+			if (0 != pthread_create(&echo, NULL, pingpong_fn, &pp))
+				die("pingpong create");
+
+			start = stats_now();
+			for (i=0; i<n; i++) {
+				t0 = stats_now();
+				evtq_enqueue(pp.ping_p, E_LIGHT);
+				evtq_dequeue(pp.pong_p, &evt_id);
+				t1 = stats_now();
+				stats_hist_add(&rtt, t1 - t0);
+			}
+			snprintf(variant, sizeof(variant), "%s%s%s", evtq_type_name(type),
+				 w ? "-" : "", w ? evtq_wake_name(wakes[w]) : "");
+			result("pingpong", variant, 1, n, stats_now() - start, &rtt, 0);
+
+			evtq_enqueue(pp.ping_p, E_DONE);
+			evtq_dequeue(pp.pong_p, &evt_id);
+			pthread_join(echo, NULL);
+			evtq_destroy(pp.ping_p);
+			evtq_destroy(pp.pong_p);
+		}
+	}
+}
+
+/********************** fsmsched mailboxes **********************/
+
+/* transitions into S:A and S:B, counting the initial entries */
+static atomic_ulong mbox_trans;
+
+/**
+ * mbox_enter - count the transition and broadcast to the group
+ * @arg: the fsm_inst_t
+ */
+static void mbox_enter(void *arg)
+{
+	atomic_fetch_add(&mbox_trans, 1);
+	fsm_broadcast((fsm_inst_t *)arg, E_BUTTON);
+}
+
+static bool mbox_no(void *arg)
+{
+	return(false);
+}
+
+static void mbox_end(void *arg)
+{
+	fsm_done((fsm_inst_t *)arg);
+}
+
+static fsm_state_t s_mbox_a = {"S:A", mbox_enter, NULL, NULL};
+static fsm_state_t s_mbox_b = {"S:B", mbox_enter, NULL, NULL};
+static fsm_state_t s_mbox_end = {"S:END", mbox_end, NULL, NULL};
+
+/*
+ * E_LIGHT bounces between S:A and S:B, E_BUTTON from the other instance
+ * is refused by its guard, E_DONE ends.
+ */
+static fsm_trans_t MBOX[] = {
+	{&s_mbox_a, E_LIGHT, NULL, &s_mbox_b},
+	{&s_mbox_b, E_LIGHT, NULL, &s_mbox_a},
+	{&s_mbox_a, E_BUTTON, mbox_no, &s_mbox_a},
+	{&s_mbox_b, E_BUTTON, mbox_no, &s_mbox_b},
+	{&s_mbox_a, E_DONE, NULL, &s_mbox_end},
+	{&s_mbox_b, E_DONE, NULL, &s_mbox_end},
+	{NULL, E_BAD, NULL, NULL},
+};
+
+/**
+ * bench_mbox - a group whose actions post to each other's mailboxes
+ *
+ * Every E_LIGHT main posts makes the pool thread running the instance post
+ * E_BUTTON to both of the group, so a pool thread posts to mailboxes only
+ * the pool drains.  param is the pool size, ns_per_op is per E_LIGHT.
+ * Exits 1 if no transition runs for a second or the count is wrong.
+ */
+static void bench_mbox(void)
+{
+	uint32_t threads[2] = {1, max_producers};
+	fsm_t *fsm_p = fsm_compile(MBOX);
+	fsmsched_t *sched_p;
+	fsmsched_group_t *group_p;
+	fsmsched_inst_t *a_p, *b_p;
+	uint64_t n = niter / 10, want, seen, last, t0, i;
+	uint32_t t, idle;
+
+	for (t=0; t<2; t++) {
+		atomic_store(&mbox_trans, 0);
+		sched_p = fsmsched_create(threads[t]);
+		group_p = fsmsched_group_create(sched_p);
+		a_p = fsmsched_inst_create(sched_p, group_p, fsm_p, 0);
+		b_p = fsmsched_inst_create(sched_p, group_p, fsm_p, 0);
+		want = 2 * n + 2;
+
+		t0 = stats_now();
+		for (i=0; i<n; i++) {
+			fsmsched_post(a_p, E_LIGHT);
+			fsmsched_post(b_p, E_LIGHT);
+		}
+		for (last=0, idle=0; (seen = atomic_load(&mbox_trans)) < want; ) {
+			idle = seen == last ? idle + 1 : 0;
+			if (idle == 1000) {
+				fprintf(stderr, "mbox: %u threads stalled after %lu of %lu transitions\n",
+					threads[t], seen, want);
+				exit(1);
+			}
+			last = seen;
+			usleep(1000);
+		}
+		result("mbox", "group", threads[t], 2 * n, stats_now() - t0, NULL, 0);
+
+		fsmsched_post(a_p, E_DONE);
+		fsmsched_post(b_p, E_DONE);
+		fsmsched_join(sched_p);
+		if (atomic_load(&mbox_trans) != want) {
+			fprintf(stderr, "mbox: %lu transitions, not %lu\n",
+				atomic_load(&mbox_trans), want);
+			exit(1);
+		}
+		fsmsched_destroy(sched_p);
+	}
+	fsm_destroy(fsm_p);
+}
+
+/********************** evtq fan-in **********************/
+
+/**
+ * fanin_t - shared state of a fan-in run
+ * @q_p: the queue
+ * @barrier: producers and main start together
+ * @per: events each producer enqueues
+ * @total: events the consumer waits for
+ * @qlat: consumer latency histogram, copied when it is done
+ */
+typedef struct fanin {
+	evtq_t *q_p;
+	pthread_barrier_t barrier;
+	uint64_t per;
+	uint64_t total;
+	stats_hist_t qlat;
+} fanin_t;
+
+static void *fanin_producer_fn(void *arg)
+{
+	fanin_t *fi_p = (fanin_t *)arg;
+	uint64_t i;
+
+	pthread_barrier_wait(&fi_p->barrier);
+	for (i=0; i<fi_p->per; i++)
+		evtq_enqueue(fi_p->q_p, E_LIGHT);
+	return(NULL);
+}
+
+/**
+ * fanin_consumer_fn - dequeue every event, stats_latency records the delay
+ * @arg: fanin_t
+ */
+static void *fanin_consumer_fn(void *arg)
+{
+	fanin_t *fi_p = (fanin_t *)arg;
+	fsm_events_t evts[BENCH_BATCH];
+	uint64_t n = 0;
+
+	while (n < fi_p->total)
+		n += evtq_dequeue_batch(fi_p->q_p, evts, BENCH_BATCH);
+	memcpy(&fi_p->qlat, &stats_get()->qlat, sizeof(fi_p->qlat));
+	return(NULL);
+}
+
+/**
+ * bench_fanin - 1..max_producers threads enqueue into one list or mpsc queue
+ */
+static void bench_fanin(void)
+{
+	static fanin_t fi;
+	static const evtq_type_t types[] = {EVTQ_LIST, EVTQ_MPSC};
+	evtq_attr_t attr = {0};
+	pthread_t prod[max_producers], cons;
+	uint64_t t0;
+	uint32_t np, t, i;
+
+	stats_latency = true;
+	for (t=0; t<sizeof(types)/sizeof(types[0]); t++) {
+		for (np=1; np<=max_producers; np*=2) {
+			attr.type = types[t];
+			fi.q_p = evtq_create(&attr);
+			fi.per = niter / 10 / np;
+			fi.total = fi.per * np;
+			pthread_barrier_init(&fi.barrier, NULL, np+1);
+
+			/* a new consumer thread, so new stats */
+			if (0 != pthread_create(&cons, NULL, fanin_consumer_fn, &fi))
+				die("fanin create");
+			for (i=0; i<np; i++)
+				if (0 != pthread_create(&prod[i], NULL, fanin_producer_fn, &fi))
+					die("fanin create");
+
+			pthread_barrier_wait(&fi.barrier);
+			t0 = stats_now();
+			for (i=0; i<np; i++)
+				pthread_join(prod[i], NULL);
+			pthread_join(cons, NULL);
+			result("fanin", evtq_type_name(types[t]), np, fi.total,
+			       stats_now() - t0, &fi.qlat, 0);
+
+			pthread_barrier_destroy(&fi.barrier);
+			evtq_destroy(fi.q_p);
+		}
+	}
+	stats_latency = false;
+}
+
+/********************** broadcast **********************/
+
+/**
+ * drain_fn - worker taking events until E_DONE
+ * @arg: worker_t, ctx_p is the broadcast channel subscription or NULL
+ */
+static void *drain_fn(void *arg)
+{
+	worker_t *w_p = (worker_t *)arg;
+	evtbus_sub_t *sub_p = (evtbus_sub_t *)w_p->ctx_p;
+	fsm_events_t evts[BENCH_BATCH];
+	size_t n, i;
+
+	while (1) {
+		n = sub_p ? evtbus_dequeue_batch(sub_p, evts, BENCH_BATCH) :
+			evtq_dequeue_batch(w_p->evtq_p, evts, BENCH_BATCH);
+		for (i=0; i<n; i++)
+			if (evts[i] == E_DONE)
+				return(NULL);
+	}
+}
+
+/**
+ * bench_broadcast - workers_evt_broadcast cost for 1..max_producers workers
+ *
+ * First with an event queue per worker, then with every worker on one
+ * broadcast channel.
+ */
+static void bench_broadcast(void)
+{
+	worker_t *w_p;
+	evtbus_sub_t *sub_p;
+	uint64_t n = niter / 10, t0, t1, i;
+	uint32_t nw;
+	int bus;
+	char name[32];
+
+	for (bus=0; bus<2; bus++) {
+		for (nw=1; nw<=max_producers; nw*=2) {
+			workers.bus_p = bus ? evtbus_create(0) : NULL;
+			worker_list_create();
+			for (i=0; i<nw; i++) {
+				snprintf(name, sizeof(name), "drain%lu", i);
+				sub_p = bus ? evtbus_subscribe(workers.bus_p, EVTBUS_ALL) : NULL;
+				w_p = worker_ctx_create(drain_fn, name, sub_p);
+				/* only this thread reads sub_p, the worker uses ctx_p */
+				w_p->sub_p = sub_p;
+				worker_list_add(w_p);
+			}
+
+			t0 = stats_now();
+			for (i=0; i<n; i++)
+				workers_evt_broadcast(E_LIGHT);
+			t1 = stats_now();
+			workers_evt_broadcast(E_DONE);
+			join_workers();
+			result("broadcast", bus ? "bus" : evtq_type_name(workers.qattr.type),
+			       nw, n, t1 - t0, NULL, stats_now() - t0);
+
+			while ((w_p = worker_first())) {
+				worker_list_del(w_p);
+				evtq_destroy(w_p->evtq_p);
+				arena_free(w_p);
+			}
+			evtbus_destroy(workers.bus_p);
+			workers.bus_p = NULL;
+		}
+	}
+}
+
+/********************** event payloads **********************/
+
+/* payload bench variants */
+enum bench_pl {
+	BENCH_PL_NONE,
+	BENCH_PL_INLINE,
+	BENCH_PL_POOL,
+	BENCH_PL_MALLOC,
+	BENCH_PL_LAST,
+};
+
+static const char * const bench_pl_names[] = {
+	[BENCH_PL_NONE] = "none",
+	[BENCH_PL_INLINE] = "inline",
+	[BENCH_PL_POOL] = "pool",
+	[BENCH_PL_MALLOC] = "malloc",
+};
+
+/**
+ * payload_t - shared state of a payload run
+ * @q_p: producer to consumer queue
+ * @variant: enum bench_pl
+ * @sum: bytes the consumer read, so the reads are not optimized out
+ */
+typedef struct payload {
+	evtq_t *q_p;
+	int variant;
+	uint64_t sum;
+} payload_t;
+
+/**
+ * payload_consumer_fn - read and release every payload until E_DONE
+ * @arg: payload_t
+ *
+ * A pooled buffer goes back to the producer pool on its remote list.
+ */
+static void *payload_consumer_fn(void *arg)
+{
+	payload_t *pl_p = (payload_t *)arg;
+	fsm_events_t evts[BENCH_BATCH];
+	evt_payload_t pls[BENCH_BATCH];
+	const uint8_t *data_p;
+	void *mem_p;
+	size_t n, i, len;
+	uint64_t sum = 0;
+	bool done = false;
+
+	while (!done) {
+		n = evtq_dequeue_batch_pl(pl_p->q_p, evts, pls, BENCH_BATCH);
+		for (i=0; i<n; i++) {
+			if (evts[i] == E_DONE)
+				done = true;
+			data_p = evt_payload_data(&pls[i], &len);
+			if (pl_p->variant == BENCH_PL_MALLOC && data_p) {
+				memcpy(&mem_p, data_p, sizeof(mem_p));
+				sum += ((uint8_t *)mem_p)[0];
+				free(mem_p);
+			} else if (data_p) {
+				sum += data_p[len-1];
+			}
+			evt_payload_release(&pls[i]);
+		}
+	}
+	pl_p->sum = sum;
+	return(NULL);
+}
+
+/**
+ * payload_make - build the payload of one bench event
+ * @variant: enum bench_pl
+ * @pl_p: filled
+ * @len: payload bytes
+ */
+static void payload_make(int variant, evt_payload_t *pl_p, uint32_t len)
+{
+	static const uint8_t src[EVTBUF_SIZE] = {1};
+	evtbuf_t *buf_p;
+	void *mem_p;
+
+	switch (variant) {
+	case BENCH_PL_INLINE:
+		evt_payload_inline(pl_p, src, len);
+		break;
+	case BENCH_PL_POOL:
+		buf_p = evtbuf_get();
+		memcpy(buf_p->data, src, len);
+		buf_p->len = len;
+		evt_payload_buf(pl_p, buf_p);
+		break;
+	case BENCH_PL_MALLOC:
+		if (NULL == (mem_p = malloc(len)))
+			die("payload_make");
+		memcpy(mem_p, src, len);
+		evt_payload_inline(pl_p, &mem_p, sizeof(mem_p));
+		break;
+	default:
+		evt_payload_none(pl_p);
+		break;
+	}
+}
+
+/**
+ * bench_payload - event payload cost, producer to consumer
+ *
+ * Inline payloads only up to EVT_INLINE_MAX, the pool and malloc up to a
+ * full buffer.
+ */
+static void bench_payload(void)
+{
+	static const uint32_t sizes[] = {16, EVT_INLINE_MAX, 256, EVTBUF_SIZE};
+	evtq_attr_t attr = {.type = EVTQ_SPSC};
+	payload_t pl;
+	evt_payload_t ev;
+	pthread_t cons;
+	uint64_t n = niter / 10, t0, i;
+	uint32_t s;
+
+	for (pl.variant=0; pl.variant<BENCH_PL_LAST; pl.variant++) {
+		for (s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++) {
+			if (pl.variant == BENCH_PL_INLINE && sizes[s] > EVT_INLINE_MAX)
+				continue;
+			if (pl.variant == BENCH_PL_NONE && s)
+				continue;
+
+			pl.q_p = evtq_create(&attr);
+			if (0 != pthread_create(&cons, NULL, payload_consumer_fn, &pl))
+				die("payload create");
+
+			t0 = stats_now();
+			for (i=0; i<n; i++) {
+				payload_make(pl.variant, &ev, sizes[s]);
+				evtq_enqueue_pl(pl.q_p, E_LIGHT, &ev);
+			}
+			evtq_enqueue(pl.q_p, E_DONE);
+			pthread_join(cons, NULL);
+			result("payload", bench_pl_names[pl.variant],
+			       pl.variant == BENCH_PL_NONE ? 0 : sizes[s], n,
+			       stats_now() - t0, NULL, 0);
+			evtq_destroy(pl.q_p);
+		}
+	}
+}
+
+/********************** timer jitter **********************/
+
+/**
+ * bench_timer_t - one bench timer
+ * @last: nsecs of the last expiry, 0 before the first
+ * @h_p: jitter histogram
+ */
+typedef struct bench_timer {
+	uint64_t last;
+	stats_hist_t *h_p;
+} bench_timer_t;
+
+/**
+ * bench_timer_notify - expiry callback, on the timer service thread
+ * @ctx: bench_timer_t
+ * @evt_id: not used
+ *
+ * Jitter is the distance of the expiry interval from the period.
+ */
+static void bench_timer_notify(void *ctx, fsm_events_t evt_id)
+{
+	bench_timer_t *bt_p = (bench_timer_t *)ctx;
+	uint64_t now = stats_now(), d;
+	const uint64_t period = BENCH_TIMER_MS * 1000000ULL;
+
+	if (bt_p->last) {
+		d = now - bt_p->last;
+		stats_hist_add(bt_p->h_p, d > period ? d - period : period - d);
+	}
+	bt_p->last = now;
+}
+
+/**
+ * bench_timer - expiry jitter with 1..BENCH_TIMER_MAX armed timers
+ *
+ * All timers have the same period, so they expire in the same wheel slot
+ * and the jitter grows with the batch the timer service delivers.
+ */
+static void bench_timer(void)
+{
+	static const uint32_t counts[] = {1, 100, 1000, BENCH_TIMER_MAX};
+	const uint32_t nruns = sizeof(counts)/sizeof(counts[0]);
+	stats_hist_t *jitter_p[nruns];
+	bench_timer_t *bt_p[nruns];
+	reactor_t *reactor_p = reactor_create();
+	pthread_t timer_service;
+	uint32_t c, i, id = BENCH_TIMER_BASE;
+
+	if (0 != pthread_create(&timer_service, NULL, timer_service_fn, reactor_p))
+		die("timer_service create");
+
+	/*
+	 * timers cannot be deleted, so every run gets new timer ids and its
+	 * own context, a late expiry of the previous run touches nothing
+	 * this run reads
+	 */
+	for (c=0; c<nruns; c++) {
+		jitter_p[c] = calloc(1, sizeof(stats_hist_t));
+		bt_p[c] = calloc(counts[c], sizeof(bench_timer_t));
+		if (NULL == jitter_p[c] || NULL == bt_p[c])
+			die("bench_timer");
+
+		for (i=0; i<counts[c]; i++) {
+			bt_p[c][i].h_p = jitter_p[c];
+			create_timer_notify(id + i, E_TIMER, bench_timer_notify, &bt_p[c][i]);
+		}
+		for (i=0; i<counts[c]; i++)
+			set_timer(id + i, BENCH_TIMER_MS);
+
+		nap(timer_msec);
+		for (i=0; i<counts[c]; i++)
+			stop_timer(id + i);
+		/* let an expiry already in the batch finish */
+		nap(2 * BENCH_TIMER_MS);
+		id += counts[c];
+
+		result("timer", "wheel", counts[c], atomic_load(&jitter_p[c]->count), 0,
+		       jitter_p[c], 0);
+	}
+
+	reactor_stop(reactor_p);
+	pthread_join(timer_service, NULL);
+	reactor_destroy(reactor_p);
+	for (c=0; c<nruns; c++) {
+		free(bt_p[c]);
+		free(jitter_p[c]);
+	}
+}
+
+/********************** ingestion **********************/
+
+/* sink workers of the ingest bench */
+#define BENCH_INGEST_WORKERS 4
+/* frames to one worker before the next */
+#define BENCH_INGEST_RUN 8
+
+/**
+ * sink_t - what one sink worker received
+ * @events: events before E_DONE
+ * @sum: sum of the sequence numbers in the payloads
+ */
+typedef struct sink {
+	uint64_t events;
+	uint64_t sum;
+} sink_t;
+
+/**
+ * sink_fn - worker counting the ingested events until E_DONE
+ * @arg: worker_t, ctx_p is the sink_t
+ */
+static void *sink_fn(void *arg)
+{
+	worker_t *w_p = (worker_t *)arg;
+	sink_t *sink_p = (sink_t *)w_p->ctx_p;
+	fsm_events_t evts[BENCH_BATCH];
+	evt_payload_t pls[BENCH_BATCH];
+	const void *data_p;
+	uint64_t seq;
+	size_t n, i, len;
+	bool done = false;
+
+	while (!done) {
+		n = evtq_dequeue_batch_pl(w_p->evtq_p, evts, pls, BENCH_BATCH);
+		for (i=0; i<n; i++) {
+			if (evts[i] == E_DONE) {
+				done = true;
+			} else if ((data_p = evt_payload_data(&pls[i], &len))) {
+				memcpy(&seq, data_p, sizeof(seq));
+				sink_p->sum += seq;
+				sink_p->events++;
+			}
+			evt_payload_release(&pls[i]);
+		}
+	}
+	return(NULL);
+}
+
+static void *reactor_fn(void *arg)
+{
+	reactor_run((reactor_t *)arg);
+	return(NULL);
+}
+
+/**
+ * stream_build - build the bench stream
+ * @n: events
+ * @len_p: set to the stream length
+ *
+ * Runs of BENCH_INGEST_RUN events to each worker in turn, each with its
+ * sequence number as an inline payload, then an E_DONE broadcast.
+ *
+ * Return: the stream, malloc'd
+ */
+static uint8_t *stream_build(uint64_t n, size_t *len_p)
+{
+	size_t size = sizeof(ingest_hdr_t) + (n + 1) * (sizeof(ingest_frame_t) + 8);
+	uint8_t *buf_p = malloc(size);
+	size_t len;
+	uint64_t i;
+
+	if (NULL == buf_p)
+		die("stream_build");
+	len = ingest_hdr_put(buf_p);
+	for (i=0; i<n; i++)
+		len += ingest_put(buf_p + len, (i / BENCH_INGEST_RUN) % BENCH_INGEST_WORKERS,
+				  E_LIGHT, &i, sizeof(i));
+	len += ingest_put(buf_p + len, INGEST_ALL, E_DONE, NULL, 0);
+	*len_p = len;
+	return(buf_p);
+}
+
+/**
+ * stream_send_unix - write the stream to a unix socket and close it
+ * @path: the socket
+ * @buf_p: the stream
+ * @len: stream length
+ */
+static void stream_send_unix(const char *path, const uint8_t *buf_p, size_t len)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	ssize_t ret;
+	size_t off = 0;
+	int fd;
+
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path)-1);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    connect(fd, (struct sockaddr *)&sun, sizeof(sun)))
+		die("ingest connect");
+	while (off < len) {
+		if ((ret = write(fd, buf_p + off, len - off)) < 0)
+			die("ingest write");
+		off += ret;
+	}
+	close(fd);
+}
+
+/**
+ * bench_ingest - events from a stream file and a unix socket to workers
+ *
+ * BENCH_INGEST_WORKERS workers take runs of the stream through their
+ * queues, queued one at a time (param 1) or in batches of up to
+ * INGEST_BATCH.  ns_per_op is from the start of the read until every
+ * worker saw E_DONE.  Exits 1 if a worker did not get every event.
+ */
+static void bench_ingest(void)
+{
+	static const uint32_t batches[] = {1, INGEST_BATCH};
+	sink_t sinks[BENCH_INGEST_WORKERS];
+	worker_t *w_p;
+	ingest_t *ig_p;
+	reactor_t *reactor_p = NULL;
+	pthread_t reactor_thread;
+	uint64_t n = niter / 10, total, sum, t0, t1;
+	uint8_t *buf_p;
+	size_t len;
+	char name[32], path[64], spec[72];
+	uint32_t b, i;
+	int unix_sock, fd;
+
+	buf_p = stream_build(n, &len);
+	snprintf(path, sizeof(path), "/tmp/fsmbench.%d.fsev", getpid());
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 ||
+	    (ssize_t)len != write(fd, buf_p, len) || close(fd))
+		die("ingest stream file");
+
+	for (unix_sock=0; unix_sock<2; unix_sock++) {
+		for (b=0; b<sizeof(batches)/sizeof(batches[0]); b++) {
+			memset(sinks, 0, sizeof(sinks));
+			worker_list_create();
+			for (i=0; i<BENCH_INGEST_WORKERS; i++) {
+				snprintf(name, sizeof(name), "sink%u", i);
+				worker_list_add(worker_ctx_create(sink_fn, name, &sinks[i]));
+			}
+			ig_p = ingest_create();
+			ig_p->batch = batches[b];
+
+			if (unix_sock) {
+				reactor_p = reactor_create();
+				snprintf(spec, sizeof(spec), "unix:/tmp/fsmbench.%d.sock", getpid());
+				if (ingest_listen(ig_p, reactor_p, spec))
+					exit(1);
+				if (0 != pthread_create(&reactor_thread, NULL, reactor_fn,
+							reactor_p))
+					die("ingest reactor create");
+			}
+
+			t0 = stats_now();
+			if (unix_sock)
+				stream_send_unix(spec + 5, buf_p, len);
+			else if (ingest_file(ig_p, path))
+				exit(1);
+			join_workers();
+			t1 = stats_now();
+			if (unix_sock) {
+				reactor_stop(reactor_p);
+				pthread_join(reactor_thread, NULL);
+			}
+			ingest_destroy(ig_p);
+			if (unix_sock)
+				reactor_destroy(reactor_p);
+
+			total = sum = 0;
+			for (i=0; i<BENCH_INGEST_WORKERS; i++) {
+				total += sinks[i].events;
+				sum += sinks[i].sum;
+			}
+			if (total != n || sum != n * (n - 1) / 2) {
+				fprintf(stderr, "ingest %s: %lu of %lu events delivered\n",
+					unix_sock ? "unix" : "file", total, n);
+				exit(1);
+			}
+			result("ingest", unix_sock ? "unix" : "file", batches[b], n, t1 - t0,
+			       NULL, 0);
+
+			while ((w_p = worker_first())) {
+				worker_list_del(w_p);
+				evtq_destroy(w_p->evtq_p);
+				arena_free(w_p);
+			}
+		}
+	}
+
+	unlink(path);
+	free(buf_p);
+}
+
+/********************** workers registry **********************/
+
+/**
+ * tally_fn - worker counting events until E_DONE
+ * @arg: worker_t, ctx_p is the uint64_t count
+ */
+static void *tally_fn(void *arg)
+{
+	worker_t *w_p = (worker_t *)arg;
+	uint64_t *count_p = (uint64_t *)w_p->ctx_p;
+	fsm_events_t evts[BENCH_BATCH];
+	size_t n, i;
+
+	while (1) {
+		n = evtq_dequeue_batch(w_p->evtq_p, evts, BENCH_BATCH);
+		for (i=0; i<n; i++) {
+			if (evts[i] == E_DONE)
+				return(NULL);
+			(*count_p)++;
+		}
+	}
+}
+
+/**
+ * churn_t - the registry churn thread
+ * @stop: set by the bench when the broadcasts are done
+ * @churns: workers added and taken off
+ */
+typedef struct churn {
+	atomic_bool stop;
+	uint64_t churns;
+} churn_t;
+
+/**
+ * churn_fn - add a worker, take it off, stop and free it, then again
+ * @arg: churn_t
+ *
+ * E_DONE goes straight to the queue after worker_list_del, no broadcast
+ * can queue behind it.
+ */
+static void *churn_fn(void *arg)
+{
+	churn_t *ch_p = (churn_t *)arg;
+	worker_t *w_p;
+	uint64_t count;
+
+	while (!atomic_load(&ch_p->stop)) {
+		w_p = worker_ctx_create(tally_fn, "churn", &count);
+		worker_list_add(w_p);
+		relax();
+		worker_list_del(w_p);
+		evtq_enqueue(w_p->evtq_p, E_DONE);
+		pthread_join(w_p->worker_id, NULL);
+		evtq_destroy(w_p->evtq_p);
+		arena_free(w_p);
+		ch_p->churns++;
+	}
+	return(NULL);
+}
+
+/**
+ * bench_registry - workers_evt_broadcast while workers come and go
+ *
+ * 1..max_producers tally workers stay on the registry, a churn thread
+ * adds and takes off another one for the whole run (churn) or is not
+ * started (static).  ns_per_op is the producer cost, the churn count
+ * goes in the max_ns column.  Exits 1 if a tally worker did not count
+ * every broadcast.
+ */
+static void bench_registry(void)
+{
+	uint64_t counts[max_producers];
+	churn_t churn;
+	pthread_t churn_thread;
+	worker_t *w_p;
+	uint64_t n = niter / 10, t0, t1, i;
+	uint32_t nw;
+	int churning;
+	char name[32];
+
+	for (churning=0; churning<2; churning++) {
+		for (nw=1; nw<=max_producers; nw*=2) {
+			memset(counts, 0, sizeof(counts));
+			worker_list_create();
+			for (i=0; i<nw; i++) {
+				snprintf(name, sizeof(name), "tally%lu", i);
+				worker_list_add(worker_ctx_create(tally_fn, name, &counts[i]));
+			}
+			atomic_init(&churn.stop, false);
+			churn.churns = 0;
+			if (churning && 0 != pthread_create(&churn_thread, NULL, churn_fn, &churn))
+				die("registry churn create");
+
+			t0 = stats_now();
+			for (i=0; i<n; i++)
+				workers_evt_broadcast(E_LIGHT);
+			t1 = stats_now();
+			if (churning) {
+				atomic_store(&churn.stop, true);
+				pthread_join(churn_thread, NULL);
+			}
+			workers_evt_broadcast(E_DONE);
+			join_workers();
+
+			for (i=0; i<nw; i++) {
+				if (counts[i] != n) {
+					fprintf(stderr, "registry %s: tally%lu got %lu of %lu events\n",
+						churning ? "churn" : "static", i, counts[i], n);
+					exit(1);
+				}
+			}
+			result("registry", churning ? "churn" : "static", nw, n, t1 - t0, NULL,
+			       churn.churns);
+
+			while ((w_p = worker_first())) {
+				worker_list_del(w_p);
+				evtq_destroy(w_p->evtq_p);
+				arena_free(w_p);
+			}
+		}
+	}
+}
+
+/**
+ * main - run the selected benches, CSV on stdout
+ * @argc: argument count
+ * @argv: options
+ */
+int main(int argc, char *argv[])
+{
+	cmdline_args(argc, argv);
+
+	printf("bench,variant,param,ops,ns_per_op,p50_ns,p99_ns,p999_ns,max_ns\n");
+	if (bench_want("fsm"))
+		bench_fsm();
+	if (bench_want("gen"))
+		bench_gen();
+	if (bench_want("rtc"))
+		bench_rtc();
+	if (bench_want("bulk"))
+		bench_bulk();
+	if (bench_want("pingpong"))
+		bench_pingpong();
+	if (bench_want("mbox"))
+		bench_mbox();
+	if (bench_want("fanin"))
+		bench_fanin();
+	if (bench_want("broadcast"))
+		bench_broadcast();
+	if (bench_want("payload"))
+		bench_payload();
+	if (bench_want("timer"))
+		bench_timer();
+	if (bench_want("ingest"))
+		bench_ingest();
+	if (bench_want("registry"))
+		bench_registry();
+
+	evtbuf_destroy();
+	stats_destroy();
+	return(0);
+}
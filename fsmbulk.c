@@ -0,0 +1,473 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * Bulk FSM engine, see fsmbulk.h
+ *
+ * fsmbulk_run hands the shards out one at a time from a shared counter,
+ * so a pool thread that got shards with cheap events takes more of them.
+ * The run waits for every pool thread to finish, a copy is only touched
+ * by the thread running its shard.
+ */
+
+#include "utils.h"
+#include "workers.h"
+#include "fsmbulk.h"
+#include "fsmgen.h"
+#include "arena.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>   /* AVX2 gather */
+#endif
+
+/*
+ * bulk_gather_fn - run one event over copies [i, n) of a shard
+ * @cell_p: the dispatch cells of the event, one per state
+ * @st_p: states of the shard copies
+ * @i: first copy
+ * @n: end of the copies
+ * @act_p: filled with the copies to run the route of
+ * @nmatch_p: set to the number of copies with a transition
+ *
+ * Return: number of @act_p entries
+ */
+typedef uint32_t (*bulk_gather_fn)(const uint32_t *cell_p, uint16_t *st_p, uint32_t i,
+				   uint32_t n, fsmbulk_act_t *act_p, uint32_t *nmatch_p);
+
+/* the gather for this cpu, set by fsmbulk_create */
+static bulk_gather_fn bulk_gather;
+
+/**
+ * bulk_queue - queue the route of a copy
+ * @act_p: the queue entry
+ * @idx: copy index in the shard
+ * @cell: its dispatch cell
+ * @from: its state before the event
+ */
+static inline void bulk_queue(fsmbulk_act_t *act_p, uint32_t idx, uint32_t cell, uint16_t from)
+{
+	act_p->idx = idx;
+	act_p->route = ((cell & FSMBULK_CELL_ROUTE) >> FSMBULK_CELL_ROUTE_SHIFT) - 1;
+	act_p->from = from;
+}
+
+/**
+ * bulk_gather_c - the gather one copy at a time, see bulk_gather_fn
+ */
+static uint32_t bulk_gather_c(const uint32_t *cell_p, uint16_t *st_p, uint32_t i,
+			      uint32_t n, fsmbulk_act_t *act_p, uint32_t *nmatch_p)
+{
+	uint32_t cell, nact = 0, nmatch = 0;
+
+	for (; i<n; i++) {
+		cell = cell_p[st_p[i]];
+		nmatch += 0 != (cell & FSMBULK_CELL_ROUTE);
+		if (cell & FSMBULK_CELL_QUEUE)
+			bulk_queue(&act_p[nact++], i, cell, st_p[i]);
+		st_p[i] = cell & FSMBULK_CELL_NEXT;
+	}
+	*nmatch_p = nmatch;
+	return(nact);
+}
+
+#if defined(__x86_64__)
+/**
+ * bulk_gather_avx2 - the gather eight copies at a time, see bulk_gather_fn
+ *
+ * Widen eight states to 32 bits, gather their cells, narrow the next
+ * states back and store them.  The sign bit of a cell is
+ * FSMBULK_CELL_QUEUE, so one movemask finds the copies to queue.  The
+ * copies left over go to bulk_gather_c.
+ */
+__attribute__((target("avx2")))
+static uint32_t bulk_gather_avx2(const uint32_t *cell_p, uint16_t *st_p, uint32_t i,
+				 uint32_t n, fsmbulk_act_t *act_p, uint32_t *nmatch_p)
+{
+	const __m256i next = _mm256_set1_epi32(FSMBULK_CELL_NEXT);
+	const __m256i route = _mm256_set1_epi32(FSMBULK_CELL_ROUTE);
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t cells[8], nact = 0, nmatch = 0, tail;
+	uint16_t from[8];
+	__m128i st;
+	__m256i cell, to;
+	int q, j;
+
+	for (; i + 8 <= n; i += 8) {
+		st = _mm_loadu_si128((const __m128i *)&st_p[i]);
+		cell = _mm256_i32gather_epi32((const int *)cell_p, _mm256_cvtepu16_epi32(st), 4);
+
+		nmatch += 8 - __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(
+			_mm256_cmpeq_epi32(_mm256_and_si256(cell, route), zero))));
+
+		q = _mm256_movemask_ps(_mm256_castsi256_ps(cell));
+		if (q) {
+			_mm256_storeu_si256((__m256i *)cells, cell);
+			_mm_storeu_si128((__m128i *)from, st);
+			for (; q; q &= q - 1) {
+				j = __builtin_ctz(q);
+				bulk_queue(&act_p[nact++], i + j, cells[j], from[j]);
+			}
+		}
+
+		/* pack within each 128 bit lane, then bring the halves together */
+		to = _mm256_and_si256(cell, next);
+		to = _mm256_permute4x64_epi64(_mm256_packus_epi32(to, to), 0xd8);
+		_mm_storeu_si128((__m128i *)&st_p[i], _mm256_castsi256_si128(to));
+	}
+
+	nact += bulk_gather_c(cell_p, st_p, i, n, &act_p[nact], &tail);
+	*nmatch_p = nmatch + tail;
+	return(nact);
+}
+#endif
+
+/**
+ * bulk_route_acts - check if a route runs any action
+ * @fsm_p: the compiled FSM
+ * @r_p: the route
+ */
+static bool bulk_route_acts(const fsm_t *fsm_p, const fsm_route_t *r_p)
+{
+	const uint16_t *chain_p = &fsm_p->chain_p[r_p->chain];
+	uint32_t i;
+
+	for (i=0; i<r_p->nexit; i++)
+		if (fsm_p->state_pp[chain_p[i]]->exit_action)
+			return(true);
+	for (; i<r_p->nexit + r_p->nentry; i++)
+		if (fsm_p->state_pp[chain_p[i]]->entry_action)
+			return(true);
+	return(false);
+}
+
+/**
+ * bulk_cells - fold the dispatch table into the gather cells
+ * @bulk_p: the engine, @fsm_p set
+ *
+ * A cell with no transition keeps the state, a guarded one keeps it too
+ * and is queued, any other takes the next state and is queued if the
+ * route has an action.
+ */
+static void bulk_cells(fsmbulk_t *bulk_p)
+{
+	const fsm_t *fsm_p = bulk_p->fsm_p;
+	const fsm_route_t *r_p;
+	uint32_t *cell_p;
+	int16_t idx;
+	uint16_t st;
+	int e;
+
+	if (NULL == (bulk_p->cell_p = malloc(E_LAST * fsm_p->nstates * sizeof(uint32_t))))
+		die("fsmbulk_create cells");
+
+	for (e=0; e<E_LAST; e++) {
+		for (st=0; st<fsm_p->nstates; st++) {
+			cell_p = &bulk_p->cell_p[e * fsm_p->nstates + st];
+			idx = fsm_p->dispatch_p[st * E_LAST + e];
+			if (idx < 0) {
+				*cell_p = st;
+				continue;
+			}
+			r_p = &fsm_p->route_p[idx];
+			*cell_p = ((uint32_t)idx + 1) << FSMBULK_CELL_ROUTE_SHIFT;
+			if (fsm_p->trans_p[r_p->trans].guard)
+				*cell_p |= FSMBULK_CELL_QUEUE | st;
+			else if (bulk_route_acts(fsm_p, r_p))
+				*cell_p |= FSMBULK_CELL_QUEUE | r_p->nextst;
+			else
+				*cell_p |= r_p->nextst;
+		}
+	}
+}
+
+/**
+ * bulk_act - run a queued route on its copy
+ * @thr_p: the pool thread
+ * @st_p: states of the shard copies
+ * @first: copy index of the shard start
+ * @a_p: the queued route
+ *
+ * The same steps as fsm_step_table, on the thread instance set to the
+ * copy.  A refused guard leaves the copy where the gather kept it.
+ * Raised events are run through fsm_run, which runs the rest of them.
+ */
+static void bulk_act(fsmbulk_thread_t *thr_p, uint16_t *st_p, uint32_t first,
+		     const fsmbulk_act_t *a_p)
+{
+	const fsm_t *fsm_p = thr_p->bulk_p->fsm_p;
+	const fsm_route_t *r_p = &fsm_p->route_p[a_p->route];
+	const uint16_t *chain_p = &fsm_p->chain_p[r_p->chain];
+	constraint guard = fsm_p->trans_p[r_p->trans].guard;
+	fsm_inst_t *inst_p = &thr_p->inst;
+	fsm_events_t evt_id;
+	action act;
+	uint32_t i;
+
+	inst_p->currst = a_p->from;
+	inst_p->id = first + a_p->idx;
+
+	if (guard && !guard(inst_p)) {
+		stats_inc(&stats_get()->guard_fails, 1);
+		return;
+	}
+
+	for (i=0; i<r_p->nexit; i++)
+		if ((act = fsm_p->state_pp[chain_p[i]]->exit_action))
+			act(inst_p);
+
+	fsm_step_move(inst_p, r_p->nextst);
+
+	for (; i<r_p->nexit + r_p->nentry; i++)
+		if ((act = fsm_p->state_pp[chain_p[i]]->entry_action))
+			act(inst_p);
+
+	if (inst_p->rtc_n) {
+		evt_id = inst_p->rtc_q[inst_p->rtc_head];
+		inst_p->rtc_head = (inst_p->rtc_head + 1) % FSM_RTC_MAX;
+		inst_p->rtc_n--;
+		stats_inc(&stats_get()->raised, 1);
+		fsm_run(inst_p, evt_id);
+	}
+	st_p[a_p->idx] = inst_p->currst;
+}
+
+/**
+ * bulk_shard - run the event stream over one shard
+ * @thr_p: the pool thread
+ * @s: shard number
+ *
+ * For each event the gather moves the whole shard, then the queued
+ * routes run in copy order.
+ */
+static void bulk_shard(fsmbulk_thread_t *thr_p, uint32_t s)
+{
+	fsmbulk_t *bulk_p = thr_p->bulk_p;
+	uint32_t first = s * FSMBULK_SHARD;
+	uint32_t n = bulk_p->n - first < FSMBULK_SHARD ? bulk_p->n - first : FSMBULK_SHARD;
+	uint16_t *st_p = &bulk_p->state_p[first];
+	stats_t *stats_p = stats_get();
+	uint64_t trans = 0;
+	uint32_t nact, nmatch, i;
+	fsm_events_t evt_id;
+	size_t e;
+
+	for (e=0; e<bulk_p->nevts; e++) {
+		evt_id = bulk_p->evts_p[e];
+		stats_inc(&stats_p->evts[evt_id < E_LAST ? evt_id : E_LAST], n);
+		if (evt_id >= E_LAST) {
+			stats_inc(&stats_p->unmatched, n);
+			continue;
+		}
+
+		nact = bulk_gather(&bulk_p->cell_p[evt_id * bulk_p->fsm_p->nstates],
+				   st_p, 0, n, thr_p->act_p, &nmatch);
+		stats_inc(&stats_p->unmatched, n - nmatch);
+		trans += nmatch;
+
+		for (i=0; i<nact; i++)
+			bulk_act(thr_p, st_p, first, &thr_p->act_p[i]);
+	}
+	__atomic_store_n(&thr_p->trans, thr_p->trans + trans, __ATOMIC_RELAXED);
+	__atomic_store_n(&thr_p->shards, thr_p->shards + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * fsmbulk_thread_fn - pool thread
+ * @arg: the worker_t, ctx_p is the fsmbulk_thread_t
+ *
+ * Wait for a run, take shards until there are none left, tell
+ * fsmbulk_run when done.
+ */
+static void *fsmbulk_thread_fn(void *arg)
+{
+	worker_t *self_p = (worker_t *)arg;
+	fsmbulk_thread_t *thr_p = (fsmbulk_thread_t *)self_p->ctx_p;
+	fsmbulk_t *bulk_p = thr_p->bulk_p;
+	uint32_t gen = 0, s;
+	bool stop;
+
+	if (NULL == (thr_p->act_p = malloc(FSMBULK_SHARD * sizeof(fsmbulk_act_t))))
+		die("fsmbulk_thread_fn");
+
+	for (;;) {
+		pthread_mutex_lock(&bulk_p->mutex);
+		while (gen == bulk_p->gen && !bulk_p->stop)
+			pthread_cond_wait(&bulk_p->cond, &bulk_p->mutex);
+		gen = bulk_p->gen;
+		stop = bulk_p->stop;
+		pthread_mutex_unlock(&bulk_p->mutex);
+		if (stop)
+			break;
+
+		while ((s = atomic_fetch_add(&bulk_p->next, 1)) < bulk_p->nshards)
+			bulk_shard(thr_p, s);
+
+		pthread_mutex_lock(&bulk_p->mutex);
+		if (0 == --bulk_p->busy)
+			pthread_cond_signal(&bulk_p->done_cond);
+		pthread_mutex_unlock(&bulk_p->mutex);
+	}
+	return(NULL);
+}
+
+/**
+ * fsmbulk_create - create n copies of an FSM and a pool to run them
+ * @fsm_p: compiled FSM, e.g. from fsm_compile or fsm_load
+ * @n: number of copies
+ * @nthreads: pool size, 0 for 1
+ * @host_p: host callbacks of the copies, done must return
+ * @host_ctx: private data for @host_p
+ * @timer_base: first timer id of the copies, they all share the timers
+ *
+ * Every copy starts in state 0, see fsmbulk_states.
+ *
+ * Return: the engine
+ */
+fsmbulk_t *fsmbulk_create(const fsm_t *fsm_p, uint32_t n, uint32_t nthreads,
+			  const fsm_host_t *host_p, void *host_ctx, uint32_t timer_base)
+{
+	fsmbulk_t *bulk_p;
+	char name[32];
+	size_t size;
+	uint32_t i;
+
+	if (0 == nthreads)
+		nthreads = 1;
+
+#if defined(__x86_64__)
+	bulk_gather = __builtin_cpu_supports("avx2") ? bulk_gather_avx2 : bulk_gather_c;
+#else
+	bulk_gather = bulk_gather_c;
+#endif
+
+	if (NULL == (bulk_p = calloc(1, sizeof(fsmbulk_t))))
+		die("fsmbulk_create");
+	bulk_p->fsm_p = fsm_p;
+	bulk_p->n = n;
+	bulk_p->nshards = (n + FSMBULK_SHARD - 1) / FSMBULK_SHARD;
+	bulk_p->host_p = host_p;
+	bulk_p->host_ctx = host_ctx;
+	bulk_p->timer_base = timer_base;
+
+	/* aligned_alloc wants whole cache lines */
+	size = ((size_t)n * sizeof(uint16_t) + L1_CACHE_BYTES - 1) & ~(size_t)(L1_CACHE_BYTES - 1);
+	if (NULL == (bulk_p->state_p = aligned_alloc(L1_CACHE_BYTES, size ? size : L1_CACHE_BYTES)))
+		die("fsmbulk_create states");
+	memset(bulk_p->state_p, 0, size);
+	bulk_cells(bulk_p);
+
+	atomic_init(&bulk_p->next, 0);
+	pthread_mutex_init(&bulk_p->mutex, NULL);
+	pthread_cond_init(&bulk_p->cond, NULL);
+	pthread_cond_init(&bulk_p->done_cond, NULL);
+
+	if (NULL == (bulk_p->thr_p = arena_calloc(nthreads * sizeof(fsmbulk_thread_t))))
+		die("fsmbulk_create threads");
+	bulk_p->nthreads = nthreads;
+	for (i=0; i<nthreads; i++) {
+		fsmbulk_thread_t *thr_p = &bulk_p->thr_p[i];
+
+		fsm_inst_init(&thr_p->inst, fsm_p, host_p, host_ctx, timer_base);
+		thr_p->idx = i;
+		thr_p->bulk_p = bulk_p;
+		snprintf(name, sizeof(name), "bulk%u", i);
+		thr_p->w_p = worker_ctx_create(fsmbulk_thread_fn, name, thr_p);
+	}
+	return(bulk_p);
+}
+
+/**
+ * fsmbulk_run - run events, in order, on every copy
+ * @bulk_p: the engine
+ * @evts_p: the events
+ * @n: number of @evts_p
+ *
+ * Returns once every copy has run every event, and the queued actions.
+ * Not to be called from two threads at once.
+ */
+void fsmbulk_run(fsmbulk_t *bulk_p, const fsm_events_t *evts_p, size_t n)
+{
+	if (0 == n || 0 == bulk_p->nshards)
+		return;
+
+	pthread_mutex_lock(&bulk_p->mutex);
+	bulk_p->evts_p = evts_p;
+	bulk_p->nevts = n;
+	atomic_store(&bulk_p->next, 0);
+	bulk_p->busy = bulk_p->nthreads;
+	bulk_p->gen++;
+	pthread_cond_broadcast(&bulk_p->cond);
+	while (bulk_p->busy)
+		pthread_cond_wait(&bulk_p->done_cond, &bulk_p->mutex);
+	bulk_p->evts_p = NULL;
+	pthread_mutex_unlock(&bulk_p->mutex);
+}
+
+/**
+ * fsmbulk_destroy - stop the pool and free the engine
+ * @bulk_p: the engine
+ *
+ * The timers of the copies are left to the timer service.
+ */
+void fsmbulk_destroy(fsmbulk_t *bulk_p)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&bulk_p->mutex);
+	bulk_p->stop = true;
+	pthread_cond_broadcast(&bulk_p->cond);
+	pthread_mutex_unlock(&bulk_p->mutex);
+
+	for (i=0; i<bulk_p->nthreads; i++) {
+		fsmbulk_thread_t *thr_p = &bulk_p->thr_p[i];
+
+		pthread_join(thr_p->w_p->worker_id, NULL);
+		if (dbg_on(DBG_WORKER))
+			printf("%s: joined\n", thr_p->w_p->name);
+		free(thr_p->act_p);
+		evtq_destroy(thr_p->w_p->evtq_p);
+		arena_free(thr_p->w_p);
+	}
+	arena_free(bulk_p->thr_p);
+
+	pthread_mutex_destroy(&bulk_p->mutex);
+	pthread_cond_destroy(&bulk_p->cond);
+	pthread_cond_destroy(&bulk_p->done_cond);
+	free(bulk_p->cell_p);
+	free(bulk_p->state_p);
+	free(bulk_p);
+}
+
+/**
+ * fsmbulk_show - print the pool threads and a state histogram
+ * @bulk_p: the engine, between fsmbulk_run calls
+ */
+void fsmbulk_show(fsmbulk_t *bulk_p)
+{
+	const fsm_t *fsm_p = bulk_p->fsm_p;
+	uint32_t *cnt_p;
+	uint32_t i;
+	uint16_t s;
+
+	printf("bulk threads=%u copies=%u shards=%u gather=%s\n",
+	       bulk_p->nthreads, bulk_p->n, bulk_p->nshards,
+	       bulk_gather == bulk_gather_c ? "scalar" : "avx2");
+	for (i=0; i<bulk_p->nthreads; i++)
+		printf("%-12s shards=%lu trans=%lu cpu=%d node=%d\n",
+		       bulk_p->thr_p[i].w_p->name,
+		       __atomic_load_n(&bulk_p->thr_p[i].shards, __ATOMIC_RELAXED),
+		       __atomic_load_n(&bulk_p->thr_p[i].trans, __ATOMIC_RELAXED),
+		       bulk_p->thr_p[i].w_p->cpu, bulk_p->thr_p[i].w_p->node);
+
+	if (NULL == (cnt_p = calloc(fsm_p->nstates, sizeof(uint32_t))))
+		die("fsmbulk_show");
+	for (i=0; i<bulk_p->n; i++)
+		cnt_p[bulk_p->state_p[i]]++;
+	printf("fsm%u:", fsm_p->id);
+	for (s=0; s<fsm_p->nstates; s++)
+		if (cnt_p[s])
+			printf(" %s=%u", fsm_p->state_pp[s]->name, cnt_p[s]);
+	printf("\n");
+	free(cnt_p);
+}
@@ -0,0 +1,158 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * Bulk FSM engine
+ *
+ * Many independent copies of one compiled FSM driven by the same event
+ * stream, e.g. a what-if run of a million stoplights.  A copy is only its
+ * state index: the states are one uint16_t array (structure of arrays),
+ * cut in shards of FSMBULK_SHARD copies that a small thread pool hands
+ * out to its threads.
+ *
+ * fsmbulk_create folds each event column of the compiled dispatch table
+ * into a [E_LAST][nstates] table of cells, the next state plus a flag for the
+ * routes with a guard or an action.  An event over a shard is then one
+ * gather: every copy loads the cell of its state and stores its next
+ * state, eight copies per AVX2 instruction where the cpu has it.  The
+ * copies whose cell is flagged are queued, and once the whole shard has
+ * moved the queue is run in copy order: the guard, the exit actions, the
+ * move and the entry actions, as fsm_step_table does them.  A guarded
+ * copy keeps its state through the gather, the queue moves it if the
+ * guard passes.  A shard runs the whole event stream before the next
+ * shard, so its states stay in the cache.
+ *
+ * Guards and actions get one fsm_inst_t per pool thread, set to the copy
+ * being run; its id is the copy index and every copy shares the host
+ * and timer_base.  Events they raise (fsm_raise) run to completion
+ * through fsm_run before the next copy.  The per-thread stats count the
+ * events, unmatched events, guard failures and raised events, but not the
+ * transitions per state pair, and nothing is traced.
+ */
+
+#ifndef _FSMBULK_H
+#define _FSMBULK_H
+
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <stdatomic.h>   /* atomic_uint */
+#include <pthread.h>     /* posix threads */
+#include "fsm.h"
+
+/* copies in a shard, a multiple of the gather width */
+#define FSMBULK_SHARD 4096
+
+/*
+ * a dispatch cell: the next state in the low 16 bits, route index + 1 in
+ * bits 16-30 (0 for no transition) and FSMBULK_CELL_QUEUE if the route
+ * has a guard or an action
+ */
+#define FSMBULK_CELL_NEXT 0xffffU
+#define FSMBULK_CELL_ROUTE 0x7fff0000U
+#define FSMBULK_CELL_ROUTE_SHIFT 16
+#define FSMBULK_CELL_QUEUE 0x80000000U
+
+struct fsmbulk;
+
+/**
+ * fsmbulk_act_t - a queued transition
+ * @idx: copy index in the shard
+ * @route: route index in fsm_t.route_p
+ * @from: state of the copy before the event
+ */
+typedef struct fsmbulk_act {
+	uint16_t idx;
+	uint16_t route;
+	uint16_t from;
+} fsmbulk_act_t;
+
+_Static_assert(FSMBULK_SHARD <= UINT16_MAX, "fsmbulk_act_t.idx is a uint16_t");
+
+/**
+ * fsmbulk_thread_t - one pool thread
+ * @inst: the instance the guards and actions of a copy get
+ * @act_p: transitions queued by the gather, FSMBULK_SHARD entries
+ *         allocated by the thread, on its node
+ * @shards: shards run, for fsmbulk_show
+ * @trans: transitions, counting the ones refused by a guard
+ * @idx: index in fsmbulk_t.thr_p
+ * @w_p: the pool worker, not on the workers list
+ * @bulk_p: owning engine
+ *
+ * Cache line aligned, adjacent pool threads do not share lines.
+ */
+typedef struct fsmbulk_thread {
+	fsm_inst_t inst;
+	fsmbulk_act_t *act_p;
+	uint64_t shards;
+	uint64_t trans;
+	uint32_t idx;
+	struct worker *w_p;
+	struct fsmbulk *bulk_p;
+} ____cacheline_aligned fsmbulk_thread_t;
+
+/**
+ * fsmbulk_t - the engine
+ * @fsm_p: compiled FSM every copy runs
+ * @n: number of copies
+ * @state_p: current state of each copy, cache line aligned
+ * @cell_p: [E_LAST][nstates] dispatch cells, see FSMBULK_CELL_QUEUE
+ * @nshards: number of shards
+ * @nthreads: pool size
+ * @thr_p: pool threads
+ * @host_p: host callbacks of every copy
+ * @host_ctx: private data for @host_p
+ * @timer_base: first timer id, shared by every copy
+ * @evts_p: events of the current fsmbulk_run
+ * @nevts: number of @evts_p
+ * @next: next shard to hand out
+ * @gen: bumped to start each fsmbulk_run
+ * @busy: pool threads not done with the current run
+ * @stop: tell the pool threads to exit
+ * @mutex: guards @gen, @busy and @stop
+ * @cond: signalled when @gen or @stop change
+ * @done_cond: signalled when @busy goes to 0
+ */
+typedef struct fsmbulk {
+	const fsm_t *fsm_p;
+	uint32_t n;
+	uint16_t *state_p;
+	uint32_t *cell_p;
+	uint32_t nshards;
+	uint32_t nthreads;
+	fsmbulk_thread_t *thr_p;
+	const fsm_host_t *host_p;
+	void *host_ctx;
+	uint32_t timer_base;
+	const fsm_events_t *evts_p;
+	size_t nevts;
+	atomic_uint next;
+	uint32_t gen;
+	uint32_t busy;
+	bool stop;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t done_cond;
+} fsmbulk_t;
+
+extern fsmbulk_t *fsmbulk_create(const fsm_t *fsm_p, uint32_t n, uint32_t nthreads,
+				 const fsm_host_t *host_p, void *host_ctx, uint32_t timer_base);
+extern void fsmbulk_run(fsmbulk_t *bulk_p, const fsm_events_t *evts_p, size_t n);
+extern void fsmbulk_destroy(fsmbulk_t *bulk_p);
+extern void fsmbulk_show(fsmbulk_t *bulk_p);
+
+/**
+ * fsmbulk_states - the state index of every copy
+ * @bulk_p: the engine
+ *
+ * All copies start in state 0, the initial state, without its entry
+ * action.  The caller may set other states, or read the result, between
+ * fsmbulk_run calls.
+ */
+static inline uint16_t *fsmbulk_states(fsmbulk_t *bulk_p)
+{
+	return(bulk_p->state_p);
+}
+
+#endif /* _FSMBULK_H */
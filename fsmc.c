@@ -0,0 +1,90 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * compile an FSM definition file to an image, see fsmdef.h
+ *
+ * The image holds the compiled dispatch tables of every machine in the
+ * file.  Programs map it read-only with fsm_load, so all of them share
+ * one copy and none parses or compiles the definitions at start.  Action
+ * and guard names are only checked when a program loads the image.
+ *
+ * example:
+ *  ./fsmc fsmdemo.fsm fsmdemo.fsmi
+ *  ./fsmdemo -f fsmdemo.fsmi
+ */
+
+#include <stdlib.h>      /* atoi, malloc, strtol, strtoll, strtoul */
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <unistd.h>      /* common typdefs, e.g. ssize_t, includes getopt.h */
+#include <stdio.h>       /* char I/O */
+#include "workers.h"
+#include "fsmdef.h"
+
+/**
+ * arguments - descriptive string for all commandline arguments
+ */
+char *arguments = "[-v] deffile imagefile\n"				\
+	" -v: list the machines written\n"				\
+	" -h: this help\n";
+
+/* the library needs these from the main program */
+uint32_t tick = 1000;
+char scriptfile[64] = "";
+uint32_t debug_flag;
+workers_t workers = WORKERS_INIT;
+__thread worker_t *worker_self_p;
+__thread workers_reader_t *workers_reader_p;
+
+static bool verbose = false;
+
+/**
+ * cmdline_args - parse command line arguments
+ * @argc: argument count (from main)
+ * @argv: array aligned with argc containing an argument string (from main)
+ *
+ * Return:
+ *  optind - the number of parsed (hyphenated) arguments
+ */
+int cmdline_args(int argc, char *argv[]) {
+	int opt;
+
+	while((opt = getopt(argc, argv, "vh")) != -1) {
+		switch(opt) {
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+		default:
+			fprintf(stderr, "Usage: %s %s\n", argv[0], arguments);
+			exit(0);
+		}
+	}
+	return optind;
+}
+
+int main(int argc, char *argv[])
+{
+	fsm_def_t *defs_p, *def_p;
+	int argi = cmdline_args(argc, argv);
+
+	if (argc - argi != 2) {
+		fprintf(stderr, "Usage: %s %s\n", argv[0], arguments);
+		exit(1);
+	}
+
+	if (NULL == (defs_p = fsm_def_load(argv[argi], NULL)))
+		exit(1);
+	if (fsm_image_write(defs_p, argv[argi+1]))
+		exit(1);
+
+	if (verbose)
+		for (def_p = defs_p; def_p; def_p = def_p->next_p)
+			printf("%s: %u states, %u transitions\n",
+			       def_p->name, def_p->nstates, def_p->ntrans);
+
+	fsm_def_free(defs_p);
+	return(0);
+}
@@ -0,0 +1,921 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * FSM definition files and compiled images, see fsmdef.h
+ *
+ * A bad definition or image is reported on stderr with the file (and
+ * line) and the load returns NULL, it is operator input.
+ */
+
+#include <stdlib.h>      /* calloc, realloc */
+#include <ctype.h>       /* isspace */
+#include <fcntl.h>       /* open */
+#include <sys/mman.h>    /* mmap */
+#include <sys/stat.h>    /* fstat */
+#include "utils.h"
+#include "fsmdef.h"
+
+/* most tokens on a definition line */
+#define DEF_TOKENS 6
+
+/* image section alignment */
+#define IMAGE_ALIGN 8
+
+/**
+ * def_row_t - a parsed transition, states by index
+ */
+typedef struct def_row {
+	uint16_t currst;
+	fsm_events_t event;
+	uint16_t nextst;
+} def_row_t;
+
+/**
+ * def_parse_t - parser state
+ * @path: the file
+ * @line: current line number
+ * @syms_p: symbol table, NULL to leave the actions unresolved
+ * @def_p: machine being parsed, NULL before the first fsm line
+ * @rows_p: its transitions
+ * @maxstates: room in @def_p->names_p
+ * @maxrows: room in @rows_p and @def_p->guards_p
+ */
+typedef struct def_parse {
+	const char *path;
+	uint32_t line;
+	const fsm_sym_t *syms_p;
+	fsm_def_t *def_p;
+	def_row_t *rows_p;
+	uint32_t maxstates;
+	uint32_t maxrows;
+} def_parse_t;
+
+/*
+ * fsm_loaded - the last file fsm_load read, the machines of a file are
+ * usually loaded one after the other
+ */
+static struct {
+	char path[256];
+	fsm_def_t *defs_p;
+	fsm_image_t *img_p;
+} fsm_loaded;
+
+/**
+ * def_error - report a definition error
+ * @p_p: parser state
+ * @msg: what is wrong
+ * @arg: the offending token, may be NULL
+ *
+ * Return: -1
+ */
+static int def_error(def_parse_t *p_p, const char *msg, const char *arg)
+{
+	fprintf(stderr, "%s:%u: %s%s%s\n", p_p->path, p_p->line, msg,
+		arg ? " " : "", arg ? arg : "");
+	return(-1);
+}
+
+/**
+ * def_tokens - split a definition line
+ * @line: the line, changed in place
+ * @tok_pp: the tokens
+ *
+ * Tokens are separated by blanks, a "quoted" token may hold blanks and #
+ * starts a comment.
+ *
+ * Return: number of tokens, -1 for an unterminated quote or too many
+ */
+static int def_tokens(char *line, char **tok_pp)
+{
+	int n = 0;
+	char *p = line;
+
+	for (;;) {
+		while (*p && isspace((unsigned char)*p))
+			p++;
+		if ('\0' == *p || '#' == *p)
+			return(n);
+		if (n == DEF_TOKENS)
+			return(-1);
+		if ('"' == *p) {
+			tok_pp[n++] = ++p;
+			if (NULL == (p = strchr(p, '"')))
+				return(-1);
+		} else {
+			tok_pp[n++] = p;
+			while (*p && !isspace((unsigned char)*p))
+				p++;
+			if ('\0' == *p)
+				return(n);
+		}
+		*p++ = '\0';
+	}
+}
+
+/**
+ * def_copy - copy a name into a definition
+ * @p_p: parser state
+ * @dst: FSM_DEF_NAME bytes
+ * @src: the token, - for none
+ *
+ * Return: 0 or -1 if @src is too long
+ */
+static int def_copy(def_parse_t *p_p, char *dst, const char *src)
+{
+	if (0 == strcmp(src, "-"))
+		src = "";
+	if (strlen(src) >= FSM_DEF_NAME)
+		return def_error(p_p, "name too long", src);
+	strcpy(dst, src);
+	return(0);
+}
+
+/**
+ * def_state - find a state of the current machine
+ * @def_p: the machine
+ * @id: state id
+ *
+ * Return: state index, -1 if there is no such state
+ */
+static int def_state(const fsm_def_t *def_p, const char *id)
+{
+	int i;
+
+	for (i=0; i<def_p->nstates; i++)
+		if (0 == strcmp(def_p->names_p[i].id, id))
+			return(i);
+	return(-1);
+}
+
+/**
+ * def_event - look up an event identifier
+ * @ident: e.g. LIGHT, see evt_ident
+ *
+ * Return: the event, E_BAD if unknown
+ */
+static fsm_events_t def_event(const char *ident)
+{
+	int i;
+
+	for (i=E_BAD+1; i<E_LAST; i++)
+		if (0 == strcmp(evt_ident[i], ident))
+			return(i);
+	return(E_BAD);
+}
+
+/**
+ * def_sym - look up a function in the symbol table
+ * @syms_p: the table, terminated by FSM_SYM_END
+ * @name: function name
+ *
+ * Return: the entry, NULL if not found
+ */
+static const fsm_sym_t *def_sym(const fsm_sym_t *syms_p, const char *name)
+{
+	for (; syms_p->name; syms_p++)
+		if (0 == strcmp(syms_p->name, name))
+			return(syms_p);
+	return(NULL);
+}
+
+/**
+ * def_action - resolve an action name
+ * @syms_p: the symbol table, NULL to not resolve
+ * @name: action name, empty for none
+ * @act_p: set to the action
+ *
+ * Return: 0 or -1 if the table has no such action
+ */
+static int def_action(const fsm_sym_t *syms_p, const char *name, action *act_p)
+{
+	const fsm_sym_t *sym_p;
+
+	*act_p = NULL;
+	if (NULL == syms_p || '\0' == name[0])
+		return(0);
+	if (NULL == (sym_p = def_sym(syms_p, name)) || NULL == sym_p->act)
+		return(-1);
+	*act_p = sym_p->act;
+	return(0);
+}
+
+/**
+ * def_guard - resolve a guard name
+ * @syms_p: the symbol table, NULL to not resolve
+ * @name: guard name, empty for none
+ * @guard_p: set to the guard
+ *
+ * Return: 0 or -1 if the table has no such guard
+ */
+static int def_guard(const fsm_sym_t *syms_p, const char *name, constraint *guard_p)
+{
+	const fsm_sym_t *sym_p;
+
+	*guard_p = NULL;
+	if (NULL == syms_p || '\0' == name[0])
+		return(0);
+	if (NULL == (sym_p = def_sym(syms_p, name)) || NULL == sym_p->guard)
+		return(-1);
+	*guard_p = sym_p->guard;
+	return(0);
+}
+
+/**
+ * def_machine - start a machine
+ * @p_p: parser state
+ * @tail_pp: tail of the machine list
+ * @name: machine name
+ *
+ * Return: 0 or -1
+ */
+static int def_machine(def_parse_t *p_p, fsm_def_t **tail_pp, const char *name)
+{
+	fsm_def_t *def_p = calloc(1, sizeof(fsm_def_t));
+
+	if (NULL == def_p)
+		die("fsm_def_load");
+	*tail_pp = def_p;
+	p_p->def_p = def_p;
+	p_p->maxstates = p_p->maxrows = 0;
+	return def_copy(p_p, def_p->name, name);
+}
+
+/**
+ * def_add_state - parse a state line
+ * @p_p: parser state
+ * @tok_pp: state id "name" entry exit [parent]
+ * @n: number of tokens in @tok_pp
+ *
+ * Return: 0 or -1
+ */
+static int def_add_state(def_parse_t *p_p, char **tok_pp, int n)
+{
+	fsm_def_t *def_p = p_p->def_p;
+	fsm_def_state_t *st_p;
+	action act;
+
+	if (def_state(def_p, tok_pp[0]) >= 0)
+		return def_error(p_p, "duplicate state", tok_pp[0]);
+	if (def_p->nstates == UINT16_MAX)
+		return def_error(p_p, "too many states", NULL);
+
+	if (def_p->nstates == p_p->maxstates) {
+		p_p->maxstates = p_p->maxstates ? 2 * p_p->maxstates : 16;
+		def_p->names_p = realloc(def_p->names_p, p_p->maxstates * sizeof(fsm_def_state_t));
+		if (NULL == def_p->names_p)
+			die("fsm_def_load states");
+	}
+	st_p = &def_p->names_p[def_p->nstates];
+	if (def_copy(p_p, st_p->id, tok_pp[0]) || def_copy(p_p, st_p->name, tok_pp[1]) ||
+	    def_copy(p_p, st_p->entry, tok_pp[2]) || def_copy(p_p, st_p->exit, tok_pp[3]))
+		return(-1);
+	if (def_action(p_p->syms_p, st_p->entry, &act))
+		return def_error(p_p, "unknown action", st_p->entry);
+	if (def_action(p_p->syms_p, st_p->exit, &act))
+		return def_error(p_p, "unknown action", st_p->exit);
+	st_p->parent[0] = '\0';
+	if (5 == n) {
+		if (def_copy(p_p, st_p->parent, tok_pp[4]))
+			return(-1);
+		if (st_p->parent[0] && def_state(def_p, st_p->parent) < 0)
+			return def_error(p_p, "unknown parent", tok_pp[4]);
+	}
+	def_p->nstates++;
+	return(0);
+}
+
+/**
+ * def_add_trans - parse a transition line
+ * @p_p: parser state
+ * @tok_pp: state event guard next
+ *
+ * Return: 0 or -1
+ */
+static int def_add_trans(def_parse_t *p_p, char **tok_pp)
+{
+	fsm_def_t *def_p = p_p->def_p;
+	def_row_t *row_p;
+	int cur, next;
+	fsm_events_t evt_id;
+	constraint guard;
+
+	if ((cur = def_state(def_p, tok_pp[0])) < 0)
+		return def_error(p_p, "unknown state", tok_pp[0]);
+	if (E_BAD == (evt_id = def_event(tok_pp[1])))
+		return def_error(p_p, "unknown event", tok_pp[1]);
+	if ((next = def_state(def_p, tok_pp[3])) < 0)
+		return def_error(p_p, "unknown state", tok_pp[3]);
+	if (def_p->ntrans == INT16_MAX)
+		return def_error(p_p, "too many transitions", NULL);
+
+	if (def_p->ntrans == p_p->maxrows) {
+		p_p->maxrows = p_p->maxrows ? 2 * p_p->maxrows : 16;
+		p_p->rows_p = realloc(p_p->rows_p, p_p->maxrows * sizeof(def_row_t));
+		def_p->guards_p = realloc(def_p->guards_p, p_p->maxrows * FSM_DEF_NAME);
+		if (NULL == p_p->rows_p || NULL == def_p->guards_p)
+			die("fsm_def_load transitions");
+	}
+	row_p = &p_p->rows_p[def_p->ntrans];
+	row_p->currst = cur;
+	row_p->event = evt_id;
+	row_p->nextst = next;
+	if (def_copy(p_p, def_p->guards_p[def_p->ntrans], tok_pp[2]))
+		return(-1);
+	if (def_guard(p_p->syms_p, def_p->guards_p[def_p->ntrans], &guard))
+		return def_error(p_p, "unknown guard", tok_pp[2]);
+	def_p->ntrans++;
+	return(0);
+}
+
+/**
+ * def_finish - build the states and the transition table of a machine
+ * @p_p: parser state, @def_p is the machine
+ *
+ * The action and guard names were checked when their lines were read.
+ *
+ * Return: 0 or -1 for a machine without transitions
+ */
+static int def_finish(def_parse_t *p_p)
+{
+	fsm_def_t *def_p = p_p->def_p;
+	action entry_act, exit_act;
+	constraint guard;
+	def_row_t *row_p;
+	uint16_t i;
+	int up;
+
+	if (NULL == def_p)
+		return(0);
+	if (0 == def_p->ntrans)
+		return def_error(p_p, "no transitions in", def_p->name);
+
+	def_p->states_p = calloc(def_p->nstates, sizeof(fsm_state_t));
+	def_p->trans_p = calloc(def_p->ntrans + 1, sizeof(fsm_trans_t));
+	if (NULL == def_p->states_p || NULL == def_p->trans_p)
+		die("fsm_def_load");
+
+	for (i=0; i<def_p->nstates; i++) {
+		fsm_def_state_t *st_p = &def_p->names_p[i];
+
+		def_action(p_p->syms_p, st_p->entry, &entry_act);
+		def_action(p_p->syms_p, st_p->exit, &exit_act);
+		up = st_p->parent[0] ? def_state(def_p, st_p->parent) : -1;
+
+		fsm_state_t st = {st_p->name, entry_act, exit_act, up < 0 ? NULL : &def_p->states_p[up]};
+		memcpy(&def_p->states_p[i], &st, sizeof(st));
+	}
+
+	for (i=0; i<def_p->ntrans; i++) {
+		row_p = &p_p->rows_p[i];
+		def_guard(p_p->syms_p, def_p->guards_p[i], &guard);
+		def_p->trans_p[i] = (fsm_trans_t){&def_p->states_p[row_p->currst], row_p->event,
+						  guard, &def_p->states_p[row_p->nextst]};
+	}
+	def_p->trans_p[i] = (fsm_trans_t){NULL, E_BAD, NULL, NULL};
+	p_p->def_p = NULL;
+	return(0);
+}
+
+/**
+ * fsm_def_load - read a definition file
+ * @path: the file
+ * @syms_p: actions and guards the file may name, NULL to leave them
+ *          unresolved (fsmc)
+ *
+ * Each machine gets its own states, fsm_compile its trans_p.
+ *
+ * Return: list of the machines in file order, NULL on error
+ */
+fsm_def_t *fsm_def_load(const char *path, const fsm_sym_t *syms_p)
+{
+	def_parse_t parse = {path, 0, syms_p, NULL, NULL, 0, 0};
+	fsm_def_t *defs_p = NULL, **tail_pp = &defs_p;
+	char buf[256], *tok_pp[DEF_TOKENS];
+	FILE *fp;
+	int n, ret = 0;
+
+	if (NULL == (fp = fopen(path, "r"))) {
+		perror(path);
+		return(NULL);
+	}
+
+	while (0 == ret && fgets(buf, sizeof(buf), fp)) {
+		parse.line++;
+		if (NULL == strchr(buf, '\n') && !feof(fp)) {
+			ret = def_error(&parse, "line too long", NULL);
+			break;
+		}
+		if ((n = def_tokens(buf, tok_pp)) <= 0) {
+			if (n < 0)
+				ret = def_error(&parse, "bad line", NULL);
+			continue;
+		}
+
+		if (0 == strcmp(tok_pp[0], "fsm") && 2 == n) {
+			if (0 == (ret = def_finish(&parse))) {
+				ret = def_machine(&parse, tail_pp, tok_pp[1]);
+				tail_pp = &(*tail_pp)->next_p;
+			}
+		} else if (NULL == parse.def_p) {
+			ret = def_error(&parse, "expected fsm name, not", tok_pp[0]);
+		} else if (0 == strcmp(tok_pp[0], "state") && (5 == n || 6 == n)) {
+			ret = def_add_state(&parse, &tok_pp[1], n - 1);
+		} else if (0 == strcmp(tok_pp[0], "trans") && 5 == n) {
+			ret = def_add_trans(&parse, &tok_pp[1]);
+		} else {
+			ret = def_error(&parse, "bad line", tok_pp[0]);
+		}
+	}
+	if (0 == ret && NULL == defs_p)
+		ret = def_error(&parse, "no fsm", NULL);
+	if (0 == ret)
+		ret = def_finish(&parse);
+
+	fclose(fp);
+	free(parse.rows_p);
+	if (ret) {
+		fsm_def_free(defs_p);
+		return(NULL);
+	}
+	return(defs_p);
+}
+
+/**
+ * fsm_def_find - find a machine by name
+ * @defs_p: from fsm_def_load
+ * @name: machine name
+ *
+ * Return: the machine, NULL if the file has none by that name
+ */
+fsm_def_t *fsm_def_find(fsm_def_t *defs_p, const char *name)
+{
+	for (; defs_p; defs_p = defs_p->next_p)
+		if (0 == strcmp(defs_p->name, name))
+			return(defs_p);
+	return(NULL);
+}
+
+/**
+ * fsm_def_free - free the machines of a definition file
+ * @defs_p: from fsm_def_load, NULL is fine
+ *
+ * FSMs compiled from them must be destroyed first.
+ */
+void fsm_def_free(fsm_def_t *defs_p)
+{
+	fsm_def_t *next_p;
+
+	for (; defs_p; defs_p = next_p) {
+		next_p = defs_p->next_p;
+		free(defs_p->trans_p);
+		free(defs_p->guards_p);
+		free(defs_p->states_p);
+		free(defs_p->names_p);
+		free(defs_p);
+	}
+}
+
+/**
+ * image_buf_t - image being written
+ * @data_p: the bytes
+ * @len: bytes used
+ * @size: bytes allocated
+ */
+typedef struct image_buf {
+	uint8_t *data_p;
+	size_t len;
+	size_t size;
+} image_buf_t;
+
+/**
+ * image_put - append to an image
+ * @buf_p: the image
+ * @src_p: bytes to copy, NULL to reserve zeroed space
+ * @len: number of bytes
+ * @align: alignment of the copy
+ *
+ * Return: offset of the copy
+ */
+static uint32_t image_put(image_buf_t *buf_p, const void *src_p, size_t len, size_t align)
+{
+	size_t off = (buf_p->len + align - 1) & ~(align - 1);
+
+	if (off + len > UINT32_MAX)
+		die("fsm_image_write too big");
+	if (off + len > buf_p->size) {
+		buf_p->size = 2 * (off + len);
+		if (NULL == (buf_p->data_p = realloc(buf_p->data_p, buf_p->size)))
+			die("fsm_image_write");
+	}
+	memset(buf_p->data_p + buf_p->len, 0, off - buf_p->len);
+	if (src_p)
+		memcpy(buf_p->data_p + off, src_p, len);
+	else
+		memset(buf_p->data_p + off, 0, len);
+	buf_p->len = off + len;
+	return(off);
+}
+
+/**
+ * image_str - append a string to an image
+ * @buf_p: the image
+ * @s: the string, empty for none
+ *
+ * Return: string offset, 0 for an empty string
+ */
+static uint32_t image_str(image_buf_t *buf_p, const char *s)
+{
+	if ('\0' == s[0])
+		return(0);
+	return image_put(buf_p, s, strlen(s) + 1, 1);
+}
+
+/**
+ * image_state - index of a state in a compiled FSM
+ * @fsm_p: the FSM
+ * @state_p: one of its states, NULL for none
+ *
+ * Return: the index, FSM_NO_STATE for NULL
+ */
+static uint16_t image_state(const fsm_t *fsm_p, const fsm_state_t *state_p)
+{
+	uint16_t i;
+
+	if (NULL == state_p)
+		return(FSM_NO_STATE);
+	for (i=0; fsm_p->state_pp[i] != state_p; i++)
+		;
+	return(i);
+}
+
+/**
+ * image_machine - compile one machine into an image
+ * @buf_p: the image
+ * @def_p: the machine, see fsm_def_load
+ * @rec_p: filled in with the offsets
+ *
+ * The states go in fsm_compile index order, so the dispatch and route
+ * tables can be used as they are.
+ */
+static void image_machine(image_buf_t *buf_p, fsm_def_t *def_p, fsm_image_fsm_t *rec_p)
+{
+	fsm_t *fsm_p = fsm_compile(def_p->trans_p);
+	fsm_image_state_t st;
+	fsm_image_trans_t tr;
+	uint16_t i;
+
+	rec_p->name = image_str(buf_p, def_p->name);
+	rec_p->nstates = fsm_p->nstates;
+	rec_p->ntrans = def_p->ntrans;
+	rec_p->evt_mask = fsm_p->evt_mask;
+	rec_p->nroutes = fsm_p->nroutes;
+	rec_p->nchain = fsm_p->nchain;
+
+	rec_p->states = image_put(buf_p, NULL, fsm_p->nstates * sizeof(st), IMAGE_ALIGN);
+	for (i=0; i<fsm_p->nstates; i++) {
+		fsm_def_state_t *names_p = &def_p->names_p[fsm_p->state_pp[i] - def_p->states_p];
+
+		st.name = image_str(buf_p, names_p->name);
+		st.entry = image_str(buf_p, names_p->entry);
+		st.exit = image_str(buf_p, names_p->exit);
+		st.parent = image_state(fsm_p, fsm_p->state_pp[i]->parent_p);
+		st.pad = 0;
+		memcpy(buf_p->data_p + rec_p->states + i * sizeof(st), &st, sizeof(st));
+	}
+
+	rec_p->trans = image_put(buf_p, NULL, def_p->ntrans * sizeof(tr), IMAGE_ALIGN);
+	for (i=0; i<def_p->ntrans; i++) {
+		tr = (fsm_image_trans_t){0};
+		tr.currst = image_state(fsm_p, def_p->trans_p[i].currst_p);
+		tr.event = def_p->trans_p[i].event;
+		tr.nextst = image_state(fsm_p, def_p->trans_p[i].nextst_p);
+		tr.guard = image_str(buf_p, def_p->guards_p[i]);
+		memcpy(buf_p->data_p + rec_p->trans + i * sizeof(tr), &tr, sizeof(tr));
+	}
+
+	rec_p->dispatch = image_put(buf_p, fsm_p->dispatch_p,
+				    fsm_p->nstates * E_LAST * sizeof(int16_t), IMAGE_ALIGN);
+	rec_p->routes = image_put(buf_p, fsm_p->route_p,
+				  fsm_p->nroutes * sizeof(fsm_route_t), IMAGE_ALIGN);
+	rec_p->chain = image_put(buf_p, fsm_p->chain_p,
+				 fsm_p->nchain * sizeof(uint16_t), IMAGE_ALIGN);
+	fsm_destroy(fsm_p);
+}
+
+/**
+ * fsm_image_write - compile the machines of a definition file to an image
+ * @defs_p: from fsm_def_load
+ * @path: image file
+ *
+ * Return: 0 or -1 if the file cannot be written
+ */
+int fsm_image_write(fsm_def_t *defs_p, const char *path)
+{
+	image_buf_t buf = {NULL, 0, 0};
+	fsm_image_hdr_t hdr = {FSM_IMAGE_MAGIC, FSM_IMAGE_VERSION, 0, 0, E_LAST};
+	fsm_image_fsm_t rec;
+	fsm_def_t *def_p;
+	uint32_t recs, i;
+	FILE *fp;
+	int ret = 0;
+
+	for (def_p = defs_p; def_p; def_p = def_p->next_p)
+		hdr.nfsm++;
+
+	image_put(&buf, &hdr, sizeof(hdr), IMAGE_ALIGN);
+	recs = image_put(&buf, NULL, hdr.nfsm * sizeof(rec), IMAGE_ALIGN);
+	for (i=0, def_p = defs_p; def_p; def_p = def_p->next_p, i++) {
+		image_machine(&buf, def_p, &rec);
+		memcpy(buf.data_p + recs + i * sizeof(rec), &rec, sizeof(rec));
+	}
+	hdr.size = buf.len;
+	memcpy(buf.data_p, &hdr, sizeof(hdr));
+
+	if (NULL == (fp = fopen(path, "w")) || 1 != fwrite(buf.data_p, buf.len, 1, fp)) {
+		perror(path);
+		ret = -1;
+	}
+	if (fp && fclose(fp)) {
+		perror(path);
+		ret = -1;
+	}
+	free(buf.data_p);
+	return(ret);
+}
+
+/**
+ * fsm_image_map - map an image read-only
+ * @path: image file from fsmc
+ *
+ * Return: the image, NULL if it cannot be mapped or is not an image of
+ * this build
+ */
+fsm_image_t *fsm_image_map(const char *path)
+{
+	const fsm_image_hdr_t *hdr_p;
+	fsm_image_t *img_p;
+	struct stat st;
+	void *p;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		return(NULL);
+	}
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(fsm_image_hdr_t)) {
+		fprintf(stderr, "%s: not an fsm image\n", path);
+		close(fd);
+		return(NULL);
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == p) {
+		perror(path);
+		return(NULL);
+	}
+
+	hdr_p = p;
+	if (FSM_IMAGE_MAGIC != hdr_p->magic || FSM_IMAGE_VERSION != hdr_p->version ||
+	    E_LAST != hdr_p->e_last || st.st_size != hdr_p->size ||
+	    sizeof(*hdr_p) + hdr_p->nfsm * sizeof(fsm_image_fsm_t) > hdr_p->size) {
+		fprintf(stderr, "%s: not an fsm image of this build, rebuild it with fsmc\n", path);
+		munmap(p, st.st_size);
+		return(NULL);
+	}
+
+	if (NULL == (img_p = calloc(1, sizeof(fsm_image_t))))
+		die("fsm_image_map");
+	img_p->base_p = p;
+	img_p->size = st.st_size;
+	return(img_p);
+}
+
+/**
+ * image_str_at - a string of an image
+ * @img_p: the image
+ * @off: string offset
+ *
+ * Return: the string, "" for offset 0, NULL if @off is not a string
+ */
+static const char *image_str_at(const fsm_image_t *img_p, uint32_t off)
+{
+	if (0 == off)
+		return("");
+	if (off >= img_p->size || NULL == memchr(img_p->base_p + off, '\0', img_p->size - off))
+		return(NULL);
+	return (const char *)(img_p->base_p + off);
+}
+
+/**
+ * image_has - check an array is inside an image
+ * @img_p: the image
+ * @off: array offset
+ * @len: array bytes
+ */
+static bool image_has(const fsm_image_t *img_p, uint32_t off, size_t len)
+{
+	return (off % IMAGE_ALIGN == 0 && off <= img_p->size && len <= img_p->size - off);
+}
+
+/**
+ * image_check - check a machine record of an image
+ * @img_p: the image
+ * @rec_p: the record
+ *
+ * Return: true if every index and offset of the machine is in range
+ */
+static bool image_check(const fsm_image_t *img_p, const fsm_image_fsm_t *rec_p)
+{
+	const fsm_image_trans_t *tr_p = (const void *)(img_p->base_p + rec_p->trans);
+	const fsm_image_state_t *st_p = (const void *)(img_p->base_p + rec_p->states);
+	const int16_t *dispatch_p = (const void *)(img_p->base_p + rec_p->dispatch);
+	const fsm_route_t *r_p = (const void *)(img_p->base_p + rec_p->routes);
+	const uint16_t *chain_p = (const void *)(img_p->base_p + rec_p->chain);
+	uint32_t i;
+
+	if (0 == rec_p->nstates || 0 == rec_p->ntrans || rec_p->nroutes > INT16_MAX ||
+	    !image_has(img_p, rec_p->states, rec_p->nstates * sizeof(fsm_image_state_t)) ||
+	    !image_has(img_p, rec_p->trans, rec_p->ntrans * sizeof(fsm_image_trans_t)) ||
+	    !image_has(img_p, rec_p->dispatch, rec_p->nstates * E_LAST * sizeof(int16_t)) ||
+	    !image_has(img_p, rec_p->routes, rec_p->nroutes * sizeof(fsm_route_t)) ||
+	    !image_has(img_p, rec_p->chain, rec_p->nchain * sizeof(uint16_t)))
+		return(false);
+
+	for (i=0; i<rec_p->nstates; i++)
+		if (st_p[i].parent >= rec_p->nstates && FSM_NO_STATE != st_p[i].parent)
+			return(false);
+	for (i=0; i<rec_p->ntrans; i++)
+		if (tr_p[i].currst >= rec_p->nstates || tr_p[i].nextst >= rec_p->nstates ||
+		    tr_p[i].event >= E_LAST)
+			return(false);
+	for (i=0; i<rec_p->nstates * E_LAST; i++)
+		if (dispatch_p[i] < -1 || dispatch_p[i] >= (int32_t)rec_p->nroutes)
+			return(false);
+	for (i=0; i<rec_p->nroutes; i++)
+		if (r_p[i].trans >= rec_p->ntrans || r_p[i].nextst != tr_p[r_p[i].trans].nextst ||
+		    r_p[i].chain > rec_p->nchain ||
+		    r_p[i].nexit + r_p[i].nentry > rec_p->nchain - r_p[i].chain)
+			return(false);
+	for (i=0; i<rec_p->nchain; i++)
+		if (chain_p[i] >= rec_p->nstates)
+			return(false);
+	return(true);
+}
+
+/**
+ * fsm_image_fsm - a compiled FSM from an image
+ * @img_p: from fsm_image_map
+ * @name: machine name
+ * @syms_p: actions and guards the machine may name
+ *
+ * The dispatch, route and chain tables are used in place, only the states
+ * and the transition table, which hold this process' function pointers,
+ * are built.  They are one allocation with state_pp, fsm_destroy frees
+ * them.  The image must stay mapped while the FSM is used.
+ *
+ * Return: the FSM, NULL if the image has no such machine, it is damaged
+ * or names a function not in @syms_p
+ */
+fsm_t *fsm_image_fsm(fsm_image_t *img_p, const char *name, const fsm_sym_t *syms_p)
+{
+	const fsm_image_hdr_t *hdr_p = (const void *)img_p->base_p;
+	const fsm_image_fsm_t *rec_p = (const void *)(img_p->base_p + sizeof(*hdr_p));
+	const fsm_image_state_t *ist_p;
+	const fsm_image_trans_t *itr_p;
+	const char *s, *entry_s, *exit_s;
+	fsm_state_t *states_p;
+	fsm_trans_t *trans_p;
+	fsm_t *fsm_p;
+	void *mem_p;
+	action entry_act, exit_act;
+	constraint guard;
+	uint32_t i;
+
+	for (i=0; i<hdr_p->nfsm; i++, rec_p++)
+		if ((s = image_str_at(img_p, rec_p->name)) && 0 == strcmp(s, name))
+			break;
+	if (i == hdr_p->nfsm) {
+		fprintf(stderr, "no fsm %s in the image\n", name);
+		return(NULL);
+	}
+	if (!image_check(img_p, rec_p)) {
+		fprintf(stderr, "fsm %s: damaged image\n", name);
+		return(NULL);
+	}
+
+	mem_p = calloc(1, rec_p->nstates * (sizeof(fsm_state_t *) + sizeof(fsm_state_t)) +
+		       (rec_p->ntrans + 1) * sizeof(fsm_trans_t));
+	if (NULL == mem_p || NULL == (fsm_p = calloc(1, sizeof(fsm_t))))
+		die("fsm_image_fsm");
+	states_p = (fsm_state_t *)((fsm_state_t **)mem_p + rec_p->nstates);
+	trans_p = (fsm_trans_t *)(states_p + rec_p->nstates);
+
+	ist_p = (const void *)(img_p->base_p + rec_p->states);
+	for (i=0; i<rec_p->nstates; i++) {
+		s = image_str_at(img_p, ist_p[i].name);
+		entry_s = image_str_at(img_p, ist_p[i].entry);
+		exit_s = image_str_at(img_p, ist_p[i].exit);
+		if (!s || !entry_s || !exit_s || def_action(syms_p, entry_s, &entry_act) ||
+		    def_action(syms_p, exit_s, &exit_act)) {
+			fprintf(stderr, "fsm %s: bad state or unknown action\n", name);
+			goto fail;
+		}
+		fsm_state_t st = {s, entry_act, exit_act,
+				  FSM_NO_STATE == ist_p[i].parent ? NULL : &states_p[ist_p[i].parent]};
+		memcpy(&states_p[i], &st, sizeof(st));
+		((fsm_state_t **)mem_p)[i] = &states_p[i];
+	}
+
+	itr_p = (const void *)(img_p->base_p + rec_p->trans);
+	for (i=0; i<rec_p->ntrans; i++) {
+		if (!(s = image_str_at(img_p, itr_p[i].guard)) || def_guard(syms_p, s, &guard)) {
+			fprintf(stderr, "fsm %s: unknown guard\n", name);
+			goto fail;
+		}
+		trans_p[i] = (fsm_trans_t){&states_p[itr_p[i].currst], itr_p[i].event, guard,
+					   &states_p[itr_p[i].nextst]};
+	}
+	trans_p[i] = (fsm_trans_t){NULL, E_BAD, NULL, NULL};
+
+	fsm_p->trans_p = trans_p;
+	fsm_p->state_pp = mem_p;
+	fsm_p->nstates = rec_p->nstates;
+	fsm_p->dispatch_p = (int16_t *)(img_p->base_p + rec_p->dispatch);
+	fsm_p->route_p = (fsm_route_t *)(img_p->base_p + rec_p->routes);
+	fsm_p->chain_p = (uint16_t *)(img_p->base_p + rec_p->chain);
+	fsm_p->nroutes = rec_p->nroutes;
+	fsm_p->nchain = rec_p->nchain;
+	fsm_p->evt_mask = rec_p->evt_mask;
+	fsm_p->image_p = img_p;
+	fsm_register(fsm_p);
+	return(fsm_p);
+
+fail:
+	free(fsm_p);
+	free(mem_p);
+	return(NULL);
+}
+
+/**
+ * fsm_image_unmap - unmap an image
+ * @img_p: from fsm_image_map, NULL is fine
+ *
+ * Every FSM from the image must be destroyed first.
+ */
+void fsm_image_unmap(fsm_image_t *img_p)
+{
+	if (NULL == img_p)
+		return;
+	munmap((void *)img_p->base_p, img_p->size);
+	free(img_p);
+}
+
+/**
+ * fsm_load - a compiled FSM from a definition file or an image
+ * @path: the file, an image if it starts with the image magic
+ * @name: machine name
+ * @syms_p: actions and guards the machine may name
+ *
+ * The file stays loaded (or mapped) for the life of the process, loading
+ * more machines from it does not read it again.
+ *
+ * Return: the FSM, NULL on error
+ */
+fsm_t *fsm_load(const char *path, const char *name, const fsm_sym_t *syms_p)
+{
+	fsm_def_t *def_p;
+	uint32_t magic = 0;
+	FILE *fp;
+
+	if (strcmp(fsm_loaded.path, path)) {
+		if (NULL == (fp = fopen(path, "r"))) {
+			perror(path);
+			return(NULL);
+		}
+		if (1 != fread(&magic, sizeof(magic), 1, fp))
+			magic = 0;
+		fclose(fp);
+
+		if (FSM_IMAGE_MAGIC == magic) {
+			if (NULL == (fsm_loaded.img_p = fsm_image_map(path)))
+				return(NULL);
+			fsm_loaded.defs_p = NULL;
+		} else {
+			if (NULL == (fsm_loaded.defs_p = fsm_def_load(path, syms_p)))
+				return(NULL);
+			fsm_loaded.img_p = NULL;
+		}
+		strncpy(fsm_loaded.path, path, sizeof(fsm_loaded.path)-1);
+	}
+
+	if (fsm_loaded.img_p)
+		return fsm_image_fsm(fsm_loaded.img_p, name, syms_p);
+
+	if (NULL == (def_p = fsm_def_find(fsm_loaded.defs_p, name))) {
+		fprintf(stderr, "%s: no fsm %s\n", path, name);
+		return(NULL);
+	}
+	return fsm_compile(def_p->trans_p);
+}
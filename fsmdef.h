@@ -0,0 +1,195 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * FSM definitions loaded at run time
+ *
+ * A definition file holds one or more machines as text, e.g.
+ *
+ *  # stoplight, see fsmdemo.fsm
+ *  fsm stoplight
+ *  state init "S:INIT" stoplight_init_enter act_exit
+ *  state on "S:ON" - -
+ *  state green "S:GREEN" green_enter act_exit on
+ *  state done "S:DONE" act_done -
+ *  trans init INIT - green
+ *  trans green BUTTON but_constraint green_but
+ *  trans on DONE - done
+ *
+ * A state is an id, its name, its entry and exit action and optionally
+ * the id of its parent state (see fsm_state_t), a transition is the
+ * current state id, the event identifier (evt_ident), the guard and the
+ * next state id; - is no action or guard.  States are declared before
+ * the transitions and substates using them and the first transition
+ * starts the machine, same as a fsm_trans_t table.  Action and guard
+ * names are resolved against a symbol table of the functions the program
+ * provides.
+ *
+ * fsmc compiles a definition file to an image: the dense dispatch and
+ * route tables of every machine plus the names, laid out to be
+ * mapped read-only.  Processes loading the same image share one copy in
+ * the page cache and skip the parse and the compile, only the small state
+ * and transition arrays holding this process' function pointers are
+ * built.  An image is only valid for the events (E_LAST) it was built
+ * with.
+ */
+
+#ifndef _FSMDEF_H
+#define _FSMDEF_H
+
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include "fsm.h"
+
+/* longest state id, name, action or guard name in a definition */
+#define FSM_DEF_NAME 32
+
+/* image magic, "FSMI" */
+#define FSM_IMAGE_MAGIC 0x494d5346
+#define FSM_IMAGE_VERSION 2
+
+/**
+ * fsm_sym_t - a function a definition may name
+ * @name: the name in the definition
+ * @act: the function if it is an action
+ * @guard: the function if it is a guard
+ */
+typedef struct fsm_sym {
+	const char *name;
+	action act;
+	constraint guard;
+} fsm_sym_t;
+
+/* symbol table entries, the table ends with FSM_SYM_END */
+#define FSM_SYM_ACTION(fn) {#fn, fn, NULL}
+#define FSM_SYM_GUARD(fn) {#fn, NULL, fn}
+#define FSM_SYM_END {NULL, NULL, NULL}
+
+/**
+ * fsm_def_state_t - the names of a state in a definition
+ * @id: state id in the transitions
+ * @name: state name
+ * @entry: entry action name, empty for none
+ * @exit: exit action name, empty for none
+ * @parent: parent state id, empty for a top level state
+ */
+typedef struct fsm_def_state {
+	char id[FSM_DEF_NAME];
+	char name[FSM_DEF_NAME];
+	char entry[FSM_DEF_NAME];
+	char exit[FSM_DEF_NAME];
+	char parent[FSM_DEF_NAME];
+} fsm_def_state_t;
+
+/**
+ * fsm_def_t - one machine of a definition file
+ * @name: machine name
+ * @nstates: states in @names_p and @states_p
+ * @ntrans: transitions in @trans_p, without the end entry
+ * @names_p: state names
+ * @states_p: the states, actions resolved
+ * @guards_p: guard name of each transition, empty for none
+ * @trans_p: transition table for fsm_compile
+ * @next_p: next machine in the file
+ */
+typedef struct fsm_def {
+	char name[FSM_DEF_NAME];
+	uint16_t nstates;
+	uint16_t ntrans;
+	fsm_def_state_t *names_p;
+	fsm_state_t *states_p;
+	char (*guards_p)[FSM_DEF_NAME];
+	fsm_trans_t *trans_p;
+	struct fsm_def *next_p;
+} fsm_def_t;
+
+/**
+ * fsm_image_hdr_t - start of an image
+ * @magic: FSM_IMAGE_MAGIC
+ * @version: FSM_IMAGE_VERSION
+ * @nfsm: machines in the image, their fsm_image_fsm_t follow
+ * @size: image bytes
+ * @e_last: E_LAST of the build that wrote the image
+ */
+typedef struct fsm_image_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t nfsm;
+	uint32_t size;
+	uint32_t e_last;
+} fsm_image_hdr_t;
+
+/**
+ * fsm_image_fsm_t - one machine in an image
+ * @name: string offset of the machine name
+ * @nstates: states, in fsm_compile index order
+ * @ntrans: transitions
+ * @evt_mask: see fsm_evt_mask
+ * @nroutes: routes, see fsm_route_t
+ * @nchain: states in the route chains
+ * @states: offset of the fsm_image_state_t array
+ * @trans: offset of the fsm_image_trans_t array
+ * @dispatch: offset of the int16_t [nstates][e_last] dispatch table
+ * @routes: offset of the fsm_route_t array
+ * @chain: offset of the uint16_t route chains
+ *
+ * Offsets are from the start of the image, string offset 0 is no name.
+ */
+typedef struct fsm_image_fsm {
+	uint32_t name;
+	uint16_t nstates;
+	uint16_t ntrans;
+	uint32_t evt_mask;
+	uint32_t nroutes;
+	uint32_t nchain;
+	uint32_t states;
+	uint32_t trans;
+	uint32_t dispatch;
+	uint32_t routes;
+	uint32_t chain;
+} fsm_image_fsm_t;
+
+/**
+ * fsm_image_state_t - string offsets of a state name and its actions, and
+ * the index of its parent, FSM_NO_STATE for none
+ */
+typedef struct fsm_image_state {
+	uint32_t name;
+	uint32_t entry;
+	uint32_t exit;
+	uint16_t parent;
+	uint16_t pad;
+} fsm_image_state_t;
+
+/**
+ * fsm_image_trans_t - one transition, states by index
+ */
+typedef struct fsm_image_trans {
+	uint16_t currst;
+	uint16_t event;
+	uint16_t nextst;
+	uint16_t pad;
+	uint32_t guard;
+} fsm_image_trans_t;
+
+/**
+ * fsm_image_t - a mapped image
+ * @base_p: the read-only mapping
+ * @size: bytes mapped
+ */
+typedef struct fsm_image {
+	const uint8_t *base_p;
+	size_t size;
+} fsm_image_t;
+
+extern fsm_def_t *fsm_def_load(const char *path, const fsm_sym_t *syms_p);
+extern fsm_def_t *fsm_def_find(fsm_def_t *defs_p, const char *name);
+extern void fsm_def_free(fsm_def_t *defs_p);
+extern int fsm_image_write(fsm_def_t *defs_p, const char *path);
+extern fsm_image_t *fsm_image_map(const char *path);
+extern fsm_t *fsm_image_fsm(fsm_image_t *img_p, const char *name, const fsm_sym_t *syms_p);
+extern void fsm_image_unmap(fsm_image_t *img_p);
+extern fsm_t *fsm_load(const char *path, const char *name, const fsm_sym_t *syms_p);
+
+#endif /* _FSMDEF_H */
@@ -22,6 +22,14 @@
 #include "evtq.h"
 #include "fsm.h"
 #include "workers.h"
+#include "fsmsched.h"
+#include "fsmsnap.h"
+#include "ingest.h"
+#include "trace.h"
+#include "stats.h"
+#include "arena.h"
+#include "affinity.h"
+#include "reactor.h"
 
 #include <fsm_defs.h>
 
@@ -32,6 +40,25 @@ char *arguments = "\n"							\
 	" -t tick: timer tick in msec\n"				\
 	" -s scriptfile: read events from file\n"			\
 	" -n: non-interactive mode (only read from scriptfile)\n"	\
+	" -q type: worker event queue type list, spsc or mpsc\n"	\
+	" -W wake: queue wakeup immediate, yield, spin, coalesce or adaptive\n" \
+	" -P name: adaptive spin-then-park wakeup for this worker only\n" \
+	" -i num: run num intersections on the FSM instance scheduler\n" \
+	" -w num: scheduler pool threads (default 2)\n"		\
+	" -T file: write a binary trace to file, see fsmtrace\n"	\
+	" -L: time event latency and actions, see the l command\n"	\
+	" -B: send broadcasts to the workers on one shared channel\n"	\
+	" -A mb: allocate workers, queues and timers from an mb MiB arena\n" \
+	" -H: back the arena with hugepages\n"			\
+	" -M: mlock the arena\n"					\
+	" -c cpus: pin workers round-robin to a cpu list, e.g. 0-3,6\n" \
+	" -C cpu: pin the timer service to cpu, workers do not use it\n" \
+	" -G: run FSM1 and FSM2 with their generated runners\n"	\
+	" -f file: load FSM1 and FSM2 from a definition file or fsmc image\n" \
+	" -S file: the S command saves the -i instances to file\n"	\
+	" -R file: start the -i instances from a snapshot file\n"	\
+	" -I spec: ingest event frames from a file, unix:PATH or tcp:[ADDR:]PORT\n" \
+	" -V: virtual clock, naps jump to the next timer instead of sleeping\n" \
 	" -d hex: set debug_flag to hex level\n"			\
 	"    0x01: debug FSM transitions\n"				\
 	"    0x02: debug event push/pop\n"				\
@@ -61,11 +88,83 @@ char scriptfile[64] = "./fsmdemo.script";
  */
 static bool non_interactive = false;
 
+/**
+ * intersections - number of stoplight/crosswalk pairs run as scheduled
+ *  FSM instances, 0 runs the two FSMs on their own worker threads.
+ * pool_threads - scheduler pool size
+ */
+static uint32_t intersections = 0;
+static uint32_t pool_threads = 2;
+
+/**
+ * tracefile - binary trace output, empty for no trace
+ */
+static char tracefile[64] = "";
+
+/**
+ * arena_mb - size of the object arena in MiB, 0 to use malloc
+ * arena_flags - arena_flags_t for -H and -M
+ */
+static uint32_t arena_mb = 0;
+static uint32_t arena_flags = 0;
+
+/**
+ * deffile - definition file or image with the stoplight and crosswalk
+ *  machines, empty for the fsm_defs.h tables
+ */
+static char deffile[64] = "";
+
+/**
+ * snapfile - snapshot the CLI S command writes, empty for none
+ * restorefile - snapshot the scheduled instances start from, empty to
+ *  start them with their init entry action
+ */
+static char snapfile[64] = "";
+static char restorefile[64] = "";
+
+/**
+ * ingestspec - binary event stream read before the script, or socket
+ *  taking streams while the program runs, empty for none, see ingest.h
+ */
+static char ingestspec[64] = "";
+
+/**
+ * virtual_clock - timers and script naps run on simulated time, see
+ *  timer_sim_start
+ */
+static bool virtual_clock = false;
+
+/**
+ * pollworker - worker whose queue spins before it parks, see
+ *  EVTQ_WAKE_ADAPTIVE, empty for none
+ */
+static char pollworker[32] = "";
+
+/**
+ * timer_cpu - cpu the timer service is pinned to, -1 for any
+ */
+static int timer_cpu = -1;
+
 /**
  * debug_flag - bitmask for enabling levels of logging
  */
 uint32_t debug_flag;
 
+/*
+ * workers - global registry of worker threads.  See workers.h
+ */
+workers_t workers = WORKERS_INIT;
+
+/*
+ * worker_self_p - thread-local pointer to the current worker.  See workers.h
+ */
+__thread worker_t *worker_self_p;
+
+/*
+ * workers_reader_p - thread-local registry reader record.  See workers.h
+ */
+__thread workers_reader_t *workers_reader_p;
+
 /**
  * cmdline_args - parse command line arguments
  * @argc: argument count (from main)
@@ -81,7 +180,7 @@ uint32_t debug_flag;
 int cmdline_args(int argc, char *argv[]) {
 	int opt;
 	
-	while((opt = getopt(argc, argv, "t:s:nd:h")) != -1) {
+	while((opt = getopt(argc, argv, "t:s:nq:W:P:i:w:T:LBA:HMc:C:Gf:S:R:I:Vd:h")) != -1) {
 		switch(opt) {
 		case 't':
 			tick = strtoul(optarg, NULL, 0);
@@ -94,6 +193,88 @@ int cmdline_args(int argc, char *argv[]) {
 		case 'n':
 			non_interactive = true;
 			break;
+		case 'q':
+		{
+			int type = evtq_type_parse(optarg);
+
+			if (type < 0) {
+				fprintf(stderr, "unknown queue type %s\n", optarg);
+				exit(1);
+			}
+			workers.qattr.type = type;
+		}
+		break;
+		case 'W':
+		{
+			int wake = evtq_wake_parse(optarg);
+
+			if (wake < 0) {
+				fprintf(stderr, "unknown queue wakeup %s\n", optarg);
+				exit(1);
+			}
+			workers.qattr.wake = wake;
+		}
+		break;
+		case 'P':
+			strncpy(pollworker, optarg, sizeof(pollworker)-1);
+			break;
+		case 'i':
+			intersections = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			pool_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			strncpy(tracefile, optarg, sizeof(tracefile)-1);
+			break;
+		case 'L':
+			stats_latency = true;
+			break;
+		case 'B':
+			workers.bus_p = evtbus_create(0);
+			break;
+		case 'A':
+			arena_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			arena_flags |= ARENA_HUGE;
+			break;
+		case 'M':
+			arena_flags |= ARENA_MLOCK;
+			break;
+		case 'c':
+			if (affinity_workers(optarg)) {
+				fprintf(stderr, "bad worker cpu list %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'C':
+			timer_cpu = strtol(optarg, NULL, 0);
+			if (affinity_timer(timer_cpu)) {
+				fprintf(stderr, "bad timer cpu %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'G':
+			fsm_gen_register(&stoplight_gen);
+			fsm_gen_register(&crosswalk_gen);
+			break;
+		case 'f':
+			strncpy(deffile, optarg, sizeof(deffile)-1);
+			break;
+		case 'S':
+			strncpy(snapfile, optarg, sizeof(snapfile)-1);
+			workers.snap_path = snapfile;
+			break;
+		case 'R':
+			strncpy(restorefile, optarg, sizeof(restorefile)-1);
+			break;
+		case 'I':
+			strncpy(ingestspec, optarg, sizeof(ingestspec)-1);
+			break;
+		case 'V':
+			virtual_clock = true;
+			break;
 		case 'd':
 			debug_flag = strtoul(optarg, NULL, 0);
 			break;
@@ -142,44 +323,136 @@ void set_sig_handlers(void) {
 
 /********************************** application logic *******************************/
 
+/*
+ * FSM_TASK_BATCH - most events fsm_task takes from its queue per wakeup
+ */
+#define FSM_TASK_BATCH 32
+
 /**
  * fsm_task - archetype event consumer thread
  * @arg: worker_t context
  *
  * This is the generic FSM task.  It's a simple infinite loop that
- * - dequeues an event enqueued from another thread (or possibly this thread)
- * - injects the event into the FSM
- * All context persists in the worker_t instance.
+ * - dequeues all events enqueued from other threads (or possibly this thread),
+ *   from the broadcast channel if the worker subscribed to it
+ * - injects the events into the FSM in order
+ * All context persists in the worker_t and its FSM instance.
  */
 void *fsm_task(void *arg)
 {
 	worker_t* self_p = (worker_t*) arg;
-        fsm_events_t evt_id;
+	fsm_events_t evts[FSM_TASK_BATCH];
+	evt_payload_t pls[FSM_TASK_BATCH];
+	size_t n;
 
 	/* init the FSM and call the the init state enter functiuon */
-	fsm_init(self_p->fsm_p);
+	fsm_init(self_p->inst_p);
 
 	/* The main lupe
-	 * dequeue event and call dbg_evts for runtime dump
-	 * fsm_run for the fsm instance, injecting evt_id
+	 * dequeue a batch of events and payloads, fsm_run_batch_pl calls
+	 * dbg_evts for runtime dump and fsm_run_pl for each, injecting evt_id
 	 *
 	 * This is an infinite loop, either ^C (SIGINT) or
 	 * E_DONE event will cause the FSM to call pthread_exit
 	 */
 	while (true)
 	{
-		evtq_dequeue(self_p->evtq_p, &evt_id);
-		dbg_evts(evt_id);
-		fsm_run(self_p->fsm_p, evt_id);
+		n = self_p->sub_p ?
+			evtbus_dequeue_batch_pl(self_p->sub_p, evts, pls, FSM_TASK_BATCH) :
+			evtq_dequeue_batch_pl(self_p->evtq_p, evts, pls, FSM_TASK_BATCH);
+		fsm_run_batch_pl(self_p->inst_p, evts, pls, n);
+		evtq_done(n);
 	}
 	
 	dbg("exitting...");
 }
 
-/*
- * workers - global linked list of worker threads.  See workers.h
+/**
+ * demo_fsm - compile one of the demo machines
+ * @name: machine name in the -f file
+ * @trans_p: fsm_defs.h table used without -f
+ *
+ * Return: the compiled FSM, a bad -f file exits
+ */
+static fsm_t *demo_fsm(const char *name, fsm_trans_t *trans_p)
+{
+	fsm_t *fsm_p;
+
+	if ('\0' == deffile[0])
+		return fsm_compile(trans_p);
+	if (NULL == (fsm_p = fsm_load(deffile, name, fsm_defs_syms)))
+		exit(1);
+	return(fsm_p);
+}
+
+/**
+ * demo_worker - create and list one of the demo workers
+ * @name: worker name
+ * @fsm_p: its machine
+ *
+ * The -P worker gets an adaptive queue, the others workers.qattr.
+ */
+static void demo_worker(char *name, fsm_t *fsm_p)
+{
+	evtq_attr_t attr = workers.qattr;
+
+	attr.wake = EVTQ_WAKE_ADAPTIVE;
+	attr.spin = 0;
+	worker_list_add(worker_fsm_create_attr(&fsm_task, name, fsm_p,
+					       strcmp(pollworker, name) ? NULL : &attr));
+}
+
+/**
+ * sched_restore - start the scheduled instances from restorefile
+ * @sched_p: the scheduler, instances added but not started
+ *
+ * A snapshot that does not fit the instances exits.
+ */
+static void sched_restore(fsmsched_t *sched_p)
+{
+	struct timespec t0, t1;
+	fsm_snap_stats_t snap;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (fsmsnap_restore(sched_p, restorefile, &snap))
+		exit(1);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("restored %s: %u instances, %u timers, %u events in %.3f msec\n",
+	       restorefile, snap.ninst, snap.ntimers, snap.nevts,
+	       (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+}
+
+/**
+ * sched_create - create the scheduled intersections
+ * @n: number of intersections
+ *
+ * All instances share one compiled FSM1 and FSM2.  Each intersection is a
+ * group with its own pair of timers, TID_LAST ids apart.  With -R the
+ * instances are not started, their states, timers and events come from
+ * the snapshot.
+ *
+ * Return: the scheduler
  */
-workers_t workers;
+static fsmsched_t *sched_create(uint32_t n)
+{
+	fsmsched_t *sched_p = fsmsched_create(pool_threads);
+	fsm_t *stoplight_p = demo_fsm("stoplight", FSM1);
+	fsm_t *crosswalk_p = demo_fsm("crosswalk", FSM2);
+	fsmsched_inst_t *(*inst_create)(fsmsched_t *, fsmsched_group_t *, const fsm_t *,
+					uint32_t);
+	fsmsched_group_t *group_p;
+	uint32_t i;
+
+	inst_create = restorefile[0] ? fsmsched_inst_add : fsmsched_inst_create;
+	for (i=0; i<n; i++) {
+		group_p = fsmsched_group_create(sched_p);
+		inst_create(sched_p, group_p, stoplight_p, i * TID_LAST);
+		inst_create(sched_p, group_p, crosswalk_p, i * TID_LAST);
+	}
+	if (restorefile[0])
+		sched_restore(sched_p);
+	return(sched_p);
+}
 
 /**
  * main - a simple driver for an event producer/consumer framework (MGMT)
@@ -190,18 +463,27 @@ workers_t workers;
  * 
  * - process command line arguments
  * - set signal handlers (just in case)
- * - start timer service thread
+ * - map the object arena for -A
+ * - start the binary trace for -T
+ * - start timer service thread for -n or -C, pinned for -C, otherwise
+ *   the timers run on the CLI reactor
  * - create a worker list
- * - create the worker pthread(s) and add to worker list
+ * - create the worker pthread(s) and add to worker list, or the
+ *   scheduled intersections for -i
  * - call the evt_script | evt_producer function from the main thread
- * - cancel timer service
+ * - stop the timer service
  * - wait for consumer thread to terminate
  * - destroy event_queue for the consumer
+ * - unmap the arena, with everything allocated from it
  */
 int main(int argc, char *argv[])
 {
 	int parsed_args;
 	pthread_t timer_service;
+	pthread_attr_t attr, *attr_p;
+	reactor_t *timer_reactor_p = NULL, *cli_reactor_p = NULL;
+	ingest_t *ingest_p = NULL;
+	uint64_t t0;
 
 	parsed_args = cmdline_args(argc, argv);
 
@@ -215,25 +497,92 @@ int main(int argc, char *argv[])
 	/* all threads in process use this */
 	set_sig_handlers();
 
-	/* create timer service and start it running */
-	if (0 != pthread_create(&timer_service, NULL, timer_service_fn, NULL))
-		die("timer_service create");
+	/* before any worker, queue or timer is allocated */
+	if (arena_mb)
+		fsm_arena = arena_create((size_t)arena_mb << 20, arena_flags);
+
+	/* before any FSM is compiled so the state names are traced */
+	if (tracefile[0] && trace_start(tracefile))
+		exit(1);
+
+	/* before the wheel is set up and any event is sent */
+	if (virtual_clock) {
+		if (workers.bus_p) {
+			fprintf(stderr, "-V cannot wait for the -B broadcast channel\n");
+			exit(1);
+		}
+		timer_sim_start();
+	}
+
+	/*
+	 * the CLI thread runs the timers too, unless there is no CLI or
+	 * the timers want a cpu of their own
+	 */
+	if (!non_interactive)
+		cli_reactor_p = reactor_create();
+	if (non_interactive || timer_cpu >= 0) {
+		/* create timer service and start it running, on its cpu for -C */
+		timer_reactor_p = reactor_create();
+		attr_p = affinity_attr(&attr, timer_cpu);
+		if (0 != pthread_create(&timer_service, attr_p, timer_service_fn, timer_reactor_p))
+			die("timer_service create");
+		if (attr_p)
+			pthread_attr_destroy(attr_p);
+	} else {
+		timer_reactor_add(cli_reactor_p);
+	}
 
 	worker_list_create();
-	worker_list_add(worker_fsm_create(&fsm_task, "stoplight", FSM1));
-	worker_list_add(worker_fsm_create(&fsm_task, "crosswalk", FSM2));
+	if (restorefile[0] && !intersections) {
+		fprintf(stderr, "-R needs the scheduled instances, -i\n");
+		exit(1);
+	}
+	if (intersections) {
+		workers.sched_p = sched_create(intersections);
+	} else {
+		demo_worker("stoplight", demo_fsm("stoplight", FSM1));
+		demo_worker("crosswalk", demo_fsm("crosswalk", FSM2));
+	}
+
+	/* a socket is served by the reactor running the CLI or the timers */
+	if (ingestspec[0]) {
+		ingest_p = ingest_create();
+		if (ingest_open(ingest_p, non_interactive ? timer_reactor_p : cli_reactor_p,
+				ingestspec))
+			exit(1);
+	}
 
 	/* loop until 'x' entered */
-	non_interactive ? evt_script() : evt_producer();
+	t0 = stats_now();
+	non_interactive ? evt_script() : evt_producer(cli_reactor_p);
+	if (virtual_clock)
+		printf("virtual clock: %lu msec in %lu msec\n", timer_sim_ms(),
+		       (stats_now() - t0) / 1000000);
+
+	if (timer_reactor_p) {
+		dbg("stop timer_service and join");
+		reactor_stop(timer_reactor_p);
+		pthread_join(timer_service, NULL);
+	}
+	if (ingest_p) {
+		ingest_show(ingest_p, ingestspec);
+		ingest_destroy(ingest_p);
+	}
+	reactor_destroy(timer_reactor_p);
+	reactor_destroy(cli_reactor_p);
 
-	/* cancel timer_service thread */
-	dbg("cancel timer_service and join");
-	pthread_cancel(timer_service);
-	pthread_join(timer_service, NULL);
-	
 	dbg("waiting for worker joins");
 	join_workers();
 	workers_evtq_destroy();
+	if (workers.sched_p) {
+		fsmsched_join(workers.sched_p);
+		fsmsched_destroy(workers.sched_p);
+	}
+	evtbus_destroy(workers.bus_p);
+	evtbuf_destroy();
+	trace_stop();
+	stats_destroy();
+	arena_destroy(fsm_arena);
 
 	dbg("exitting...\n");
 }
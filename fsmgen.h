@@ -0,0 +1,249 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * FSM runners generated from the transition table definition
+ *
+ * A table is written once as X-macro lists: the states, in order of first
+ * appearance in the rows, and the rows themselves,
+ *
+ *  #define FSM1_STATES(X, f) X(f, stoplight_init) X(f, green) ...
+ *  #define FSM1_ROWS(X, f) X(f, stoplight_init, E_INIT, NULL, green) ...
+ *
+ * with every state defined by FSM_GEN_STATE, or FSM_GEN_SUBSTATE for a
+ * state inside another, and listed in fsm_compile order (a state, then
+ * its parents not listed yet).  FSM_GEN expands the lists
+ * into the fsm_trans_t table for fsm_compile and into fsm_run_<f>, one
+ * switch on (state, event) that calls the guard and actions directly so
+ * the compiler can inline them.  fsm_specialize (or fsm_compile, for a
+ * table registered with fsm_gen_register) points the compiled FSM at the
+ * runner and fsm_run_pl calls it instead of walking the dispatch table.
+ *
+ * A transition between states with the same parent is run inline.  The
+ * others, and the events a state leaves to its parents, go to
+ * fsm_step_table with the exit and entry chains fsm_compile built.
+ *
+ * Both paths share the fsm_step_ helpers below, so they give the same
+ * states, return values, stats and trace; fsmbench -b gen checks it.  A
+ * duplicate (state, event) row is a compile error in the runner, the
+ * interpreter takes the first one.
+ */
+
+#ifndef _FSMGEN_H
+#define _FSMGEN_H
+
+#include <utils.h>
+#include <fsm.h>
+#include <trace.h>
+#include <stats.h>
+
+extern void _dbg_trans(fsm_inst_t *inst_p, fsm_state_t *nextst_p, fsm_events_t evt_id);
+extern int fsm_step_table(fsm_inst_t *inst_p, fsm_events_t evt_id);
+
+#define dbg_trans(inst_p, nextst_p, evt_id) \
+	do { if (dbg_on(DBG_TRANS)) _dbg_trans(inst_p, nextst_p, evt_id); } while (0)
+
+/**
+ * fsm_step_guard_failed - account a transition its guard refused
+ * @inst_p - the FSM instance
+ * @evt_id - the event id
+ * @nextst - dense index of the refused next state
+ *
+ * Return: 1, see fsm_run
+ */
+static inline int fsm_step_guard_failed(fsm_inst_t *inst_p, fsm_events_t evt_id, uint16_t nextst)
+{
+	dbg_verbose("Guard FAILED");
+	stats_inc(&stats_get()->guard_fails, 1);
+	trace_trans(inst_p, evt_id, inst_p->currst, nextst, 1);
+	return(1);
+}
+
+/**
+ * fsm_step_begin - account a transition before its actions run
+ * @inst_p - the FSM instance
+ * @evt_id - the event id
+ * @nextst - dense index of the next state
+ *
+ * Traced before the actions, the S:DONE entry may not return.
+ *
+ * Return: start time for fsm_step_end, 0 unless stats_latency
+ */
+static inline uint64_t fsm_step_begin(fsm_inst_t *inst_p, fsm_events_t evt_id, uint16_t nextst)
+{
+	trace_trans(inst_p, evt_id, inst_p->currst, nextst, 0);
+	stats_trans(inst_p->fsm_p, inst_p->currst, nextst);
+	return unlikely(stats_latency) ? stats_now() : 0;
+}
+
+/**
+ * fsm_step_move - make the next state current
+ * @inst_p - the FSM instance
+ * @nextst - dense index of the next state
+ *
+ * show_workers reads currst from other threads.
+ */
+static inline void fsm_step_move(fsm_inst_t *inst_p, uint16_t nextst)
+{
+	__atomic_store_n(&inst_p->currst, nextst, __ATOMIC_RELAXED);
+}
+
+/**
+ * fsm_step_end - account a transition after its actions ran
+ * @t0 - from fsm_step_begin
+ *
+ * Return: 0, see fsm_run
+ */
+static inline int fsm_step_end(uint64_t t0)
+{
+	if (t0)
+		stats_hist_add(&stats_get()->act, stats_now() - t0);
+	dbg_verbose("Guard PASSED");
+	return(0);
+}
+
+/**
+ * fsm_step_unmatched - account an event with no transition
+ * @inst_p - the FSM instance
+ * @evt_id - the event id
+ *
+ * Return: -1, see fsm_run
+ */
+static inline int fsm_step_unmatched(fsm_inst_t *inst_p, fsm_events_t evt_id)
+{
+	stats_inc(&stats_get()->unmatched, 1);
+	trace_trans(inst_p, evt_id, inst_p->currst, TRACE_NO_STATE, -1);
+	return(-1);
+}
+
+/**
+ * fsm_gen_act - run an action known at compile time
+ * @act - the action, may be NULL
+ * @inst_p - the FSM instance
+ */
+static inline void fsm_gen_act(action act, fsm_inst_t *inst_p)
+{
+	if (act)
+		act(inst_p);
+}
+
+/**
+ * fsm_gen_guard - check a guard known at compile time
+ * @guard - the guard, NULL always passes
+ * @inst_p - the FSM instance
+ */
+static inline bool fsm_gen_guard(constraint guard, fsm_inst_t *inst_p)
+{
+	return (NULL == guard || guard(inst_p));
+}
+
+/*
+ * FSM_GEN_STATE_FNS - the direct calls of the actions of state s_<st> and
+ * its parent, folded to a constant by the compiler
+ */
+#define FSM_GEN_STATE_FNS(st, entry, exit, up)				\
+	static inline void fsm_gen_entry_##st(fsm_inst_t *inst_p)	\
+	{								\
+		fsm_gen_act(entry, inst_p);				\
+	}								\
+	static inline void fsm_gen_exit_##st(fsm_inst_t *inst_p)	\
+	{								\
+		fsm_gen_act(exit, inst_p);				\
+	}								\
+	static inline const fsm_state_t *fsm_gen_up_##st(void)		\
+	{								\
+		return(up);						\
+	}
+
+/*
+ * FSM_GEN_STATE - define top level state s_<st>
+ */
+#define FSM_GEN_STATE(st, name, entry, exit)				\
+	fsm_state_t s_##st = {name, entry, exit, NULL};			\
+	FSM_GEN_STATE_FNS(st, entry, exit, NULL)
+
+/*
+ * FSM_GEN_SUBSTATE - define state s_<st> inside s_<parent>, defined before
+ */
+#define FSM_GEN_SUBSTATE(st, name, entry, exit, parent)			\
+	fsm_state_t s_##st = {name, entry, exit, &s_##parent};		\
+	FSM_GEN_STATE_FNS(st, entry, exit, &s_##parent)
+
+/* one fsm_trans_t */
+#define FSM_GEN_ROW(f, cur, evt, guard, next) {&s_##cur, evt, guard, &s_##next},
+
+/* runner state index */
+#define FSM_GEN_ENUM(f, st) f##_##st,
+
+/* runner index to state */
+#define FSM_GEN_STATE_P(f, st) &s_##st,
+
+/*
+ * one transition in the runner, same steps as fsm_step_table; across
+ * nesting levels it takes the compiled chains
+ */
+#define FSM_GEN_CASE(f, cur, evt, guard, next)				\
+	case f##_##cur * E_LAST + evt:					\
+		if (fsm_gen_up_##cur() != fsm_gen_up_##next())		\
+			break;						\
+		dbg_trans(inst_p, &s_##next, evt_id);			\
+		if (!fsm_gen_guard(guard, inst_p))			\
+			return fsm_step_guard_failed(inst_p, evt_id, f##_##next); \
+		t0 = fsm_step_begin(inst_p, evt_id, f##_##next);	\
+		fsm_gen_exit_##cur(inst_p);				\
+		fsm_step_move(inst_p, f##_##next);			\
+		fsm_gen_entry_##next(inst_p);				\
+		return fsm_step_end(t0);
+
+/**
+ * FSM_GEN - the table @table and its runner fsm_run_@f
+ * @f - runner name, prefix of the state indices
+ * @table - fsm_trans_t table name
+ * @STATES - the state list, in fsm_compile order
+ * @ROWS - the transition list
+ *
+ * Also defines @f_gen, the fsm_gen_t for fsm_specialize.
+ */
+#define FSM_GEN(f, table, STATES, ROWS)					\
+	fsm_trans_t table[] = {						\
+		ROWS(FSM_GEN_ROW, f)					\
+		/* end of table for fsm_compile */			\
+		{NULL, E_BAD, NULL, NULL},				\
+	};								\
+									\
+	enum f##_states {						\
+		STATES(FSM_GEN_ENUM, f)					\
+		f##_NSTATES						\
+	};								\
+									\
+	static inline int fsm_step_##f(fsm_inst_t *inst_p, fsm_events_t evt_id) \
+	{								\
+		uint64_t t0;						\
+									\
+		switch (evt_id < E_LAST ? inst_p->currst * E_LAST + evt_id : UINT32_MAX) { \
+		ROWS(FSM_GEN_CASE, f)					\
+		}							\
+		/* a parent transition, or none */			\
+		return fsm_step_table(inst_p, evt_id);			\
+	}								\
+									\
+	static int fsm_run_##f(fsm_inst_t *inst_p, fsm_events_t evt_id,	\
+			       const evt_payload_t *pl_p)		\
+	{								\
+		int ret;						\
+									\
+		inst_p->pl_p = pl_p;					\
+		stats_evt(evt_id);					\
+		ret = fsm_step_##f(inst_p, evt_id);			\
+		inst_p->pl_p = NULL;					\
+		return(ret);						\
+	}								\
+									\
+	static fsm_state_t * const f##_state_p[] = {			\
+		STATES(FSM_GEN_STATE_P, f)				\
+	};								\
+									\
+	const fsm_gen_t f##_gen = {#f, table, fsm_run_##f, f##_state_p, f##_NSTATES};
+
+#endif /* _FSMGEN_H */
@@ -0,0 +1,912 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * FSM instance scheduler, see fsmsched.h
+ *
+ * Posting an event is an MPSC enqueue to the instance mailbox followed by
+ * an exchange on the instance sched flag.  Only the poster that flips it
+ * 0->1 makes the instance runnable.  After a run the pool thread clears
+ * the flag and then checks the mailbox again, a post racing with the
+ * clear either sees 0 and queues the instance or its event is seen by
+ * the check.  The flag exchange also orders one run of an instance before
+ * the next, whichever thread does it.
+ *
+ * Parking uses park_mutex plus the idle count: a parking thread bumps
+ * idle and looks at every queue once more under the mutex, a thread that
+ * makes work runnable checks idle after publishing it and only then takes
+ * the mutex to signal.
+ */
+
+#include "utils.h"
+#include "workers.h"
+#include "fsmsched.h"
+#include "arena.h"
+
+/*
+ * sched_self_p - the fsmsched_thread_t of the calling pool thread, NULL
+ * for any other thread
+ */
+static __thread fsmsched_thread_t *sched_self_p;
+
+/**
+ * deque_init - set up an empty deque
+ * @dq_p: the deque
+ */
+static void deque_init(fsmsched_deque_t *dq_p)
+{
+	fsmsched_deque_buf_t *buf_p;
+
+	buf_p = calloc(1, sizeof(fsmsched_deque_buf_t) +
+		       FSMSCHED_DEQUE_SIZE * sizeof(fsmsched_inst_t *));
+	if (NULL == buf_p)
+		die("deque_init");
+	buf_p->size = FSMSCHED_DEQUE_SIZE;
+
+	atomic_init(&dq_p->top, 0);
+	atomic_init(&dq_p->bottom, 0);
+	atomic_init(&dq_p->buf_p, buf_p);
+}
+
+/**
+ * deque_grow - double the deque array, owner only
+ * @dq_p: the deque
+ * @buf_p: the current, full, array
+ * @top: current top
+ * @bottom: current bottom
+ *
+ * Return: the new array
+ */
+static fsmsched_deque_buf_t *deque_grow(fsmsched_deque_t *dq_p, fsmsched_deque_buf_t *buf_p,
+					int64_t top, int64_t bottom)
+{
+	fsmsched_deque_buf_t *new_p;
+	int64_t i;
+
+	new_p = malloc(sizeof(fsmsched_deque_buf_t) + 2 * buf_p->size * sizeof(fsmsched_inst_t *));
+	if (NULL == new_p)
+		die("deque_grow");
+	new_p->size = 2 * buf_p->size;
+	new_p->next_p = buf_p;
+	for (i=top; i<bottom; i++)
+		atomic_store_explicit(&new_p->slot[i & (new_p->size - 1)],
+				      atomic_load_explicit(&buf_p->slot[i & (buf_p->size - 1)],
+							   memory_order_relaxed),
+				      memory_order_relaxed);
+	atomic_store_explicit(&dq_p->buf_p, new_p, memory_order_release);
+	return(new_p);
+}
+
+/**
+ * deque_push - push an instance at the bottom, owner only
+ * @dq_p: the deque
+ * @si_p: the instance
+ */
+static void deque_push(fsmsched_deque_t *dq_p, fsmsched_inst_t *si_p)
+{
+	int64_t b = atomic_load_explicit(&dq_p->bottom, memory_order_relaxed);
+	int64_t t = atomic_load_explicit(&dq_p->top, memory_order_acquire);
+	fsmsched_deque_buf_t *buf_p = atomic_load_explicit(&dq_p->buf_p, memory_order_relaxed);
+
+	if (b - t > buf_p->size - 1)
+		buf_p = deque_grow(dq_p, buf_p, t, b);
+
+	atomic_store_explicit(&buf_p->slot[b & (buf_p->size - 1)], si_p, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&dq_p->bottom, b+1, memory_order_relaxed);
+}
+
+/**
+ * deque_pop - pop the most recently pushed instance, owner only
+ * @dq_p: the deque
+ *
+ * Only the last instance can race with a thief, the CAS on top decides.
+ *
+ * Return: the instance or NULL if the deque is empty
+ */
+static fsmsched_inst_t *deque_pop(fsmsched_deque_t *dq_p)
+{
+	int64_t b = atomic_load_explicit(&dq_p->bottom, memory_order_relaxed) - 1;
+	fsmsched_deque_buf_t *buf_p = atomic_load_explicit(&dq_p->buf_p, memory_order_relaxed);
+	fsmsched_inst_t *si_p = NULL;
+	int64_t t;
+
+	atomic_store_explicit(&dq_p->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&dq_p->top, memory_order_relaxed);
+
+	if (t <= b) {
+		si_p = atomic_load_explicit(&buf_p->slot[b & (buf_p->size - 1)],
+					    memory_order_relaxed);
+		if (t == b) {
+			/* last one, race the thieves for it */
+			if (!atomic_compare_exchange_strong_explicit(&dq_p->top, &t, t+1,
+								     memory_order_seq_cst,
+								     memory_order_relaxed))
+				si_p = NULL;
+			atomic_store_explicit(&dq_p->bottom, b+1, memory_order_relaxed);
+		}
+	} else {
+		atomic_store_explicit(&dq_p->bottom, b+1, memory_order_relaxed);
+	}
+	return(si_p);
+}
+
+/**
+ * deque_steal - take the oldest instance, any thread
+ * @dq_p: the deque
+ *
+ * Return: the instance, NULL if empty or another thread won the race
+ */
+static fsmsched_inst_t *deque_steal(fsmsched_deque_t *dq_p)
+{
+	int64_t t = atomic_load_explicit(&dq_p->top, memory_order_acquire);
+	fsmsched_deque_buf_t *buf_p;
+	fsmsched_inst_t *si_p;
+	int64_t b;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&dq_p->bottom, memory_order_acquire);
+	if (t >= b)
+		return(NULL);
+
+	buf_p = atomic_load_explicit(&dq_p->buf_p, memory_order_acquire);
+	si_p = atomic_load_explicit(&buf_p->slot[t & (buf_p->size - 1)], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&dq_p->top, &t, t+1,
+						     memory_order_seq_cst,
+						     memory_order_relaxed))
+		return(NULL);
+	return(si_p);
+}
+
+/**
+ * deque_empty - snapshot check, any thread
+ * @dq_p: the deque
+ */
+static bool deque_empty(fsmsched_deque_t *dq_p)
+{
+	return atomic_load(&dq_p->bottom) <= atomic_load(&dq_p->top);
+}
+
+/**
+ * inject_push - add an instance to the tail of the injection queue
+ * @sched_p: the scheduler
+ * @si_p: instance, its sched flag was just set
+ */
+static void inject_push(fsmsched_t *sched_p, fsmsched_inst_t *si_p)
+{
+	si_p->next_p = NULL;
+
+	pthread_mutex_lock(&sched_p->inj_mutex);
+	if (sched_p->inj_tail_p)
+		sched_p->inj_tail_p->next_p = si_p;
+	else
+		sched_p->inj_head_p = si_p;
+	sched_p->inj_tail_p = si_p;
+	atomic_fetch_add(&sched_p->inj_len, 1);
+	pthread_mutex_unlock(&sched_p->inj_mutex);
+}
+
+/**
+ * inject_pop - take the first instance off the injection queue
+ * @sched_p: the scheduler
+ *
+ * Return: the instance or NULL if the queue is empty
+ */
+static fsmsched_inst_t *inject_pop(fsmsched_t *sched_p)
+{
+	fsmsched_inst_t *si_p;
+
+	if (0 == atomic_load_explicit(&sched_p->inj_len, memory_order_relaxed))
+		return(NULL);
+
+	pthread_mutex_lock(&sched_p->inj_mutex);
+	si_p = sched_p->inj_head_p;
+	if (si_p) {
+		sched_p->inj_head_p = si_p->next_p;
+		if (NULL == sched_p->inj_head_p)
+			sched_p->inj_tail_p = NULL;
+		atomic_fetch_sub(&sched_p->inj_len, 1);
+	}
+	pthread_mutex_unlock(&sched_p->inj_mutex);
+	return(si_p);
+}
+
+/**
+ * sched_wake - wake a parked pool thread, if there is one
+ * @sched_p: the scheduler
+ *
+ * Called after new work is published.  The fence pairs with the idle
+ * increment in sched_park.
+ */
+static void sched_wake(fsmsched_t *sched_p)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (0 == atomic_load_explicit(&sched_p->idle, memory_order_relaxed))
+		return;
+
+	pthread_mutex_lock(&sched_p->park_mutex);
+	pthread_cond_signal(&sched_p->park_cond);
+	pthread_mutex_unlock(&sched_p->park_mutex);
+}
+
+/**
+ * sched_runnable - make an instance runnable
+ * @si_p: instance, its sched flag was just set by the caller
+ * @local: a pool thread of the same scheduler may use its own deque
+ */
+static void sched_runnable(fsmsched_inst_t *si_p, bool local)
+{
+	fsmsched_t *sched_p = si_p->sched_p;
+
+	if (local && sched_self_p && sched_self_p->sched_p == sched_p)
+		deque_push(&sched_self_p->deque, si_p);
+	else
+		inject_push(sched_p, si_p);
+	sched_wake(sched_p);
+}
+
+/**
+ * sched_work - any runnable instance, snapshot
+ * @sched_p: the scheduler
+ */
+static bool sched_work(fsmsched_t *sched_p)
+{
+	uint32_t i;
+
+	if (atomic_load(&sched_p->inj_len))
+		return(true);
+	for (i=0; i<sched_p->nthreads; i++)
+		if (!deque_empty(&sched_p->thr_p[i].deque))
+			return(true);
+	return(false);
+}
+
+/**
+ * sched_park - sleep until there is work or the scheduler stops
+ * @thr_p: the calling pool thread
+ *
+ * While the scheduler is paused the thread sleeps even with work, the
+ * last one to park wakes fsmsched_pause.
+ */
+static void sched_park(fsmsched_thread_t *thr_p)
+{
+	fsmsched_t *sched_p = thr_p->sched_p;
+	bool pause;
+
+	pthread_mutex_lock(&sched_p->park_mutex);
+	atomic_fetch_add(&sched_p->idle, 1);
+	pause = atomic_load(&sched_p->pause);
+	if (pause && atomic_load(&sched_p->idle) == sched_p->nthreads)
+		pthread_cond_signal(&sched_p->pause_cond);
+	if ((pause || !sched_work(sched_p)) && !atomic_load(&sched_p->stop)) {
+		__atomic_store_n(&thr_p->parks, thr_p->parks + 1, __ATOMIC_RELAXED);
+		pthread_cond_wait(&sched_p->park_cond, &sched_p->park_mutex);
+	}
+	atomic_fetch_sub(&sched_p->idle, 1);
+	pthread_mutex_unlock(&sched_p->park_mutex);
+}
+
+/**
+ * sched_steal - try to steal from every other pool thread once
+ * @thr_p: the calling pool thread
+ *
+ * Start with the next thread so thieves spread over the victims.
+ *
+ * Return: a stolen instance or NULL
+ */
+static fsmsched_inst_t *sched_steal(fsmsched_thread_t *thr_p)
+{
+	fsmsched_t *sched_p = thr_p->sched_p;
+	fsmsched_inst_t *si_p;
+	uint32_t i, victim;
+
+	for (i=1; i<sched_p->nthreads; i++) {
+		victim = (thr_p->idx + i) % sched_p->nthreads;
+		if (NULL != (si_p = deque_steal(&sched_p->thr_p[victim].deque))) {
+			__atomic_store_n(&thr_p->steals, thr_p->steals + 1, __ATOMIC_RELAXED);
+			return(si_p);
+		}
+	}
+	return(NULL);
+}
+
+/**
+ * sched_next - find the next instance to run
+ * @thr_p: the calling pool thread
+ *
+ * Own deque (newest first, the events it was just sent are hot in the
+ * cache), then the injection queue, then steal.  Every
+ * FSMSCHED_INJECT_EVERY runs the injection queue goes first so a stream
+ * of local work cannot starve it.  Spin FSMSCHED_SPIN times over all of
+ * them before parking.  A paused scheduler parks right away.
+ *
+ * Return: the instance or NULL when the scheduler is stopping
+ */
+static fsmsched_inst_t *sched_next(fsmsched_thread_t *thr_p)
+{
+	fsmsched_t *sched_p = thr_p->sched_p;
+	fsmsched_inst_t *si_p = NULL;
+	int spin = 0;
+
+	if (0 == thr_p->runs % FSMSCHED_INJECT_EVERY && !atomic_load(&sched_p->pause) &&
+	    (si_p = inject_pop(sched_p)))
+		return(si_p);
+
+	while (!atomic_load_explicit(&sched_p->stop, memory_order_relaxed)) {
+		if (atomic_load(&sched_p->pause)) {
+			sched_park(thr_p);
+			continue;
+		}
+		if ((si_p = deque_pop(&thr_p->deque)) ||
+		    (si_p = inject_pop(sched_p)) ||
+		    (si_p = sched_steal(thr_p)))
+			return(si_p);
+
+		if (++spin < FSMSCHED_SPIN) {
+			cpu_relax();
+			continue;
+		}
+		sched_park(thr_p);
+		spin = 0;
+	}
+	return(NULL);
+}
+
+/**
+ * sched_take - take the next events of an instance
+ * @si_p: the instance
+ * @evts: gets up to FSMSCHED_BATCH event ids
+ * @pls: gets their payloads
+ *
+ * The mailbox first, the spill once the mailbox is empty: a poster only
+ * goes back to the mailbox when the spill is empty, so its events stay in
+ * order.
+ *
+ * Return: number of events taken
+ */
+static size_t sched_take(fsmsched_inst_t *si_p, fsm_events_t *evts, evt_payload_t *pls)
+{
+	size_t n;
+
+	n = evtq_trydequeue_batch_pl(si_p->mbox_p, evts, pls, FSMSCHED_BATCH);
+	if (n || 0 == atomic_load(&si_p->spilled))
+		return(n);
+
+	pthread_mutex_lock(&si_p->spill_mutex);
+	n = evtq_trydequeue_batch_pl(si_p->mbox_p, evts, pls, FSMSCHED_BATCH);
+	if (0 == n) {
+		n = evtq_trydequeue_batch_pl(si_p->spill_p, evts, pls, FSMSCHED_BATCH);
+		atomic_fetch_sub(&si_p->spilled, n);
+	}
+	pthread_mutex_unlock(&si_p->spill_mutex);
+	return(n);
+}
+
+/**
+ * fsmsched_thread_fn - pool thread loop
+ * @arg: worker_t, ctx_p is the fsmsched_thread_t
+ *
+ * Run each instance for up to FSMSCHED_BATCH events.  If its mailbox is
+ * still not empty it goes to the back of the injection queue, so one busy
+ * instance does not starve the others.
+ */
+static void *fsmsched_thread_fn(void *arg)
+{
+	worker_t *self_p = (worker_t *)arg;
+	fsmsched_thread_t *thr_p = (fsmsched_thread_t *)self_p->ctx_p;
+	fsm_events_t evts[FSMSCHED_BATCH];
+	evt_payload_t pls[FSMSCHED_BATCH];
+	fsmsched_inst_t *si_p;
+	size_t n, i;
+
+	sched_self_p = thr_p;
+
+	while (NULL != (si_p = sched_next(thr_p))) {
+		__atomic_store_n(&thr_p->runs, thr_p->runs + 1, __ATOMIC_RELAXED);
+
+		n = sched_take(si_p, evts, pls);
+		/* events after the final state are dropped */
+		if (!si_p->done)
+			fsm_run_batch_pl(&si_p->inst, evts, pls, n);
+		else
+			for (i=0; i<n; i++)
+				evt_payload_release(&pls[i]);
+		evtq_done(n);
+
+		atomic_store(&si_p->sched, 0);
+		if ((evtq_len(si_p->mbox_p) || atomic_load(&si_p->spilled)) &&
+		    0 == atomic_exchange(&si_p->sched, 1))
+			sched_runnable(si_p, false);
+	}
+
+	dbg("exitting...");
+	return(NULL);
+}
+
+/**
+ * sched_host_broadcast - fsm_host_t broadcast for a scheduled instance
+ * @inst_p: the sending instance
+ * @evt_id: the event id
+ * @self: also to the sender
+ *
+ * Every other member of the instance group gets the event.  Same as
+ * worker_host_broadcast for the two worker FSMs.
+ */
+static void sched_host_broadcast(fsm_inst_t *inst_p, fsm_events_t evt_id, bool self)
+{
+	fsmsched_inst_t *si_p = (fsmsched_inst_t *)inst_p->host_ctx;
+	fsmsched_group_t *group_p = si_p->group_p;
+	uint64_t filtered = 0;
+	int i;
+
+	for (i=0; i<group_p->n; i++) {
+		if (!self && group_p->inst_pp[i] == si_p)
+			continue;
+		if (!fsm_accepts(group_p->inst_pp[i]->inst.fsm_p, evt_id)) {
+			filtered++;
+			continue;
+		}
+		fsmsched_post(group_p->inst_pp[i], evt_id);
+	}
+	if (filtered)
+		stats_filtered(filtered);
+}
+
+/**
+ * sched_host_done - fsm_host_t done for a scheduled instance
+ * @inst_p: the instance
+ *
+ * Retire the instance, the last one wakes fsmsched_join.
+ */
+static void sched_host_done(fsm_inst_t *inst_p)
+{
+	fsmsched_inst_t *si_p = (fsmsched_inst_t *)inst_p->host_ctx;
+	fsmsched_t *sched_p = si_p->sched_p;
+
+	si_p->done = true;
+	if (1 == atomic_fetch_sub(&sched_p->live, 1)) {
+		pthread_mutex_lock(&sched_p->mutex);
+		pthread_cond_broadcast(&sched_p->cond);
+		pthread_mutex_unlock(&sched_p->mutex);
+	}
+}
+
+static const fsm_host_t sched_host = {
+	.broadcast = sched_host_broadcast,
+	.done = sched_host_done,
+};
+
+/**
+ * fsmsched_create - create a scheduler and start its pool threads
+ * @nthreads: number of pool threads, at least 1
+ *
+ * The pool threads are workers (worker_self works in actions) but are
+ * not put on the workers list, they get events only through instance
+ * mailboxes.  Each pool thread owns one work-stealing deque.
+ *
+ * Return: the scheduler
+ */
+fsmsched_t *fsmsched_create(uint32_t nthreads)
+{
+	fsmsched_t *sched_p;
+	char name[32];
+	uint32_t i;
+
+	if (0 == nthreads)
+		nthreads = 1;
+
+	if (NULL == (sched_p = calloc(1, sizeof(fsmsched_t))))
+		die("fsmsched_create");
+	if (NULL == (sched_p->thr_p = arena_calloc(nthreads * sizeof(fsmsched_thread_t))))
+		die("fsmsched_create threads");
+
+	sched_p->nthreads = nthreads;
+	atomic_init(&sched_p->live, 0);
+	atomic_init(&sched_p->stop, false);
+	pthread_mutex_init(&sched_p->mutex, NULL);
+	pthread_cond_init(&sched_p->cond, NULL);
+	pthread_mutex_init(&sched_p->inj_mutex, NULL);
+	atomic_init(&sched_p->inj_len, 0);
+	pthread_mutex_init(&sched_p->park_mutex, NULL);
+	pthread_cond_init(&sched_p->park_cond, NULL);
+	atomic_init(&sched_p->idle, 0);
+	atomic_init(&sched_p->pause, false);
+	pthread_cond_init(&sched_p->pause_cond, NULL);
+
+	/* all deques must exist before any pool thread can steal */
+	for (i=0; i<nthreads; i++) {
+		deque_init(&sched_p->thr_p[i].deque);
+		sched_p->thr_p[i].idx = i;
+		sched_p->thr_p[i].sched_p = sched_p;
+	}
+
+	for (i=0; i<nthreads; i++) {
+		fsmsched_thread_t *thr_p = &sched_p->thr_p[i];
+
+		snprintf(name, sizeof(name), "pool%u", i);
+		thr_p->w_p = worker_ctx_create(fsmsched_thread_fn, name, thr_p);
+	}
+	return(sched_p);
+}
+
+/**
+ * fsmsched_group_create - create an empty instance group
+ * @sched_p: the scheduler
+ *
+ * Return: the group
+ */
+fsmsched_group_t *fsmsched_group_create(fsmsched_t *sched_p)
+{
+	fsmsched_group_t *group_p;
+
+	if (NULL == (group_p = arena_calloc(sizeof(fsmsched_group_t))))
+		die("fsmsched_group_create");
+	return(group_p);
+}
+
+/**
+ * fsmsched_inst_add - add an FSM instance to a group without starting it
+ * @sched_p: the scheduler
+ * @group_p: group for the instance broadcasts
+ * @fsm_p: compiled FSM, shared with other instances
+ * @timer_base: first timer id owned by the instance, see fsm_timer_id
+ *
+ * The instance is in its initial state but no entry action has run,
+ * fsmsnap_restore sets its state instead.
+ *
+ * Return: the instance
+ */
+fsmsched_inst_t *fsmsched_inst_add(fsmsched_t *sched_p, fsmsched_group_t *group_p,
+				   const fsm_t *fsm_p, uint32_t timer_base)
+{
+	evtq_attr_t attr = {
+		.type = EVTQ_MPSC,
+		.size = FSMSCHED_MBOX_SIZE,
+		.wake = EVTQ_WAKE_IMMEDIATE,
+	};
+	evtq_attr_t spill_attr = {
+		.type = EVTQ_LIST,
+		.wake = EVTQ_WAKE_IMMEDIATE,
+	};
+	fsmsched_inst_t *si_p;
+	int i;
+
+	if (group_p->n >= FSMSCHED_GROUP_MAX)
+		die("fsmsched group full");
+
+	if (NULL == (si_p = arena_calloc(sizeof(fsmsched_inst_t))))
+		die("fsmsched_inst_create");
+
+	fsm_inst_init(&si_p->inst, fsm_p, &sched_host, si_p, timer_base);
+	si_p->mbox_p = evtq_create(&attr);
+	si_p->spill_p = evtq_create(&spill_attr);
+	atomic_init(&si_p->spilled, 0);
+	pthread_mutex_init(&si_p->spill_mutex, NULL);
+	atomic_init(&si_p->sched, 0);
+	si_p->group_p = group_p;
+	si_p->sched_p = sched_p;
+	group_p->inst_pp[group_p->n++] = si_p;
+
+	pthread_mutex_lock(&sched_p->mutex);
+	for (i=0; i<sched_p->nfsm; i++)
+		if (sched_p->fsm_pp[i] == fsm_p)
+			break;
+	if (i == sched_p->nfsm) {
+		if (sched_p->nfsm >= FSMSCHED_FSM_MAX)
+			die("fsmsched too many FSMs");
+		sched_p->fsm_pp[sched_p->nfsm++] = fsm_p;
+	}
+
+	if (sched_p->ninst == sched_p->ninst_max) {
+		sched_p->ninst_max = sched_p->ninst_max ? 2*sched_p->ninst_max : 64;
+		sched_p->inst_pp = realloc(sched_p->inst_pp,
+					   sched_p->ninst_max * sizeof(fsmsched_inst_t *));
+		if (NULL == sched_p->inst_pp)
+			die("fsmsched_inst_create list");
+	}
+	si_p->inst.id = sched_p->ninst;
+	sched_p->inst_pp[sched_p->ninst++] = si_p;
+	atomic_fetch_add(&sched_p->live, 1);
+	pthread_mutex_unlock(&sched_p->mutex);
+	return(si_p);
+}
+
+/**
+ * fsmsched_inst_create - add an FSM instance to a group
+ * @sched_p: the scheduler
+ * @group_p: group for the instance broadcasts
+ * @fsm_p: compiled FSM, shared with other instances
+ * @timer_base: first timer id owned by the instance, see fsm_timer_id
+ *
+ * The instance may run on any pool thread.  Its init state entry
+ * action (fsm_init) is called here, on the calling thread, before any
+ * event can be posted to it.
+ *
+ * Return: the instance
+ */
+fsmsched_inst_t *fsmsched_inst_create(fsmsched_t *sched_p, fsmsched_group_t *group_p,
+				      const fsm_t *fsm_p, uint32_t timer_base)
+{
+	fsmsched_inst_t *si_p = fsmsched_inst_add(sched_p, group_p, fsm_p, timer_base);
+
+	fsm_init(&si_p->inst);
+	return(si_p);
+}
+
+/**
+ * sched_put - queue events on an instance without waiting
+ * @si_p: the instance
+ * @ids_p: the event ids, in order
+ * @pls_p: @n payloads, NULL for none
+ * @n: number of events
+ *
+ * The mailbox while nothing is spilled, the spill behind it once the
+ * mailbox is full, until the pool thread has taken the spill back.
+ */
+static void sched_put(fsmsched_inst_t *si_p, const fsm_events_t *ids_p,
+		      const evt_payload_t *pls_p, size_t n)
+{
+	size_t done = 0;
+
+	if (0 == atomic_load(&si_p->spilled)) {
+		done = evtq_tryenqueue_batch_pl(si_p->mbox_p, ids_p, pls_p, n);
+		if (done == n)
+			return;
+	}
+
+	pthread_mutex_lock(&si_p->spill_mutex);
+	if (0 == atomic_load(&si_p->spilled))
+		done += evtq_tryenqueue_batch_pl(si_p->mbox_p, ids_p + done,
+						 pls_p ? pls_p + done : NULL, n - done);
+	if (done < n) {
+		evtq_enqueue_batch_pl(si_p->spill_p, ids_p + done,
+				      pls_p ? pls_p + done : NULL, n - done);
+		atomic_fetch_add(&si_p->spilled, n - done);
+	}
+	pthread_mutex_unlock(&si_p->spill_mutex);
+}
+
+/**
+ * fsmsched_post - send an event to one instance
+ * @si_p: the instance
+ * @evt_id: the event id
+ *
+ * Safe from any thread.  A pool thread (an action broadcasting to its
+ * group) puts the instance on its own deque, so a group tends to stay on
+ * one thread until another thread steals it.  A post never waits: the
+ * events a full mailbox has no room for go to the instance's unbounded
+ * spill.  A pool thread waiting on a mailbox only pool threads drain could
+ * deadlock, e.g. two instances of a group broadcasting to each other.
+ */
+void fsmsched_post(fsmsched_inst_t *si_p, fsm_events_t evt_id)
+{
+	fsmsched_post_pl(si_p, evt_id, NULL);
+}
+
+/**
+ * fsmsched_post_pl - send an event with a payload to one instance
+ * @si_p: the instance
+ * @evt_id: the event id
+ * @pl_p: payload, NULL for none, the mailbox takes its buffer reference
+ */
+void fsmsched_post_pl(fsmsched_inst_t *si_p, fsm_events_t evt_id, const evt_payload_t *pl_p)
+{
+	sched_put(si_p, &evt_id, pl_p, 1);
+
+	if (0 == atomic_exchange(&si_p->sched, 1))
+		sched_runnable(si_p, true);
+}
+
+/**
+ * fsmsched_post_batch_pl - send @n events to one instance
+ * @si_p: the instance
+ * @ids_p: the event ids, in order
+ * @pls_p: @n payloads, NULL for none, the mailbox takes their buffer references
+ * @n: number of events
+ *
+ * One mailbox batch and one runnable check for the lot, e.g. for a run of
+ * ingested frames to the same instance.
+ */
+void fsmsched_post_batch_pl(fsmsched_inst_t *si_p, const fsm_events_t *ids_p,
+			    const evt_payload_t *pls_p, size_t n)
+{
+	sched_put(si_p, ids_p, pls_p, n);
+
+	if (n && 0 == atomic_exchange(&si_p->sched, 1))
+		sched_runnable(si_p, true);
+}
+
+/**
+ * fsmsched_broadcast - send an event to every instance
+ * @sched_p: the scheduler
+ * @evt_id: the event id
+ *
+ * Called from workers_evt_broadcast, e.g. for CLI and script events.
+ * Instances must not be created while broadcasting.
+ */
+void fsmsched_broadcast(fsmsched_t *sched_p, fsm_events_t evt_id)
+{
+	fsmsched_broadcast_pl(sched_p, evt_id, NULL);
+}
+
+/**
+ * fsmsched_broadcast_pl - send an event with a payload to every instance
+ * @sched_p: the scheduler
+ * @evt_id: the event id
+ * @pl_p: payload, NULL for none, the caller keeps it
+ *
+ * Each instance gets its own copy or buffer reference.
+ */
+void fsmsched_broadcast_pl(fsmsched_t *sched_p, fsm_events_t evt_id, const evt_payload_t *pl_p)
+{
+	uint64_t filtered = 0;
+	evt_payload_t pl;
+	uint32_t i;
+
+	for (i=0; i<sched_p->ninst; i++) {
+		if (!fsm_accepts(sched_p->inst_pp[i]->inst.fsm_p, evt_id)) {
+			filtered++;
+			continue;
+		}
+		evt_payload_dup(&pl, pl_p);
+		fsmsched_post_pl(sched_p->inst_pp[i], evt_id, &pl);
+	}
+	if (filtered)
+		stats_filtered(filtered);
+}
+
+/**
+ * fsmsched_pause - stop running instances until fsmsched_resume
+ * @sched_p: the scheduler
+ *
+ * Returns once every pool thread is parked, instance states and
+ * mailboxes are then only touched by the caller.  Events posted while
+ * paused wait in the mailboxes and spills.  Not from a pool thread.
+ */
+void fsmsched_pause(fsmsched_t *sched_p)
+{
+	pthread_mutex_lock(&sched_p->park_mutex);
+	atomic_store(&sched_p->pause, true);
+	while (atomic_load(&sched_p->idle) < sched_p->nthreads)
+		pthread_cond_wait(&sched_p->pause_cond, &sched_p->park_mutex);
+	pthread_mutex_unlock(&sched_p->park_mutex);
+}
+
+/**
+ * fsmsched_resume - run instances again after fsmsched_pause
+ * @sched_p: the scheduler
+ */
+void fsmsched_resume(fsmsched_t *sched_p)
+{
+	pthread_mutex_lock(&sched_p->park_mutex);
+	atomic_store(&sched_p->pause, false);
+	pthread_cond_broadcast(&sched_p->park_cond);
+	pthread_mutex_unlock(&sched_p->park_mutex);
+}
+
+/**
+ * fsmsched_join - wait for every instance to finish, then stop the pool
+ * @sched_p: the scheduler
+ */
+void fsmsched_join(fsmsched_t *sched_p)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&sched_p->mutex);
+	while (atomic_load(&sched_p->live))
+		pthread_cond_wait(&sched_p->cond, &sched_p->mutex);
+	pthread_mutex_unlock(&sched_p->mutex);
+
+	atomic_store(&sched_p->stop, true);
+	pthread_mutex_lock(&sched_p->park_mutex);
+	pthread_cond_broadcast(&sched_p->park_cond);
+	pthread_mutex_unlock(&sched_p->park_mutex);
+
+	for (i=0; i<sched_p->nthreads; i++) {
+		fsmsched_thread_t *thr_p = &sched_p->thr_p[i];
+
+		pthread_join(thr_p->w_p->worker_id, NULL);
+		if (dbg_on(DBG_WORKER))
+			printf("%s: joined\n", thr_p->w_p->name);
+	}
+}
+
+/**
+ * fsmsched_destroy - free a joined scheduler and its instances
+ * @sched_p: the scheduler
+ *
+ * Instance timers are left to the timer service.  Instances from the
+ * arena are not walked, they go with arena_destroy.
+ */
+void fsmsched_destroy(fsmsched_t *sched_p)
+{
+	fsmsched_inst_t *si_p;
+	uint32_t i;
+
+	for (i=0; i<sched_p->ninst && !fsm_arena; i++) {
+		si_p = sched_p->inst_pp[i];
+		evtq_destroy(si_p->mbox_p);
+		evtq_destroy(si_p->spill_p);
+		pthread_mutex_destroy(&si_p->spill_mutex);
+		/* the last member frees the group */
+		if (si_p->group_p->inst_pp[si_p->group_p->n - 1] == si_p)
+			arena_free(si_p->group_p);
+		arena_free(si_p);
+	}
+	free(sched_p->inst_pp);
+
+	for (i=0; i<sched_p->nthreads; i++) {
+		fsmsched_thread_t *thr_p = &sched_p->thr_p[i];
+		fsmsched_deque_buf_t *buf_p, *n_p;
+
+		for (buf_p = atomic_load(&thr_p->deque.buf_p); buf_p; buf_p = n_p) {
+			n_p = buf_p->next_p;
+			free(buf_p);
+		}
+		evtq_destroy(thr_p->w_p->evtq_p);
+		arena_free(thr_p->w_p);
+	}
+	arena_free(sched_p->thr_p);
+
+	pthread_mutex_destroy(&sched_p->mutex);
+	pthread_cond_destroy(&sched_p->cond);
+	pthread_mutex_destroy(&sched_p->inj_mutex);
+	pthread_mutex_destroy(&sched_p->park_mutex);
+	pthread_cond_destroy(&sched_p->park_cond);
+	pthread_cond_destroy(&sched_p->pause_cond);
+	free(sched_p);
+}
+
+/**
+ * fsmsched_show - print the pool threads and a state histogram
+ * @sched_p: the scheduler
+ *
+ * Queue depths are the events waiting in all mailboxes, the runnable
+ * instances on the injection queue and on each pool thread deque.
+ * Instances may change state while being counted.
+ */
+void fsmsched_show(fsmsched_t *sched_p)
+{
+	fsmsched_deque_t *dq_p;
+	uint64_t queued = 0;
+	uint32_t *cnt_p;
+	uint32_t i;
+	int f, s;
+
+	for (i=0; i<sched_p->ninst; i++)
+		queued += evtq_len(sched_p->inst_pp[i]->mbox_p) +
+			atomic_load(&sched_p->inst_pp[i]->spilled);
+	printf("sched threads=%u instances=%u live=%u queued=%lu inject=%u\n",
+	       sched_p->nthreads, sched_p->ninst, atomic_load(&sched_p->live),
+	       queued, atomic_load(&sched_p->inj_len));
+	for (i=0; i<sched_p->nthreads; i++) {
+		dq_p = &sched_p->thr_p[i].deque;
+		printf("%-12s runs=%lu steals=%lu parks=%lu deque=%lld cpu=%d node=%d\n",
+		       sched_p->thr_p[i].w_p->name,
+		       __atomic_load_n(&sched_p->thr_p[i].runs, __ATOMIC_RELAXED),
+		       __atomic_load_n(&sched_p->thr_p[i].steals, __ATOMIC_RELAXED),
+		       __atomic_load_n(&sched_p->thr_p[i].parks, __ATOMIC_RELAXED),
+		       atomic_load(&dq_p->bottom) - atomic_load(&dq_p->top),
+		       sched_p->thr_p[i].w_p->cpu, sched_p->thr_p[i].w_p->node);
+	}
+
+	for (f=0; f<sched_p->nfsm; f++) {
+		const fsm_t *fsm_p = sched_p->fsm_pp[f];
+
+		if (NULL == (cnt_p = calloc(fsm_p->nstates, sizeof(uint32_t))))
+			die("fsmsched_show");
+		for (i=0; i<sched_p->ninst; i++)
+			if (sched_p->inst_pp[i]->inst.fsm_p == fsm_p)
+				cnt_p[__atomic_load_n(&sched_p->inst_pp[i]->inst.currst,
+						      __ATOMIC_RELAXED)]++;
+
+		printf("fsm%d:", f);
+		for (s=0; s<fsm_p->nstates; s++)
+			if (cnt_p[s])
+				printf(" %s=%u", fsm_p->state_pp[s]->name, cnt_p[s]);
+		printf("\n");
+		free(cnt_p);
+	}
+}
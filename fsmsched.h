@@ -0,0 +1,217 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * FSM instance scheduler
+ *
+ * Many fsm_inst_t instances, sharing compiled FSMs, multiplexed over a
+ * small pool of threads.  Each instance has an EVTQ_MPSC mailbox.  Posting
+ * an event to an idle instance makes it runnable: a pool thread pushes it
+ * on its own work-stealing deque, any other thread puts it on the shared
+ * injection queue.  Pool threads run their own deque first, then the
+ * injection queue, then steal from the other deques, then park.
+ *
+ * A runnable instance is on exactly one queue and is run by one thread at
+ * a time, which drains the mailbox in order through fsm_run_batch, so its
+ * FSM is never cranked by two threads at once and its events stay in
+ * order even when it moves between threads.
+ *
+ * Instances are created in groups (e.g. the stoplight and crosswalk of
+ * one intersection), an instance broadcast goes to its group instead of
+ * to every worker.
+ */
+
+#ifndef _FSMSCHED_H
+#define _FSMSCHED_H
+
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <stdatomic.h>   /* atomic_int */
+#include <pthread.h>     /* posix threads */
+#include "evtq.h"
+#include "fsm.h"
+
+/* slots in each instance mailbox */
+#define FSMSCHED_MBOX_SIZE 64
+/* most instances in a group */
+#define FSMSCHED_GROUP_MAX 4
+/* most different compiled FSMs, for fsmsched_show */
+#define FSMSCHED_FSM_MAX 8
+/* most events an instance takes from its mailbox each time it runs */
+#define FSMSCHED_BATCH 16
+/* initial deque size, it doubles when full */
+#define FSMSCHED_DEQUE_SIZE 256
+/* a pool thread checks the injection queue first every this many runs */
+#define FSMSCHED_INJECT_EVERY 32
+/* empty polls of every queue before a pool thread parks */
+#define FSMSCHED_SPIN 64
+
+struct fsmsched;
+struct fsmsched_group;
+
+/**
+ * fsmsched_inst_t - a scheduled FSM instance
+ * @inst: the FSM instance, host_ctx points back here
+ * @mbox_p: EVTQ_MPSC mailbox
+ * @spill_p: EVTQ_LIST overflow of a full @mbox_p, run after it
+ * @spilled: events on @spill_p, the posters check it without the lock
+ * @spill_mutex: guards moving events to and from @spill_p
+ * @sched: 1 while on a run queue or running, so it is queued only once
+ * @done: the instance reached its final state
+ * @next_p: injection queue link
+ * @group_p: group the instance broadcasts to
+ * @sched_p: owning scheduler
+ *
+ * Cache line aligned, instances are posted to from many threads and are
+ * allocated back to back.
+ */
+typedef struct fsmsched_inst {
+	fsm_inst_t inst;
+	evtq_t *mbox_p;
+	evtq_t *spill_p;
+	atomic_uint spilled;
+	pthread_mutex_t spill_mutex;
+	atomic_int sched;
+	bool done;
+	struct fsmsched_inst *next_p;
+	struct fsmsched_group *group_p;
+	struct fsmsched *sched_p;
+} ____cacheline_aligned fsmsched_inst_t;
+
+/**
+ * fsmsched_group_t - instances sharing broadcasts
+ * @inst_pp: group members
+ * @n: number of members
+ */
+typedef struct fsmsched_group {
+	fsmsched_inst_t *inst_pp[FSMSCHED_GROUP_MAX];
+	int n;
+} fsmsched_group_t;
+
+/**
+ * fsmsched_deque_buf_t - circular array of a work-stealing deque
+ * @size: number of slots, a power of two
+ * @next_p: older, smaller array, kept until fsmsched_destroy because a
+ *          thief may still read it
+ * @slot: the instances
+ */
+typedef struct fsmsched_deque_buf {
+	int64_t size;
+	struct fsmsched_deque_buf *next_p;
+	_Atomic(fsmsched_inst_t *) slot[];
+} fsmsched_deque_buf_t;
+
+/**
+ * fsmsched_deque_t - Chase-Lev work-stealing deque
+ * @top: next slot to steal, thieves race for it with a CAS
+ * @bottom: next slot to push, only the owner writes it
+ * @buf_p: current array
+ *
+ * The owner pushes and pops at @bottom, thieves take from @top.  This is
+ * the C11 version from "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013).
+ *
+ * @top and @bottom are on separate cache lines so thieves do not bounce
+ * the line the owner pushes on.
+ */
+typedef struct fsmsched_deque {
+	atomic_llong top ____cacheline_aligned;
+	atomic_llong bottom ____cacheline_aligned;
+	_Atomic(fsmsched_deque_buf_t *) buf_p;
+} fsmsched_deque_t;
+
+/**
+ * fsmsched_thread_t - one pool thread and its deque
+ * @deque: instances made runnable by this thread
+ * @runs: number of instance runs, for fsmsched_show
+ * @steals: number of instances stolen from other threads
+ * @parks: number of times the thread went to sleep
+ * @idx: index in fsmsched_t.thr_p
+ * @w_p: the pool worker, not on the workers list
+ * @sched_p: owning scheduler
+ *
+ * Cache line aligned, adjacent pool threads in fsmsched_t.thr_p do not
+ * share lines.
+ */
+typedef struct fsmsched_thread {
+	fsmsched_deque_t deque;
+	uint64_t runs;
+	uint64_t steals;
+	uint64_t parks;
+	uint32_t idx;
+	struct worker *w_p;
+	struct fsmsched *sched_p;
+} ____cacheline_aligned fsmsched_thread_t;
+
+_Static_assert(offsetof(fsmsched_deque_t, top) / L1_CACHE_BYTES !=
+	       offsetof(fsmsched_deque_t, bottom) / L1_CACHE_BYTES, "deque top apart from bottom");
+_Static_assert(sizeof(fsmsched_thread_t) % L1_CACHE_BYTES == 0, "fsmsched_thread_t is whole lines");
+
+/**
+ * fsmsched_t - the scheduler
+ * @nthreads: pool size
+ * @thr_p: pool threads
+ * @ninst: number of instances
+ * @ninst_max: allocated size of @inst_pp
+ * @inst_pp: all instances, in creation order
+ * @live: instances not done, fsmsched_join waits for 0
+ * @stop: tell the pool threads to exit
+ * @mutex: guards @inst_pp growth and the join wait
+ * @cond: signalled when @live goes to 0
+ * @inj_mutex: guards the injection queue
+ * @inj_head_p: first instance on the injection queue
+ * @inj_tail_p: last instance on the injection queue
+ * @inj_len: injection queue length, read without the lock to skip it
+ * @park_mutex: guards parking
+ * @park_cond: parked pool threads wait on it
+ * @idle: number of parked (or parking) pool threads
+ * @pause: pool threads park even with work, see fsmsched_pause
+ * @pause_cond: signalled when the last pool thread parks for @pause
+ * @fsm_pp: compiled FSMs used by the instances
+ * @nfsm: number of entries in @fsm_pp
+ */
+typedef struct fsmsched {
+	uint32_t nthreads;
+	fsmsched_thread_t *thr_p;
+	uint32_t ninst;
+	uint32_t ninst_max;
+	fsmsched_inst_t **inst_pp;
+	atomic_uint live;
+	atomic_bool stop;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_mutex_t inj_mutex;
+	fsmsched_inst_t *inj_head_p;
+	fsmsched_inst_t *inj_tail_p;
+	atomic_uint inj_len;
+	pthread_mutex_t park_mutex;
+	pthread_cond_t park_cond;
+	atomic_uint idle;
+	atomic_bool pause;
+	pthread_cond_t pause_cond;
+	const fsm_t *fsm_pp[FSMSCHED_FSM_MAX];
+	int nfsm;
+} fsmsched_t;
+
+extern fsmsched_t *fsmsched_create(uint32_t nthreads);
+extern fsmsched_group_t *fsmsched_group_create(fsmsched_t *sched_p);
+extern fsmsched_inst_t *fsmsched_inst_add(fsmsched_t *sched_p, fsmsched_group_t *group_p,
+					  const fsm_t *fsm_p, uint32_t timer_base);
+extern fsmsched_inst_t *fsmsched_inst_create(fsmsched_t *sched_p, fsmsched_group_t *group_p,
+					     const fsm_t *fsm_p, uint32_t timer_base);
+extern void fsmsched_post(fsmsched_inst_t *si_p, fsm_events_t evt_id);
+extern void fsmsched_post_pl(fsmsched_inst_t *si_p, fsm_events_t evt_id,
+			     const evt_payload_t *pl_p);
+extern void fsmsched_post_batch_pl(fsmsched_inst_t *si_p, const fsm_events_t *ids_p,
+				   const evt_payload_t *pls_p, size_t n);
+extern void fsmsched_broadcast(fsmsched_t *sched_p, fsm_events_t evt_id);
+extern void fsmsched_broadcast_pl(fsmsched_t *sched_p, fsm_events_t evt_id,
+				  const evt_payload_t *pl_p);
+extern void fsmsched_pause(fsmsched_t *sched_p);
+extern void fsmsched_resume(fsmsched_t *sched_p);
+extern void fsmsched_join(fsmsched_t *sched_p);
+extern void fsmsched_destroy(fsmsched_t *sched_p);
+extern void fsmsched_show(fsmsched_t *sched_p);
+
+#endif /* _FSMSCHED_H */
@@ -0,0 +1,455 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * Snapshot and restore of scheduled FSM instances, see fsmsnap.h
+ *
+ * The snapshot is built in memory while the timers are held and the pool
+ * is paused, the file is written after both run again.  A restore reads
+ * the whole file and checks every record against the scheduler before it
+ * changes anything.
+ */
+
+#include <stdlib.h>      /* malloc, realloc */
+#include <sys/stat.h>    /* stat */
+#include "utils.h"
+#include "timer.h"
+#include "evtbuf.h"
+#include "fsmsnap.h"
+
+/* records and payloads are on 4 byte boundaries */
+#define SNAP_ALIGN 4
+
+/**
+ * snap_buf_t - snapshot being written
+ * @data_p: the bytes
+ * @len: bytes used
+ * @size: bytes allocated
+ */
+typedef struct snap_buf {
+	uint8_t *data_p;
+	size_t len;
+	size_t size;
+} snap_buf_t;
+
+/**
+ * snap_put - append to a snapshot
+ * @buf_p: the snapshot
+ * @src_p: bytes to copy
+ * @len: number of bytes, padded to SNAP_ALIGN
+ */
+static void snap_put(snap_buf_t *buf_p, const void *src_p, size_t len)
+{
+	size_t pad = (len + SNAP_ALIGN - 1) & ~(size_t)(SNAP_ALIGN - 1);
+
+	if (buf_p->len + pad > buf_p->size) {
+		buf_p->size = 2 * (buf_p->len + pad);
+		if (NULL == (buf_p->data_p = realloc(buf_p->data_p, buf_p->size)))
+			die("fsmsnap_write");
+	}
+	memcpy(buf_p->data_p + buf_p->len, src_p, len);
+	memset(buf_p->data_p + buf_p->len + len, 0, pad - len);
+	buf_p->len += pad;
+}
+
+/**
+ * snap_owner - instance a timer notifies
+ * @sched_p: the scheduler
+ * @timer_p: the timer
+ *
+ * Return: the instance index, FSM_SNAP_NO_OWNER for a broadcast timer,
+ * -1 for a timer of something else
+ */
+static int64_t snap_owner(const fsmsched_t *sched_p, const fsmtimer_t *timer_p)
+{
+	const fsm_inst_t *inst_p = timer_p->ctx;
+
+	if (NULL == timer_p->notify)
+		return(FSM_SNAP_NO_OWNER);
+	if (fsm_timer_notify != timer_p->notify || NULL == inst_p)
+		return(-1);
+	if (inst_p->id >= sched_p->ninst || &sched_p->inst_pp[inst_p->id]->inst != inst_p)
+		return(-1);
+	return(inst_p->id);
+}
+
+/**
+ * snap_walk_t - timer_walk context of fsmsnap_write
+ * @sched_p: the scheduler
+ * @buf_p: the snapshot
+ * @ntimers: timers written
+ */
+typedef struct snap_walk {
+	const fsmsched_t *sched_p;
+	snap_buf_t *buf_p;
+	uint32_t ntimers;
+} snap_walk_t;
+
+/**
+ * snap_timer - timer_walk callback, append one timer
+ * @timer_p: the timer
+ * @rem_ms: msec to its next expiry
+ * @arg: snap_walk_t
+ */
+static void snap_timer(const fsmtimer_t *timer_p, uint64_t rem_ms, void *arg)
+{
+	snap_walk_t *walk_p = arg;
+	fsm_snap_timer_t rec = {0};
+	int64_t owner = snap_owner(walk_p->sched_p, timer_p);
+
+	if (owner < 0)
+		return;
+
+	rec.timerid = timer_p->timerid;
+	rec.owner = owner;
+	rec.evtid = timer_p->evtid;
+	rec.tick_ms = timer_p->tick_ms;
+	rec.old_tick_ms = timer_p->old_tick_ms;
+	rec.rem_ms = rem_ms;
+	snap_put(walk_p->buf_p, &rec, sizeof(rec));
+	walk_p->ntimers++;
+}
+
+/**
+ * snap_queue - append the first @n events of a queue
+ * @buf_p: the snapshot
+ * @q_p: the mailbox or spill of an instance, not running
+ * @n: the events on @q_p
+ * @idx: the instance index
+ *
+ * The queue is turned over FSMSCHED_MBOX_SIZE events at a time, each
+ * lot going back behind the rest, so it ends in the same order.  The
+ * payload references go back with the events.
+ */
+static void snap_queue(snap_buf_t *buf_p, evtq_t *q_p, size_t n, uint32_t idx)
+{
+	fsm_events_t evts[FSMSCHED_MBOX_SIZE];
+	evt_payload_t pls[FSMSCHED_MBOX_SIZE];
+	fsm_snap_evt_t rec;
+	const void *data_p;
+	size_t k, i, len;
+
+	while (n && 0 != (k = evtq_trydequeue_batch_pl(q_p, evts, pls,
+						       n < FSMSCHED_MBOX_SIZE ? n : FSMSCHED_MBOX_SIZE))) {
+		for (i=0; i<k; i++) {
+			data_p = evt_payload_data(&pls[i], &len);
+			rec.inst = idx;
+			rec.evtid = evts[i];
+			rec.len = len;
+			snap_put(buf_p, &rec, sizeof(rec));
+			if (len)
+				snap_put(buf_p, data_p, len);
+		}
+		/* the events go back, they were counted when first sent */
+		evtq_enqueue_batch_pl(q_p, evts, pls, k);
+		evtq_done(k);
+		n -= k;
+	}
+}
+
+/**
+ * snap_mbox - append the events waiting for an instance
+ * @buf_p: the snapshot
+ * @si_p: the instance, not running
+ * @idx: its index
+ *
+ * The mailbox, then the spill behind it, in the order the instance would
+ * run them.
+ *
+ * Return: the number of events
+ */
+static uint32_t snap_mbox(snap_buf_t *buf_p, fsmsched_inst_t *si_p, uint32_t idx)
+{
+	uint32_t nmbox = evtq_len(si_p->mbox_p);
+	uint32_t nspill = atomic_load(&si_p->spilled);
+
+	snap_queue(buf_p, si_p->mbox_p, nmbox, idx);
+	snap_queue(buf_p, si_p->spill_p, nspill, idx);
+	return(nmbox + nspill);
+}
+
+/**
+ * fsmsnap_write - save every instance of a scheduler
+ * @sched_p: the scheduler, instances are not created meanwhile
+ * @path: snapshot file
+ * @stats_p: set to what was saved, may be NULL
+ *
+ * The timers are held and the pool paused while the snapshot is taken,
+ * instances carry on from where they were afterwards.  Not from a pool
+ * thread or a timer callback.
+ *
+ * Return: 0 or -1 if the file cannot be written
+ */
+int fsmsnap_write(fsmsched_t *sched_p, const char *path, fsm_snap_stats_t *stats_p)
+{
+	fsm_snap_hdr_t hdr = {FSM_SNAP_MAGIC, FSM_SNAP_VERSION, 0, 0, 0, 0, E_LAST};
+	snap_buf_t buf = {NULL, 0, 0};
+	snap_walk_t walk = {sched_p, &buf, 0};
+	fsm_snap_fsm_t frec;
+	fsm_snap_inst_t irec;
+	fsmsched_inst_t *si_p;
+	uint32_t i;
+	FILE *fp;
+	int ret = 0, f;
+
+	timer_hold();
+	fsmsched_pause(sched_p);
+
+	hdr.nfsm = sched_p->nfsm;
+	hdr.ninst = sched_p->ninst;
+	snap_put(&buf, &hdr, sizeof(hdr));
+	for (f=0; f<sched_p->nfsm; f++) {
+		frec.nstates = sched_p->fsm_pp[f]->nstates;
+		frec.nroutes = sched_p->fsm_pp[f]->nroutes;
+		frec.evt_mask = fsm_evt_mask(sched_p->fsm_pp[f]);
+		snap_put(&buf, &frec, sizeof(frec));
+	}
+	for (i=0; i<sched_p->ninst; i++) {
+		si_p = sched_p->inst_pp[i];
+		for (f=0; sched_p->fsm_pp[f] != si_p->inst.fsm_p; f++)
+			;
+		irec.timer_base = si_p->inst.timer_base;
+		irec.currst = si_p->inst.currst;
+		irec.fsm = f;
+		irec.done = si_p->done;
+		snap_put(&buf, &irec, sizeof(irec));
+	}
+
+	timer_walk(snap_timer, &walk);
+	hdr.ntimers = walk.ntimers;
+
+	/* events after the final state are dropped, do not save them */
+	for (i=0; i<sched_p->ninst; i++)
+		if (!sched_p->inst_pp[i]->done)
+			hdr.nevts += snap_mbox(&buf, sched_p->inst_pp[i], i);
+
+	fsmsched_resume(sched_p);
+	timer_release();
+
+	memcpy(buf.data_p, &hdr, sizeof(hdr));
+	if (NULL == (fp = fopen(path, "w")) || 1 != fwrite(buf.data_p, buf.len, 1, fp)) {
+		perror(path);
+		ret = -1;
+	}
+	if (fp && fclose(fp)) {
+		perror(path);
+		ret = -1;
+	}
+	free(buf.data_p);
+
+	if (stats_p)
+		*stats_p = (fsm_snap_stats_t){hdr.ninst, hdr.ntimers, hdr.nevts};
+	return(ret);
+}
+
+/**
+ * snap_cur_t - snapshot being read
+ * @data_p: the whole file
+ * @len: file bytes
+ * @off: next record
+ */
+typedef struct snap_cur {
+	const uint8_t *data_p;
+	size_t len;
+	size_t off;
+} snap_cur_t;
+
+/**
+ * snap_get - take the next bytes of a snapshot
+ * @cur_p: the snapshot
+ * @len: number of bytes, padded to SNAP_ALIGN
+ *
+ * Return: pointer to the bytes, NULL past the end of the file
+ */
+static const void *snap_get(snap_cur_t *cur_p, size_t len)
+{
+	size_t pad = (len + SNAP_ALIGN - 1) & ~(size_t)(SNAP_ALIGN - 1);
+	const void *p = cur_p->data_p + cur_p->off;
+
+	if (pad > cur_p->len - cur_p->off)
+		return(NULL);
+	cur_p->off += pad;
+	return(p);
+}
+
+/**
+ * snap_read - read a whole snapshot file
+ * @path: snapshot file
+ * @cur_p: set to the file bytes
+ *
+ * Return: 0 or -1 if it cannot be read
+ */
+static int snap_read(const char *path, snap_cur_t *cur_p)
+{
+	struct stat st;
+	uint8_t *data_p;
+	FILE *fp;
+
+	if (NULL == (fp = fopen(path, "r"))) {
+		perror(path);
+		return(-1);
+	}
+	if (fstat(fileno(fp), &st) || NULL == (data_p = malloc(st.st_size + 1)) ||
+	    (st.st_size && 1 != fread(data_p, st.st_size, 1, fp))) {
+		perror(path);
+		fclose(fp);
+		return(-1);
+	}
+	fclose(fp);
+
+	cur_p->data_p = data_p;
+	cur_p->len = st.st_size;
+	cur_p->off = 0;
+	return(0);
+}
+
+/**
+ * snap_check - check a snapshot against the scheduler
+ * @sched_p: the scheduler
+ * @cur_p: the whole snapshot, at its start
+ *
+ * Return: true if every record fits the instances and the file ends
+ * after the last one
+ */
+static bool snap_check(const fsmsched_t *sched_p, snap_cur_t *cur_p)
+{
+	const fsm_snap_hdr_t *hdr_p = snap_get(cur_p, sizeof(*hdr_p));
+	const fsm_snap_fsm_t *frec_p;
+	const fsm_snap_inst_t *irec_p;
+	const fsm_snap_timer_t *trec_p;
+	const fsm_snap_evt_t *erec_p;
+	const fsm_t *fsm_p;
+	uint32_t i;
+
+	if (NULL == hdr_p || hdr_p->nfsm != sched_p->nfsm || hdr_p->ninst != sched_p->ninst)
+		return(false);
+
+	for (i=0; i<hdr_p->nfsm; i++) {
+		fsm_p = sched_p->fsm_pp[i];
+		if (NULL == (frec_p = snap_get(cur_p, sizeof(*frec_p))) ||
+		    frec_p->nstates != fsm_p->nstates || frec_p->nroutes != fsm_p->nroutes ||
+		    frec_p->evt_mask != fsm_evt_mask(fsm_p))
+			return(false);
+	}
+	for (i=0; i<hdr_p->ninst; i++) {
+		const fsm_inst_t *inst_p = &sched_p->inst_pp[i]->inst;
+
+		if (NULL == (irec_p = snap_get(cur_p, sizeof(*irec_p))) ||
+		    irec_p->fsm >= hdr_p->nfsm || sched_p->fsm_pp[irec_p->fsm] != inst_p->fsm_p ||
+		    irec_p->timer_base != inst_p->timer_base ||
+		    irec_p->currst >= inst_p->fsm_p->nstates)
+			return(false);
+	}
+	for (i=0; i<hdr_p->ntimers; i++) {
+		if (NULL == (trec_p = snap_get(cur_p, sizeof(*trec_p))) ||
+		    (trec_p->owner >= hdr_p->ninst && FSM_SNAP_NO_OWNER != trec_p->owner) ||
+		    trec_p->evtid >= E_LAST || NULL != find_timer_by_id(trec_p->timerid))
+			return(false);
+	}
+	for (i=0; i<hdr_p->nevts; i++) {
+		if (NULL == (erec_p = snap_get(cur_p, sizeof(*erec_p))) ||
+		    erec_p->inst >= hdr_p->ninst || erec_p->evtid >= E_LAST ||
+		    erec_p->len > EVTBUF_SIZE ||
+		    (erec_p->len && NULL == snap_get(cur_p, erec_p->len)))
+			return(false);
+	}
+	return (cur_p->off == cur_p->len);
+}
+
+/**
+ * snap_payload - build the payload of a saved event
+ * @pl_p: the payload
+ * @data_p: saved bytes
+ * @len: number of bytes, at most EVTBUF_SIZE
+ */
+static void snap_payload(evt_payload_t *pl_p, const void *data_p, size_t len)
+{
+	evtbuf_t *evtbuf_p;
+
+	if (0 == len) {
+		evt_payload_none(pl_p);
+	} else if (evt_payload_inline(pl_p, data_p, len)) {
+		evtbuf_p = evtbuf_get();
+		memcpy(evtbuf_p->data, data_p, len);
+		evtbuf_p->len = len;
+		evt_payload_buf(pl_p, evtbuf_p);
+	}
+}
+
+/**
+ * fsmsnap_restore - put the instances of a scheduler back from a snapshot
+ * @sched_p: the scheduler, its instances from fsmsched_inst_add and no
+ *           instance timers created yet
+ * @path: snapshot from fsmsnap_write
+ * @stats_p: set to what was restored, may be NULL
+ *
+ * States first, then the timers, then the events are posted, so an
+ * event run as soon as it is posted finds its group and timers in place.
+ *
+ * Return: 0 or -1 if the file cannot be read or does not match the
+ * scheduler, nothing is changed then
+ */
+int fsmsnap_restore(fsmsched_t *sched_p, const char *path, fsm_snap_stats_t *stats_p)
+{
+	const fsm_snap_hdr_t *hdr_p;
+	const fsm_snap_inst_t *irec_p;
+	const fsm_snap_timer_t *trec_p;
+	const fsm_snap_evt_t *erec_p;
+	fsmsched_inst_t *si_p;
+	evt_payload_t pl;
+	snap_cur_t cur;
+	uint32_t i;
+
+	if (snap_read(path, &cur))
+		return(-1);
+	if (cur.len < sizeof(*hdr_p) ||
+	    FSM_SNAP_MAGIC != ((const fsm_snap_hdr_t *)cur.data_p)->magic ||
+	    FSM_SNAP_VERSION != ((const fsm_snap_hdr_t *)cur.data_p)->version ||
+	    E_LAST != ((const fsm_snap_hdr_t *)cur.data_p)->e_last) {
+		fprintf(stderr, "%s: not a snapshot of this build\n", path);
+		free((void *)cur.data_p);
+		return(-1);
+	}
+	if (!snap_check(sched_p, &cur)) {
+		fprintf(stderr, "%s: snapshot does not match the instances\n", path);
+		free((void *)cur.data_p);
+		return(-1);
+	}
+
+	cur.off = 0;
+	hdr_p = snap_get(&cur, sizeof(*hdr_p));
+	snap_get(&cur, hdr_p->nfsm * sizeof(fsm_snap_fsm_t));
+
+	for (i=0; i<hdr_p->ninst; i++) {
+		irec_p = snap_get(&cur, sizeof(*irec_p));
+		si_p = sched_p->inst_pp[i];
+		__atomic_store_n(&si_p->inst.currst, irec_p->currst, __ATOMIC_RELAXED);
+		if (irec_p->done)
+			fsm_done(&si_p->inst);
+	}
+
+	for (i=0; i<hdr_p->ntimers; i++) {
+		trec_p = snap_get(&cur, sizeof(*trec_p));
+		if (FSM_SNAP_NO_OWNER == trec_p->owner)
+			create_timer(trec_p->timerid, trec_p->evtid);
+		else
+			create_timer_notify(trec_p->timerid, trec_p->evtid, fsm_timer_notify,
+					    &sched_p->inst_pp[trec_p->owner]->inst);
+		restore_timer(trec_p->timerid, trec_p->tick_ms, trec_p->old_tick_ms,
+			      trec_p->rem_ms);
+	}
+
+	for (i=0; i<hdr_p->nevts; i++) {
+		erec_p = snap_get(&cur, sizeof(*erec_p));
+		snap_payload(&pl, erec_p + 1, erec_p->len);
+		if (erec_p->len)
+			snap_get(&cur, erec_p->len);
+		fsmsched_post_pl(sched_p->inst_pp[erec_p->inst], erec_p->evtid, &pl);
+	}
+
+	if (stats_p)
+		*stats_p = (fsm_snap_stats_t){hdr_p->ninst, hdr_p->ntimers, hdr_p->nevts};
+	free((void *)cur.data_p);
+	return(0);
+}
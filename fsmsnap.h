@@ -0,0 +1,137 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * Snapshot and restore of scheduled FSM instances
+ *
+ * A snapshot holds, for every instance of a scheduler, its current state
+ * index, the events waiting in its mailbox (with their payloads) and the
+ * timers it owns: period, previous period and the msec left to the next
+ * expiry.  Timers broadcasting to the workers are saved too.  It is
+ * written in one pass while the pool is paused and the timers are held,
+ * so an event is either still in a mailbox or still a timer to expire,
+ * never both.
+ *
+ * Restore is for a scheduler built the same way (same machines, same
+ * instances in the same order, same timer bases) with fsmsched_inst_add,
+ * so no entry action runs: states are set, the timers are created and
+ * set to the time they had left, and the saved events are posted again.
+ * Instances that had reached their final state are retired.  This is a
+ * few stores per instance instead of running every init action again.
+ *
+ * The file is a fsm_snap_hdr_t, then nfsm fsm_snap_fsm_t, ninst
+ * fsm_snap_inst_t, ntimers fsm_snap_timer_t and nevts fsm_snap_evt_t,
+ * each event followed by its payload bytes padded to 4 bytes.  A snapshot
+ * is only valid for the build (E_LAST) and the machines it was taken
+ * with.
+ */
+
+#ifndef _FSMSNAP_H
+#define _FSMSNAP_H
+
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include "fsmsched.h"
+
+/* snapshot magic, "FSMS" */
+#define FSM_SNAP_MAGIC 0x534d5346
+#define FSM_SNAP_VERSION 1
+
+/* fsm_snap_timer_t.owner of a timer broadcasting to the workers */
+#define FSM_SNAP_NO_OWNER UINT32_MAX
+
+/**
+ * fsm_snap_hdr_t - start of a snapshot
+ * @magic: FSM_SNAP_MAGIC
+ * @version: FSM_SNAP_VERSION
+ * @nfsm: machines, in fsmsched_t.fsm_pp order
+ * @ninst: instances, in fsmsched_t.inst_pp order
+ * @ntimers: timers
+ * @nevts: mailbox events
+ * @e_last: E_LAST of the build that wrote the snapshot
+ */
+typedef struct fsm_snap_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t nfsm;
+	uint32_t ninst;
+	uint32_t ntimers;
+	uint32_t nevts;
+	uint32_t e_last;
+} fsm_snap_hdr_t;
+
+/**
+ * fsm_snap_fsm_t - what a machine must match on restore
+ * @nstates: states
+ * @nroutes: routes, see fsm_route_t
+ * @evt_mask: see fsm_evt_mask
+ */
+typedef struct fsm_snap_fsm {
+	uint16_t nstates;
+	uint16_t nroutes;
+	uint32_t evt_mask;
+} fsm_snap_fsm_t;
+
+/**
+ * fsm_snap_inst_t - one instance
+ * @timer_base: see fsm_timer_id
+ * @currst: dense index of the current state
+ * @fsm: machine index
+ * @done: the instance reached its final state
+ */
+typedef struct fsm_snap_inst {
+	uint32_t timer_base;
+	uint16_t currst;
+	uint8_t fsm;
+	uint8_t done;
+} fsm_snap_inst_t;
+
+/**
+ * fsm_snap_timer_t - one timer
+ * @timerid: unique timer id
+ * @owner: index of the instance it notifies, FSM_SNAP_NO_OWNER to broadcast
+ * @evtid: event sent on expiry
+ * @pad: 0
+ * @tick_ms: period, 0 if stopped
+ * @old_tick_ms: previous period, for toggle_timer
+ * @rem_ms: msec to the next expiry
+ */
+typedef struct fsm_snap_timer {
+	uint32_t timerid;
+	uint32_t owner;
+	uint16_t evtid;
+	uint16_t pad;
+	uint32_t tick_ms;
+	uint32_t old_tick_ms;
+	uint32_t rem_ms;
+} fsm_snap_timer_t;
+
+/**
+ * fsm_snap_evt_t - one mailbox event, @len payload bytes follow
+ * @inst: index of the instance
+ * @evtid: the event id
+ * @len: payload bytes, 0 for none
+ */
+typedef struct fsm_snap_evt {
+	uint32_t inst;
+	uint16_t evtid;
+	uint16_t len;
+} fsm_snap_evt_t;
+
+/**
+ * fsm_snap_stats_t - what a snapshot holds, for the caller to print
+ * @ninst: instances
+ * @ntimers: timers
+ * @nevts: mailbox events
+ */
+typedef struct fsm_snap_stats {
+	uint32_t ninst;
+	uint32_t ntimers;
+	uint32_t nevts;
+} fsm_snap_stats_t;
+
+extern int fsmsnap_write(fsmsched_t *sched_p, const char *path, fsm_snap_stats_t *stats_p);
+extern int fsmsnap_restore(fsmsched_t *sched_p, const char *path, fsm_snap_stats_t *stats_p);
+
+#endif /* _FSMSNAP_H */
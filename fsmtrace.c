@@ -0,0 +1,224 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * decode a binary trace file written with fsmdemo -T
+ *
+ * Each record is printed in the text format of the matching debug
+ * output: TRACE_TRANS like DBG_TRANS (dbg_trans), TRACE_EVT like
+ * DBG_EVTS (dbg_evts in evtq_enqueue).  The file is in flush order, a
+ * chunk of each thread ring at a time, so the records are sorted by
+ * timestamp before printing.
+ *
+ * example:
+ *  ./fsmdemo -n -t 100 -T /tmp/fsm.trace
+ *  ./fsmtrace /tmp/fsm.trace
+ */
+
+#include <stdlib.h>      /* atoi, malloc, strtol, strtoll, strtoul */
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <unistd.h>      /* common typdefs, e.g. ssize_t, includes getopt.h */
+#include <stdio.h>       /* char I/O */
+#include <string.h>      /* strlen, strsignal,, memset */
+#include "trace.h"
+
+/**
+ * arguments - descriptive string for all commandline arguments
+ */
+char *arguments = "[-v] [-e] tracefile\n"				\
+	" -v: add instance, fsm_run result and nsec timestamp\n"	\
+	" -e: skip event enqueue records\n"				\
+	" -h: this help\n";
+
+/* not used, the trace headers declare it */
+uint32_t debug_flag;
+
+static bool verbose = false;
+static bool no_evts = false;
+
+/* most FSMs and threads in a trace */
+#define MAX_FSMS 64
+#define MAX_THREADS 4096
+/* most states in a traced FSM */
+#define MAX_STATES 256
+
+/*
+ * names from the TRACE_STATE and TRACE_THREAD records
+ */
+static char state_names[MAX_FSMS][MAX_STATES][TRACE_NAME_LEN];
+static char thread_names[MAX_THREADS][TRACE_NAME_LEN];
+
+/**
+ * cmdline_args - parse command line arguments
+ * @argc: argument count (from main)
+ * @argv: array aligned with argc containing an argument string (from main)
+ *
+ * Return:
+ *  optind - the number of parsed (hyphenated) arguments
+ */
+int cmdline_args(int argc, char *argv[]) {
+	int opt;
+
+	while((opt = getopt(argc, argv, "veh")) != -1) {
+		switch(opt) {
+		case 'v':
+			verbose = true;
+			break;
+		case 'e':
+			no_evts = true;
+			break;
+		case 'h':
+		default:
+			fprintf(stderr, "Usage: %s %s\n", argv[0], arguments);
+			exit(0);
+		}
+	}
+	return optind;
+}
+
+/**
+ * state_name - name of a state, ? if the TRACE_STATE record was lost
+ * @fsm: fsm id
+ * @idx: dense state index
+ */
+static const char *state_name(uint16_t fsm, uint16_t idx)
+{
+	if (idx == TRACE_NO_STATE)
+		return "no next";
+	if (fsm >= MAX_FSMS || idx >= MAX_STATES || '\0' == state_names[fsm][idx][0])
+		return "?";
+	return state_names[fsm][idx];
+}
+
+/**
+ * thread_name - name of a trace thread id
+ * @thread: trace thread id
+ */
+static const char *thread_name(uint16_t thread)
+{
+	if (thread >= MAX_THREADS || '\0' == thread_names[thread][0])
+		return "?";
+	return thread_names[thread];
+}
+
+/**
+ * decode - print one trace record
+ * @rec_p: the record
+ *
+ * Return: 0 for success, -1 for an unknown record type
+ */
+static int decode(const trace_rec_t *rec_p)
+{
+	uint64_t sec = rec_p->ts / 1000000000ULL;
+	uint64_t nsec = rec_p->ts % 1000000000ULL;
+
+	switch(rec_p->type) {
+	case TRACE_THREAD:
+		if (rec_p->thread < MAX_THREADS)
+			memcpy(thread_names[rec_p->thread], rec_p->name, TRACE_NAME_LEN);
+		break;
+	case TRACE_STATE:
+		if (rec_p->fsm < MAX_FSMS && rec_p->evt < MAX_STATES)
+			memcpy(state_names[rec_p->fsm][rec_p->evt], rec_p->name, TRACE_NAME_LEN);
+		break;
+	case TRACE_TRANS:
+		/* same text as dbg_trans */
+		printf("%s:ts=%ld.%3ld evt=%s trans %s to %s",
+		       thread_name(rec_p->thread),
+		       (long)(sec%100), (long)(nsec/1000000),
+		       rec_p->evt < E_LAST ? evt_name[rec_p->evt] : evt_name[E_BAD],
+		       state_name(rec_p->fsm, rec_p->from),
+		       state_name(rec_p->fsm, rec_p->to));
+		if (verbose)
+			printf(" inst=%u ret=%d ts=%lu.%09lu", rec_p->inst, rec_p->ret, sec, nsec);
+		printf("\n");
+		break;
+	case TRACE_EVT:
+		if (no_evts)
+			break;
+		/* same text as dbg_evts */
+		printf("%s:evtq_enqueue %s", thread_name(rec_p->thread),
+		       rec_p->evt < E_LAST ? evt_name[rec_p->evt] : evt_name[E_BAD]);
+		if (verbose)
+			printf(" ts=%lu.%09lu", sec, nsec);
+		printf("\n");
+		break;
+	default:
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * struct rec_key - sort key, timestamp then file order
+ */
+struct rec_key {
+	uint64_t ts;
+	size_t idx;
+};
+
+static int key_cmp(const void *a, const void *b)
+{
+	const struct rec_key *a_p = (const struct rec_key *)a;
+	const struct rec_key *b_p = (const struct rec_key *)b;
+
+	if (a_p->ts != b_p->ts)
+		return (a_p->ts < b_p->ts) ? -1 : 1;
+	return (a_p->idx < b_p->idx) ? -1 : (a_p->idx > b_p->idx);
+}
+
+/**
+ * main - decode a trace file to stdout
+ * @argc: argument count
+ * @argv: options and the trace file name
+ */
+int main(int argc, char *argv[])
+{
+	trace_rec_t *recs_p = NULL;
+	struct rec_key *keys_p;
+	size_t nrec = 0, maxrec = 0, i;
+	FILE *fp;
+	int parsed_args;
+
+	parsed_args = cmdline_args(argc, argv);
+	if (parsed_args >= argc) {
+		fprintf(stderr, "Usage: %s %s\n", argv[0], arguments);
+		exit(1);
+	}
+
+	if (NULL == (fp = fopen(argv[parsed_args], "r")))
+		die(argv[parsed_args]);
+
+	while (1) {
+		if (nrec == maxrec) {
+			maxrec = maxrec ? 2*maxrec : 4096;
+			if (NULL == (recs_p = realloc(recs_p, maxrec * sizeof(trace_rec_t))))
+				die("fsmtrace");
+		}
+		if (1 != fread(&recs_p[nrec], sizeof(trace_rec_t), 1, fp))
+			break;
+		nrec++;
+	}
+	fclose(fp);
+
+	if (NULL == (keys_p = malloc((nrec+1) * sizeof(struct rec_key))))
+		die("fsmtrace");
+	for (i=0; i<nrec; i++) {
+		keys_p[i].ts = recs_p[i].ts;
+		keys_p[i].idx = i;
+	}
+	qsort(keys_p, nrec, sizeof(struct rec_key), key_cmp);
+
+	for (i=0; i<nrec; i++) {
+		if (decode(&recs_p[keys_p[i].idx])) {
+			fprintf(stderr, "bad record %lu type %u\n", keys_p[i].idx,
+				recs_p[keys_p[i].idx].type);
+			exit(1);
+		}
+	}
+	free(keys_p);
+	free(recs_p);
+	return(0);
+}
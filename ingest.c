@@ -0,0 +1,560 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * Batched event ingestion from files and sockets, see ingest.h
+ *
+ * Frames are parsed straight out of the mapped file or the connection
+ * buffer.  Events to the same target collect in ingest_t until the target
+ * changes, the batch is full or the input runs out, then go to the
+ * mailbox or worker queue in one enqueue.
+ */
+
+#define _GNU_SOURCE         /* accept4 */
+#include <stdlib.h>      /* calloc, free */
+#include <fcntl.h>       /* open */
+#include <errno.h>       /* EAGAIN */
+#include <sys/mman.h>    /* mmap, madvise */
+#include <sys/stat.h>    /* fstat */
+#include <sys/socket.h>  /* socket, bind, listen, accept4 */
+#include <netinet/in.h>  /* sockaddr_in */
+#include <arpa/inet.h>   /* inet_pton */
+#include "utils.h"
+#include "fsmsched.h"
+#include "ingest.h"
+
+/**
+ * ingest_create - create an ingestion stage
+ *
+ * Instance targets are resolved against workers.sched_p as it is now,
+ * create the stage after the instances.  Worker targets are indexes into
+ * the workers registry as it is when the frame is parsed.
+ */
+ingest_t *ingest_create(void)
+{
+	ingest_t *ig_p;
+
+	if (NULL == (ig_p = calloc(1, sizeof(ingest_t))))
+		die("ingest_create");
+
+	ig_p->sched_p = workers.sched_p;
+	ig_p->batch = INGEST_BATCH;
+	ig_p->snap_p = &workers_snap_none;
+
+	ig_p->listen.fd = -1;
+	NL_INIT_LIST_HEAD(&ig_p->conns);
+	return(ig_p);
+}
+
+/**
+ * ingest_hdr_put - write a stream header
+ * @buf_p: sizeof(ingest_hdr_t) bytes
+ *
+ * Return: bytes written
+ */
+size_t ingest_hdr_put(uint8_t *buf_p)
+{
+	ingest_hdr_t hdr = {
+		.magic = INGEST_MAGIC,
+		.version = INGEST_VERSION,
+		.e_last = E_LAST,
+	};
+
+	memcpy(buf_p, &hdr, sizeof(hdr));
+	return(sizeof(hdr));
+}
+
+/**
+ * ingest_put - write one frame
+ * @buf_p: sizeof(ingest_frame_t) + INGEST_PAD(@len) bytes
+ * @target: instance or worker index, INGEST_ALL to broadcast
+ * @evt_id: the event id
+ * @data_p: payload bytes
+ * @len: payload length, at most EVTBUF_SIZE
+ *
+ * Return: bytes written
+ */
+size_t ingest_put(uint8_t *buf_p, uint32_t target, fsm_events_t evt_id,
+		  const void *data_p, size_t len)
+{
+	ingest_frame_t frame = {
+		.target = target,
+		.evt_id = evt_id,
+		.len = len,
+	};
+
+	memcpy(buf_p, &frame, sizeof(frame));
+	if (len)
+		memcpy(buf_p + sizeof(frame), data_p, len);
+	memset(buf_p + sizeof(frame) + len, 0, INGEST_PAD(len) - len);
+	return(sizeof(frame) + INGEST_PAD(len));
+}
+
+/**
+ * ingest_hdr_check - check a stream header
+ * @buf_p: sizeof(ingest_hdr_t) bytes
+ *
+ * Return: true if the stream is for this build
+ */
+static bool ingest_hdr_check(const uint8_t *buf_p)
+{
+	ingest_hdr_t hdr;
+
+	memcpy(&hdr, buf_p, sizeof(hdr));
+	return(INGEST_MAGIC == hdr.magic && INGEST_VERSION == hdr.version &&
+	       E_LAST == hdr.e_last);
+}
+
+/**
+ * ingest_payload - make the payload of a frame
+ * @pl_p: set to the payload
+ * @data_p: payload bytes
+ * @len: at most EVTBUF_SIZE
+ *
+ * Inline when it fits, otherwise a buffer of the calling thread pool.
+ */
+static void ingest_payload(evt_payload_t *pl_p, const void *data_p, size_t len)
+{
+	evtbuf_t *evtbuf_p;
+
+	if (0 == len) {
+		evt_payload_none(pl_p);
+	} else if (evt_payload_inline(pl_p, data_p, len)) {
+		evtbuf_p = evtbuf_get();
+		memcpy(evtbuf_p->data, data_p, len);
+		evtbuf_p->len = len;
+		evt_payload_buf(pl_p, evtbuf_p);
+	}
+}
+
+/**
+ * ingest_flush - queue the pending events
+ * @ig_p: the stage
+ *
+ * Callers of ingest_parse flush when the input runs dry, so nothing
+ * waits in the stage for more input.
+ */
+void ingest_flush(ingest_t *ig_p)
+{
+	if (0 == ig_p->n)
+		return;
+
+	if (ig_p->sched_p)
+		fsmsched_post_batch_pl(ig_p->sched_p->inst_pp[ig_p->target], ig_p->ids,
+				       ig_p->pls, ig_p->n);
+	else
+		evtq_enqueue_batch_pl(ig_p->snap_p->w_pp[ig_p->target]->evtq_p, ig_p->ids,
+				      ig_p->pls, ig_p->n);
+	ig_p->batches++;
+	ig_p->n = 0;
+}
+
+/**
+ * ingest_accepts - fsm_accepts for a target
+ * @ig_p: the stage
+ * @target: instance or worker index, in range
+ * @evt_id: the event id
+ *
+ * Same filter as a broadcast, a worker without an FSM takes everything.
+ */
+static bool ingest_accepts(const ingest_t *ig_p, uint32_t target, fsm_events_t evt_id)
+{
+	const fsm_inst_t *inst_p;
+
+	inst_p = ig_p->sched_p ? &ig_p->sched_p->inst_pp[target]->inst :
+		ig_p->snap_p->w_pp[target]->inst_p;
+	return(NULL == inst_p || fsm_accepts(inst_p->fsm_p, evt_id));
+}
+
+/**
+ * ingest_event - route one frame
+ * @ig_p: the stage
+ * @frame_p: the frame
+ * @data_p: its payload bytes
+ *
+ * A broadcast goes out at once, after the pending events so the order of
+ * the stream is kept.
+ */
+static void ingest_event(ingest_t *ig_p, const ingest_frame_t *frame_p, const uint8_t *data_p)
+{
+	uint32_t target = frame_p->target;
+	uint32_t ntargets = ig_p->sched_p ? ig_p->sched_p->ninst : ig_p->snap_p->n;
+	evt_payload_t pl;
+
+	ig_p->frames++;
+	if (frame_p->evt_id >= E_LAST || (target != INGEST_ALL && target >= ntargets)) {
+		ig_p->bad++;
+		return;
+	}
+
+	if (target == INGEST_ALL) {
+		ingest_flush(ig_p);
+		ingest_payload(&pl, data_p, frame_p->len);
+		workers_evt_broadcast_pl(frame_p->evt_id, &pl);
+		evt_payload_release(&pl);
+		return;
+	}
+	if (NULL == ig_p->sched_p && ig_p->snap_p->w_pp[target]->sub_p) {
+		ig_p->dropped++;
+		return;
+	}
+	if (!ingest_accepts(ig_p, target, frame_p->evt_id)) {
+		stats_filtered(1);
+		return;
+	}
+
+	if (ig_p->n && (ig_p->target != target || ig_p->n >= ig_p->batch))
+		ingest_flush(ig_p);
+	ig_p->target = target;
+	ig_p->ids[ig_p->n] = frame_p->evt_id;
+	ingest_payload(&ig_p->pls[ig_p->n], data_p, frame_p->len);
+	ig_p->n++;
+}
+
+/**
+ * ingest_parse - route the whole frames of a buffer
+ * @ig_p: the stage
+ * @buf_p: frames, after the stream header
+ * @len: bytes in @buf_p
+ *
+ * Stops at a partial frame, the caller keeps those bytes for the next
+ * call.  Events to instances may be left pending, see ingest_flush;
+ * events to workers are queued before it returns, in the registry
+ * snapshot the frames were routed with.
+ *
+ * Return: bytes used, -1 if a frame is longer than a payload can be
+ */
+ssize_t ingest_parse(ingest_t *ig_p, const uint8_t *buf_p, size_t len)
+{
+	ingest_frame_t frame;
+	size_t off = 0, flen;
+	ssize_t ret = -1;
+
+	/* one read section for the buffer */
+	ig_p->snap_p = workers_read_lock();
+	while (len - off >= sizeof(frame)) {
+		memcpy(&frame, buf_p + off, sizeof(frame));
+		if (frame.len > EVTBUF_SIZE)
+			goto out;
+		flen = sizeof(frame) + INGEST_PAD(frame.len);
+		if (len - off < flen)
+			break;
+		ingest_event(ig_p, &frame, buf_p + off + sizeof(frame));
+		off += flen;
+	}
+	ret = off;
+out:
+	/* worker targets are only good in the snapshot they were found in */
+	if (NULL == ig_p->sched_p)
+		ingest_flush(ig_p);
+	ig_p->snap_p = &workers_snap_none;
+	workers_read_unlock();
+	return(ret);
+}
+
+/**
+ * ingest_send - route one event as a frame
+ * @ig_p: the stage
+ * @target: instance or worker index, INGEST_ALL to broadcast
+ * @evt_id: the event id
+ * @data_p: payload bytes
+ * @len: payload length
+ *
+ * For the CLI, the event is queued before this returns.
+ *
+ * Return: 0 or -1 if @len is too long
+ */
+int ingest_send(ingest_t *ig_p, uint32_t target, fsm_events_t evt_id,
+		const void *data_p, size_t len)
+{
+	uint8_t buf[sizeof(ingest_frame_t) + EVTBUF_SIZE];
+	size_t flen;
+
+	if (len > EVTBUF_SIZE)
+		return(-1);
+	flen = ingest_put(buf, target, evt_id, data_p, len);
+	ingest_parse(ig_p, buf, flen);
+	ingest_flush(ig_p);
+	return(0);
+}
+
+/**
+ * ingest_file - route every frame of a stream file
+ * @ig_p: the stage
+ * @path: the file
+ *
+ * The file is mapped read-only and read once front to back.
+ *
+ * Return: 0 or -1 if it cannot be mapped, is not a stream of this build
+ * or ends in a partial frame
+ */
+int ingest_file(ingest_t *ig_p, const char *path)
+{
+	struct stat st;
+	uint8_t *p;
+	ssize_t used;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		return(-1);
+	}
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(ingest_hdr_t)) {
+		fprintf(stderr, "%s: not an event stream\n", path);
+		close(fd);
+		return(-1);
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == p) {
+		perror(path);
+		return(-1);
+	}
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+	if (!ingest_hdr_check(p)) {
+		fprintf(stderr, "%s: not an event stream of this build\n", path);
+		munmap(p, st.st_size);
+		return(-1);
+	}
+	used = ingest_parse(ig_p, p + sizeof(ingest_hdr_t), st.st_size - sizeof(ingest_hdr_t));
+	ingest_flush(ig_p);
+	munmap(p, st.st_size);
+
+	if (used != (ssize_t)(st.st_size - sizeof(ingest_hdr_t))) {
+		fprintf(stderr, "%s: corrupt event stream\n", path);
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * conn_close - close a connection
+ * @ig_p: the stage
+ * @conn_p: the connection
+ */
+static void conn_close(ingest_t *ig_p, ingest_conn_t *conn_p)
+{
+	reactor_del(ig_p->reactor_p, &conn_p->src);
+	close(conn_p->src.fd);
+	nl_list_del(&conn_p->list);
+	free(conn_p);
+}
+
+/**
+ * conn_ready - reactor callback for a connection
+ * @src_p: the connection source, ctx_p is the stage
+ * @events: epoll events
+ *
+ * Route the whole frames read so far, keep a partial frame for the next
+ * read.  The connection is closed at end of stream, on a read error and
+ * on a bad header or frame.
+ */
+static void conn_ready(reactor_src_t *src_p, uint32_t events)
+{
+	ingest_t *ig_p = src_p->ctx_p;
+	ingest_conn_t *conn_p = nl_container_of(src_p, ingest_conn_t, src);
+	size_t off = 0;
+	ssize_t len, used;
+
+	len = read(src_p->fd, conn_p->buf + conn_p->len, sizeof(conn_p->buf) - conn_p->len);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		conn_close(ig_p, conn_p);
+		return;
+	}
+	conn_p->len += len;
+
+	if (!conn_p->hdr) {
+		if (conn_p->len < sizeof(ingest_hdr_t))
+			return;
+		if (!ingest_hdr_check(conn_p->buf)) {
+			fprintf(stderr, "ingest: not an event stream of this build\n");
+			conn_close(ig_p, conn_p);
+			return;
+		}
+		conn_p->hdr = true;
+		off = sizeof(ingest_hdr_t);
+	}
+
+	used = ingest_parse(ig_p, conn_p->buf + off, conn_p->len - off);
+	ingest_flush(ig_p);
+	if (used < 0) {
+		fprintf(stderr, "ingest: corrupt event stream\n");
+		conn_close(ig_p, conn_p);
+		return;
+	}
+	off += used;
+	conn_p->len -= off;
+	memmove(conn_p->buf, conn_p->buf + off, conn_p->len);
+}
+
+/**
+ * listen_ready - reactor callback for the listening socket
+ * @src_p: the listening source, ctx_p is the stage
+ * @events: epoll events
+ *
+ * Take every pending connection.
+ */
+static void listen_ready(reactor_src_t *src_p, uint32_t events)
+{
+	ingest_t *ig_p = src_p->ctx_p;
+	ingest_conn_t *conn_p;
+	int fd;
+
+	while ((fd = accept4(src_p->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (NULL == (conn_p = malloc(sizeof(ingest_conn_t))))
+			die("ingest accept");
+		conn_p->src.fd = fd;
+		conn_p->src.flags = 0;
+		conn_p->src.fn = conn_ready;
+		conn_p->src.ctx_p = ig_p;
+		conn_p->hdr = false;
+		conn_p->len = 0;
+		nl_list_add_tail(&conn_p->list, &ig_p->conns);
+		reactor_add(ig_p->reactor_p, &conn_p->src);
+	}
+}
+
+/**
+ * listen_socket - create the listening socket of a spec
+ * @ig_p: the stage, sun_path is set for a unix socket
+ * @spec: unix:PATH, tcp:PORT on the loopback address or tcp:ADDR:PORT
+ *
+ * Return: the socket, -1 on error
+ */
+static int listen_socket(ingest_t *ig_p, const char *spec)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct sockaddr_in sin = { .sin_family = AF_INET };
+	struct sockaddr *sa_p;
+	socklen_t salen;
+	const char *port_p;
+	char addr[INET_ADDRSTRLEN];
+	int fd, one = 1;
+
+	if (0 == strncmp(spec, "unix:", 5)) {
+		if (strlen(spec + 5) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "%s: path too long\n", spec);
+			return(-1);
+		}
+		strcpy(sun.sun_path, spec + 5);
+		unlink(sun.sun_path);
+		sa_p = (struct sockaddr *)&sun;
+		salen = sizeof(sun);
+	} else if (0 == strncmp(spec, "tcp:", 4)) {
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if ((port_p = strrchr(spec + 4, ':'))) {
+			snprintf(addr, sizeof(addr), "%.*s", (int)(port_p - spec - 4), spec + 4);
+			if (1 != inet_pton(AF_INET, addr, &sin.sin_addr)) {
+				fprintf(stderr, "%s: bad address\n", spec);
+				return(-1);
+			}
+			port_p++;
+		} else {
+			port_p = spec + 4;
+		}
+		sin.sin_port = htons(strtoul(port_p, NULL, 0));
+		sa_p = (struct sockaddr *)&sin;
+		salen = sizeof(sin);
+	} else {
+		fprintf(stderr, "%s: not unix:PATH or tcp:[ADDR:]PORT\n", spec);
+		return(-1);
+	}
+
+	if ((fd = socket(sa_p->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		perror(spec);
+		return(-1);
+	}
+	if (sa_p->sa_family == AF_INET)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, sa_p, salen) || listen(fd, SOMAXCONN)) {
+		perror(spec);
+		close(fd);
+		return(-1);
+	}
+	if (sa_p->sa_family == AF_UNIX)
+		strcpy(ig_p->sun_path, sun.sun_path);
+	return(fd);
+}
+
+/**
+ * ingest_listen - take event streams from a socket
+ * @ig_p: the stage, not listening yet
+ * @reactor_p: reactor accepting and reading the connections
+ * @spec: unix:PATH, tcp:PORT on the loopback address or tcp:ADDR:PORT
+ *
+ * Each connection sends a stream header and frames until it closes.
+ * From here on the stage belongs to the @reactor_p thread.
+ *
+ * Return: 0 or -1 if the socket cannot be created
+ */
+int ingest_listen(ingest_t *ig_p, reactor_t *reactor_p, const char *spec)
+{
+	int fd;
+
+	if ((fd = listen_socket(ig_p, spec)) < 0)
+		return(-1);
+
+	ig_p->reactor_p = reactor_p;
+	ig_p->listen.fd = fd;
+	ig_p->listen.flags = 0;
+	ig_p->listen.fn = listen_ready;
+	ig_p->listen.ctx_p = ig_p;
+	reactor_add(reactor_p, &ig_p->listen);
+	return(0);
+}
+
+/**
+ * ingest_open - ingest_listen for a socket spec, else ingest_file
+ * @ig_p: the stage
+ * @reactor_p: reactor for a socket
+ * @spec: unix:PATH, tcp:[ADDR:]PORT or a stream file
+ *
+ * Return: 0 or -1 on error
+ */
+int ingest_open(ingest_t *ig_p, reactor_t *reactor_p, const char *spec)
+{
+	if (0 == strncmp(spec, "unix:", 5) || 0 == strncmp(spec, "tcp:", 4))
+		return ingest_listen(ig_p, reactor_p, spec);
+	return ingest_file(ig_p, spec);
+}
+
+/**
+ * ingest_show - print the stage counters
+ * @ig_p: the stage
+ * @name: stream name for the output
+ */
+void ingest_show(const ingest_t *ig_p, const char *name)
+{
+	printf("ingest %s: %lu frames, %lu batches, %lu bad, %lu dropped\n", name,
+	       ig_p->frames, ig_p->batches, ig_p->bad, ig_p->dropped);
+}
+
+/**
+ * ingest_destroy - close the sockets and free the stage
+ * @ig_p: the stage, NULL for none
+ *
+ * The reactor must not be running, or be this thread.  Pending events are
+ * queued first.
+ */
+void ingest_destroy(ingest_t *ig_p)
+{
+	ingest_conn_t *conn_p, *n_p;
+
+	if (NULL == ig_p)
+		return;
+
+	ingest_flush(ig_p);
+	nl_list_for_each_entry_safe(conn_p, n_p, &ig_p->conns, list)
+		conn_close(ig_p, conn_p);
+	if (ig_p->listen.fd >= 0) {
+		reactor_del(ig_p->reactor_p, &ig_p->listen);
+		close(ig_p->listen.fd);
+	}
+	if (ig_p->sun_path[0])
+		unlink(ig_p->sun_path);
+	free(ig_p);
+}
@@ -0,0 +1,146 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * Batched event ingestion from files and sockets
+ *
+ * An event stream is an ingest_hdr_t followed by frames: an ingest_frame_t
+ * naming the target, the event id and the payload length, then the
+ * payload bytes padded to 4 bytes.  Everything is in host byte order, a
+ * stream is for the build (E_LAST) it was written for.
+ *
+ * The target is an index into the scheduled instances when there is a
+ * scheduler (workers.sched_p), otherwise into the workers registry as it
+ * is when the frame is parsed, or INGEST_ALL to broadcast the event.  Consecutive frames to the same
+ * target are queued with one evtq_enqueue_batch_pl, so a burst costs one
+ * tail claim and at most one consumer wakeup per batch instead of per
+ * event.
+ *
+ * A stream comes from a file, mapped and parsed in one pass, or from the
+ * connections of a unix or TCP listening socket served by a reactor.
+ * The CLI encodes its event commands as frames and sends them the same
+ * way.
+ */
+
+#ifndef _INGEST_H
+#define _INGEST_H
+
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <sys/un.h>      /* sockaddr_un */
+#include <libnl3/netlink/list.h> /* kernel-ish linked list */
+#include "evtbuf.h"
+#include "reactor.h"
+#include "workers.h"
+
+/* stream magic, "FSEV" */
+#define INGEST_MAGIC 0x56455346
+#define INGEST_VERSION 1
+
+/* ingest_frame_t.target to broadcast the event */
+#define INGEST_ALL UINT32_MAX
+
+/* default most events queued to a target at once */
+#define INGEST_BATCH 64
+
+/* bytes buffered per connection, whole frames are at most 8 + EVTBUF_SIZE */
+#define INGEST_CONN_BUF (64 * 1024)
+
+/* frames and payloads are on 4 byte boundaries */
+#define INGEST_ALIGN 4
+#define INGEST_PAD(len) (((len) + INGEST_ALIGN - 1) & ~(size_t)(INGEST_ALIGN - 1))
+
+/**
+ * ingest_hdr_t - start of a stream
+ * @magic: INGEST_MAGIC
+ * @version: INGEST_VERSION
+ * @e_last: E_LAST of the build the stream is for
+ */
+typedef struct ingest_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t e_last;
+} ingest_hdr_t;
+
+/**
+ * ingest_frame_t - one event, @len payload bytes follow
+ * @target: instance or worker index, INGEST_ALL to broadcast
+ * @evt_id: the event id
+ * @len: payload bytes, 0 for none, at most EVTBUF_SIZE
+ */
+typedef struct ingest_frame {
+	uint32_t target;
+	uint16_t evt_id;
+	uint16_t len;
+} ingest_frame_t;
+
+/**
+ * ingest_conn_t - one connection of a listening socket
+ * @list: ingest_t.conns entry
+ * @src: reactor source of the connection
+ * @hdr: the stream header was read
+ * @len: bytes of a partial frame carried in @buf
+ * @buf: received bytes
+ */
+typedef struct ingest_conn {
+	struct nl_list_head list;
+	reactor_src_t src;
+	bool hdr;
+	size_t len;
+	uint8_t buf[INGEST_CONN_BUF];
+} ingest_conn_t;
+
+/**
+ * ingest_t - an ingestion stage, used by one thread
+ * @sched_p: scheduler the targets are instances of, NULL for workers
+ * @snap_p: workers registry snapshot while ingest_parse runs
+ * @batch: most events queued to a target at once, 1..INGEST_BATCH
+ * @target: target of the pending events
+ * @n: pending events
+ * @ids: pending event ids
+ * @pls: pending payloads
+ * @frames: frames parsed
+ * @batches: batches queued
+ * @bad: frames skipped for an unknown target or event id
+ * @dropped: frames to a worker reading the broadcast channel only
+ * @reactor_p: reactor of the listening socket, NULL for none
+ * @listen: listening socket source
+ * @sun_path: unix socket path, unlinked by ingest_destroy, "" for none
+ * @conns: open ingest_conn_t
+ *
+ * The listening socket and its connections run on the reactor thread.
+ */
+typedef struct ingest {
+	struct fsmsched *sched_p;
+	const workers_snap_t *snap_p;
+	uint32_t batch;
+	uint32_t target;
+	uint32_t n;
+	fsm_events_t ids[INGEST_BATCH];
+	evt_payload_t pls[INGEST_BATCH];
+	uint64_t frames;
+	uint64_t batches;
+	uint64_t bad;
+	uint64_t dropped;
+	reactor_t *reactor_p;
+	reactor_src_t listen;
+	char sun_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct nl_list_head conns;
+} ingest_t;
+
+extern ingest_t *ingest_create(void);
+extern size_t ingest_hdr_put(uint8_t *buf_p);
+extern size_t ingest_put(uint8_t *buf_p, uint32_t target, fsm_events_t evt_id,
+			 const void *data_p, size_t len);
+extern ssize_t ingest_parse(ingest_t *ig_p, const uint8_t *buf_p, size_t len);
+extern void ingest_flush(ingest_t *ig_p);
+extern int ingest_send(ingest_t *ig_p, uint32_t target, fsm_events_t evt_id,
+		       const void *data_p, size_t len);
+extern int ingest_file(ingest_t *ig_p, const char *path);
+extern int ingest_listen(ingest_t *ig_p, reactor_t *reactor_p, const char *spec);
+extern int ingest_open(ingest_t *ig_p, reactor_t *reactor_p, const char *spec);
+extern void ingest_show(const ingest_t *ig_p, const char *name);
+extern void ingest_destroy(ingest_t *ig_p);
+
+#endif /* _INGEST_H */
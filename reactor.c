@@ -0,0 +1,191 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * event loop, see reactor.h
+ */
+
+#include <errno.h>       /* EINTR */
+#include <stdlib.h>      /* calloc */
+#include <sys/eventfd.h> /* eventfd */
+#include "utils.h"
+#include "reactor.h"
+
+__thread reactor_t *reactor_self_p;
+
+/**
+ * reactor_woken - eventfd source, clear the wakeup count
+ * @src_p: the eventfd source
+ * @events: epoll events
+ */
+static void reactor_woken(reactor_src_t *src_p, uint32_t events)
+{
+	uint64_t cnt;
+
+	/* nonblocking, a nap may have taken the count already */
+	if (-1 == read(src_p->fd, &cnt, sizeof(cnt)) && EAGAIN != errno)
+		die("reactor eventfd read");
+}
+
+/**
+ * reactor_create - create an empty loop
+ *
+ * Return: the loop, with only its eventfd source
+ */
+reactor_t *reactor_create(void)
+{
+	reactor_t *reactor_p = calloc(1, sizeof(reactor_t));
+
+	if (NULL == reactor_p)
+		die("reactor_create");
+
+	if (-1 == (reactor_p->epfd = epoll_create1(EPOLL_CLOEXEC)) ||
+	    -1 == (reactor_p->nap_epfd = epoll_create1(EPOLL_CLOEXEC)))
+		die("epoll");
+	if (-1 == (reactor_p->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)))
+		die("eventfd");
+
+	reactor_p->wake.flags = REACTOR_NAP;
+	reactor_p->wake.fn = reactor_woken;
+	reactor_p->wake.ctx_p = reactor_p;
+	atomic_init(&reactor_p->stop, false);
+	reactor_add(reactor_p, &reactor_p->wake);
+	return(reactor_p);
+}
+
+/**
+ * reactor_add - put a source on the loop
+ * @reactor_p: the loop
+ * @src_p: the source, must stay valid until reactor_del
+ *
+ * Safe from any thread, epoll_ctl is.
+ */
+void reactor_add(reactor_t *reactor_p, reactor_src_t *src_p)
+{
+	struct epoll_event event;
+
+	/* data.ptr finds the source */
+	event.data.ptr = src_p;
+	event.events = EPOLLIN;
+	if (-1 == epoll_ctl(reactor_p->epfd, EPOLL_CTL_ADD, src_p->fd, &event))
+		die("reactor_add");
+	if ((src_p->flags & REACTOR_NAP) &&
+	    -1 == epoll_ctl(reactor_p->nap_epfd, EPOLL_CTL_ADD, src_p->fd, &event))
+		die("reactor_add nap");
+}
+
+/**
+ * reactor_del - take a source off the loop
+ * @reactor_p: the loop
+ * @src_p: the source
+ */
+void reactor_del(reactor_t *reactor_p, reactor_src_t *src_p)
+{
+	epoll_ctl(reactor_p->epfd, EPOLL_CTL_DEL, src_p->fd, NULL);
+	if (src_p->flags & REACTOR_NAP)
+		epoll_ctl(reactor_p->nap_epfd, EPOLL_CTL_DEL, src_p->fd, NULL);
+}
+
+/**
+ * reactor_poll - wait on an epoll set and run the ready sources
+ * @reactor_p: the loop
+ * @epfd: the set
+ * @timeout: msec, -1 to wait until a source is ready
+ */
+static void reactor_poll(reactor_t *reactor_p, int epfd, int timeout)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	reactor_src_t *src_p;
+	int nfds, i;
+
+	nfds = epoll_wait(epfd, events, REACTOR_MAX_EVENTS, timeout);
+	if (dbg_on(DBG_DEEP))
+		printf("reactor poll_wait fds=%d\n", nfds);
+
+	/* a signal interrupt is not an error */
+	if (-1 == nfds && EINTR != errno)
+		die("epoll_wait");
+
+	for (i=0; i<nfds; i++) {
+		src_p = (reactor_src_t *)events[i].data.ptr;
+		src_p->fn(src_p, events[i].events);
+	}
+}
+
+/**
+ * reactor_run - run the loop on the calling thread until reactor_stop
+ * @reactor_p: the loop
+ */
+void reactor_run(reactor_t *reactor_p)
+{
+	reactor_self_p = reactor_p;
+	while (!atomic_load_explicit(&reactor_p->stop, memory_order_acquire))
+		reactor_poll(reactor_p, reactor_p->epfd, -1);
+	reactor_self_p = NULL;
+}
+
+/**
+ * reactor_wake - make the loop thread return from epoll_wait
+ * @reactor_p: the loop
+ *
+ * Safe from any thread.
+ */
+void reactor_wake(reactor_t *reactor_p)
+{
+	uint64_t one = 1;
+
+	if (-1 == write(reactor_p->wake.fd, &one, sizeof(one)) && EAGAIN != errno)
+		die("reactor eventfd write");
+}
+
+/**
+ * reactor_stop - make reactor_run return
+ * @reactor_p: the loop
+ *
+ * Safe from any thread and from a source callback.
+ */
+void reactor_stop(reactor_t *reactor_p)
+{
+	atomic_store_explicit(&reactor_p->stop, true, memory_order_release);
+	reactor_wake(reactor_p);
+}
+
+/**
+ * reactor_nap - sleep, keep serving the REACTOR_NAP sources
+ * @ms: msecs
+ *
+ * On a thread not running a loop this is nap.
+ */
+void reactor_nap(uint32_t ms)
+{
+	reactor_t *reactor_p = reactor_self_p;
+	uint64_t now, end;
+	struct timespec ts;
+
+	if (NULL == reactor_p) {
+		nap(ms);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+	for (end = now + ms; now < end; now = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000) {
+		reactor_poll(reactor_p, reactor_p->nap_epfd, end - now);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+	}
+}
+
+/**
+ * reactor_destroy - close the loop, the sources stay open
+ * @reactor_p: the loop, NULL is fine
+ */
+void reactor_destroy(reactor_t *reactor_p)
+{
+	if (NULL == reactor_p)
+		return;
+	close(reactor_p->wake.fd);
+	close(reactor_p->nap_epfd);
+	close(reactor_p->epfd);
+	free(reactor_p);
+}
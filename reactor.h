@@ -0,0 +1,88 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * event loop for the fd driven inputs of a process
+ *
+ * One epoll set owns the timer wheel timerfd, the CLI input and an
+ * eventfd other threads write to wake the loop, so one thread serves all
+ * of them and only wakes when one of them has work.  There is no poll
+ * timeout: a thread setting a timer re-arms the timerfd itself.
+ *
+ * A source is an fd and a callback run on the loop thread.  Sources with
+ * REACTOR_NAP also run while a callback naps with reactor_nap, e.g. the
+ * CLI n command, so timers keep firing under a script run from the CLI.
+ */
+
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <stdatomic.h>   /* stop flag */
+#include <sys/epoll.h>   /* EPOLLIN */
+
+/* most epoll events taken per wakeup */
+#define REACTOR_MAX_EVENTS 16
+
+/**
+ * reactor_flags_t - source flags
+ * @REACTOR_NAP: also dispatch the source during reactor_nap
+ */
+typedef enum reactor_flags {
+	REACTOR_NAP = 0x1,
+} reactor_flags_t;
+
+struct reactor_src;
+
+/*
+ * reactor_fn_t - source callback, on the loop thread
+ * @src_p: the source
+ * @events: the epoll events, EPOLLIN unless the fd has an error
+ */
+typedef void (*reactor_fn_t)(struct reactor_src *src_p, uint32_t events);
+
+/**
+ * reactor_src_t - one fd on the loop
+ * @fd: the fd, level triggered
+ * @flags: reactor_flags_t
+ * @fn: called when @fd is ready
+ * @ctx_p: private data for @fn
+ */
+typedef struct reactor_src {
+	int fd;
+	uint32_t flags;
+	reactor_fn_t fn;
+	void *ctx_p;
+} reactor_src_t;
+
+/**
+ * reactor_t - the loop
+ * @epfd: every source
+ * @nap_epfd: the REACTOR_NAP sources
+ * @wake: the eventfd source
+ * @stop: reactor_run returns when set
+ */
+typedef struct reactor {
+	int epfd;
+	int nap_epfd;
+	reactor_src_t wake;
+	atomic_bool stop;
+} reactor_t;
+
+/*
+ * reactor_self_p - the loop run by the calling thread, NULL if none
+ */
+extern __thread reactor_t *reactor_self_p;
+
+extern reactor_t *reactor_create(void);
+extern void reactor_add(reactor_t *reactor_p, reactor_src_t *src_p);
+extern void reactor_del(reactor_t *reactor_p, reactor_src_t *src_p);
+extern void reactor_run(reactor_t *reactor_p);
+extern void reactor_wake(reactor_t *reactor_p);
+extern void reactor_stop(reactor_t *reactor_p);
+extern void reactor_nap(uint32_t ms);
+extern void reactor_destroy(reactor_t *reactor_p);
+
+#endif /* _REACTOR_H */
@@ -0,0 +1,256 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * per-thread statistics, see stats.h
+ *
+ * Like the trace rings, a thread gets its stats_t the first time it
+ * counts and it stays on a lock-free list until stats_destroy, so
+ * stats_show can walk the list while threads come and go.
+ */
+
+#include "utils.h"
+#include "workers.h"
+#include "stats.h"
+
+bool stats_latency;
+__thread stats_t *stats_self_p;
+
+static _Atomic(stats_t *) stats_list;
+static atomic_uint stats_nthreads;
+
+/*
+ * state names of each fsm_t id, the names are in the static state tables
+ * so they outlive the compiled FSM
+ */
+static const char *stats_states[STATS_FSM_MAX][STATS_STATE_MAX];
+
+/**
+ * hist_snap_t - a histogram summed over threads
+ * @count: number of samples
+ * @max: largest sample
+ * @bucket: samples in each bucket
+ */
+typedef struct hist_snap {
+	uint64_t count;
+	uint64_t max;
+	uint64_t bucket[STATS_BUCKETS];
+} hist_snap_t;
+
+/**
+ * stats_create - give the calling thread its counters
+ */
+stats_t *stats_create(void)
+{
+	stats_t *st_p = calloc(1, sizeof(stats_t));
+	const char *name = worker_get_name();
+	uint32_t n = atomic_fetch_add(&stats_nthreads, 1);
+
+	if (NULL == st_p)
+		die("stats_create");
+
+	if (name)
+		strncpy(st_p->name, name, sizeof(st_p->name)-1);
+	else
+		snprintf(st_p->name, sizeof(st_p->name), "thread%u", n);
+
+	st_p->next_p = atomic_load(&stats_list);
+	while (!atomic_compare_exchange_weak(&stats_list, &st_p->next_p, st_p))
+		;
+	stats_self_p = st_p;
+	return(st_p);
+}
+
+/**
+ * stats_fsm - remember the state names of a compiled FSM
+ * @fsm_p: from fsm_compile
+ *
+ * Called by fsm_compile, which runs before the FSM threads start.
+ */
+void stats_fsm(const fsm_t *fsm_p)
+{
+	uint16_t i;
+
+	if (fsm_p->id >= STATS_FSM_MAX)
+		return;
+	for (i=0; i<fsm_p->nstates && i<STATS_STATE_MAX; i++)
+		stats_states[fsm_p->id][i] = fsm_p->state_pp[i]->name;
+}
+
+/**
+ * hist_add - add a thread histogram to a snapshot
+ * @snap_p: the snapshot
+ * @h_p: a thread histogram
+ */
+static void hist_add(hist_snap_t *snap_p, stats_hist_t *h_p)
+{
+	uint64_t max = atomic_load_explicit(&h_p->max, memory_order_relaxed);
+	uint32_t i;
+
+	snap_p->count += atomic_load_explicit(&h_p->count, memory_order_relaxed);
+	if (max > snap_p->max)
+		snap_p->max = max;
+	for (i=0; i<STATS_BUCKETS; i++)
+		snap_p->bucket[i] += atomic_load_explicit(&h_p->bucket[i], memory_order_relaxed);
+}
+
+/**
+ * bucket_high - largest value in a histogram bucket
+ * @idx: bucket index from stats_bucket
+ */
+static uint64_t bucket_high(uint32_t idx)
+{
+	uint32_t e, m;
+
+	if (idx < STATS_SUB)
+		return idx;
+	e = idx / STATS_SUB + STATS_SUB_BITS - 1;
+	m = idx % STATS_SUB;
+	return ((uint64_t)(STATS_SUB + m) << (e - STATS_SUB_BITS)) +
+		(1ULL << (e - STATS_SUB_BITS)) - 1;
+}
+
+/**
+ * hist_pct - value at a percentile of a snapshot
+ * @snap_p: the snapshot
+ * @pct: percentile in tenths, e.g. 999 for p99.9
+ *
+ * The upper bound of the bucket holding the sample, at most the largest
+ * sample.
+ *
+ * Return: nsecs, 0 for an empty histogram
+ */
+static uint64_t hist_pct(const hist_snap_t *snap_p, uint32_t pct)
+{
+	uint64_t want, sum = 0;
+	uint32_t i;
+
+	if (0 == snap_p->count)
+		return(0);
+
+	want = (snap_p->count * pct + 999) / 1000;
+	for (i=0; i<STATS_BUCKETS; i++) {
+		sum += snap_p->bucket[i];
+		if (sum >= want)
+			break;
+	}
+	return (bucket_high(i) < snap_p->max) ? bucket_high(i) : snap_p->max;
+}
+
+/**
+ * stats_hist_pct - value at a percentile of one histogram
+ * @h_p: the histogram
+ * @pct: percentile in tenths, e.g. 999 for p99.9
+ *
+ * Return: nsecs, 0 for an empty histogram
+ */
+uint64_t stats_hist_pct(stats_hist_t *h_p, uint32_t pct)
+{
+	hist_snap_t snap;
+
+	memset(&snap, 0, sizeof(snap));
+	hist_add(&snap, h_p);
+	return hist_pct(&snap, pct);
+}
+
+/**
+ * hist_show - print count, p50, p99, p99.9 and max of a snapshot
+ * @snap_p: the snapshot
+ */
+static void hist_show(const hist_snap_t *snap_p)
+{
+	printf(" %9lu %8lu %8lu %8lu %8lu", snap_p->count,
+	       hist_pct(snap_p, 500), hist_pct(snap_p, 990), hist_pct(snap_p, 999),
+	       snap_p->max);
+}
+
+/**
+ * stats_show - print per-thread latency and the merged FSM counters
+ *
+ * The counters are read while the threads update them, so the totals
+ * may be slightly out of step with each other.
+ */
+void stats_show(void)
+{
+	static hist_snap_t qlat, act, tot_qlat, tot_act;
+	uint64_t evts[E_LAST+1] = {0};
+	uint64_t guard = 0, unmatched = 0, filtered = 0, raised = 0, n;
+	stats_t *st_p;
+	uint32_t f, i, j;
+
+	memset(&tot_qlat, 0, sizeof(tot_qlat));
+	memset(&tot_act, 0, sizeof(tot_act));
+
+	printf("latency nsec%s\n%-12s %9s %8s %8s %8s %8s | %9s %8s %8s %8s %8s\n",
+	       stats_latency ? "" : " (off, see -L)",
+	       "name", "queued", "p50", "p99", "p999", "max",
+	       "actions", "p50", "p99", "p999", "max");
+	for (st_p = atomic_load(&stats_list); st_p; st_p = st_p->next_p) {
+		memset(&qlat, 0, sizeof(qlat));
+		memset(&act, 0, sizeof(act));
+		hist_add(&qlat, &st_p->qlat);
+		hist_add(&act, &st_p->act);
+		hist_add(&tot_qlat, &st_p->qlat);
+		hist_add(&tot_act, &st_p->act);
+
+		printf("%-12s", st_p->name);
+		hist_show(&qlat);
+		printf(" |");
+		hist_show(&act);
+		printf("\n");
+
+		for (i=0; i<=E_LAST; i++)
+			evts[i] += atomic_load_explicit(&st_p->evts[i], memory_order_relaxed);
+		guard += atomic_load_explicit(&st_p->guard_fails, memory_order_relaxed);
+		unmatched += atomic_load_explicit(&st_p->unmatched, memory_order_relaxed);
+		filtered += atomic_load_explicit(&st_p->filtered, memory_order_relaxed);
+		raised += atomic_load_explicit(&st_p->raised, memory_order_relaxed);
+	}
+	printf("%-12s", "total");
+	hist_show(&tot_qlat);
+	printf(" |");
+	hist_show(&tot_act);
+	printf("\n");
+
+	printf("fsm events:");
+	for (i=0; i<E_LAST; i++)
+		if (evts[i])
+			printf(" %s=%lu", evt_name[i], evts[i]);
+	if (evts[E_LAST])
+		printf(" %s=%lu", evt_name[E_BAD], evts[E_LAST]);
+	printf("\nguard failures=%lu unmatched=%lu filtered=%lu raised=%lu\n",
+	       guard, unmatched, filtered, raised);
+
+	printf("transitions:\n");
+	for (f=0; f<STATS_FSM_MAX; f++) {
+		for (i=0; i<STATS_STATE_MAX; i++) {
+			for (j=0; j<STATS_STATE_MAX; j++) {
+				n = 0;
+				for (st_p = atomic_load(&stats_list); st_p; st_p = st_p->next_p)
+					n += atomic_load_explicit(&st_p->trans[f][i][j],
+								  memory_order_relaxed);
+				if (n)
+					printf(" fsm%u %s -> %s: %lu\n", f,
+					       stats_states[f][i] ? stats_states[f][i] : "?",
+					       stats_states[f][j] ? stats_states[f][j] : "?", n);
+			}
+		}
+	}
+}
+
+/**
+ * stats_destroy - free the counters of every thread
+ *
+ * Call after the counting threads are done.
+ */
+void stats_destroy(void)
+{
+	stats_t *st_p, *n_p;
+
+	for (st_p = atomic_exchange(&stats_list, NULL); st_p; st_p = n_p) {
+		n_p = st_p->next_p;
+		free(st_p);
+	}
+	stats_self_p = NULL;
+}
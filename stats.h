@@ -0,0 +1,211 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * per-thread FSM and event queue statistics
+ *
+ * Each thread counts into its own stats_t, created the first time it
+ * counts something, so the hot path is a thread-local load and a few
+ * uncontended stores.  stats_show merges the threads on read.
+ *
+ * Counted always: events dispatched per event id, transitions per state
+ * pair, guard failures, unmatched events (no transition for the current
+ * state), filtered broadcasts (no transition in any state) and events
+ * an instance raised to itself (fsm_raise.)  With
+ * stats_latency set (fsmdemo -L) each event is also stamped on enqueue
+ * and two log-linear histograms are kept: enqueue to dequeue latency and
+ * the exit+entry action time of a transition.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <stdatomic.h>   /* counters */
+#include <time.h>        /* clock_gettime */
+#include "utils.h"
+#include "evtq.h"
+#include "fsm.h"
+
+/*
+ * log-linear histogram: values below STATS_SUB nsec get a bucket each,
+ * above that every power of two is split in STATS_SUB buckets, so the
+ * error is under 1/STATS_SUB (6%) over the whole uint64_t range.
+ */
+#define STATS_SUB_BITS 4
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB)
+
+/* fsm_t ids and states per FSM with transition pair counters */
+#define STATS_FSM_MAX 8
+#define STATS_STATE_MAX 16
+
+/**
+ * stats_hist_t - log-linear latency histogram in nsecs
+ * @count: number of samples
+ * @max: largest sample
+ * @bucket: samples in each bucket, see stats_bucket
+ */
+typedef struct stats_hist {
+	atomic_ulong count;
+	atomic_ulong max;
+	atomic_ulong bucket[STATS_BUCKETS];
+} stats_hist_t;
+
+/**
+ * stats_t - counters of one thread, only that thread writes them
+ * @next_p: next thread on the stats list
+ * @name: worker name, threadN for other threads
+ * @evts: events run through fsm_run, E_LAST counts bad event ids
+ * @trans: transitions by fsm_t id, from state, to state
+ * @guard_fails: transitions refused by a guard
+ * @unmatched: events with no transition in the current state
+ * @filtered: broadcast deliveries skipped, the FSM has no transition for
+ *            the event in any state
+ * @raised: events run to completion within the fsm_run that raised them
+ * @qlat: enqueue to dequeue latency
+ * @act: exit plus entry action time of a transition
+ */
+typedef struct stats {
+	struct stats *next_p;
+	char name[32];
+	atomic_ulong evts[E_LAST+1];
+	atomic_ulong trans[STATS_FSM_MAX][STATS_STATE_MAX][STATS_STATE_MAX];
+	atomic_ulong guard_fails;
+	atomic_ulong unmatched;
+	atomic_ulong filtered;
+	atomic_ulong raised;
+	stats_hist_t qlat;
+	stats_hist_t act;
+} stats_t;
+
+/*
+ * stats_latency - stamp events and time actions, set before the threads
+ * start
+ */
+extern bool stats_latency;
+
+/*
+ * stats_self_p - the calling thread counters, NULL until stats_get
+ */
+extern __thread stats_t *stats_self_p;
+
+extern stats_t *stats_create(void);
+extern void stats_fsm(const fsm_t *fsm_p);
+extern uint64_t stats_hist_pct(stats_hist_t *h_p, uint32_t pct);
+extern void stats_show(void);
+extern void stats_destroy(void);
+
+/**
+ * stats_get - counters of the calling thread
+ */
+static inline stats_t *stats_get(void)
+{
+	if (unlikely(NULL == stats_self_p))
+		return stats_create();
+	return stats_self_p;
+}
+
+/**
+ * stats_inc - add to a counter only the calling thread writes
+ * @cnt_p: the counter
+ * @n: amount
+ *
+ * A plain load and store, no locked instruction.
+ */
+static inline void stats_inc(atomic_ulong *cnt_p, uint64_t n)
+{
+	atomic_store_explicit(cnt_p, atomic_load_explicit(cnt_p, memory_order_relaxed) + n,
+			      memory_order_relaxed);
+}
+
+/**
+ * stats_now - CLOCK_MONOTONIC in nsecs
+ */
+static inline uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * stats_stamp - enqueue timestamp for an event, 0 if not timing
+ */
+static inline uint64_t stats_stamp(void)
+{
+	return unlikely(stats_latency) ? stats_now() : 0;
+}
+
+/**
+ * stats_bucket - histogram bucket of a value
+ * @v: nsecs
+ */
+static inline uint32_t stats_bucket(uint64_t v)
+{
+	uint32_t e;
+
+	if (v < STATS_SUB)
+		return (uint32_t)v;
+	e = 63 - __builtin_clzll(v);
+	return (e - STATS_SUB_BITS + 1) * STATS_SUB +
+		(uint32_t)((v >> (e - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+/**
+ * stats_hist_add - add one sample to a histogram of the calling thread
+ * @h_p: the histogram
+ * @v: nsecs
+ */
+static inline void stats_hist_add(stats_hist_t *h_p, uint64_t v)
+{
+	stats_inc(&h_p->bucket[stats_bucket(v)], 1);
+	stats_inc(&h_p->count, 1);
+	if (v > atomic_load_explicit(&h_p->max, memory_order_relaxed))
+		atomic_store_explicit(&h_p->max, v, memory_order_relaxed);
+}
+
+/**
+ * stats_qlat - record the queue latency of a dequeued event
+ * @ts: the event enqueue stamp, 0 if it was not stamped
+ */
+static inline void stats_qlat(uint64_t ts)
+{
+	if (ts)
+		stats_hist_add(&stats_get()->qlat, stats_now() - ts);
+}
+
+/**
+ * stats_evt - count an event run through fsm_run
+ * @evt_id: the event
+ */
+static inline void stats_evt(fsm_events_t evt_id)
+{
+	stats_inc(&stats_get()->evts[evt_id < E_LAST ? evt_id : E_LAST], 1);
+}
+
+/**
+ * stats_trans - count a transition
+ * @fsm_p: the compiled FSM
+ * @from: state index before the transition
+ * @to: state index after the transition
+ */
+static inline void stats_trans(const fsm_t *fsm_p, uint16_t from, uint16_t to)
+{
+	if (fsm_p->id < STATS_FSM_MAX && from < STATS_STATE_MAX && to < STATS_STATE_MAX)
+		stats_inc(&stats_get()->trans[fsm_p->id][from][to], 1);
+}
+
+/**
+ * stats_filtered - count broadcast deliveries skipped by an event mask
+ * @n: number skipped
+ */
+static inline void stats_filtered(uint64_t n)
+{
+	stats_inc(&stats_get()->filtered, n);
+}
+
+#endif /* _STATS_H */
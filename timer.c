@@ -3,25 +3,106 @@
  * Copyright (C) 2021 Dahetral Systems
  * Author: David Turvene (dturvene@dahetral.com)
  *
- * periodic timer API using timerfd functions 
+ * periodic timer API using a hierarchical timer wheel driven by one timerfd
+ *
+ * Timers are kept in a wheel of WHEEL_LEVELS levels, each WHEEL_SIZE
+ * slots.  Level 0 slots are 1 msec wide, each higher level slot is
+ * WHEEL_SIZE times wider than the level below it.  A timer is placed in
+ * the lowest level that can hold its expiry and moved (cascaded) down a
+ * level when the wheel clock reaches its slot, the same scheme as the
+ * classic kernel timer wheel (tv1..tv5 in $K/kernel/time/timer.c before
+ * v4.8).  Adding and removing a timer is O(1).
+ *
+ * The single timerfd is armed, absolute, for the next msec that has work
+ * (an expiry or a non-empty slot to cascade) so the timer service only
+ * wakes when needed.  Any thread setting a timer re-arms the timerfd
+ * itself, there is no polling for new timers.  All timers expiring in one
+ * wakeup are delivered as a batch.
+ *
+ * timer_hold keeps the wheel from expiring anything, e.g. while a
+ * snapshot reads the timers (timer_walk) and the events they sent, and
+ * restore_timer puts a timer back with the time it had left.
+ *
+ * The timerfd is a reactor source, the wheel runs on whatever thread runs
+ * that reactor: the CLI thread or a timer_service_fn thread.
+ *
+ * With timer_sim_start the wheel runs on a virtual clock instead and the
+ * timerfd is never armed.  The clock only moves in timer_nap, which jumps
+ * it from one deadline to the next and waits after each for every event
+ * the expired timers caused to be run (evtq_quiesce), so a long scenario
+ * takes no longer than the work in it and runs the same way every time.
  */
 
-#include <sys/epoll.h>   /* epoll_ctl */
 #include "utils.h"
 #include "timer.h"
 #include "workers.h"
+#include "arena.h"
+#include "reactor.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+/* five levels hold 2^30 msec, about 12 days, longer timers are re-cascaded */
+#define WHEEL_LEVELS 5
+#define WHEEL_SPAN (1ULL << (WHEEL_LEVELS * WHEEL_BITS))
+
+/**
+ * struct timer_wheel - the timer wheel, guarded by timer_list.mutex
+ * @clk: next msec to process, every timer due before it has expired
+ * @armed: msec the timerfd is armed for, UINT64_MAX if disarmed
+ * @pending: bitmap of non-empty slots for each level
+ * @slot: timer lists for each level and slot
+ * @fd: the timerfd
+ */
+static struct timer_wheel {
+	uint64_t clk;
+	uint64_t armed;
+	uint64_t pending[WHEEL_LEVELS];
+	struct nl_list_head slot[WHEEL_LEVELS][WHEEL_SIZE];
+	int fd;
+} wheel;
+
+/*
+ * timer_index - dense registry of timers, indexed by timerid
+ *
+ * Two levels so a sparse id space does not cost a huge array: a chunk of
+ * TIMER_CHUNK pointers is allocated the first time an id in it is
+ * created.  Timers are never freed, so find_timer_by_id can read the
+ * registry without taking timer_list.mutex, the release stores in
+ * create_timer pair with its acquire loads.
+ */
+#define TIMER_CHUNK_BITS 10
+#define TIMER_CHUNK (1 << TIMER_CHUNK_BITS)
+#define TIMER_CHUNKS 1024
+#define TIMER_ID_MAX (TIMER_CHUNK * TIMER_CHUNKS)
+typedef _Atomic(fsmtimer_t *) timer_slot_t;
+static _Atomic(timer_slot_t *) timer_index[TIMER_CHUNKS];
+
+static timer_list_t timer_list = {
+	.head.list = { &timer_list.head.list, &timer_list.head.list },
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+/* held while a batch expires and is delivered, see timer_hold */
+static pthread_mutex_t timer_expire_mutex = PTHREAD_MUTEX_INITIALIZER;
+static reactor_src_t timer_src;
 
-#define MAX_TIMERS 4
+/*
+ * timer_sim - the wheel runs on sim_now instead of CLOCK_MONOTONIC
+ * sim_now - virtual msec, only timer_nap moves it
+ */
+static bool timer_sim;
+static atomic_ulong sim_now;
 
-static timer_list_t timer_list;
-static int fd_epoll;
+/* most timers show_timers prints, there is one per FSM instance timer */
+#define SHOW_TIMERS_MAX 32
 
 static inline void dbg_timer(fsm_events_t evt_id, const char *msg)
 {
 	struct timespec ts;
 	char buf[120];
 
-	if (!(debug_flag&DBG_TIMERS))
+	if (!dbg_on(DBG_TIMERS))
 		return;
 
 	clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -35,97 +116,347 @@ static inline void dbg_timer(fsm_events_t evt_id, const char *msg)
 }
 
 /**
- * find_timer_by_id - 
- *
- * @timerid: the unique timer id
+ * timer_now_ms - current CLOCK_MONOTONIC time in msecs
+ */
+static inline uint64_t timer_now_ms(void)
+{
+	struct timespec ts;
+
+	if (timer_sim)
+		return atomic_load_explicit(&sim_now, memory_order_relaxed);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * wheel_add - place a timer in the wheel
+ * @timer_p: timer with a valid expires
  *
- * Return: a pointer to the fsmtimer_t
+ * Pick the lowest level that can hold the distance from the wheel clock,
+ * the slot is the expiry msec bits for that level.  A timer already due
+ * goes in the next slot processed, one beyond WHEEL_SPAN is parked in the
+ * furthest slot and placed again when it is reached.
  */
-fsmtimer_t *find_timer_by_id(uint32_t timerid)
+static void wheel_add(fsmtimer_t *timer_p)
 {
-	fsmtimer_t *timer_p;
-	fsmtimer_t *found_p = NULL;
-	pthread_mutex_lock(&timer_list.mutex);
-	nl_list_for_each_entry(timer_p, &timer_list.head.list, list) {
-		if (timerid == timer_p->timerid) {
-			found_p = timer_p;
-		}
+	uint64_t expires = timer_p->expires;
+	uint64_t delta;
+	int lvl, idx;
+
+	if (expires < wheel.clk)
+		expires = wheel.clk;
+	delta = expires - wheel.clk;
+	if (delta >= WHEEL_SPAN) {
+		delta = WHEEL_SPAN - 1;
+		expires = wheel.clk + delta;
 	}
-	
-	pthread_mutex_unlock(&timer_list.mutex);
-	return(found_p);
+
+	lvl = (delta < WHEEL_SIZE) ? 0 : (63 - __builtin_clzll(delta)) / WHEEL_BITS;
+	idx = (expires >> (lvl * WHEEL_BITS)) & WHEEL_MASK;
+
+	nl_list_add_tail(&timer_p->wheel, &wheel.slot[lvl][idx]);
+	wheel.pending[lvl] |= 1ULL << idx;
+	timer_p->lvl = lvl;
+	timer_p->idx = idx;
+}
+
+/**
+ * wheel_del - take a timer out of the wheel, if it is in it
+ * @timer_p: timer to remove
+ */
+static void wheel_del(fsmtimer_t *timer_p)
+{
+	if (nl_list_empty(&timer_p->wheel))
+		return;
+
+	nl_list_del(&timer_p->wheel);
+	NL_INIT_LIST_HEAD(&timer_p->wheel);
+	if (nl_list_empty(&wheel.slot[timer_p->lvl][timer_p->idx]))
+		wheel.pending[timer_p->lvl] &= ~(1ULL << timer_p->idx);
 }
 
 /**
- * find_timer_by_pollfd - 
+ * wheel_next - next msec, at or after the wheel clock, with work to do
  *
- * @pollfd: the fd from poll_wait
+ * For each level find the first non-empty slot going around the wheel
+ * from the clock.  On level 0 that is an expiry, on higher levels it is
+ * when the slot is cascaded down.
  *
- * Return: a pointer to the fsmtimer_t
+ * Return: the msec or UINT64_MAX if the wheel is empty
  */
-fsmtimer_t *find_timer_by_pollfd(int pollfd)
+static uint64_t wheel_next(void)
 {
-	fsmtimer_t* timer_p;
-	fsmtimer_t *found_p = NULL;	
-	pthread_mutex_lock(&timer_list.mutex);
-	nl_list_for_each_entry(timer_p, &timer_list.head.list, list) {
-		if (pollfd == timer_p->fd) {
-			found_p = timer_p;
+	uint64_t next = UINT64_MAX;
+	uint64_t unit, rot, t;
+	int lvl, shift, c;
+
+	for (lvl=0; lvl<WHEEL_LEVELS; lvl++) {
+		if (0 == wheel.pending[lvl])
+			continue;
+
+		shift = lvl * WHEEL_BITS;
+		/* first slot boundary at or after the clock */
+		unit = (wheel.clk + (1ULL << shift) - 1) >> shift;
+		c = unit & WHEEL_MASK;
+		rot = (wheel.pending[lvl] >> c) | (c ? wheel.pending[lvl] << (WHEEL_SIZE - c) : 0);
+		t = (unit + __builtin_ctzll(rot)) << shift;
+		if (t < next)
+			next = t;
+	}
+	return(next);
+}
+
+/**
+ * wheel_cascade - move the timers in one slot down to the lower levels
+ * @lvl: wheel level, > 0
+ * @idx: slot index
+ */
+static void wheel_cascade(int lvl, int idx)
+{
+	struct nl_list_head *head_p = &wheel.slot[lvl][idx];
+	fsmtimer_t *timer_p, *n_p;
+	struct nl_list_head tmp;
+
+	if (nl_list_empty(head_p))
+		return;
+
+	/* detach the slot first, wheel_add may not put a timer back in it */
+	tmp.next = head_p->next;
+	tmp.prev = head_p->prev;
+	tmp.next->prev = &tmp;
+	tmp.prev->next = &tmp;
+	NL_INIT_LIST_HEAD(head_p);
+	wheel.pending[lvl] &= ~(1ULL << idx);
+
+	nl_list_for_each_entry_safe(timer_p, n_p, &tmp, wheel) {
+		nl_list_del(&timer_p->wheel);
+		wheel_add(timer_p);
+	}
+}
+
+/**
+ * wheel_advance - run the wheel clock up to now
+ * @now: current msec
+ * @batch_p: expired timers are added to this list
+ *
+ * Jump the clock from one msec with work to the next, cascading the slots
+ * of every level whose boundary the clock is on (lowest level first) and
+ * then expiring the level 0 slot.  Periodic timers are put back in the
+ * wheel for their next period.
+ */
+static void wheel_advance(uint64_t now, struct nl_list_head *batch_p)
+{
+	fsmtimer_t *timer_p, *n_p;
+	uint64_t next, expires;
+	int lvl, idx;
+
+	while (wheel.clk <= now) {
+		next = wheel_next();
+		if (next > now) {
+			wheel.clk = now + 1;
+			break;
+		}
+		wheel.clk = next;
+
+		for (lvl=1; lvl<WHEEL_LEVELS; lvl++) {
+			if (wheel.clk & ((1ULL << (lvl * WHEEL_BITS)) - 1))
+				break;
+			wheel_cascade(lvl, (wheel.clk >> (lvl * WHEEL_BITS)) & WHEEL_MASK);
+		}
+
+		idx = wheel.clk & WHEEL_MASK;
+		nl_list_for_each_entry_safe(timer_p, n_p, &wheel.slot[0][idx], wheel) {
+			wheel_del(timer_p);
+
+			/* parked beyond WHEEL_SPAN, not due yet */
+			if (timer_p->expires > wheel.clk) {
+				wheel_add(timer_p);
+				continue;
+			}
+
+			nl_list_add_tail(&timer_p->batch, batch_p);
+
+			/* periodic, keep the phase like timerfd it_interval */
+			expires = timer_p->expires;
+			while (expires <= now)
+				expires += timer_p->tick_ms;
+			__atomic_store_n(&timer_p->expires, expires, __ATOMIC_RELAXED);
+			wheel_add(timer_p);
 		}
+		wheel.clk++;
 	}
-	pthread_mutex_unlock(&timer_list.mutex);
-	return(found_p);
 }
 
+/**
+ * wheel_arm - arm the timerfd for the next msec with work
+ *
+ * Called with timer_list.mutex held whenever the wheel changes.  Only
+ * touches the timerfd when the deadline moves.
+ */
+static void wheel_arm(void)
+{
+	struct itimerspec ts = {0};
+	uint64_t next = wheel_next();
+
+	if (next == wheel.armed || timer_sim)
+		return;
+	wheel.armed = next;
+
+	/* all zero disarms */
+	if (next != UINT64_MAX) {
+		ts.it_value.tv_sec = next / 1000;
+		ts.it_value.tv_nsec = (next % 1000) * 1000000;
+		/* absolute 0 would disarm */
+		if (0 == next)
+			ts.it_value.tv_nsec = 1;
+	}
+
+	if (-1 == timerfd_settime(wheel.fd, TFD_TIMER_ABSTIME, &ts, NULL))
+		die("timerfd_settime");
+}
+
+/**
+ * wheel_init - create the timerfd and empty the wheel
+ */
+static void wheel_init(void)
+{
+	int lvl, idx;
+
+	for (lvl=0; lvl<WHEEL_LEVELS; lvl++) {
+		wheel.pending[lvl] = 0;
+		for (idx=0; idx<WHEEL_SIZE; idx++)
+			NL_INIT_LIST_HEAD(&wheel.slot[lvl][idx]);
+	}
+	wheel.clk = timer_now_ms();
+	wheel.armed = UINT64_MAX;
+
+	/* nonblocking, a reactor_nap may have read the expiry first */
+	if (-1 == (wheel.fd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)))
+		die("timerfd_create");
+}
+
+/**
+ * timer_init - one time setup of the wheel
+ *
+ * Run through pthread_once from both create_timer and timer_reactor_add,
+ * so a worker may create a timer before the timer service is running.
+ */
+static void timer_init(void)
+{
+	wheel_init();
+}
+
+/**
+ * find_timer_by_id - 
+ *
+ * @timerid: the unique timer id
+ *
+ * Two loads from timer_index, no lock.
+ *
+ * Return: a pointer to the fsmtimer_t, NULL if not created
+ */
+fsmtimer_t *find_timer_by_id(uint32_t timerid)
+{
+	timer_slot_t *chunk_p;
+
+	if (timerid >= TIMER_ID_MAX)
+		return(NULL);
+
+	chunk_p = atomic_load_explicit(&timer_index[timerid >> TIMER_CHUNK_BITS],
+				       memory_order_acquire);
+	if (NULL == chunk_p)
+		return(NULL);
+	return atomic_load_explicit(&chunk_p[timerid & (TIMER_CHUNK - 1)],
+				    memory_order_acquire);
+}
+
+/**
+ * show_timers - print the first SHOW_TIMERS_MAX timers and a total
+ */
 void show_timers(void)
 {
 	fsmtimer_t* timer_p;
-	printf("timers\n%-2s:%-2s %-18s %-9s\n", "id", "fd", "event name", "msec val");
+	uint32_t cnt = 0;
+
+	printf("timers\n%-2s:%-2s %-18s %-9s\n", "id", "lv", "event name", "msec val");
 	pthread_mutex_lock(&timer_list.mutex);
 	nl_list_for_each_entry(timer_p, &timer_list.head.list, list) {
+		if (cnt++ >= SHOW_TIMERS_MAX)
+			continue;
 		printf("%2u:%2d evt=%14s msec=%5lu\n", timer_p->timerid,
-		       timer_p->fd,
+		       timer_p->tick_ms ? timer_p->lvl : -1,
 		       evt_name[timer_p->evtid],
 		       timer_p->tick_ms);
 	}
 	pthread_mutex_unlock(&timer_list.mutex);
+	if (cnt > SHOW_TIMERS_MAX)
+		printf("... %u timers\n", cnt);
 }
 
 /**
- * create_timer
+ * create_timer_notify - create a timer with an expiry callback
+ * @timerid: unique timer id
+ * @evtid: event passed to @notify on expiry
+ * @notify: called on the timer service thread, NULL to broadcast @evtid
+ *          to all workers
+ * @ctx: passed to @notify
  *
  * but don't start it
  */
-int create_timer(uint32_t timerid, fsm_events_t evtid)
+int create_timer_notify(uint32_t timerid, fsm_events_t evtid,
+			void (*notify)(void *ctx, fsm_events_t evtid), void *ctx)
 {
-	fsmtimer_t *timer_p = malloc(sizeof(fsmtimer_t));
-	struct epoll_event event;     /* struct to add to the epoll list */
+	fsmtimer_t *timer_p = arena_calloc(sizeof(fsmtimer_t));
+	timer_slot_t *chunk_p;
 
-	if (NULL != find_timer_by_id(timerid))
-		die("timer exists");
+	if (NULL == timer_p)
+		die("create_timer");
 
-	if (-1 == (timer_p->fd=timerfd_create(CLOCK_MONOTONIC, 0)))
-		die("timerfd_create");
+	if (timerid >= TIMER_ID_MAX)
+		die("timer id too large");
+
+	pthread_once(&timer_once, timer_init);
 
 	timer_p->timerid = timerid;
 	timer_p->evtid = evtid;
+	timer_p->notify = notify;
+	timer_p->ctx = ctx;
 	timer_p->tick_ms = 0;
+	timer_p->old_tick_ms = 0;
+	timer_p->expires = 0;
+	NL_INIT_LIST_HEAD(&timer_p->wheel);
 
 	pthread_mutex_lock(&timer_list.mutex);
 
-	nl_list_add_tail(&timer_p->list, &timer_list.head.list);
+	if (NULL != find_timer_by_id(timerid))
+		die("timer exists");
 
-	/* add to poll list */
-	event.data.fd = timer_p->fd;
-	event.events = EPOLLIN;
-	if (-1 == epoll_ctl(fd_epoll, EPOLL_CTL_ADD, event.data.fd, &event))
-		die("epoll_ctl for new timer");
-	
+	chunk_p = timer_index[timerid >> TIMER_CHUNK_BITS];
+	if (NULL == chunk_p) {
+		if (NULL == (chunk_p = arena_calloc(TIMER_CHUNK * sizeof(timer_slot_t))))
+			die("create_timer index");
+		atomic_store_explicit(&timer_index[timerid >> TIMER_CHUNK_BITS], chunk_p,
+				      memory_order_release);
+	}
+	atomic_store_explicit(&chunk_p[timerid & (TIMER_CHUNK - 1)], timer_p,
+			      memory_order_release);
+
+	nl_list_add_tail(&timer_p->list, &timer_list.head.list);
 	pthread_mutex_unlock(&timer_list.mutex);
 	
 	return(0);
 }
 
+/**
+ * create_timer - create a timer broadcasting evtid to all workers
+ * @timerid: unique timer id
+ * @evtid: event broadcast on expiry
+ */
+int create_timer(uint32_t timerid, fsm_events_t evtid)
+{
+	return create_timer_notify(timerid, evtid, NULL, NULL);
+}
+
 /**
  * set_timer_p - set a timer to a new periodic timeout tick_ms in the future
  *
@@ -134,7 +465,7 @@ int create_timer(uint32_t timerid, fsm_events_t evtid)
  *
  * Return: the tick_ms
  *
- * This is called from the timer thread to set, reset, cancel
+ * This is called from any thread to set, reset, cancel
  * a timer.  If ms == 0, the timer is cancelled.  If a running 
  * timer is being set, the future timeout is reset to this value.
  *
@@ -143,41 +474,34 @@ int create_timer(uint32_t timerid, fsm_events_t evtid)
  */
 int set_timer_p(fsmtimer_t *timer_p, uint64_t tick_ms)
 {
-	struct itimerspec ts;
-	time_t sec;
-	long nsec;
-
 	if (NULL == timer_p)
 		die("set_timer unknown timer");
 
-	if (debug_flag & DBG_TIMERS) {
+	if (dbg_on(DBG_TIMERS)) {
 		printf("%d:%s set to %lu msecs\n",
 		       timer_p->timerid,
 		       evt_name[timer_p->evtid],
 		       tick_ms);
 	}
 
+	pthread_mutex_lock(&timer_list.mutex);
+
 	/* save current tick before updating, used by toggle function */
 	timer_p->old_tick_ms = timer_p->tick_ms;
-	timer_p->tick_ms = tick_ms;
-	if (debug_flag & DBG_TIMERS)
+	__atomic_store_n(&timer_p->tick_ms, tick_ms, __ATOMIC_RELAXED);
+	if (dbg_on(DBG_TIMERS))
 		printf("%d: old=%ld tick=%ld\n", timer_p->timerid,
 		       timer_p->old_tick_ms, timer_p->tick_ms);
 	
-	/* convert ms into timerfd argument 
-	 * special case for 0, which disarms the timer
-	 */
-	sec = tick_ms ? (tick_ms/1000) : 0;
-	nsec = tick_ms ? (tick_ms%1000)*1e6 : 0;
-
-	ts.it_value.tv_sec = sec;
-	ts.it_value.tv_nsec = nsec;
-	ts.it_interval.tv_sec = sec;
-	ts.it_interval.tv_nsec = nsec;
-
-	if (-1 == timerfd_settime(timer_p->fd, 0, &ts, NULL))
-		die("set_timer");
+	/* special case for 0, which disarms the timer */
+	wheel_del(timer_p);
+	if (tick_ms) {
+		__atomic_store_n(&timer_p->expires, timer_now_ms() + tick_ms, __ATOMIC_RELAXED);
+		wheel_add(timer_p);
+	}
+	wheel_arm();
 
+	pthread_mutex_unlock(&timer_list.mutex);
 
 	return(0);
 }
@@ -199,28 +523,75 @@ void set_timer(uint32_t timerid, uint64_t tick_ms)
 	set_timer_p(timer_p, tick_ms);
 }
 
+/**
+ * restore_timer - set a timer with its first expiry apart from its period
+ * @timerid: unique timer id
+ * @tick_ms: period in msec, 0 leaves the timer stopped
+ * @old_tick_ms: previous period, for toggle_timer
+ * @rem_ms: msec to the first expiry, 0 for due now
+ *
+ * Puts back a timer read by timer_walk, e.g. from a snapshot.
+ */
+void restore_timer(uint32_t timerid, uint64_t tick_ms, uint64_t old_tick_ms, uint64_t rem_ms)
+{
+	fsmtimer_t *timer_p = find_timer_by_id(timerid);
+
+	if (NULL == timer_p)
+		die("restore_timer unknown timer");
+
+	pthread_mutex_lock(&timer_list.mutex);
+	timer_p->old_tick_ms = old_tick_ms;
+	__atomic_store_n(&timer_p->tick_ms, tick_ms, __ATOMIC_RELAXED);
+	wheel_del(timer_p);
+	if (tick_ms) {
+		__atomic_store_n(&timer_p->expires, timer_now_ms() + rem_ms, __ATOMIC_RELAXED);
+		wheel_add(timer_p);
+	}
+	wheel_arm();
+	pthread_mutex_unlock(&timer_list.mutex);
+}
+
+/**
+ * stop_timer - cancel a timer, it can be restarted with toggle_timer
+ * @timerid: unique timer id
+ *
+ * Return: 0 for success, -1 if timer not found
+ */
+int stop_timer(uint32_t timerid)
+{
+	fsmtimer_t *timer_p = find_timer_by_id(timerid);
+
+	if (NULL == timer_p)
+		return(-1);
+	set_timer_p(timer_p, 0);
+	return(0);
+}
+
 /**
  * get_timer - remaining time in msec
  * @timerid: unique timerid in timer list
  *
- * Result: remaining time in msec
+ * This is on the guard path (but_constraint) so it does not take
+ * timer_list.mutex, tick_ms and expires are read atomically.  A timer
+ * being set at the same time may give the old or new remaining time.
+ *
+ * Result: remaining time in msec, 0 if the timer is stopped
  */
 uint64_t get_timer(uint32_t timerid)
 {
 	fsmtimer_t *timer_p = find_timer_by_id(timerid);
-	struct itimerspec ts;
-	uint64_t msec;
+	uint64_t msec = 0;
+	uint64_t now, expires;
 	
 	if (NULL == timer_p)
 		die("get_timer unknown timer");
 	
-	if (-1 == timerfd_gettime(timer_p->fd,&ts))
-		die("get_timer");
-
-	/* convert timerfd to msec */	
-	msec = ts.it_value.tv_sec * 1000L + ts.it_value.tv_nsec / 1e6;
+	now = timer_now_ms();
+	expires = __atomic_load_n(&timer_p->expires, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&timer_p->tick_ms, __ATOMIC_RELAXED) && expires > now)
+		msec = expires - now;
 
-	if (debug_flag & DBG_TIMERS) {
+	if (dbg_on(DBG_TIMERS)) {
 		printf("%d: remaining msec=%ld\n", timerid, msec);
 	}
 	return (msec);
@@ -247,10 +618,10 @@ int toggle_timer(uint32_t timerid)
 	}
 	
 	if (0 != timer_p->tick_ms) {
-		dbg_timer(timer_p->timerid, "timer off");
+		dbg_timer(timer_p->evtid, "timer off");
 		set_timer_p(timer_p, 0);
 	} else {
-		dbg_timer(timer_p->timerid, "timer restore");		
+		dbg_timer(timer_p->evtid, "timer restore");		
 		set_timer_p(timer_p, timer_p->old_tick_ms);
 	}
 
@@ -258,70 +629,197 @@ int toggle_timer(uint32_t timerid)
 }
 
 /**
- * timer_service_fn - pthread generating timer events to consumer
- * @arg: event queue array created by controlling thread
+ * timer_expire - advance the wheel and deliver expired timer events
  *
- * - use epoll_wait with a short timeout to wait on timer expiration
- * 
- * thread loops forever until program exits or a pthread_cancel is sent
- * to it.
+ * Collect every timer due up to now in one pass under the lock, re-arm
+ * the timerfd, then broadcast the batch without holding the lock.  The
+ * whole pass is under timer_expire_mutex so timer_hold waits for a
+ * batch being delivered.
  */
-void *timer_service_fn(void *arg)
+static void timer_expire(void)
 {
-	struct epoll_event events[MAX_TIMERS];
-	uint64_t res;
+	struct nl_list_head batch;
+	fsmtimer_t *timer_p, *n_p;
 
-	/* init the timer list */
-	pthread_mutex_init(&timer_list.mutex, NULL);
-	NL_INIT_LIST_HEAD(&timer_list.head.list);
+	NL_INIT_LIST_HEAD(&batch);
 
-	/* create epoll */
-	if (-1 == (fd_epoll=epoll_create1(0)))
-		die("epoll");
-	
-	if (0 != pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL))
-		die("pthread_setcancelstate");
-	
-	while (1) {
-		int nfds; /* number of ready file descriptors */
+	pthread_mutex_lock(&timer_expire_mutex);
+	pthread_mutex_lock(&timer_list.mutex);
+	wheel_advance(timer_now_ms(), &batch);
+	/* force re-arm, the timerfd fired */
+	wheel.armed = UINT64_MAX - 1;
+	wheel_arm();
+	pthread_mutex_unlock(&timer_list.mutex);
 
-		/* set timeout to 200ms because workers may create_timer */
-		nfds=epoll_wait(fd_epoll, events, MAX_TIMERS, 200);
+	nl_list_for_each_entry_safe(timer_p, n_p, &batch, batch) {
+		nl_list_del(&timer_p->batch);
+		dbg_timer(timer_p->evtid, "expire");
+		if (timer_p->notify)
+			timer_p->notify(timer_p->ctx, timer_p->evtid);
+		else
+			workers_evt_broadcast(timer_p->evtid);
+	}
+	pthread_mutex_unlock(&timer_expire_mutex);
+}
 
-		if (debug_flag & DBG_DEEP)
-			printf("timer poll_wait fds=%d\n", nfds);
+/**
+ * timer_hold - stop timers expiring until timer_release
+ *
+ * Waits for a batch being delivered.  Timers falling due meanwhile
+ * expire after timer_release, the timerfd stays readable.  Not from a
+ * timer notify callback.
+ */
+void timer_hold(void)
+{
+	pthread_mutex_lock(&timer_expire_mutex);
+}
 
-		switch(nfds) {
-		case -1:
-			/* if poll returns due to an signal interrupt then do nothing 
-			 * otherwise die
-			 */
-			if (errno != EINTR)
-				die("epoll_wait");
-			break;
-		case 0: /* just loop */
+/**
+ * timer_release - let timers expire again after timer_hold
+ */
+void timer_release(void)
+{
+	pthread_mutex_unlock(&timer_expire_mutex);
+}
+
+/**
+ * timer_walk - call a function for every timer
+ * @fn: called with the timer, its remaining msec (0 if stopped) and @arg
+ * @arg: passed to @fn
+ *
+ * Under timer_list.mutex, @fn must not set timers.  With timer_hold the
+ * remaining times are those of timers that have not expired.
+ */
+void timer_walk(void (*fn)(const fsmtimer_t *timer_p, uint64_t rem_ms, void *arg), void *arg)
+{
+	fsmtimer_t *timer_p;
+	uint64_t now;
+
+	pthread_mutex_lock(&timer_list.mutex);
+	now = timer_now_ms();
+	nl_list_for_each_entry(timer_p, &timer_list.head.list, list)
+		fn(timer_p, (timer_p->tick_ms && timer_p->expires > now) ?
+		   timer_p->expires - now : 0, arg);
+	pthread_mutex_unlock(&timer_list.mutex);
+}
+
+/**
+ * timer_sim_start - run the timers on a virtual clock
+ *
+ * Before any timer is created and any worker started.  Events are
+ * counted from here on, see evtq_quiesce, so every consumer must call
+ * evtq_done for the events it runs.
+ */
+void timer_sim_start(void)
+{
+	timer_sim = true;
+	evtq_track = true;
+}
+
+/**
+ * timer_sim_ms - virtual msec since timer_sim_start
+ */
+uint64_t timer_sim_ms(void)
+{
+	return atomic_load(&sim_now);
+}
+
+/**
+ * timer_sim_advance - move the virtual clock @ms forward
+ * @ms: msecs
+ *
+ * Wait for the events already sent, then expire the wheel at each msec it
+ * has work for up to the end of the nap, waiting for the events of each
+ * batch before going on.  A timer set by an action is on the wheel before
+ * the clock moves, so it expires at its own deadline within this nap.
+ */
+static void timer_sim_advance(uint32_t ms)
+{
+	uint64_t end = timer_now_ms() + ms;
+	uint64_t next;
+
+	evtq_quiesce();
+	while (1) {
+		pthread_mutex_lock(&timer_list.mutex);
+		next = wheel_next();
+		pthread_mutex_unlock(&timer_list.mutex);
+		if (next > end)
 			break;
-		default:
-		{
-			int i;
-			fsmtimer_t *timer_p;
-			
-			for (i=0; i<nfds; i++) {
-				/* bad event or corrupted file descriptor */
-				if (!(events[i].events&EPOLLIN))
-					die("bad incoming event");
-
-				timer_p = find_timer_by_pollfd(events[i].data.fd);
-				if (timer_p) {
-					read(events[i].data.fd, &res, sizeof(res));	
-					dbg_timer(timer_p->evtid, "expire");
-					workers_evt_broadcast(timer_p->evtid);
-				} else {
-					die("unknown timer in poll list");
-				}
-			}
-		}
-		break;
-		} /* switch */
-	} /* while */
+
+		atomic_store(&sim_now, next);
+		timer_expire();
+		evtq_quiesce();
+	}
+
+	/* no work up to the end, this only moves the wheel clock */
+	atomic_store(&sim_now, end);
+	timer_expire();
+}
+
+/**
+ * timer_nap - sleep, keep the timers on the calling reactor running
+ * @ms: msecs
+ *
+ * reactor_nap, or on the virtual clock timer_sim_advance, which returns
+ * as soon as the work falling due in the nap is done.
+ */
+void timer_nap(uint32_t ms)
+{
+	if (timer_sim)
+		timer_sim_advance(ms);
+	else
+		reactor_nap(ms);
+}
+
+/**
+ * timer_ready - reactor callback for the wheel timerfd
+ * @src_p: the timerfd source
+ * @events: epoll events
+ */
+static void timer_ready(reactor_src_t *src_p, uint32_t events)
+{
+	uint64_t res;
+
+	/* bad event or corrupted file descriptor */
+	if (!(events & EPOLLIN))
+		die("bad incoming event");
+
+	if (-1 == read(src_p->fd, &res, sizeof(res)) && EAGAIN != errno)
+		die("timerfd read");
+	timer_expire();
+}
+
+/**
+ * timer_reactor_add - run the timer wheel on a reactor
+ * @reactor_p: the reactor, only one per process gets the wheel
+ *
+ * Timers keep firing while the reactor thread is in reactor_nap.
+ */
+void timer_reactor_add(reactor_t *reactor_p)
+{
+	/* the wheel may already be set up by create_timer */
+	pthread_once(&timer_once, timer_init);
+
+	timer_src.fd = wheel.fd;
+	timer_src.flags = REACTOR_NAP;
+	timer_src.fn = timer_ready;
+	timer_src.ctx_p = &wheel;
+	reactor_add(reactor_p, &timer_src);
+}
+
+/**
+ * timer_service_fn - pthread generating timer events to consumer
+ * @arg: the reactor_t to run the wheel on
+ *
+ * For a program whose main thread does not run a reactor.  The thread
+ * sleeps in epoll_wait until the next expiry, and returns after
+ * reactor_stop.
+ */
+void *timer_service_fn(void *arg)
+{
+	reactor_t *reactor_p = (reactor_t *)arg;
+
+	timer_reactor_add(reactor_p);
+	reactor_run(reactor_p);
+	return(NULL);
 }
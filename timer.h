@@ -20,13 +20,34 @@
 #include <libnl3/netlink/list.h> /* kernel-ish linked list */
 #include <evtq.h>
 
+/**
+ * fsmtimer_t - one periodic timer
+ * @list: timer_list entry
+ * @wheel: timer wheel slot entry, empty when the timer is stopped
+ * @batch: expired batch entry, only used by the timer service
+ * @timerid: unique timer id
+ * @evtid: event sent on expiry
+ * @notify: expiry callback, NULL to broadcast @evtid to all workers
+ * @ctx: private data for @notify
+ * @tick_ms: period in msec, 0 if stopped
+ * @old_tick_ms: previous period, used by toggle_timer
+ * @expires: CLOCK_MONOTONIC msec of the next expiry
+ * @lvl: wheel level holding the timer
+ * @idx: wheel slot holding the timer
+ */
 typedef struct fsmtimer {
 	struct nl_list_head list;
+	struct nl_list_head wheel;
+	struct nl_list_head batch;
 	uint32_t timerid;
 	fsm_events_t evtid;
+	void (*notify)(void *ctx, fsm_events_t evtid);
+	void *ctx;
 	uint64_t tick_ms;
 	uint64_t old_tick_ms;
-	int fd;
+	uint64_t expires;
+	int lvl;
+	int idx;
 } fsmtimer_t;
 
 typedef struct timer_list {
@@ -35,14 +56,27 @@ typedef struct timer_list {
 } timer_list_t;
 
 extern int create_timer(uint32_t timerid, fsm_events_t evtid);
+extern int create_timer_notify(uint32_t timerid, fsm_events_t evtid,
+			       void (*notify)(void *ctx, fsm_events_t evtid), void *ctx);
 extern void set_timer(uint32_t timerid, uint64_t tick_ms);
+extern void restore_timer(uint32_t timerid, uint64_t tick_ms, uint64_t old_tick_ms,
+			  uint64_t rem_ms);
 extern int stop_timer(uint32_t timerid);
 extern uint64_t get_timer(uint32_t timerid);
 extern int toggle_timer(uint32_t timerid);
+struct reactor;
+
+extern void timer_reactor_add(struct reactor *reactor_p);
 extern void* timer_service_fn(void *arg);
 extern fsmtimer_t *find_timer_by_id(uint32_t timerid);
-extern fsmtimer_t *find_timer_by_pollfd(int pollfd);
 extern void show_timers(void);
+extern void timer_hold(void);
+extern void timer_release(void);
+extern void timer_sim_start(void);
+extern uint64_t timer_sim_ms(void);
+extern void timer_nap(uint32_t ms);
+extern void timer_walk(void (*fn)(const fsmtimer_t *timer_p, uint64_t rem_ms, void *arg),
+		       void *arg);
 
 static inline uint64_t get_msec(uint32_t timerid)
 {
@@ -0,0 +1,290 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * binary FSM trace, see trace.h
+ *
+ * A thread gets its ring the first time it writes a record.  Rings are
+ * pushed on a lock-free list and never freed before trace_stop, so the
+ * flusher can walk the list while threads come and go.
+ */
+
+#include "utils.h"
+#include "workers.h"
+#include "trace.h"
+
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+/**
+ * trace_ring_t - per-thread trace ring
+ * @next_p: next ring on trace_rings
+ * @thread: trace thread id
+ * @tail: next record to write, only the owner thread stores it
+ * @head: next record to flush, only the flusher stores it
+ * @drops: records lost because the ring was full
+ * @rec: the records
+ */
+typedef struct trace_ring {
+	struct trace_ring *next_p;
+	uint16_t thread;
+	atomic_uint tail;
+	atomic_uint head;
+	atomic_ulong drops;
+	trace_rec_t rec[TRACE_RING_SIZE];
+} trace_ring_t;
+
+bool trace_enabled;
+
+static _Atomic(trace_ring_t *) trace_rings;
+static atomic_uint trace_nthreads;
+static __thread trace_ring_t *trace_self_p;
+
+static FILE *trace_fp;
+static pthread_t trace_flusher;
+static atomic_bool trace_stopping;
+
+/**
+ * trace_ts - current CLOCK_MONOTONIC time in nsecs
+ *
+ * A vDSO call, no syscall.
+ */
+static inline uint64_t trace_ts(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * trace_ring_create - give the calling thread a ring
+ *
+ * The first record is the thread name, threadN for a thread that is not
+ * a worker.
+ */
+static trace_ring_t *trace_ring_create(void)
+{
+	trace_ring_t *ring_p = calloc(1, sizeof(trace_ring_t));
+	const char *name = worker_get_name();
+	trace_rec_t *rec_p;
+
+	if (NULL == ring_p)
+		die("trace_ring_create");
+
+	ring_p->thread = atomic_fetch_add(&trace_nthreads, 1);
+
+	rec_p = &ring_p->rec[0];
+	rec_p->ts = trace_ts();
+	rec_p->type = TRACE_THREAD;
+	rec_p->thread = ring_p->thread;
+	if (name)
+		strncpy(rec_p->name, name, TRACE_NAME_LEN-1);
+	else
+		snprintf(rec_p->name, TRACE_NAME_LEN, "thread%u", ring_p->thread);
+
+	atomic_init(&ring_p->tail, 1);
+	atomic_init(&ring_p->head, 0);
+	atomic_init(&ring_p->drops, 0);
+
+	/* release, the flusher sees the name record with the ring */
+	ring_p->next_p = atomic_load(&trace_rings);
+	while (!atomic_compare_exchange_weak(&trace_rings, &ring_p->next_p, ring_p))
+		;
+	trace_self_p = ring_p;
+	return(ring_p);
+}
+
+/**
+ * trace_put - reserve the next record in the calling thread ring
+ * @type: trace_type_t
+ *
+ * Return: the record to fill, finish with trace_commit, or NULL if the
+ *         ring is full
+ */
+static trace_rec_t *trace_put(trace_type_t type)
+{
+	trace_ring_t *ring_p = trace_self_p;
+	trace_rec_t *rec_p;
+	uint32_t tail;
+
+	if (unlikely(NULL == ring_p))
+		ring_p = trace_ring_create();
+
+	tail = atomic_load_explicit(&ring_p->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&ring_p->head, memory_order_acquire) >= TRACE_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring_p->drops, 1, memory_order_relaxed);
+		return(NULL);
+	}
+
+	rec_p = &ring_p->rec[tail & TRACE_RING_MASK];
+	memset(rec_p, 0, sizeof(*rec_p));
+	rec_p->ts = trace_ts();
+	rec_p->type = type;
+	rec_p->thread = ring_p->thread;
+	return(rec_p);
+}
+
+/**
+ * trace_commit - publish the record from trace_put to the flusher
+ */
+static inline void trace_commit(void)
+{
+	trace_ring_t *ring_p = trace_self_p;
+
+	atomic_store_explicit(&ring_p->tail,
+			      atomic_load_explicit(&ring_p->tail, memory_order_relaxed) + 1,
+			      memory_order_release);
+}
+
+/**
+ * _trace_trans - record an fsm_run result
+ * @inst_p: the FSM instance
+ * @evt_id: input event
+ * @from: state index before the event
+ * @to: next state index, TRACE_NO_STATE if no transition
+ * @ret: fsm_run return value
+ */
+void _trace_trans(const fsm_inst_t *inst_p, fsm_events_t evt_id,
+		  uint16_t from, uint16_t to, int ret)
+{
+	trace_rec_t *rec_p = trace_put(TRACE_TRANS);
+
+	if (NULL == rec_p)
+		return;
+	rec_p->fsm = inst_p->fsm_p->id;
+	rec_p->evt = evt_id;
+	rec_p->inst = inst_p->id;
+	rec_p->from = from;
+	rec_p->to = to;
+	rec_p->ret = ret;
+	trace_commit();
+}
+
+/**
+ * _trace_evt - record an event enqueue
+ * @evt_id: the event
+ */
+void _trace_evt(fsm_events_t evt_id)
+{
+	trace_rec_t *rec_p = trace_put(TRACE_EVT);
+
+	if (NULL == rec_p)
+		return;
+	rec_p->evt = evt_id;
+	trace_commit();
+}
+
+/**
+ * _trace_fsm - record the state names of a compiled FSM
+ * @fsm_p: from fsm_compile
+ *
+ * Names are written with the normal records so a full ring can lose
+ * them, trace_start runs before any FSM is compiled so the ring is empty.
+ */
+void _trace_fsm(const fsm_t *fsm_p)
+{
+	trace_rec_t *rec_p;
+	uint16_t i;
+
+	for (i=0; i<fsm_p->nstates; i++) {
+		if (NULL == (rec_p = trace_put(TRACE_STATE)))
+			return;
+		rec_p->fsm = fsm_p->id;
+		rec_p->evt = i;
+		strncpy(rec_p->name, fsm_p->state_pp[i]->name, TRACE_NAME_LEN-1);
+		trace_commit();
+	}
+}
+
+/**
+ * trace_drain - write every ring out to the trace file
+ *
+ * At most two fwrites per ring, the records up to the end of the ring
+ * and the ones from the start.
+ */
+static void trace_drain(void)
+{
+	trace_ring_t *ring_p;
+	uint32_t head, tail, idx, n;
+
+	for (ring_p = atomic_load(&trace_rings); ring_p; ring_p = ring_p->next_p) {
+		head = atomic_load_explicit(&ring_p->head, memory_order_relaxed);
+		tail = atomic_load_explicit(&ring_p->tail, memory_order_acquire);
+
+		while (head != tail) {
+			idx = head & TRACE_RING_MASK;
+			n = tail - head;
+			if (n > TRACE_RING_SIZE - idx)
+				n = TRACE_RING_SIZE - idx;
+			if (n != fwrite(&ring_p->rec[idx], sizeof(trace_rec_t), n, trace_fp))
+				die("trace write");
+			head += n;
+		}
+		atomic_store_explicit(&ring_p->head, head, memory_order_release);
+	}
+	fflush(trace_fp);
+}
+
+/**
+ * trace_flusher_fn - drain the rings every TRACE_FLUSH_MS
+ * @arg: not used
+ */
+static void *trace_flusher_fn(void *arg)
+{
+	while (!atomic_load(&trace_stopping)) {
+		nap(TRACE_FLUSH_MS);
+		trace_drain();
+	}
+	return(NULL);
+}
+
+/**
+ * trace_start - open the trace file and start the flusher
+ * @path: trace file, truncated
+ *
+ * Call before starting the threads to trace and compiling the FSMs.
+ *
+ * Return: 0 for success, -1 if the file cannot be opened
+ */
+int trace_start(const char *path)
+{
+	if (NULL == (trace_fp = fopen(path, "w"))) {
+		perror(path);
+		return(-1);
+	}
+
+	atomic_store(&trace_stopping, false);
+	if (0 != pthread_create(&trace_flusher, NULL, trace_flusher_fn, NULL))
+		die("trace flusher create");
+	trace_enabled = true;
+	return(0);
+}
+
+/**
+ * trace_stop - flush the rings a last time and close the trace file
+ *
+ * Call after the traced threads are done, later records are lost.
+ */
+void trace_stop(void)
+{
+	trace_ring_t *ring_p, *n_p;
+	uint64_t drops = 0;
+
+	if (!trace_enabled)
+		return;
+
+	atomic_store(&trace_stopping, true);
+	pthread_join(trace_flusher, NULL);
+	trace_enabled = false;
+	trace_drain();
+	fclose(trace_fp);
+
+	for (ring_p = atomic_exchange(&trace_rings, NULL); ring_p; ring_p = n_p) {
+		n_p = ring_p->next_p;
+		drops += atomic_load(&ring_p->drops);
+		free(ring_p);
+	}
+	if (drops)
+		fprintf(stderr, "trace: %lu records dropped\n", drops);
+}
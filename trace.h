@@ -0,0 +1,107 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (C) 2021 Dahetral Systems
+ * Author: David Turvene (dturvene@dahetral.com)
+ *
+ * binary FSM trace
+ *
+ * Each thread writes fixed-size trace_rec_t records into its own
+ * single-producer ring, no lock and no formatting on the traced thread.
+ * A flusher thread drains every ring to the trace file, and the fsmtrace
+ * tool decodes the file into the same text as the DBG_TRANS/DBG_EVTS
+ * debug output.  If a ring is full the record is dropped and counted,
+ * tracing never blocks the traced thread.
+ *
+ * State and thread names are written to the file as TRACE_STATE and
+ * TRACE_THREAD records so the decoder does not need the FSM tables.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>     /* bool type and true, false values */
+#include <inttypes.h>    /* include stdint.h, PRI macros, integer conversions */
+#include <stdatomic.h>   /* ring head/tail */
+#include "utils.h"
+#include "evtq.h"
+#include "fsm.h"
+
+/* records in each per-thread ring, a power of two */
+#define TRACE_RING_SIZE 4096
+/* flusher period */
+#define TRACE_FLUSH_MS 10
+/* longest name in a TRACE_STATE or TRACE_THREAD record, with the nul */
+#define TRACE_NAME_LEN 16
+
+/**
+ * trace_type_t - trace record types
+ * @TRACE_NONE: not used
+ * @TRACE_THREAD: name of a trace thread id
+ * @TRACE_STATE: name of an FSM state index
+ * @TRACE_TRANS: fsm_run result
+ * @TRACE_EVT: event enqueued
+ */
+typedef enum trace_type {
+	TRACE_NONE = 0,
+	TRACE_THREAD,
+	TRACE_STATE,
+	TRACE_TRANS,
+	TRACE_EVT,
+} trace_type_t;
+
+/* to field when there is no matching transition */
+#define TRACE_NO_STATE 0xffff
+
+/**
+ * trace_rec_t - one trace record, the trace file is an array of these
+ * @ts: CLOCK_MONOTONIC nsecs
+ * @type: trace_type_t
+ * @thread: trace thread id of the writer
+ * @fsm: fsm_t id
+ * @evt: event id, or state index for TRACE_STATE
+ * @inst: fsm_inst_t id
+ * @from: state index before fsm_run
+ * @to: next state index, TRACE_NO_STATE if no transition matched
+ * @ret: fsm_run return value, 1 is a guard failure
+ * @name: TRACE_STATE and TRACE_THREAD name
+ */
+typedef struct trace_rec {
+	uint64_t ts;
+	uint16_t type;
+	uint16_t thread;
+	uint16_t fsm;
+	uint16_t evt;
+	union {
+		struct {
+			uint32_t inst;
+			uint16_t from;
+			uint16_t to;
+			int32_t ret;
+			uint32_t pad;
+		};
+		char name[TRACE_NAME_LEN];
+	};
+} trace_rec_t;
+
+_Static_assert(sizeof(trace_rec_t) == 32, "trace_rec_t file format");
+
+/*
+ * trace_enabled - set by trace_start before any traced thread runs
+ */
+extern bool trace_enabled;
+
+#define trace_on() unlikely(trace_enabled)
+
+extern int trace_start(const char *path);
+extern void trace_stop(void);
+extern void _trace_trans(const fsm_inst_t *inst_p, fsm_events_t evt_id,
+			 uint16_t from, uint16_t to, int ret);
+extern void _trace_evt(fsm_events_t evt_id);
+extern void _trace_fsm(const fsm_t *fsm_p);
+
+#define trace_trans(inst_p, evt_id, from, to, ret) \
+	do { if (trace_on()) _trace_trans(inst_p, evt_id, from, to, ret); } while (0)
+#define trace_evt(evt_id) do { if (trace_on()) _trace_evt(evt_id); } while (0)
+#define trace_fsm(fsm_p) do { if (trace_on()) _trace_fsm(fsm_p); } while (0)
+
+#endif /* _TRACE_H */
@@ -8,6 +8,9 @@
  * die: test program will fail so exit with an error
  * nap: sleep for N milliseconds
  * relax: stop running the thread and put it at tail of run queue
+ * cpu_relax: spin-wait hint to the cpu
+ * ____cacheline_aligned: start a struct or field on its own cache line
+ * futex_wait, futex_wake: park and wake on a 32-bit word
  * dbg: function, timestamp, msg write to stdout
  */
 
@@ -21,6 +24,8 @@
 #include <time.h>        /* nanosleep, clock_gettime */
 #include <string.h>      /* strlen */
 #include <pthread.h>     /* pthread_self */
+#include <linux/futex.h> /* FUTEX_WAIT, FUTEX_WAKE */
+#include <sys/syscall.h> /* SYS_futex */
 
 /**
  * die - terminate task with a descriptive error message
@@ -56,6 +61,50 @@ inline static void relax()
 	sched_yield();
 }
 
+/*
+ * L1_CACHE_BYTES - cache line size, the unit of false sharing
+ */
+#define L1_CACHE_BYTES 64
+
+/**
+ * ____cacheline_aligned - align to a cache line, as in the kernel
+ *
+ * On a struct type every object gets its own lines, on a field the field
+ * and those after it start a new line.
+ */
+#define ____cacheline_aligned __attribute__((__aligned__(L1_CACHE_BYTES)))
+
+/**
+ * cpu_relax - tell the cpu this is a spin-wait loop
+ *
+ * Same idea as the kernel cpu_relax(): x86 pause, arm yield.  Does not
+ * give up the cpu like relax().
+ */
+inline static void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/*
+ * futex_wait, futex_wake - thin wrappers, see man:futex.  Only process
+ * private futexes are used.
+ */
+inline static void futex_wait(void *uaddr, uint32_t val)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+inline static void futex_wake(void *uaddr, int nwake)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, nwake, NULL, NULL, 0);
+}
+
 /* 
  * _dbg_func - dump debug info to stdout
  * @func: calling function
@@ -83,6 +132,9 @@ inline static void _dbg_func(const char *func, const char *msg)
 	write(1, buf, strlen(buf));
 }
 
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
 extern uint32_t debug_flag;
 #define DBG_NONE    0x00
 #define DBG_TRANS   0x01  
@@ -90,8 +142,43 @@ extern uint32_t debug_flag;
 #define DBG_TIMERS  0x04
 #define DBG_WORKER  0x10
 #define DBG_DEEP    0x20
+#define DBG_ALL     (DBG_TRANS|DBG_EVTS|DBG_TIMERS|DBG_WORKER|DBG_DEEP)
+
+/*
+ * DBG_COMPILED - debug_flag bits built into the program.  Any other bit
+ * tested with dbg_on is constant false and the compiler drops the debug
+ * code, e.g. -DDBG_COMPILED=0 for a build without any debug output.
+ */
+#ifndef DBG_COMPILED
+#define DBG_COMPILED DBG_ALL
+#endif
+
+/**
+ * dbg_on - test if a debug level is enabled
+ * @bit: one of the DBG_ levels
+ *
+ * A compiled-out level is a constant 0.  Otherwise it is one load of
+ * debug_flag and a branch predicted not taken, so the disabled path on
+ * the event hot path costs nothing but that test.  All debug formatting
+ * must be inside the test.
+ */
+#define dbg_on(bit) unlikely((DBG_COMPILED & (bit)) && (debug_flag & (bit)))
+
+#define dbg_verbose(msg) do { if (dbg_on(DBG_DEEP)) _dbg_func(__func__, msg); } while (0)
+
+/**
+ * dbg_verbosef - dbg_verbose with a printf format
+ * @fmt: format string, only expanded when DBG_DEEP is on
+ */
+#define dbg_verbosef(fmt, ...)						\
+do {									\
+	if (dbg_on(DBG_DEEP)) {						\
+		char _msg[80];						\
+		snprintf(_msg, sizeof(_msg), fmt, __VA_ARGS__);		\
+		_dbg_func(__func__, _msg);				\
+	}								\
+} while (0)
 
-#define dbg_verbose(msg) if (debug_flag & DBG_DEEP) _dbg_func(__func__, msg)
 #define dbg(msg) _dbg_func(__func__, msg)
 
 #endif /* _UTILS_H */
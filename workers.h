@@ -4,6 +4,16 @@
  * Author: David Turvene (dturvene@dahetral.com)
  *
  * worker thread management
+ *
+ * The workers registry is read without a lock: workers_read_lock returns
+ * the current snapshot, an array of the workers, that stays valid until
+ * workers_read_unlock.  Broadcasts and lookups walk the array, they never
+ * wait for a writer.  worker_list_add and worker_list_del take the
+ * registry mutex, change the list, publish a new snapshot and retire the
+ * old one.  A retired snapshot is freed once no reader is in a read
+ * section that started before it was replaced (epoch based reclamation):
+ * each reader announces the registry epoch when it enters, and a writer
+ * bumps the epoch after every publish.
  */
 
 #ifndef _WORKERS_H
@@ -21,78 +31,563 @@
 #include "utils.h"
 #include "evtq.h"
 #include "fsm.h"
+#include "evtbus.h"
+#include "stats.h"
+#include "arena.h"
+#include "affinity.h"
 
+/**
+ * worker_t - one worker thread
+ * @list: workers list entry
+ * @name: thread name for debug and the CLI
+ * @worker_id: pthread id
+ * @startfn_p: thread function, called with the worker_t
+ * @inst_p: FSM instance run by a worker_fsm_create thread, otherwise NULL
+ * @evtq_p: worker event queue
+ * @qattr: attributes @evtq_p is created with
+ * @sub_p: broadcast channel subscription, NULL to use @evtq_p
+ * @ctx_p: private data for a worker_ctx_create thread
+ * @fsm_p: compiled FSM for @inst_p, NULL for a worker_ctx_create thread
+ * @cpu: cpu the thread is pinned to, -1 if not pinned
+ * @node: NUMA node of @cpu, -1 if not pinned
+ * @ready: set by the thread when its queue and instance exist
+ *
+ * Cache line aligned, workers created back to back do not share lines.
+ */
 typedef struct worker {
 	struct nl_list_head list;
 	char name[32];
 	pthread_t worker_id;
-	fsm_trans_t *fsm_p;
+	void *(*startfn_p)(void*);
+	fsm_inst_t *inst_p;
 	evtq_t *evtq_p;
-} worker_t;
+	evtq_attr_t qattr;
+	evtbus_sub_t *sub_p;
+	void *ctx_p;
+	const fsm_t *fsm_p;
+	int cpu;
+	int node;
+	atomic_bool ready;
+} ____cacheline_aligned worker_t;
 
+_Static_assert(sizeof(worker_t) % L1_CACHE_BYTES == 0, "worker_t is whole cache lines");
+
+struct fsmsched;
+
+/**
+ * workers_snap_t - the workers at one point, see workers_read_lock
+ * @next_p: next retired snapshot
+ * @retired: registry epoch it was replaced in
+ * @n: entries in @w_pp
+ * @w_pp: the workers, in list order
+ */
+typedef struct workers_snap {
+	struct workers_snap *next_p;
+	uint64_t retired;
+	uint32_t n;
+	worker_t *w_pp[];
+} workers_snap_t;
+
+/**
+ * workers_reader_t - registry reader record of a thread
+ * @next_p: next record, records are never unlinked
+ * @epoch: registry epoch announced by the thread, 0 outside a read section
+ * @used: owned by a thread, see workers_reader_exit
+ * @depth: read section nesting, only the owner touches it
+ *
+ * One cache line each, writers read @epoch of all of them.
+ */
+typedef struct workers_reader {
+	struct workers_reader *next_p;
+	atomic_ulong epoch;
+	atomic_bool used;
+	uint32_t depth;
+} ____cacheline_aligned workers_reader_t;
+
+/**
+ * workers_t - list of all worker threads
+ * @head: list head, changed with @mutex held
+ * @qattr: attributes for each worker event queue, set before worker_create
+ * @sched_p: FSM instance scheduler, if any, also gets every broadcast
+ * @bus_p: broadcast channel, if any, FSM workers subscribe to it instead
+ *         of reading their event queue
+ * @snap_path: file the CLI S command saves the @sched_p snapshot to, see
+ *             fsmsnap.h, NULL for none
+ * @mutex: serializes worker_list_add and worker_list_del
+ * @snap_p: current snapshot, NULL before worker_list_create
+ * @epoch: registry epoch, starts at 1
+ * @readers: reader records of every thread that read the registry
+ * @retired_p: replaced snapshots not freed yet, with @mutex held
+ *
+ * Define it with WORKERS_INIT.
+ */
 typedef struct workers {
 	worker_t head;
+	evtq_attr_t qattr;
+	struct fsmsched *sched_p;
+	evtbus_t *bus_p;
+	const char *snap_path;
+	pthread_mutex_t mutex;
+	_Atomic(workers_snap_t *) snap_p;
+	atomic_ulong epoch;
+	_Atomic(workers_reader_t *) readers;
+	workers_snap_t *retired_p;
 } workers_t;
 
+#define WORKERS_INIT { .mutex = PTHREAD_MUTEX_INITIALIZER, .epoch = 1 }
+
+extern void fsmsched_broadcast_pl(struct fsmsched *sched_p, fsm_events_t evt_id,
+				  const evt_payload_t *pl_p);
+extern void fsmsched_show(struct fsmsched *sched_p);
+
 /*
  * defined as a global in main program
  */
 extern workers_t workers;
 
-inline static worker_t * worker_create(void *(*startfn_p)(void*), char* name)
+/*
+ * worker_self_p - the worker_t of the calling thread, NULL for threads
+ * not started by worker_create.  Defined as a global in main program.
+ */
+extern __thread worker_t *worker_self_p;
+
+/*
+ * workers_reader_p - the registry reader record of the calling thread,
+ * NULL until its first workers_read_lock.  Defined as a global in main
+ * program.
+ */
+extern __thread workers_reader_t *workers_reader_p;
+
+/* what workers_read_lock returns before worker_list_create */
+static const workers_snap_t workers_snap_none = { .n = 0 };
+
+/**
+ * workers_for_each - walk the workers of a snapshot
+ * @snap_p: from workers_read_lock
+ * @i: uint32_t cursor
+ * @w_p: worker_t pointer, set to each worker
+ */
+#define workers_for_each(snap_p, i, w_p)				\
+	for ((i) = 0; (i) < (snap_p)->n && ((w_p) = (snap_p)->w_pp[(i)], true); (i)++)
+
+/**
+ * workers_reader - the reader record of the calling thread
+ *
+ * The first call takes a record a finished thread gave back, or pushes
+ * a new one on workers.readers.
+ */
+inline static workers_reader_t *workers_reader(void)
+{
+	workers_reader_t *r_p;
+	bool used;
+
+	if (workers_reader_p)
+		return(workers_reader_p);
+
+	for (r_p = atomic_load(&workers.readers); r_p; r_p = r_p->next_p) {
+		used = false;
+		if (atomic_compare_exchange_strong(&r_p->used, &used, true))
+			return(workers_reader_p = r_p);
+	}
+
+	if (NULL == (r_p = arena_calloc(sizeof(workers_reader_t))))
+		die("workers_reader");
+	atomic_init(&r_p->used, true);
+	r_p->next_p = atomic_load(&workers.readers);
+	while (!atomic_compare_exchange_weak(&workers.readers, &r_p->next_p, r_p))
+		;
+	return(workers_reader_p = r_p);
+}
+
+/**
+ * workers_read_lock - enter a registry read section
+ *
+ * Wait-free, a store and a few loads once the thread has its record.
+ * Read sections nest, only the outermost announces the epoch.  Do not
+ * block in a read section for longer than it takes a worker queue to
+ * drain, worker_list_del waits for it.
+ *
+ * Return: the snapshot, valid until the matching workers_read_unlock
+ */
+inline static const workers_snap_t *workers_read_lock(void)
+{
+	workers_reader_t *r_p = workers_reader();
+	const workers_snap_t *snap_p;
+
+	/* seq_cst: the announce is seen by a writer or the snapshot is new */
+	if (0 == r_p->depth++)
+		atomic_store(&r_p->epoch, atomic_load(&workers.epoch));
+	snap_p = atomic_load(&workers.snap_p);
+	return(snap_p ? snap_p : &workers_snap_none);
+}
+
+/**
+ * workers_read_unlock - leave a registry read section
+ */
+inline static void workers_read_unlock(void)
+{
+	workers_reader_t *r_p = workers_reader_p;
+
+	if (0 == --r_p->depth)
+		atomic_store_explicit(&r_p->epoch, 0, memory_order_release);
+}
+
+/**
+ * workers_reader_exit - give the reader record back, the thread is ending
+ *
+ * Worker threads do it on the way out, so adding and removing workers
+ * does not grow workers.readers.
+ */
+inline static void workers_reader_exit(void)
+{
+	if (NULL == workers_reader_p)
+		return;
+	atomic_store_explicit(&workers_reader_p->used, false, memory_order_release);
+	workers_reader_p = NULL;
+}
+
+/**
+ * workers_reclaim - free the retired snapshots no reader can hold
+ *
+ * With workers.mutex held.  A snapshot retired in epoch e is still read
+ * by a reader that announced e or less.
+ */
+inline static void workers_reclaim(void)
+{
+	workers_reader_t *r_p;
+	workers_snap_t *snap_p, **snap_pp = &workers.retired_p;
+	uint64_t oldest = UINT64_MAX, e;
+
+	for (r_p = atomic_load(&workers.readers); r_p; r_p = r_p->next_p)
+		if ((e = atomic_load(&r_p->epoch)) && e < oldest)
+			oldest = e;
+
+	while ((snap_p = *snap_pp)) {
+		if (snap_p->retired < oldest) {
+			*snap_pp = snap_p->next_p;
+			free(snap_p);
+		} else {
+			snap_pp = &snap_p->next_p;
+		}
+	}
+}
+
+/**
+ * workers_publish - replace the snapshot with the list as it is now
+ *
+ * With workers.mutex held.
+ */
+inline static void workers_publish(void)
+{
+	workers_snap_t *snap_p, *old_p;
+	worker_t *w_p;
+	uint32_t n = 0;
+
+	nl_list_for_each_entry(w_p, &workers.head.list, list)
+		n++;
+	if (NULL == (snap_p = malloc(sizeof(workers_snap_t) + n * sizeof(worker_t *))))
+		die("workers_publish");
+	snap_p->next_p = NULL;
+	snap_p->retired = 0;
+	snap_p->n = 0;
+	nl_list_for_each_entry(w_p, &workers.head.list, list)
+		snap_p->w_pp[snap_p->n++] = w_p;
+
+	old_p = atomic_exchange(&workers.snap_p, snap_p);
+	if (old_p) {
+		old_p->retired = atomic_fetch_add(&workers.epoch, 1);
+		old_p->next_p = workers.retired_p;
+		workers.retired_p = old_p;
+	}
+	workers_reclaim();
+}
+
+/**
+ * workers_synchronize - wait until every read section in progress ended
+ *
+ * After it a worker taken out of the registry is no longer seen by any
+ * reader.  Must not be called in a read section.
+ */
+inline static void workers_synchronize(void)
+{
+	workers_reader_t *r_p;
+	uint64_t epoch, e;
+
+	if (workers_reader_p && workers_reader_p->depth)
+		die("workers_synchronize in a read section");
+
+	epoch = atomic_fetch_add(&workers.epoch, 1);
+	for (r_p = atomic_load(&workers.readers); r_p; r_p = r_p->next_p)
+		while ((e = atomic_load(&r_p->epoch)) && e <= epoch)
+			relax();
+
+	pthread_mutex_lock(&workers.mutex);
+	workers_reclaim();
+	pthread_mutex_unlock(&workers.mutex);
+}
+
+inline static void workers_evt_broadcast(fsm_events_t evt_id);
+inline static void workers_evt_broadcast_pl(fsm_events_t evt_id, const evt_payload_t *pl_p);
+inline static void workers_evt_send(fsm_events_t evt_id, const evt_payload_t *pl_p,
+				    const worker_t *skip_p);
+
+/**
+ * worker_host_broadcast - fsm_host_t broadcast for a worker FSM instance
+ * @inst_p: the instance
+ * @evt_id: the event id
+ * @self: also to the worker of @inst_p
+ *
+ * Every other worker gets the event.  Without @self the sending worker
+ * is left out, the instance ran it to completion, see fsm_broadcast.
+ */
+inline static void worker_host_broadcast(fsm_inst_t *inst_p, fsm_events_t evt_id, bool self)
+{
+	workers_evt_send(evt_id, NULL, self ? NULL : (worker_t *)inst_p->host_ctx);
+}
+
+/**
+ * worker_host_done - fsm_host_t done for a worker FSM instance
+ * @inst_p: the instance
+ *
+ * The worker thread exits, see join_workers.  Leave the broadcast
+ * channel first so producers do not wait for the thread.
+ */
+inline static void worker_host_done(fsm_inst_t *inst_p)
 {
-	worker_t *w_p = malloc(sizeof(worker_t));
+	worker_t *w_p = (worker_t *)inst_p->host_ctx;
+
+	if (w_p->sub_p)
+		evtbus_unsubscribe(w_p->sub_p);
+	workers_reader_exit();
+	pthread_exit(NULL);
+}
+
+static const fsm_host_t worker_host = {
+	.broadcast = worker_host_broadcast,
+	.done = worker_host_done,
+};
+
+/**
+ * worker_start - common pthread start routine for workers
+ * @arg: the worker_t
+ *
+ * Set the thread-local worker_self_p before the worker start function
+ * runs so worker_self is a load instead of a worker list walk.
+ *
+ * The queue and FSM instance are created here, on the worker cpu and
+ * node when the worker is pinned, before the creator is told the worker
+ * is ready.  With a broadcast channel the worker subscribes to the
+ * events its table has transitions for.
+ */
+inline static void *worker_start(void *arg)
+{
+	worker_t *w_p = (worker_t *)arg;
+	void *ret_p;
+
+	worker_self_p = w_p;
+	w_p->node = affinity_place_self(w_p->cpu);
+
+	w_p->evtq_p = evtq_create(&w_p->qattr);
+	if (w_p->fsm_p) {
+		if (NULL == (w_p->inst_p = arena_calloc(sizeof(fsm_inst_t))))
+			die("worker_start");
+		/* must set this before the thread fsm_init */
+		fsm_inst_init(w_p->inst_p, w_p->fsm_p, &worker_host, w_p, 0);
+		w_p->sub_p = workers.bus_p ?
+			evtbus_subscribe(workers.bus_p, fsm_evt_mask(w_p->fsm_p)) : NULL;
+	}
+	atomic_store_explicit(&w_p->ready, true, memory_order_release);
+
+	ret_p = w_p->startfn_p(w_p);
+	workers_reader_exit();
+	return(ret_p);
+}
+
+/**
+ * worker_spawn - start a worker thread and wait until it is ready
+ * @w_p: the worker, name, start function and FSM set
+ *
+ * Workers take the next cpu of the placement policy.  Waiting keeps the
+ * worker queue in place before anyone can send to it, and the bus
+ * subscriptions in creation order.
+ */
+inline static void worker_spawn(worker_t *w_p)
+{
+	pthread_attr_t attr, *attr_p;
+
+	w_p->cpu = affinity_next_cpu();
+	w_p->node = -1;
+	atomic_init(&w_p->ready, false);
+
+	attr_p = affinity_attr(&attr, w_p->cpu);
+	if (0 != pthread_create(&w_p->worker_id, attr_p, worker_start, (void *)w_p))
+		die("worker_create");
+	if (attr_p)
+		pthread_attr_destroy(attr_p);
+
+	while (!atomic_load_explicit(&w_p->ready, memory_order_acquire))
+		relax();
+}
+
+/**
+ * worker_ctx_create - create a worker thread with private data
+ * @startfn_p: thread function
+ * @name: thread name
+ * @ctx_p: private data, the thread reads it from worker_t.ctx_p
+ */
+inline static worker_t *worker_ctx_create(void *(*startfn_p)(void*), char* name, void *ctx_p)
+{
+	worker_t *w_p = arena_calloc(sizeof(worker_t));
+
+	if (NULL == w_p)
+		die("worker_create");
 
 	strncpy(w_p->name, name, sizeof(w_p->name));
+	w_p->startfn_p = startfn_p;
+	w_p->qattr = workers.qattr;
+	w_p->inst_p = NULL;
+	w_p->sub_p = NULL;
+	w_p->ctx_p = ctx_p;
 	w_p->fsm_p = NULL;
-	w_p->evtq_p = evtq_create();
-	if (0 != pthread_create(&w_p->worker_id, NULL, startfn_p, (void *)w_p))
-		die("worker_create");
+	worker_spawn(w_p);
 	return (w_p);
 }
 
-inline static worker_t *worker_fsm_create(void *(*startfn_p)(void*), char* name, fsm_trans_t* fsm_p)
+inline static worker_t * worker_create(void *(*startfn_p)(void*), char* name)
 {
-	worker_t *w_p = malloc(sizeof(worker_t));	
+	return worker_ctx_create(startfn_p, name, NULL);
+}
 
-	strncpy(w_p->name, name, sizeof(w_p->name));
-	w_p->fsm_p = fsm_p; /* must set this before starting thread fsm_init */
-	w_p->evtq_p = evtq_create();
-	if (0 != pthread_create(&w_p->worker_id, NULL, startfn_p, (void *)w_p))
+/**
+ * worker_fsm_create_attr - worker_fsm_create with its own queue attributes
+ * @startfn_p: thread function, see fsm_task
+ * @name: thread name
+ * @fsm_p: compiled machine definition, e.g. from fsm_compile or fsm_load
+ * @qattr_p: queue attributes, NULL for workers.qattr
+ *
+ * E.g. EVTQ_WAKE_ADAPTIVE for a worker pinned to an isolated cpu, so it
+ * busy-polls while the other workers keep parking.
+ */
+inline static worker_t *worker_fsm_create_attr(void *(*startfn_p)(void*), char* name,
+					       fsm_t *fsm_p, const evtq_attr_t *qattr_p)
+{
+	worker_t *w_p = arena_calloc(sizeof(worker_t));
+
+	if (NULL == w_p)
 		die("worker_create");
+
+	strncpy(w_p->name, name, sizeof(w_p->name));
+	w_p->startfn_p = startfn_p;
+	w_p->qattr = qattr_p ? *qattr_p : workers.qattr;
+	w_p->ctx_p = NULL;
+	w_p->fsm_p = fsm_p;
+	worker_spawn(w_p);
 	return(w_p);
 }
 
+/**
+ * worker_fsm_create - create a worker thread running one FSM instance
+ * @startfn_p: thread function, see fsm_task
+ * @name: thread name
+ * @fsm_p: compiled machine definition, e.g. from fsm_compile or fsm_load
+ *
+ * Timer ids of the instance start at 0, all worker FSMs share them.
+ * The instance is created by the thread, see worker_start.  The queue
+ * is created with workers.qattr.
+ */
+inline static worker_t *worker_fsm_create(void *(*startfn_p)(void*), char* name, fsm_t *fsm_p)
+{
+	return(worker_fsm_create_attr(startfn_p, name, fsm_p, NULL));
+}
+
+/**
+ * worker_list_create - start with an empty registry
+ *
+ * Only when no worker is on it, readers may still hold the old snapshot.
+ */
 inline static void worker_list_create()
 {
+	pthread_mutex_lock(&workers.mutex);
 	NL_INIT_LIST_HEAD(&workers.head.list);
+	workers_publish();
+	pthread_mutex_unlock(&workers.mutex);
 }
 
+/**
+ * worker_list_add - put a worker on the registry
+ * @w_p: the worker, from worker_create and friends
+ *
+ * Broadcasts already in progress do not see it.
+ */
 inline static void worker_list_add(worker_t *w_p)
 {
+	pthread_mutex_lock(&workers.mutex);
 	nl_list_add_tail(&w_p->list, &workers.head.list);
+	workers_publish();
+	pthread_mutex_unlock(&workers.mutex);
 }
 
+/**
+ * worker_list_del - take a worker off the registry
+ * @w_p: the worker
+ *
+ * Returns once no reader can see @w_p, nothing is queued to it past
+ * this point and the caller may stop the thread, destroy its queue and
+ * free it.  Not in a read section, see workers_synchronize; a broadcast
+ * blocked on the full queue of @w_p keeps it waiting until the worker
+ * takes events again.
+ */
+inline static void worker_list_del(worker_t *w_p)
+{
+	pthread_mutex_lock(&workers.mutex);
+	nl_list_del(&w_p->list);
+	workers_publish();
+	pthread_mutex_unlock(&workers.mutex);
+	workers_synchronize();
+}
+
+/**
+ * worker_first - first worker of the registry
+ *
+ * Return: the worker, NULL if there is none
+ */
 inline static worker_t *worker_first()
 {
-	worker_t *w_p;
-	w_p = nl_list_first_entry(&workers.head.list, worker_t, list);
+	const workers_snap_t *snap_p = workers_read_lock();
+	worker_t *w_p = snap_p->n ? snap_p->w_pp[0] : NULL;
+
+	workers_read_unlock();
 	return (w_p);
 }
 
+/**
+ * worker_find_id - look a worker up by thread id
+ * @id: the pthread id
+ *
+ * The pointer stays good until worker_list_del of the worker, the
+ * caller makes sure that does not race with its use.
+ *
+ * Return: the worker, NULL if there is none
+ */
 inline static worker_t *worker_find_id(pthread_t id)
 {
-	worker_t *w_p;
-	nl_list_for_each_entry(w_p, &workers.head.list, list) {
-		if (w_p->worker_id == id)
-			return(w_p);
+	const workers_snap_t *snap_p = workers_read_lock();
+	worker_t *w_p, *found_p = NULL;
+	uint32_t i;
+
+	workers_for_each(snap_p, i, w_p) {
+		if (w_p->worker_id == id) {
+			found_p = w_p;
+			break;
+		}
 	}
-	return(NULL);
+	workers_read_unlock();
+	return(found_p);
 }
 
 inline static worker_t *worker_self(void)
 {
-	return worker_find_id(pthread_self());
+	return worker_self_p;
 }
 
 inline static const char* worker_get_name(void)
@@ -104,51 +599,191 @@ inline static const char* worker_get_name(void)
 	return (NULL);
 }
 
+/**
+ * worker_find_by_name - look a worker up by name
+ * @name: the thread name
+ *
+ * Same as worker_find_id.
+ *
+ * Return: the worker, NULL if there is none
+ */
 inline static worker_t *worker_find_by_name(const char *name)
 {
-	worker_t *w_p;	
-	nl_list_for_each_entry(w_p, &workers.head.list, list) {
-		if (0 == strncmp(w_p->name, name, sizeof(w_p->name)))
-			return(w_p);
+	const workers_snap_t *snap_p = workers_read_lock();
+	worker_t *w_p, *found_p = NULL;
+	uint32_t i;
+
+	workers_for_each(snap_p, i, w_p) {
+		if (0 == strncmp(w_p->name, name, sizeof(w_p->name))) {
+			found_p = w_p;
+			break;
+		}
 	}
-	return(NULL);
+	workers_read_unlock();
+	return(found_p);
 }
 
+/**
+ * workers_evt_broadcast - send an event to every worker
+ * @evt_id: the event id
+ *
+ * One publish on the broadcast channel for all subscribed workers, an
+ * enqueue for each of the others.  An FSM worker is skipped, and the
+ * skip counted, when its table has no transition for the event.
+ */
 inline static void workers_evt_broadcast(fsm_events_t evt_id)
 {
+	workers_evt_broadcast_pl(evt_id, NULL);
+}
+
+/**
+ * workers_evt_broadcast_pl - send an event with a payload to every worker
+ * @evt_id: the event id
+ * @pl_p: payload, NULL for none, the caller keeps it
+ *
+ * Same as workers_evt_broadcast, each receiver gets its own copy of the
+ * inline bytes or reference on the pooled buffer.
+ */
+inline static void workers_evt_broadcast_pl(fsm_events_t evt_id, const evt_payload_t *pl_p)
+{
+	workers_evt_send(evt_id, pl_p, NULL);
+}
+
+/**
+ * workers_evt_send - send an event with a payload to every worker but one
+ * @evt_id: the event id
+ * @pl_p: payload, NULL for none, the caller keeps it
+ * @skip_p: worker not to send it to, NULL for none
+ *
+ * Same as workers_evt_broadcast_pl.  A worker added or taken off while
+ * the event goes out gets it or not, never a freed queue.
+ */
+inline static void workers_evt_send(fsm_events_t evt_id, const evt_payload_t *pl_p,
+				    const worker_t *skip_p)
+{
+	const workers_snap_t *snap_p;
 	worker_t *w_p;
-	nl_list_for_each_entry(w_p, &workers.head.list, list) {
-		evtq_enqueue(w_p->evtq_p, evt_id);
+	evt_payload_t pl;
+	uint64_t filtered = 0;
+	uint32_t i;
+
+	if (workers.bus_p) {
+		evt_payload_dup(&pl, pl_p);
+		evtbus_publish_from(workers.bus_p, skip_p ? skip_p->sub_p : NULL, evt_id, &pl);
 	}
+	snap_p = workers_read_lock();
+	workers_for_each(snap_p, i, w_p) {
+		if (w_p->sub_p || w_p == skip_p)
+			continue;
+		if (w_p->inst_p && !fsm_accepts(w_p->inst_p->fsm_p, evt_id)) {
+			filtered++;
+			continue;
+		}
+		evt_payload_dup(&pl, pl_p);
+		evtq_enqueue_pl(w_p->evtq_p, evt_id, &pl);
+	}
+	workers_read_unlock();
+	if (filtered)
+		stats_filtered(filtered);
+	if (workers.sched_p)
+		fsmsched_broadcast_pl(workers.sched_p, evt_id, pl_p);
 }
 
 inline static void workers_evtq_destroy(void)
 {
+	const workers_snap_t *snap_p;
 	worker_t *w_p;
-	nl_list_for_each_entry(w_p, &workers.head.list, list) {
+	uint32_t i;
+
+	/* arena queues go with arena_destroy */
+	if (fsm_arena)
+		return;
+	snap_p = workers_read_lock();
+	workers_for_each(snap_p, i, w_p) {
 		evtq_destroy(w_p->evtq_p);
 	}
+	workers_read_unlock();
 }	
 
+/**
+ * join_workers - wait for every worker thread to end
+ *
+ * Joins the workers of the snapshot at the call, outside the read
+ * section so a worker taken off meanwhile does not hold up writers.
+ */
 inline static void join_workers(void)
 {
-	worker_t *w_p;
-	nl_list_for_each_entry(w_p, &workers.head.list, list) {
-		pthread_join(w_p->worker_id, NULL);
-		if (debug_flag & DBG_WORKER)
-			printf("%s: joined\n", w_p->name);
+	const workers_snap_t *snap_p = workers_read_lock();
+	uint32_t i, n = snap_p->n;
+	worker_t **w_pp = malloc((n ? n : 1) * sizeof(worker_t *));
+
+	if (NULL == w_pp)
+		die("join_workers");
+	memcpy(w_pp, snap_p->w_pp, n * sizeof(worker_t *));
+	workers_read_unlock();
+
+	for (i=0; i<n; i++) {
+		pthread_join(w_pp[i]->worker_id, NULL);
+		if (dbg_on(DBG_WORKER))
+			printf("%s: joined\n", w_pp[i]->name);
 	}
+	free(w_pp);
 }
 
 inline static void show_workers(void)
 {
+	const workers_snap_t *snap_p;
+	worker_t *w_p;
+	uint32_t i;
+
+	printf("workers\n%-15s:%-12s %-14s %5s %4s %4s\n", "id", "name", "[curr_state]", "qlen",
+	       "cpu", "node");
+	snap_p = workers_read_lock();
+	workers_for_each(snap_p, i, w_p) {
+		printf("%ld:%-12s %-14s %5u %4d %4d\n", w_p->worker_id, w_p->name,
+		       w_p->inst_p ? fsm_curr_state(w_p->inst_p)->name : "",
+		       evtq_len(w_p->evtq_p), w_p->cpu, w_p->node);
+	}
+	workers_read_unlock();
+	affinity_show();
+	if (workers.sched_p)
+		fsmsched_show(workers.sched_p);
+}
+
+inline static void show_queues(void)
+{
+	const workers_snap_t *snap_p;
 	worker_t *w_p;
+	evtq_stats_t st;
+	uint32_t i;
+
+	printf("queues\n%-12s %-5s %-9s %5s %10s %10s %10s\n",
+	       "name", "type", "wake", "len", "dequeues", "waits", "wakeups");
+	snap_p = workers_read_lock();
+	workers_for_each(snap_p, i, w_p) {
+		evtq_stats(w_p->evtq_p, &st);
+		printf("%-12s %-5s %-9s %5u %10lu %10lu %10lu\n", w_p->name,
+		       evtq_type_name(w_p->evtq_p->type),
+		       evtq_wake_name(w_p->evtq_p->wake),
+		       st.len, st.dequeues, st.waits, st.wakeups);
+	}
 
-	printf("workers\n%-15s:%-12s %-14s\n", "id", "name", "[curr_state]");
-	nl_list_for_each_entry(w_p, &workers.head.list, list) {
-		printf("%ld:%-12s ", w_p->worker_id, w_p->name);
-		w_p->fsm_p ? printf("%s\n", w_p->fsm_p->currst_p->name) : printf("\n");
+	if (workers.bus_p) {
+		evtbus_show(workers.bus_p);
+		printf("%-12s %-10s %5s %10s %10s %10s\n", "name", "mask", "lag", "reads",
+		       "skips", "waits");
+		workers_for_each(snap_p, i, w_p) {
+			if (NULL == w_p->sub_p)
+				continue;
+			printf("%-12s 0x%08x %5lu %10lu %10lu %10lu\n", w_p->name,
+			       w_p->sub_p->mask,
+			       atomic_load(&workers.bus_p->claim) -
+			       atomic_load(&w_p->sub_p->cursor),
+			       atomic_load(&w_p->sub_p->reads), atomic_load(&w_p->sub_p->skips),
+			       atomic_load(&w_p->sub_p->waits));
+		}
 	}
+	workers_read_unlock();
 }
 
 #endif /* _WORKERS_H */